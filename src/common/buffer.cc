@@ -581,6 +581,24 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     }
   };
 
+  /*
+   * memory owned elsewhere; the owner is told through release(arg) once
+   * the last reference is dropped
+   */
+  class buffer::raw_external : public buffer::raw {
+    void (*release)(void *arg);
+    void *arg;
+  public:
+    raw_external(char *d, unsigned l, void (*release)(void *), void *arg)
+      : raw(d, l), release(release), arg(arg) { }
+    ~raw_external() {
+      release(arg);
+    }
+    raw* clone_empty() {
+      return new buffer::raw_char(len);
+    }
+  };
+
 #if defined(HAVE_XIO)
   class buffer::xio_msg_buffer : public buffer::raw {
   private:
@@ -654,6 +672,10 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
   buffer::raw* buffer::create_static(unsigned len, char *buf) {
     return new raw_static(buf, len);
   }
+  buffer::raw* buffer::claim_external(unsigned len, char *buf,
+				      void (*release)(void *), void *arg) {
+    return new raw_external(buf, len, release, arg);
+  }
   buffer::raw* buffer::create_aligned(unsigned len, unsigned align) {
 #ifndef __CYGWIN__
     //return new raw_mmap_pages(len);
@@ -663,13 +663,31 @@ OPTION(osd_recovery_threads, OPT_INT, 1)
 OPTION(osd_recover_clone_overlap, OPT_BOOL, true)   // preserve clone_overlap during recovery/migration
 OPTION(osd_op_num_threads_per_shard, OPT_INT, 2)
 OPTION(osd_op_num_shards, OPT_INT, 5)
-OPTION(osd_op_queue, OPT_STR, "prio") // PrioritzedQueue (prio), Weighted Priority Queue (wpq), or debug_random
+OPTION(osd_op_queue, OPT_STR, "prio") // PrioritzedQueue (prio), Weighted Priority Queue (wpq), mClock (mclock), or debug_random
 OPTION(osd_op_queue_cut_off, OPT_STR, "low") // Min priority to go to strict queue. (low, high, debug_random)
+// mclock op queue reservation (ops/s), weight and limit (ops/s, 0 for none)
+// per op shard; client ops and sub ops are tracked per client or peer osd
+OPTION(osd_op_queue_mclock_client_op_res, OPT_DOUBLE, 100.0)
+OPTION(osd_op_queue_mclock_client_op_wgt, OPT_DOUBLE, 500.0)
+OPTION(osd_op_queue_mclock_client_op_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_osd_subop_res, OPT_DOUBLE, 100.0)
+OPTION(osd_op_queue_mclock_osd_subop_wgt, OPT_DOUBLE, 500.0)
+OPTION(osd_op_queue_mclock_osd_subop_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_snap_res, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_snap_wgt, OPT_DOUBLE, 1.0)
+OPTION(osd_op_queue_mclock_snap_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_recov_res, OPT_DOUBLE, 10.0)
+OPTION(osd_op_queue_mclock_recov_wgt, OPT_DOUBLE, 10.0)
+OPTION(osd_op_queue_mclock_recov_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_scrub_res, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_scrub_wgt, OPT_DOUBLE, 1.0)
+OPTION(osd_op_queue_mclock_scrub_lim, OPT_DOUBLE, 0.0)
 
 // Set to true for testing.  Users should NOT set this.
 // If set to true even after reading enough shards to
 // decode the object, any error will be reported.
 OPTION(osd_read_ec_check_for_errors, OPT_BOOL, false) // return error if any ec shard has an error
+OPTION(osd_ec_subchunk_reads, OPT_BOOL, true) // read only the needed bytes of healthy ec data shards, without decoding
 
 // Only use clone_overlap for recovery if there are fewer than
 // osd_recover_clone_overlap_limit entries in the overlap set
@@ -853,6 +871,12 @@ OPTION(osd_objectstore_tracing, OPT_BOOL, false) // true if LTTng-UST tracepoint
 // Set to true for testing.  Users should NOT set this.
 OPTION(osd_debug_override_acting_compat, OPT_BOOL, false)
 OPTION(osd_objectstore_fuse, OPT_BOOL, false)
+// per-object sequential read detection and prefetch; 0 streams disables
+OPTION(osd_objectstore_readahead_streams, OPT_U64, 256) // objects tracked
+OPTION(osd_objectstore_readahead_shards, OPT_U32, 8) // independently locked parts of the stream table
+OPTION(osd_objectstore_readahead_trigger_requests, OPT_INT, 2) // sequential reads before prefetching
+OPTION(osd_objectstore_readahead_min_bytes, OPT_U64, 128*1024)
+OPTION(osd_objectstore_readahead_max_bytes, OPT_U64, 4*1024*1024)
 
 OPTION(osd_bench_small_size_max_iops, OPT_U32, 100) // 100 IOPS
 OPTION(osd_bench_large_size_max_throughput, OPT_U64, 100 << 20) // 100 MB/s
@@ -862,13 +886,16 @@ OPTION(osd_bench_duration, OPT_U32, 30) // duration of 'osd bench', capped at 30
 OPTION(memstore_device_bytes, OPT_U64, 1024*1024*1024)
 OPTION(memstore_page_set, OPT_BOOL, true)
 OPTION(memstore_page_size, OPT_U64, 64 << 10)
+OPTION(memstore_page_zero_copy_read, OPT_BOOL, false) // reads reference pages, overwrites copy them
 
 OPTION(bdev_debug_inflight_ios, OPT_BOOL, false)
 OPTION(bdev_inject_crash, OPT_INT, 0)  // if N>0, then ~ 1/N IOs will complete before we crash on flush.
 OPTION(bdev_inject_crash_flush_delay, OPT_INT, 2) // wait N more seconds on flush
 OPTION(bdev_aio, OPT_BOOL, true)
 OPTION(bdev_aio_poll_ms, OPT_INT, 250)  // milliseconds
-OPTION(bdev_aio_max_queue_depth, OPT_INT, 32)
+OPTION(bdev_aio_max_queue_depth, OPT_INT, 32)  // per aio queue
+OPTION(bdev_aio_queues, OPT_INT, 4)  // aio contexts, each with its own completion thread
+OPTION(bdev_aio_busy_poll, OPT_BOOL, false)  // spin on completions instead of blocking for bdev_aio_poll_ms
 
 // if yes, osd will unbind all NVMe devices from kernel driver and bind them
 // to the uio_pci_generic driver. The purpose is to prevent the case where
@@ -883,6 +910,8 @@ OPTION(bluefs_max_log_runway, OPT_U64, 4194304)  // alloc this much at a time
 OPTION(bluefs_log_compact_min_ratio, OPT_FLOAT, 5.0)      // before we consider
 OPTION(bluefs_log_compact_min_size, OPT_U64, 16*1048576)  // before we consider
 OPTION(bluefs_min_flush_size, OPT_U64, 65536)  // ignore flush until its this big
+OPTION(bluefs_wal_direct_io, OPT_BOOL, true)  // write rocksdb wal files with O_DIRECT aio
+OPTION(bluefs_preextend_wal_size, OPT_U64, 64*1048576)  // zero-fill new rocksdb wal files to this size (0 to disable)
 
 OPTION(bluestore_bluefs, OPT_BOOL, true)
 OPTION(bluestore_bluefs_env_mirror, OPT_BOOL, false) // mirror to normal Env for debug
@@ -908,18 +937,41 @@ OPTION(bluestore_block_wal_size, OPT_U64, 96 * 1024*1024) // rocksdb wal
 OPTION(bluestore_block_wal_create, OPT_BOOL, false)
 OPTION(bluestore_max_dir_size, OPT_U32, 1000000)
 OPTION(bluestore_min_alloc_size, OPT_U32, 64*1024)
-OPTION(bluestore_onode_map_size, OPT_U32, 1024)   // onodes per collection
+OPTION(bluestore_allocator, OPT_STR, "stupid")  // stupid|bitmap
+OPTION(bluestore_bitmap_zone_blocks, OPT_U32, 8192)  // blocks per bitmap allocator zone (lock granularity)
+OPTION(bluestore_freelist_type, OPT_STR, "extent")  // extent|bitmap; fixed at mkfs
+OPTION(bluestore_freelist_blocks_per_key, OPT_INT, 128)  // bitmap freelist: blocks per kv key (power of 2)
+OPTION(bluestore_csum_type, OPT_STR, "crc32c") // none|crc32c
+OPTION(bluestore_csum_block_size, OPT_U32, 4096)  // power of 2, >= device block size
+OPTION(bluestore_compression, OPT_STR, "none")  // none|passive|aggressive; pool compression_mode overrides
+OPTION(bluestore_compression_required_ratio, OPT_DOUBLE, .875)  // store compressed only if compressed/raw <= this
+OPTION(bluestore_onode_map_size, OPT_U32, 1024)   // enode hash buckets per collection
+OPTION(bluestore_cache_size, OPT_U64, 512*1024*1024)  // onodes and data, all shards
+OPTION(bluestore_cache_shards, OPT_INT, 8)
+OPTION(bluestore_cache_type, OPT_STR, "2q")   // lru, 2q
+OPTION(bluestore_cache_meta_ratio, OPT_DOUBLE, .25)   // max share for onodes
+OPTION(bluestore_2q_cache_kin_ratio, OPT_DOUBLE, .5)  // share of data in a1in
+OPTION(bluestore_2q_cache_kout_ratio, OPT_DOUBLE, .5) // ghosts in a1out, as share of data
 OPTION(bluestore_cache_tails, OPT_BOOL, true)   // cache tail blocks in Onode
 OPTION(bluestore_backend, OPT_STR, "rocksdb")
 OPTION(bluestore_rocksdb_options, OPT_STR, "compression=kNoCompression,max_write_buffer_number=16,min_write_buffer_number_to_merge=3,recycle_log_file_num=16")
+// prefixes kept in their own rocksdb column family, as space separated
+// prefix:options pairs, e.g. "L:write_buffer_size=16777216 M:bloom_bits=10".
+// options add to bluestore_rocksdb_options and also take block_size,
+// block_cache_size and bloom_bits.  only applied when the db is created.
+OPTION(bluestore_rocksdb_cfs, OPT_STR, "")
 OPTION(bluestore_fsck_on_mount, OPT_BOOL, false)
+OPTION(bluestore_fsck_on_mount_deep, OPT_BOOL, false)
 OPTION(bluestore_fsck_on_umount, OPT_BOOL, false)
+OPTION(bluestore_fsck_on_umount_deep, OPT_BOOL, true)
+OPTION(bluestore_fsck_threads, OPT_INT, 4)  // collections checked in parallel
 OPTION(bluestore_fail_eio, OPT_BOOL, true)
 OPTION(bluestore_sync_io, OPT_BOOL, false)  // perform initial io synchronously
 OPTION(bluestore_sync_transaction, OPT_BOOL, false)  // perform kv txn synchronously
 OPTION(bluestore_sync_submit_transaction, OPT_BOOL, false)
 OPTION(bluestore_sync_wal_apply, OPT_BOOL, true)     // perform initial wal work synchronously (possibly in combination with aio so we only *queue* ios)
 OPTION(bluestore_wal_threads, OPT_INT, 4)
+OPTION(bluestore_wal_max_batch, OPT_INT, 64)  // txcs whose wal writes are merged and applied together
 OPTION(bluestore_wal_thread_timeout, OPT_INT, 30)
 OPTION(bluestore_wal_thread_suicide_timeout, OPT_INT, 120)
 OPTION(bluestore_max_ops, OPT_U64, 512)
@@ -952,6 +1004,7 @@ OPTION(kstore_sync_submit_transaction, OPT_BOOL, false)
 OPTION(kstore_onode_map_size, OPT_U64, 1024)
 OPTION(kstore_cache_tails, OPT_BOOL, true)
 OPTION(kstore_default_stripe_size, OPT_INT, 65536)
+OPTION(kstore_stripe_cache_size, OPT_U64, 64*1024*1024) // bytes of recently touched stripes to keep
 
 OPTION(filestore_omap_backend, OPT_STR, "leveldb")
 
@@ -974,6 +1027,12 @@ OPTION(filestore_wbthrottle_xfs_inodes_start_flusher, OPT_U64, 500)
 OPTION(filestore_wbthrottle_btrfs_inodes_hard_limit, OPT_U64, 5000)
 OPTION(filestore_wbthrottle_xfs_inodes_hard_limit, OPT_U64, 5000)
 
+/// derive the limits above from measured flush latency; they become ceilings
+OPTION(filestore_wbthrottle_adaptive, OPT_BOOL, false)
+OPTION(filestore_wbthrottle_adaptive_start_ms, OPT_U32, 100)   // backlog drain time to start flushing at
+OPTION(filestore_wbthrottle_adaptive_hard_ms, OPT_U32, 1000)   // backlog drain time to block writers at
+OPTION(filestore_wbthrottle_adaptive_max_flushers, OPT_INT, 4) // flusher threads, read at mount
+
 // Tests index failure paths
 OPTION(filestore_index_retry_probability, OPT_DOUBLE, 0)
 
@@ -982,6 +1041,7 @@ OPTION(filestore_debug_inject_read_err, OPT_BOOL, false)
 
 OPTION(filestore_debug_omap_check, OPT_BOOL, 0) // Expensive debugging check on sync
 OPTION(filestore_omap_header_cache_size, OPT_INT, 1024)
+OPTION(filestore_omap_header_cache_shards, OPT_INT, 16) // split cache size among these, by object hash
 
 // Use omap for xattrs for attrs over
 // filestore_max_inline_xattr_size or
@@ -1029,7 +1089,7 @@ OPTION(filestore_queue_max_ops, OPT_INT, 50)
 OPTION(filestore_queue_max_bytes, OPT_INT, 100 << 20)
 OPTION(filestore_queue_committing_max_ops, OPT_INT, 500)        // this is ON TOP of filestore_queue_max_*
 OPTION(filestore_queue_committing_max_bytes, OPT_INT, 100 << 20) //  "
-OPTION(filestore_op_threads, OPT_INT, 2)
+OPTION(filestore_op_threads, OPT_INT, 2)  // one op queue shard per thread
 OPTION(filestore_op_thread_timeout, OPT_INT, 60)
 OPTION(filestore_op_thread_suicide_timeout, OPT_INT, 180)
 OPTION(filestore_commit_timeout, OPT_FLOAT, 600)
@@ -1057,6 +1117,7 @@ OPTION(journal_block_align, OPT_BOOL, true)
 OPTION(journal_write_header_frequency, OPT_U64, 0)
 OPTION(journal_max_write_bytes, OPT_INT, 10 << 20)
 OPTION(journal_max_write_entries, OPT_INT, 100)
+OPTION(journal_aio_queue_depth, OPT_INT, 16)  // write batches in flight with aio (0 = back off adaptively)
 OPTION(journal_queue_max_ops, OPT_INT, 300)
 OPTION(journal_queue_max_bytes, OPT_INT, 32 << 20)
 OPTION(journal_align_min_size, OPT_INT, 64 << 10)  // align data payloads >= this.
@@ -0,0 +1,370 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef MCLOCK_QUEUE_H
+#define MCLOCK_QUEUE_H
+
+#include "common/Formatter.h"
+#include "common/OpQueue.h"
+#include "include/assert.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+
+/**
+ * mClock queue with strict priority queue
+ *
+ * Ops are grouped into clients, by default one per class K, and each
+ * client has a reservation, a weight and a limit in ops per second.
+ * Clients whose reservation tag is due are served first, in tag order,
+ * so that each gets at least its reservation.  The rest of the
+ * throughput is shared in proportion to the weights among the clients
+ * that are under their limit.  The priority and cost of non-strict ops
+ * are not used.
+ *
+ * Only the op at the head of each client's queue is tagged, and
+ * dequeue() looks at every client with queued ops, which is cheap for
+ * the few dozen clients a queue sees at once.
+ *
+ * dequeue() must return an op, so the queue is work conserving: when
+ * every client is over its limit, the one that gets back under it
+ * first is served anyway.
+ *
+ * Strict ops are served before all others, highest priority first.
+ */
+
+template <typename T, typename K, typename C = K>
+class mClockQueue : public OpQueue <T, K> {
+public:
+  struct ClientInfo {
+    double reservation;  ///< ops/s always granted, 0 for none
+    double weight;       ///< share of the rest, > 0
+    double limit;        ///< ops/s at most, 0 for none
+    ClientInfo(double reservation = 0, double weight = 1, double limit = 0)
+      : reservation(reservation), weight(weight), limit(limit) {}
+  };
+  /// client of an op, given its class
+  typedef std::function<C (const K&, const T&)> ClassifyFunc;
+  typedef std::function<ClientInfo (const C&)> ClientInfoFunc;
+  /// current time in seconds
+  typedef std::function<double ()> ClockFunc;
+
+  static C classify_by_class(const K &cl, const T &item) {
+    return C(cl);
+  }
+  static double steady_clock_now() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  struct Request {
+    K cl;
+    double arrival;
+    T item;
+    Request(K cl, double arrival, T item)
+      : cl(cl), arrival(arrival), item(item) {}
+  };
+
+  struct Tags {
+    double reservation;
+    double proportion;
+    double limit;
+    Tags() : reservation(0), proportion(0), limit(0) {}
+  };
+
+  struct Client {
+    ClientInfo info;
+    std::deque<Request> requests;
+    Tags prev;          ///< tags of the last op served
+    Tags head;          ///< tags of requests.front() if head_tagged
+    bool head_tagged;
+    uint64_t served_reservation;
+    uint64_t served_weight;
+    explicit Client(const ClientInfo &info)
+      : info(info), head_tagged(false),
+	served_reservation(0), served_weight(0) {
+      assert(info.weight > 0);
+    }
+  };
+
+  typedef std::map<C, Client> Clients;
+  Clients clients;
+  unsigned size;
+
+  typedef std::list<std::pair<K, T>> ListPairs;
+  typedef std::map<unsigned, ListPairs> SubQueues;
+  SubQueues high_queue;
+  unsigned high_size;
+
+  ClassifyFunc classify_f;
+  ClientInfoFunc client_info_f;
+  ClockFunc clock_f;
+
+  void tag_head(Client &c) {
+    if (c.head_tagged)
+      return;
+    const Request &r = c.requests.front();
+    c.head.reservation = c.info.reservation > 0 ?
+      std::max(c.prev.reservation + 1.0 / c.info.reservation, r.arrival) :
+      std::numeric_limits<double>::infinity();
+    c.head.proportion =
+      std::max(c.prev.proportion + 1.0 / c.info.weight, r.arrival);
+    c.head.limit = c.info.limit > 0 ?
+      std::max(c.prev.limit + 1.0 / c.info.limit, r.arrival) : 0;
+    c.head_tagged = true;
+  }
+
+  bool is_idle(const Client &c, double now) const {
+    return c.requests.empty() &&
+      c.prev.proportion <= now &&
+      c.prev.limit <= now &&
+      (c.info.reservation == 0 || c.prev.reservation <= now);
+  }
+
+  Client &get_client(const K &cl, const T &item, double now) {
+    C id = classify_f(cl, item);
+    typename Clients::iterator p = clients.find(id);
+    if (p == clients.end()) {
+      // forget clients which have been idle long enough not to matter
+      for (typename Clients::iterator i = clients.begin();
+	   i != clients.end(); ) {
+	if (is_idle(i->second, now)) {
+	  clients.erase(i++);
+	} else {
+	  ++i;
+	}
+      }
+      p = clients.insert(std::make_pair(id, Client(client_info_f(id)))).first;
+    }
+    Client &c = p->second;
+    if (c.requests.empty()) {
+      // a client becoming active must not get ahead of the others by
+      // starting from proportion tags in the past
+      double min_proportion = std::numeric_limits<double>::infinity();
+      for (typename Clients::iterator i = clients.begin();
+	   i != clients.end(); ++i) {
+	if (i->second.head_tagged && !i->second.requests.empty())
+	  min_proportion = std::min(min_proportion, i->second.head.proportion);
+      }
+      if (min_proportion != std::numeric_limits<double>::infinity())
+	c.prev.proportion = std::max(c.prev.proportion,
+				     min_proportion - 1.0 / c.info.weight);
+    }
+    return c;
+  }
+
+  T serve(Client &c, bool weight_phase) {
+    c.prev = c.head;
+    if (weight_phase) {
+      // ops served by weight do not count towards the reservation
+      if (c.info.reservation > 0)
+	c.prev.reservation -= 1.0 / c.info.reservation;
+      ++c.served_weight;
+    } else {
+      ++c.served_reservation;
+    }
+    T ret = c.requests.front().item;
+    c.requests.pop_front();
+    c.head_tagged = false;
+    --size;
+    return ret;
+  }
+
+  unsigned remove_if(
+      std::function<bool (const K&, const T&)> f, std::list<T> *out) {
+    unsigned count = 0;
+    for (typename SubQueues::iterator i = high_queue.begin();
+	 i != high_queue.end(); ) {
+      for (typename ListPairs::iterator j = i->second.begin();
+	   j != i->second.end(); ) {
+	if (f(j->first, j->second)) {
+	  if (out)
+	    out->push_back(j->second);
+	  i->second.erase(j++);
+	  --high_size;
+	  ++count;
+	} else {
+	  ++j;
+	}
+      }
+      if (i->second.empty()) {
+	high_queue.erase(i++);
+      } else {
+	++i;
+      }
+    }
+    for (typename Clients::iterator i = clients.begin();
+	 i != clients.end(); ++i) {
+      std::deque<Request> &q = i->second.requests;
+      for (typename std::deque<Request>::iterator j = q.begin();
+	   j != q.end(); ) {
+	if (f(j->cl, j->item)) {
+	  if (out)
+	    out->push_back(j->item);
+	  if (j == q.begin())
+	    i->second.head_tagged = false;
+	  j = q.erase(j);
+	  --size;
+	  ++count;
+	} else {
+	  ++j;
+	}
+      }
+    }
+    return count;
+  }
+
+public:
+  explicit mClockQueue(
+    ClientInfoFunc client_info_f,
+    ClassifyFunc classify_f = classify_by_class,
+    ClockFunc clock_f = steady_clock_now)
+    : size(0),
+      high_size(0),
+      classify_f(classify_f),
+      client_info_f(client_info_f),
+      clock_f(clock_f) {}
+
+  unsigned length() const override final {
+    return high_size + size;
+  }
+
+  void remove_by_filter(
+      std::function<bool (T)> f, std::list<T> *removed = 0) override final {
+    remove_if([&f](const K &cl, const T &item) { return f(item); }, removed);
+  }
+
+  void remove_by_class(K k, std::list<T> *out = 0) override final {
+    remove_if([&k](const K &cl, const T &item) { return cl == k; }, out);
+  }
+
+  void enqueue_strict(K cl, unsigned priority, T item) override final {
+    high_queue[priority].push_back(std::make_pair(cl, item));
+    ++high_size;
+  }
+
+  void enqueue_strict_front(K cl, unsigned priority, T item) override final {
+    high_queue[priority].push_front(std::make_pair(cl, item));
+    ++high_size;
+  }
+
+  void enqueue(K cl, unsigned priority, unsigned cost, T item) override final {
+    double now = clock_f();
+    Client &c = get_client(cl, item, now);
+    c.requests.push_back(Request(cl, now, item));
+    ++size;
+  }
+
+  void enqueue_front(K cl, unsigned priority, unsigned cost, T item) override final {
+    double now = clock_f();
+    Client &c = get_client(cl, item, now);
+    // the op keeps the place, and the tags, of the one it goes before
+    double arrival = c.requests.empty() ? now : c.requests.front().arrival;
+    c.requests.push_front(Request(cl, arrival, item));
+    ++size;
+  }
+
+  bool empty() const override final {
+    return (high_size + size == 0) ? true : false;
+  }
+
+  T dequeue() override final {
+    assert(!empty());
+
+    if (!high_queue.empty()) {
+      T ret = high_queue.rbegin()->second.front().second;
+      high_queue.rbegin()->second.pop_front();
+      if (high_queue.rbegin()->second.empty()) {
+	high_queue.erase(high_queue.rbegin()->first);
+      }
+      --high_size;
+      return ret;
+    }
+
+    double now = clock_f();
+    typename Clients::iterator best = clients.end();
+    // reservations which are due, earliest first
+    for (typename Clients::iterator i = clients.begin();
+	 i != clients.end(); ++i) {
+      if (i->second.requests.empty())
+	continue;
+      tag_head(i->second);
+      if (i->second.head.reservation <= now &&
+	  (best == clients.end() ||
+	   i->second.head.reservation < best->second.head.reservation))
+	best = i;
+    }
+    if (best != clients.end())
+      return serve(best->second, false);
+
+    // then by weight among the clients under their limit
+    for (typename Clients::iterator i = clients.begin();
+	 i != clients.end(); ++i) {
+      if (i->second.requests.empty() || i->second.head.limit > now)
+	continue;
+      if (best == clients.end() ||
+	  i->second.head.proportion < best->second.head.proportion)
+	best = i;
+    }
+    if (best == clients.end()) {
+      // everyone is over their limit
+      for (typename Clients::iterator i = clients.begin();
+	   i != clients.end(); ++i) {
+	if (i->second.requests.empty())
+	  continue;
+	if (best == clients.end() ||
+	    i->second.head.limit < best->second.head.limit)
+	  best = i;
+      }
+    }
+    assert(best != clients.end());
+    return serve(best->second, true);
+  }
+
+  void dump(ceph::Formatter *f) const {
+    f->dump_int("high_size", high_size);
+    f->open_array_section("high_queues");
+    for (typename SubQueues::const_iterator p = high_queue.begin();
+	 p != high_queue.end();
+	 ++p) {
+      f->open_object_section("subqueue");
+      f->dump_int("priority", p->first);
+      f->dump_int("size", p->second.size());
+      f->close_section();
+    }
+    f->close_section();
+    f->dump_int("size", size);
+    f->open_array_section("clients");
+    for (typename Clients::const_iterator p = clients.begin();
+	 p != clients.end();
+	 ++p) {
+      f->open_object_section("client");
+      f->dump_stream("client") << p->first;
+      f->dump_int("size", p->second.requests.size());
+      f->dump_float("reservation", p->second.info.reservation);
+      f->dump_float("weight", p->second.info.weight);
+      f->dump_float("limit", p->second.info.limit);
+      f->dump_int("served_by_reservation", p->second.served_reservation);
+      f->dump_int("served_by_weight", p->second.served_weight);
+      f->close_section();
+    }
+    f->close_section();
+  }
+};
+
+#endif
@@ -128,6 +128,7 @@ namespace buffer CEPH_BUFFER_API {
   class raw;
   class raw_malloc;
   class raw_static;
+  class raw_external;
   class raw_mmap_pages;
   class raw_posix_aligned;
   class raw_hack_aligned;
@@ -148,6 +149,8 @@ namespace buffer CEPH_BUFFER_API {
   raw* create_malloc(unsigned len);
   raw* claim_malloc(unsigned len, char *buf);
   raw* create_static(unsigned len, char *buf);
+  raw* claim_external(unsigned len, char *buf,
+		      void (*release)(void *arg), void *arg);
   raw* create_aligned(unsigned len, unsigned align);
   raw* create_page_aligned(unsigned len);
   raw* create_zero_copy(unsigned len, int fd, int64_t *offset);
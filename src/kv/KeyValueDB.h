@@ -93,6 +93,13 @@ public:
       const std::string &prefix ///< [in] Prefix by which to remove keys
       ) = 0;
 
+    /// Merge value into key, using the merge operator set for prefix
+    virtual void merge(
+      const std::string &prefix,   ///< [in] Prefix ==> MUST match some established merge operator
+      const std::string &key,      ///< [in] Key to be merged
+      const bufferlist  &value     ///< [in] value to be merged into key
+    ) { assert(0 == "Not implemented"); }
+
     virtual ~TransactionImpl() {}
   };
   typedef ceph::shared_ptr< TransactionImpl > Transaction;
@@ -120,6 +127,16 @@ public:
     const std::set<std::string> &key,      ///< [in] Key to retrieve
     std::map<std::string, bufferlist> *out ///< [out] Key value retrieved
     ) = 0;
+  /// Retrieve a batch of keys in one call; missing keys are left out of
+  /// *out.  Backends with a native batched lookup should override this.
+  virtual int multi_get(
+    const std::string &prefix,             ///< [in] Prefix for keys
+    const std::vector<std::string> &keys,  ///< [in] Keys to retrieve
+    std::map<std::string, bufferlist> *out ///< [out] Key values retrieved
+    ) {
+    std::set<std::string> ks(keys.begin(), keys.end());
+    return get(prefix, ks, out);
+  }
   virtual int get(const std::string &prefix, ///< [in] prefix
 		  const std::string &key,    ///< [in] key
 		  bufferlist *value) {  ///< [out] value
@@ -269,6 +286,41 @@ public:
 
   virtual ~KeyValueDB() {}
 
+  /// merge operator for a prefix: combines an existing value (if any) with
+  /// the operand passed to TransactionImpl::merge()
+  class MergeOperator {
+  public:
+    /// Merge into a key that doesn't exist
+    virtual void merge_nonexistent(
+      const char *rdata, size_t rlen,
+      std::string *new_value) = 0;
+    /// Merge into a key that does exist
+    virtual void merge(
+      const char *ldata, size_t llen,
+      const char *rdata, size_t rlen,
+      std::string *new_value) = 0;
+    /// We use each operator name and each prefix to construct the
+    /// overall RocksDB operator name for consistency check at open time.
+    virtual string name() const = 0;
+
+    virtual ~MergeOperator() {}
+  };
+
+  /// Setup one or more operators, this needs to be done BEFORE the DB is opened.
+  virtual int set_merge_operator(const std::string& prefix,
+				 std::shared_ptr<MergeOperator> mop) {
+    return -EOPNOTSUPP;
+  }
+
+  /// Keep keys under prefix apart from the rest of the db (e.g., in their
+  /// own rocksdb column family) so they can be tuned and compacted on their
+  /// own.  options uses the backend's option string syntax.  Call before
+  /// open; the transaction and iterator APIs are unaffected.
+  virtual int set_column_family(const std::string& prefix,
+				const std::string& options) {
+    return -EOPNOTSUPP;
+  }
+
   /// compact the underlying store
   virtual void compact() {}
 
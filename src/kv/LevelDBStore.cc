@@ -166,11 +166,70 @@ void LevelDBStore::close()
     cct->get_perfcounters_collection()->remove(logger);
 }
 
+int LevelDBStore::set_merge_operator(
+  const string& prefix,
+  std::shared_ptr<KeyValueDB::MergeOperator> mop)
+{
+  merge_ops[prefix] = mop;
+  return 0;
+}
+
+void LevelDBStore::_resolve_merges(LevelDBTransactionImpl *t)
+{
+  // each merged key gets a final put (or delete) at the end of the
+  // batch, which supersedes whatever the transaction did to it earlier.
+  for (auto& p : t->merge_keys) {
+    LevelDBTransactionImpl::MergeKey& mk = p.second;
+    if (!mk.has_merge)
+      continue;
+    string value;
+    leveldb::Status s = db->Get(leveldb::ReadOptions(),
+				leveldb::Slice(p.first), &value);
+    bool exists = s.ok();
+    for (auto& op : mk.ops) {
+      switch (op.first) {
+      case LevelDBTransactionImpl::MergeKey::OP_SET:
+	value = op.second;
+	exists = true;
+	break;
+      case LevelDBTransactionImpl::MergeKey::OP_RM:
+	value.clear();
+	exists = false;
+	break;
+      case LevelDBTransactionImpl::MergeKey::OP_MERGE:
+	{
+	  string new_value;
+	  if (exists)
+	    mk.mop->merge(value.data(), value.size(),
+			  op.second.data(), op.second.size(), &new_value);
+	  else
+	    mk.mop->merge_nonexistent(op.second.data(), op.second.size(),
+				      &new_value);
+	  value.swap(new_value);
+	  exists = true;
+	}
+	break;
+      }
+    }
+    if (exists)
+      t->bat.Put(leveldb::Slice(p.first), leveldb::Slice(value));
+    else
+      t->bat.Delete(leveldb::Slice(p.first));
+  }
+}
+
 int LevelDBStore::submit_transaction(KeyValueDB::Transaction t)
 {
   utime_t start = ceph_clock_now(g_ceph_context);
   LevelDBTransactionImpl * _t =
     static_cast<LevelDBTransactionImpl *>(t.get());
+  // a plain set or rm of a merge key must not land between another
+  // transaction's read and write of it, so take the lock for those too
+  std::unique_lock<std::mutex> l(merge_lock, std::defer_lock);
+  if (!_t->merge_keys.empty())
+    l.lock();
+  if (_t->has_merges)
+    _resolve_merges(_t);
   leveldb::Status s = db->Write(leveldb::WriteOptions(), &(_t->bat));
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_leveldb_txns);
@@ -183,6 +242,13 @@ int LevelDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
   utime_t start = ceph_clock_now(g_ceph_context);
   LevelDBTransactionImpl * _t =
     static_cast<LevelDBTransactionImpl *>(t.get());
+  // a plain set or rm of a merge key must not land between another
+  // transaction's read and write of it, so take the lock for those too
+  std::unique_lock<std::mutex> l(merge_lock, std::defer_lock);
+  if (!_t->merge_keys.empty())
+    l.lock();
+  if (_t->has_merges)
+    _resolve_merges(_t);
   leveldb::WriteOptions options;
   options.sync = true;
   leveldb::Status s = db->Write(options, &(_t->bat));
@@ -192,6 +258,24 @@ int LevelDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
   return s.ok() ? 0 : -1;
 }
 
+void LevelDBStore::LevelDBTransactionImpl::_note_op(
+  const string &prefix,
+  const string &key,
+  MergeKey::op_t op,
+  const string &value)
+{
+  auto p = db->merge_ops.find(prefix);
+  if (p == db->merge_ops.end())
+    return;
+  MergeKey& mk = merge_keys[key];
+  mk.mop = p->second;
+  mk.ops.push_back(make_pair(op, value));
+  if (op == MergeKey::OP_MERGE) {
+    mk.has_merge = true;
+    has_merges = true;
+  }
+}
+
 void LevelDBStore::LevelDBTransactionImpl::set(
   const string &prefix,
   const string &k,
@@ -221,6 +305,11 @@ void LevelDBStore::LevelDBTransactionImpl::set(
     bufferlist val = to_set_bl;
     bat.Put(leveldb::Slice(key), leveldb::Slice(val.c_str(), val.length()));
   }
+  if (!db->merge_ops.empty()) {
+    string v;
+    to_set_bl.copy(0, bllen, v);
+    _note_op(prefix, key, MergeKey::OP_SET, v);
+  }
 }
 
 void LevelDBStore::LevelDBTransactionImpl::rmkey(const string &prefix,
@@ -228,6 +317,8 @@ void LevelDBStore::LevelDBTransactionImpl::rmkey(const string &prefix,
 {
   string key = combine_strings(prefix, k);
   bat.Delete(leveldb::Slice(key));
+  if (!db->merge_ops.empty())
+    _note_op(prefix, key, MergeKey::OP_RM, string());
 }
 
 void LevelDBStore::LevelDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
@@ -238,29 +329,69 @@ void LevelDBStore::LevelDBTransactionImpl::rmkeys_by_prefix(const string &prefix
        it->next()) {
     string key = combine_strings(prefix, it->key());
     bat.Delete(key);
+    if (!db->merge_ops.empty())
+      _note_op(prefix, key, MergeKey::OP_RM, string());
+  }
+  // keys that only exist as merges earlier in this transaction
+  if (db->merge_ops.count(prefix)) {
+    string start = combine_strings(prefix, string());
+    for (auto p = merge_keys.lower_bound(start);
+	 p != merge_keys.end() && p->first.compare(0, start.size(), start) == 0;
+	 ++p)
+      p->second.ops.push_back(make_pair(MergeKey::OP_RM, string()));
   }
 }
 
+void LevelDBStore::LevelDBTransactionImpl::merge(
+  const string &prefix,
+  const string &k,
+  const bufferlist &bl)
+{
+  assert(db->merge_ops.count(prefix));
+  string key = combine_strings(prefix, k);
+  string v;
+  bl.copy(0, bl.length(), v);
+  _note_op(prefix, key, MergeKey::OP_MERGE, v);
+}
+
 int LevelDBStore::get(
     const string &prefix,
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
+  std::vector<string> v(keys.begin(), keys.end());
+  return multi_get(prefix, v, out);
+}
+
+int LevelDBStore::multi_get(
+    const string &prefix,
+    const std::vector<string> &keys,
+    std::map<string, bufferlist> *out)
+{
+  // leveldb has no batched lookup; do point lookups against one
+  // snapshot, which (unlike seeking an iterator) can use the bloom filter.
   utime_t start = ceph_clock_now(g_ceph_context);
-  KeyValueDB::Iterator it = get_iterator(prefix);
-  for (std::set<string>::const_iterator i = keys.begin();
-       i != keys.end();
-       ++i) {
-    it->lower_bound(*i);
-    if (it->valid() && it->key() == *i) {
-      out->insert(make_pair(*i, it->value()));
-    } else if (!it->valid())
-      break;
+  leveldb::ReadOptions options;
+  options.snapshot = db->GetSnapshot();
+  int r = 0;
+  for (auto& k : keys) {
+    string value;
+    leveldb::Status s = db->Get(options,
+				leveldb::Slice(combine_strings(prefix, k)),
+				&value);
+    if (s.ok()) {
+      bufferlist bl;
+      bl.append(value);
+      (*out)[k].claim(bl);
+    } else if (!s.IsNotFound()) {
+      r = -EIO;
+    }
   }
+  db->ReleaseSnapshot(options.snapshot);
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_leveldb_gets);
   logger->tinc(l_leveldb_get_latency, lat);
-  return 0;
+  return r;
 }
 
 int LevelDBStore::get(const string &prefix, 
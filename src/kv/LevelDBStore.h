@@ -8,6 +8,7 @@
 #include "KeyValueDB.h"
 #include <set>
 #include <map>
+#include <mutex>
 #include <string>
 #include "include/memory.h"
 #include <boost/scoped_ptr.hpp>
@@ -65,6 +66,13 @@ class LevelDBStore : public KeyValueDB {
 
   int do_open(ostream &out, bool create_if_missing);
 
+  // emulated merge operators.  merges are read-modify-write, so they
+  // are resolved and written under merge_lock, as is any transaction
+  // writing a merge key, to avoid lost updates between concurrent
+  // transactions.
+  map<string, std::shared_ptr<KeyValueDB::MergeOperator> > merge_ops;
+  std::mutex merge_lock;
+
   // manage async compactions
   Mutex compact_queue_lock;
   Cond compact_queue_cond;
@@ -185,7 +193,19 @@ public:
   public:
     leveldb::WriteBatch bat;
     LevelDBStore *db;
-    explicit LevelDBTransactionImpl(LevelDBStore *db) : db(db) {}
+
+    /// ops on one key with a merge operator, in transaction order
+    struct MergeKey {
+      enum op_t { OP_SET, OP_RM, OP_MERGE };
+      std::shared_ptr<KeyValueDB::MergeOperator> mop;
+      vector<pair<op_t,string> > ops;
+      bool has_merge = false;
+    };
+    map<string,MergeKey> merge_keys;  ///< full key -> ops
+    bool has_merges;
+
+    explicit LevelDBTransactionImpl(LevelDBStore *db)
+      : db(db), has_merges(false) {}
     void set(
       const string &prefix,
       const string &k,
@@ -196,6 +216,14 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void merge(
+      const string &prefix,
+      const string &k,
+      const bufferlist &bl);
+
+  private:
+    void _note_op(const string &prefix, const string &key,
+		  MergeKey::op_t op, const string &value);
   };
 
   KeyValueDB::Transaction get_transaction() {
@@ -205,6 +233,9 @@ public:
 
   int submit_transaction(KeyValueDB::Transaction t);
   int submit_transaction_sync(KeyValueDB::Transaction t);
+private:
+  void _resolve_merges(LevelDBTransactionImpl *t);
+public:
   int get(
     const string &prefix,
     const std::set<string> &key,
@@ -214,6 +245,14 @@ public:
   int get(const string &prefix, 
     const string &key,   
     bufferlist *value);
+  int multi_get(
+    const string &prefix,
+    const std::vector<string> &keys,
+    std::map<string, bufferlist> *out);
+
+  /// leveldb has no merge operators; merges are resolved at submit time
+  int set_merge_operator(const string& prefix,
+			 std::shared_ptr<KeyValueDB::MergeOperator> mop);
       
   class LevelDBWholeSpaceIteratorImpl :
     public KeyValueDB::WholeSpaceIteratorImpl {
@@ -1,6 +1,7 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
 
+#include <algorithm>
 #include <set>
 #include <map>
 #include <string>
@@ -17,6 +18,7 @@
 #include "rocksdb/slice.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/filter_policy.h"
+#include "rocksdb/merge_operator.h"
 #include "rocksdb/utilities/convenience.h"
 using std::string;
 #include "common/perf_counters.h"
@@ -84,6 +86,74 @@ int string2bool(string val, bool &b_val)
   }
 }
   
+class RocksDBStore::MergeOperatorRouter : public rocksdb::AssociativeMergeOperator {
+  RocksDBStore& store;
+  string name;
+public:
+  explicit MergeOperatorRouter(RocksDBStore &_store) : store(_store) {
+    // the name covers every prefix/operator pair, so a db reopened with a
+    // different set of operators is caught by rocksdb
+    name = "ceph:";
+    for (auto& p : store.merge_ops) {
+      name += p.first + "." + p.second->name() + ";";
+    }
+  }
+  const char *Name() const {
+    return name.c_str();
+  }
+  bool Merge(const rocksdb::Slice& key,
+	     const rocksdb::Slice* existing_value,
+	     const rocksdb::Slice& value,
+	     std::string* new_value,
+	     rocksdb::Logger* logger) const {
+    // find the operator whose prefix matches this key (prefix + '\0' + key)
+    for (auto& p : store.merge_ops) {
+      if (key.size() > p.first.length() &&
+	  key[p.first.length()] == 0 &&
+	  memcmp(key.data(), p.first.c_str(), p.first.length()) == 0) {
+	if (existing_value) {
+	  p.second->merge(existing_value->data(), existing_value->size(),
+			  value.data(), value.size(),
+			  new_value);
+	} else {
+	  p.second->merge_nonexistent(value.data(), value.size(), new_value);
+	}
+	return true;
+      }
+    }
+    return false;  // no operator for this prefix; rocksdb reports corruption
+  }
+};
+
+int RocksDBStore::set_merge_operator(
+  const string& prefix,
+  std::shared_ptr<KeyValueDB::MergeOperator> mop)
+{
+  // If you fail here, it's because you can't do this on an open database
+  assert(db == nullptr);
+  merge_ops.push_back(std::make_pair(prefix, mop));
+  return 0;
+}
+
+int RocksDBStore::set_column_family(const string& prefix, const string& options)
+{
+  // If you fail here, it's because you can't do this on an open database
+  assert(db == nullptr);
+  if (prefix.empty() || prefix == rocksdb::kDefaultColumnFamilyName)
+    return -EINVAL;
+  column_families[prefix].options = options;
+  return 0;
+}
+
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const string& prefix,
+						       ColumnFamily **pcf)
+{
+  ColumnFamily *cf = get_cf(prefix);
+  if (pcf)
+    *pcf = cf;
+  return cf ? cf->handle : db->DefaultColumnFamily();
+}
+
 int RocksDBStore::tryInterpret(const string key, const string val, rocksdb::Options &opt)
 {
   if (key == "compaction_threads") {
@@ -139,6 +209,51 @@ int RocksDBStore::ParseOptionsFromString(const string opt_str, rocksdb::Options
   return 0;
 }
 
+int RocksDBStore::_parse_cf_options(const string& opt_str,
+				    rocksdb::ColumnFamilyOptions &opt)
+{
+  map<string, string> str_map;
+  int r = get_str_map(opt_str, &str_map, ",\n;");
+  if (r < 0)
+    return r;
+  // table options are not reachable through the option string, so the
+  // ones worth tuning per column family are handled here
+  bool own_table = false;
+  rocksdb::BlockBasedTableOptions bbt_opts;
+  bbt_opts.block_size = g_conf->rocksdb_block_size;
+  bbt_opts.block_cache = block_cache;
+  for (auto& p : str_map) {
+    std::string err;
+    if (p.first == "block_size") {
+      bbt_opts.block_size = strict_sistrtoll(p.second.c_str(), &err);
+      own_table = true;
+    } else if (p.first == "block_cache_size") {
+      int64_t size = strict_sistrtoll(p.second.c_str(), &err);
+      if (err.empty())
+	bbt_opts.block_cache = rocksdb::NewLRUCache(size);
+      own_table = true;
+    } else if (p.first == "bloom_bits") {
+      int bits = strict_strtol(p.second.c_str(), 10, &err);
+      if (err.empty() && bits > 0)
+	bbt_opts.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bits));
+      own_table = true;
+    } else {
+      rocksdb::Status status = rocksdb::GetColumnFamilyOptionsFromString(
+	opt, p.first + "=" + p.second, &opt);
+      if (!status.ok())
+	err = status.ToString();
+    }
+    if (!err.empty()) {
+      derr << __func__ << " bad option " << p.first << "=" << p.second
+	   << ": " << err << dendl;
+      return -EINVAL;
+    }
+  }
+  if (own_table)
+    opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbt_opts));
+  return 0;
+}
+
 int RocksDBStore::init(string _options_str)
 {
   options_str = _options_str;
@@ -218,19 +333,68 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
     opt.env = static_cast<rocksdb::Env*>(priv);
   }
 
-  auto cache = rocksdb::NewLRUCache(g_conf->rocksdb_cache_size);
+  if (!merge_ops.empty()) {
+    opt.merge_operator.reset(new MergeOperatorRouter(*this));
+  }
+
+  block_cache = rocksdb::NewLRUCache(g_conf->rocksdb_cache_size);
   rocksdb::BlockBasedTableOptions bbt_opts;
   bbt_opts.block_size = g_conf->rocksdb_block_size;
-  bbt_opts.block_cache = cache;
+  bbt_opts.block_cache = block_cache;
   opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbt_opts));
   dout(10) << __func__ << " set block size to " << g_conf->rocksdb_block_size
            << " cache size to " << g_conf->rocksdb_cache_size << dendl;
 
-  status = rocksdb::DB::Open(opt, path, &db);
+  // Every column family on disk has to be opened, configured or not, or
+  // its keys would vanish.  A configured one is only created along with
+  // the db: on an existing db its prefix already lives in the default
+  // column family and stays there.
+  std::vector<string> existing;
+  status = rocksdb::DB::ListColumnFamilies(opt, path, &existing);
+  bool fresh = !status.ok() || existing.empty();
+  for (auto& name : existing) {
+    if (name != rocksdb::kDefaultColumnFamilyName &&
+	!column_families.count(name)) {
+      dout(1) << __func__ << " column family " << name
+	      << " is not configured, using default options" << dendl;
+      column_families[name];
+    }
+  }
+  std::vector<rocksdb::ColumnFamilyDescriptor> cfs;
+  std::vector<ColumnFamily*> cf_by_index;
+  cfs.push_back(rocksdb::ColumnFamilyDescriptor(
+		  rocksdb::kDefaultColumnFamilyName,
+		  rocksdb::ColumnFamilyOptions(opt)));
+  cf_by_index.push_back(nullptr);
+  for (auto& p : column_families) {
+    if (!fresh &&
+	std::find(existing.begin(), existing.end(), p.first) == existing.end()) {
+      derr << __func__ << " column family " << p.first << " does not exist;"
+	   << " its keys stay in the default column family" << dendl;
+      continue;
+    }
+    rocksdb::ColumnFamilyOptions cf_opt(opt);
+    int r = _parse_cf_options(p.second.options, cf_opt);
+    if (r < 0)
+      return r;
+    dout(10) << __func__ << " column family " << p.first << " options "
+	     << p.second.options << dendl;
+    cfs.push_back(rocksdb::ColumnFamilyDescriptor(p.first, cf_opt));
+    cf_by_index.push_back(&p.second);
+  }
+  opt.create_missing_column_families = fresh;
+
+  std::vector<rocksdb::ColumnFamilyHandle*> handles;
+  status = rocksdb::DB::Open(opt, path, cfs, &handles, &db);
   if (!status.ok()) {
     derr << status.ToString() << dendl;
     return -EINVAL;
   }
+  // we use db->DefaultColumnFamily() for the default column family
+  delete handles[0];
+  for (unsigned i = 1; i < handles.size(); ++i) {
+    cf_by_index[i]->handle = handles[i];
+  }
 
   PerfCountersBuilder plb(g_ceph_context, "rocksdb", l_rocksdb_first, l_rocksdb_last);
   plb.add_u64_counter(l_rocksdb_gets, "rocksdb_get", "Gets");
@@ -244,6 +408,10 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
   plb.add_u64(l_rocksdb_compact_queue_len, "rocksdb_compact_queue_len", "Length of compaction queue");
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
+  for (auto& p : column_families) {
+    if (p.second.handle)
+      _init_cf_logger(p.first, p.second);
+  }
 
   if (compact_on_mount) {
     derr << "Compacting rocksdb store..." << dendl;
@@ -253,6 +421,52 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
   return 0;
 }
 
+void RocksDBStore::_init_cf_logger(const string& prefix, ColumnFamily& cf)
+{
+  PerfCountersBuilder plb(g_ceph_context, "rocksdb_cf_" + prefix,
+			  l_rocksdb_cf_first, l_rocksdb_cf_last);
+  plb.add_u64_counter(l_rocksdb_cf_sets, "sets", "Keys set");
+  plb.add_u64_counter(l_rocksdb_cf_set_bytes, "set_bytes", "Sum for bytes of values set");
+  plb.add_u64_counter(l_rocksdb_cf_rmkeys, "rmkeys", "Keys removed");
+  plb.add_u64_counter(l_rocksdb_cf_merges, "merges", "Merge operands written");
+  plb.add_u64_counter(l_rocksdb_cf_gets, "gets", "Gets");
+  plb.add_time_avg(l_rocksdb_cf_get_latency, "get_latency", "Get latency");
+  plb.add_u64(l_rocksdb_cf_num_keys, "num_keys", "Estimated number of keys");
+  plb.add_u64(l_rocksdb_cf_live_bytes, "live_bytes", "Estimated bytes of live data");
+  plb.add_u64(l_rocksdb_cf_mem_bytes, "memtable_bytes", "Bytes in memtables");
+  cf.logger = plb.create_perf_counters();
+  cct->get_perfcounters_collection()->add(cf.logger);
+}
+
+void RocksDBStore::_update_cf_stats()
+{
+  if (!db)
+    return;
+  for (auto& p : column_families) {
+    ColumnFamily& cf = p.second;
+    if (!cf.handle)
+      continue;
+    uint64_t v;
+    if (db->GetIntProperty(cf.handle, "rocksdb.estimate-num-keys", &v))
+      cf.logger->set(l_rocksdb_cf_num_keys, v);
+    if (db->GetIntProperty(cf.handle, "rocksdb.estimate-live-data-size", &v))
+      cf.logger->set(l_rocksdb_cf_live_bytes, v);
+    if (db->GetIntProperty(cf.handle, "rocksdb.cur-size-all-mem-tables", &v))
+      cf.logger->set(l_rocksdb_cf_mem_bytes, v);
+  }
+}
+
+void RocksDBStore::_close_column_families()
+{
+  for (auto& p : column_families) {
+    ColumnFamily& cf = p.second;
+    delete cf.logger;
+    cf.logger = nullptr;
+    delete cf.handle;
+    cf.handle = nullptr;
+  }
+}
+
 int RocksDBStore::_test_init(const string& dir)
 {
   rocksdb::Options options;
@@ -268,6 +482,9 @@ RocksDBStore::~RocksDBStore()
   close();
   delete logger;
 
+  // column family handles have to go before the db
+  _close_column_families();
+
   // Ensure db is destroyed before dependent db_cache and filterpolicy
   delete db;
 
@@ -291,6 +508,10 @@ void RocksDBStore::close()
 
   if (logger)
     cct->get_perfcounters_collection()->remove(logger);
+  for (auto& p : column_families) {
+    if (p.second.logger)
+      cct->get_perfcounters_collection()->remove(p.second.logger);
+  }
 }
 
 int RocksDBStore::submit_transaction(KeyValueDB::Transaction t)
@@ -353,56 +574,125 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const bufferlist &to_set_bl)
 {
   string key = combine_strings(prefix, k);
+  ColumnFamily *cf;
+  rocksdb::ColumnFamilyHandle *h = db->get_cf_handle(prefix, &cf);
 
   // bufferlist::c_str() is non-constant, so we can't call c_str()
   if (to_set_bl.is_contiguous() && to_set_bl.length() > 0) {
-    bat->Put(rocksdb::Slice(key),
+    bat->Put(h, rocksdb::Slice(key),
 	     rocksdb::Slice(to_set_bl.buffers().front().c_str(),
 			    to_set_bl.length()));
   } else {
     // make a copy
     bufferlist val = to_set_bl;
-    bat->Put(rocksdb::Slice(key),
+    bat->Put(h, rocksdb::Slice(key),
 	     rocksdb::Slice(val.c_str(), val.length()));
   }
+  if (cf) {
+    cf->logger->inc(l_rocksdb_cf_sets);
+    cf->logger->inc(l_rocksdb_cf_set_bytes, to_set_bl.length());
+  }
+}
+
+void RocksDBStore::RocksDBTransactionImpl::merge(
+  const string &prefix,
+  const string &k,
+  const bufferlist &to_set_bl)
+{
+  string key = combine_strings(prefix, k);
+  ColumnFamily *cf;
+  rocksdb::ColumnFamilyHandle *h = db->get_cf_handle(prefix, &cf);
+
+  // bufferlist::c_str() is non-constant, so we can't call c_str()
+  if (to_set_bl.is_contiguous() && to_set_bl.length() > 0) {
+    bat->Merge(h, rocksdb::Slice(key),
+	       rocksdb::Slice(to_set_bl.buffers().front().c_str(),
+			      to_set_bl.length()));
+  } else {
+    // make a copy
+    bufferlist val = to_set_bl;
+    bat->Merge(h, rocksdb::Slice(key),
+	       rocksdb::Slice(val.c_str(), val.length()));
+  }
+  if (cf)
+    cf->logger->inc(l_rocksdb_cf_merges);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
-  bat->Delete(combine_strings(prefix, k));
+  ColumnFamily *cf;
+  rocksdb::ColumnFamilyHandle *h = db->get_cf_handle(prefix, &cf);
+  bat->Delete(h, combine_strings(prefix, k));
+  if (cf)
+    cf->logger->inc(l_rocksdb_cf_rmkeys);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
+  ColumnFamily *cf;
+  rocksdb::ColumnFamilyHandle *h = db->get_cf_handle(prefix, &cf);
+  uint64_t n = 0;
   KeyValueDB::Iterator it = db->get_iterator(prefix);
   for (it->seek_to_first();
        it->valid();
        it->next()) {
-    bat->Delete(combine_strings(prefix, it->key()));
+    bat->Delete(h, combine_strings(prefix, it->key()));
+    ++n;
   }
+  if (cf)
+    cf->logger->inc(l_rocksdb_cf_rmkeys, n);
 }
 
 int RocksDBStore::get(
     const string &prefix,
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
+{
+  std::vector<string> v(keys.begin(), keys.end());
+  return multi_get(prefix, v, out);
+}
+
+int RocksDBStore::multi_get(
+    const string &prefix,
+    const std::vector<string> &keys,
+    std::map<string, bufferlist> *out)
 {
   utime_t start = ceph_clock_now(g_ceph_context);
-  KeyValueDB::Iterator it = get_iterator(prefix);
-  for (std::set<string>::const_iterator i = keys.begin();
-       i != keys.end();
-       ++i) {
-    it->lower_bound(*i);
-    if (it->valid() && it->key() == *i) {
-      out->insert(make_pair(*i, it->value()));
-    } else if (!it->valid())
-      break;
+  std::vector<string> full_keys;
+  std::vector<rocksdb::Slice> slices;
+  full_keys.reserve(keys.size());
+  slices.reserve(keys.size());
+  for (auto& k : keys) {
+    full_keys.push_back(combine_strings(prefix, k));
+    slices.push_back(rocksdb::Slice(full_keys.back()));
+  }
+  ColumnFamily *cf;
+  std::vector<rocksdb::ColumnFamilyHandle*> handles(
+    keys.size(), get_cf_handle(prefix, &cf));
+  std::vector<string> values;
+  std::vector<rocksdb::Status> status =
+    db->MultiGet(rocksdb::ReadOptions(), handles, slices, &values);
+  int r = 0;
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    if (status[i].ok()) {
+      bufferlist bl;
+      bl.append(values[i]);
+      (*out)[keys[i]].claim(bl);
+    } else if (!status[i].IsNotFound()) {
+      derr << __func__ << " " << prefix << " " << keys[i] << ": "
+	   << status[i].ToString() << dendl;
+      r = -EIO;
+    }
   }
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
   logger->tinc(l_rocksdb_get_latency, lat);
-  return 0;
+  if (cf) {
+    cf->logger->inc(l_rocksdb_cf_gets);
+    cf->logger->tinc(l_rocksdb_cf_get_latency, lat);
+  }
+  return r;
 }
 
 int RocksDBStore::get(
@@ -413,16 +703,39 @@ int RocksDBStore::get(
   assert(out && (out->length() == 0));
   utime_t start = ceph_clock_now(g_ceph_context);
   int r = 0;
-  KeyValueDB::Iterator it = get_iterator(prefix);
-  it->lower_bound(key);
-  if (it->valid() && it->key() == key) {
-    out->append(it->value_as_ptr());
+  ColumnFamily *cf;
+  rocksdb::ColumnFamilyHandle *h = get_cf_handle(prefix, &cf);
+  if (!column_families.empty()) {
+    // a point lookup, rather than an iterator that would have to merge
+    // every column family
+    string value;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), h,
+				combine_strings(prefix, key), &value);
+    if (s.ok()) {
+      out->append(value);
+    } else if (s.IsNotFound()) {
+      r = -ENOENT;
+    } else {
+      derr << __func__ << " " << prefix << " " << key << ": "
+	   << s.ToString() << dendl;
+      r = -EIO;
+    }
   } else {
-    r = -ENOENT;
+    KeyValueDB::Iterator it = get_iterator(prefix);
+    it->lower_bound(key);
+    if (it->valid() && it->key() == key) {
+      out->append(it->value_as_ptr());
+    } else {
+      r = -ENOENT;
+    }
   }
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
   logger->tinc(l_rocksdb_get_latency, lat);
+  if (cf) {
+    cf->logger->inc(l_rocksdb_cf_gets);
+    cf->logger->tinc(l_rocksdb_cf_get_latency, lat);
+  }
   return r;
 }
 
@@ -466,6 +779,11 @@ void RocksDBStore::compact()
   logger->inc(l_rocksdb_compact);
   rocksdb::CompactRangeOptions options;
   db->CompactRange(options, nullptr, nullptr);
+  for (auto& p : column_families) {
+    if (p.second.handle)
+      db->CompactRange(options, p.second.handle, nullptr, nullptr);
+  }
+  _update_cf_stats();
 }
 
 
@@ -542,39 +860,81 @@ void RocksDBStore::compact_range(const string& start, const string& end)
   rocksdb::Slice cstart(start);
   rocksdb::Slice cend(end);
   db->CompactRange(options, &cstart, &cend);
+  // a column family only holds [prefix\0, past_prefix(prefix))
+  for (auto& p : column_families) {
+    if (p.second.handle &&
+	combine_strings(p.first, string()) < end &&
+	past_prefix(p.first) > start)
+      db->CompactRange(options, p.second.handle, &cstart, &cend);
+  }
 }
 RocksDBStore::RocksDBWholeSpaceIteratorImpl::~RocksDBWholeSpaceIteratorImpl()
 {
-  delete dbiter;
+  for (auto i : iters)
+    delete i;
+}
+void RocksDBStore::RocksDBWholeSpaceIteratorImpl::_pick()
+{
+  if (iters.size() == 1)
+    return;
+  rocksdb::Iterator *best = nullptr;
+  for (auto i : iters) {
+    if (!i->Valid())
+      continue;
+    if (!best) {
+      best = i;
+      continue;
+    }
+    int c = i->key().compare(best->key());
+    if (forward ? c < 0 : c > 0)
+      best = i;
+  }
+  dbiter = best ? best : iters.front();
+}
+int RocksDBStore::RocksDBWholeSpaceIteratorImpl::_seek(const string& k)
+{
+  rocksdb::Slice slice_k(k);
+  for (auto i : iters)
+    i->Seek(slice_k);
+  forward = true;
+  _pick();
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first()
 {
-  dbiter->SeekToFirst();
-  return dbiter->status().ok() ? 0 : -1;
+  for (auto i : iters)
+    i->SeekToFirst();
+  forward = true;
+  _pick();
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first(const string &prefix)
 {
-  rocksdb::Slice slice_prefix(prefix);
-  dbiter->Seek(slice_prefix);
-  return dbiter->status().ok() ? 0 : -1;
+  return _seek(prefix);
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last()
 {
-  dbiter->SeekToLast();
-  return dbiter->status().ok() ? 0 : -1;
+  for (auto i : iters)
+    i->SeekToLast();
+  forward = false;
+  _pick();
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last(const string &prefix)
 {
   string limit = past_prefix(prefix);
   rocksdb::Slice slice_limit(limit);
-  dbiter->Seek(slice_limit);
-
-  if (!dbiter->Valid()) {
-    dbiter->SeekToLast();
-  } else {
-    dbiter->Prev();
+  for (auto i : iters) {
+    i->Seek(slice_limit);
+    if (!i->Valid()) {
+      i->SeekToLast();
+    } else {
+      i->Prev();
+    }
   }
-  return dbiter->status().ok() ? 0 : -1;
+  forward = false;
+  _pick();
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::upper_bound(const string &prefix, const string &after)
 {
@@ -584,14 +944,11 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::upper_bound(const string &prefi
     if (key.first == prefix && key.second == after)
       next();
   }
-  return dbiter->status().ok() ? 0 : -1;
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::lower_bound(const string &prefix, const string &to)
 {
-  string bound = combine_strings(prefix, to);
-  rocksdb::Slice slice_bound(bound);
-  dbiter->Seek(slice_bound);
-  return dbiter->status().ok() ? 0 : -1;
+  return _seek(combine_strings(prefix, to));
 }
 bool RocksDBStore::RocksDBWholeSpaceIteratorImpl::valid()
 {
@@ -599,15 +956,42 @@ bool RocksDBStore::RocksDBWholeSpaceIteratorImpl::valid()
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::next()
 {
-  if (valid())
-  dbiter->Next();
-  return dbiter->status().ok() ? 0 : -1;
+  if (valid()) {
+    if (!forward) {
+      // the other children sit before the current key.  keys are never
+      // in two column families, so a seek puts them past it.
+      for (auto i : iters) {
+	if (i != dbiter)
+	  i->Seek(dbiter->key());
+      }
+      forward = true;
+    }
+    dbiter->Next();
+    _pick();
+  }
+  return status();
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::prev()
 {
-  if (valid())
+  if (valid()) {
+    if (forward) {
+      // the other children sit after the current key
+      for (auto i : iters) {
+	if (i == dbiter)
+	  continue;
+	i->Seek(dbiter->key());
+	if (i->Valid()) {
+	  i->Prev();
+	} else {
+	  i->SeekToLast();
+	}
+      }
+      forward = false;
+    }
     dbiter->Prev();
-    return dbiter->status().ok() ? 0 : -1;
+    _pick();
+  }
+  return status();
 }
 string RocksDBStore::RocksDBWholeSpaceIteratorImpl::key()
 {
@@ -645,7 +1029,11 @@ bufferptr RocksDBStore::RocksDBWholeSpaceIteratorImpl::value_as_ptr()
 
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::status()
 {
-  return dbiter->status().ok() ? 0 : -1;
+  for (auto i : iters) {
+    if (!i->status().ok())
+      return -1;
+  }
+  return 0;
 }
 
 string RocksDBStore::past_prefix(const string &prefix)
@@ -655,13 +1043,30 @@ string RocksDBStore::past_prefix(const string &prefix)
   return limit;
 }
 
+void RocksDBStore::_new_iterators(const rocksdb::ReadOptions& opts,
+				  std::vector<rocksdb::Iterator*> *out)
+{
+  if (column_families.empty()) {
+    out->push_back(db->NewIterator(opts));
+    return;
+  }
+  std::vector<rocksdb::ColumnFamilyHandle*> handles;
+  handles.push_back(db->DefaultColumnFamily());
+  for (auto& p : column_families) {
+    if (p.second.handle)
+      handles.push_back(p.second.handle);
+  }
+  // one consistent view across all of them
+  rocksdb::Status status = db->NewIterators(opts, handles, out);
+  assert(status.ok());
+}
+
 RocksDBStore::WholeSpaceIterator RocksDBStore::_get_iterator()
 {
+  std::vector<rocksdb::Iterator*> iters;
+  _new_iterators(rocksdb::ReadOptions(), &iters);
   return std::shared_ptr<KeyValueDB::WholeSpaceIteratorImpl>(
-    new RocksDBWholeSpaceIteratorImpl(
-      db->NewIterator(rocksdb::ReadOptions())
-    )
-  );
+    new RocksDBWholeSpaceIteratorImpl(iters));
 }
 
 RocksDBStore::WholeSpaceIterator RocksDBStore::_get_snapshot_iterator()
@@ -672,10 +1077,10 @@ RocksDBStore::WholeSpaceIterator RocksDBStore::_get_snapshot_iterator()
   snapshot = db->GetSnapshot();
   options.snapshot = snapshot;
 
+  std::vector<rocksdb::Iterator*> iters;
+  _new_iterators(options, &iters);
   return std::shared_ptr<KeyValueDB::WholeSpaceIteratorImpl>(
-    new RocksDBSnapshotIteratorImpl(db, snapshot,
-      db->NewIterator(options))
-  );
+    new RocksDBSnapshotIteratorImpl(db, snapshot, iters));
 }
 
 RocksDBStore::RocksDBSnapshotIteratorImpl::~RocksDBSnapshotIteratorImpl()
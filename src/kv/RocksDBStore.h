@@ -10,6 +10,7 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <vector>
 #include <boost/scoped_ptr.hpp>
 
 #include <errno.h>
@@ -36,6 +37,21 @@ enum {
   l_rocksdb_last,
 };
 
+// one set per column family, named rocksdb_cf_<prefix>
+enum {
+  l_rocksdb_cf_first = 34350,
+  l_rocksdb_cf_sets,
+  l_rocksdb_cf_set_bytes,
+  l_rocksdb_cf_rmkeys,
+  l_rocksdb_cf_merges,
+  l_rocksdb_cf_gets,
+  l_rocksdb_cf_get_latency,
+  l_rocksdb_cf_num_keys,
+  l_rocksdb_cf_live_bytes,
+  l_rocksdb_cf_mem_bytes,
+  l_rocksdb_cf_last,
+};
+
 namespace rocksdb{
   class DB;
   class Env;
@@ -46,7 +62,10 @@ namespace rocksdb{
   class WriteBatch;
   class Iterator;
   class Logger;
+  class ColumnFamilyHandle;
   struct Options;
+  struct ColumnFamilyOptions;
+  struct ReadOptions;
 }
 
 extern rocksdb::Logger *create_rocksdb_ceph_logger();
@@ -64,6 +83,39 @@ class RocksDBStore : public KeyValueDB {
   string options_str;
   int do_open(ostream &out, bool create_if_missing);
 
+  /// per-prefix merge operators, dispatched by MergeOperatorRouter
+  class MergeOperatorRouter;
+  std::vector<std::pair<std::string,
+			std::shared_ptr<KeyValueDB::MergeOperator> > > merge_ops;
+
+  /// a prefix that lives in its own column family (named after the prefix)
+  struct ColumnFamily {
+    string options;                      ///< from set_column_family
+    rocksdb::ColumnFamilyHandle *handle; ///< null until opened
+    PerfCounters *logger;
+    ColumnFamily() : handle(nullptr), logger(nullptr) {}
+  };
+  map<string, ColumnFamily> column_families;  ///< prefix -> cf
+  std::shared_ptr<rocksdb::Cache> block_cache; ///< shared by default
+
+  int _parse_cf_options(const string& opt_str, rocksdb::ColumnFamilyOptions &opt);
+  void _init_cf_logger(const string& prefix, ColumnFamily& cf);
+  void _update_cf_stats();
+  void _close_column_families();
+  ColumnFamily *get_cf(const string& prefix) {
+    if (column_families.empty())
+      return nullptr;
+    auto p = column_families.find(prefix);
+    if (p == column_families.end() || !p->second.handle)
+      return nullptr;
+    return &p->second;
+  }
+  /// handle for prefix (default cf if it has none); *pcf gets its cf or null
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const string& prefix,
+					     ColumnFamily **pcf = nullptr);
+  void _new_iterators(const rocksdb::ReadOptions& opts,
+		      std::vector<rocksdb::Iterator*> *out);
+
   // manage async compactions
   Mutex compact_queue_lock;
   Cond compact_queue_cond;
@@ -154,6 +206,10 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void merge(
+      const string& prefix,
+      const string& k,
+      const bufferlist &bl);
   };
 
   KeyValueDB::Transaction get_transaction() {
@@ -173,14 +229,27 @@ public:
     const string &key,
     bufferlist *out
     );
+  int multi_get(
+    const string &prefix,
+    const std::vector<string> &keys,
+    std::map<string, bufferlist> *out
+    );
 
+  /// iterates over one or more column families as a single keyspace.
+  /// keys keep their prefix in every column family and the prefixes are
+  /// disjoint, so merging the children by key gives the usual ordering.
   class RocksDBWholeSpaceIteratorImpl :
     public KeyValueDB::WholeSpaceIteratorImpl {
   protected:
-    rocksdb::Iterator *dbiter;
+    std::vector<rocksdb::Iterator*> iters; ///< one per column family
+    rocksdb::Iterator *dbiter;             ///< child at current position
+    bool forward;                          ///< direction of last move
+    void _pick();
+    int _seek(const string& k);
   public:
-    explicit RocksDBWholeSpaceIteratorImpl(rocksdb::Iterator *iter) :
-      dbiter(iter) { }
+    explicit RocksDBWholeSpaceIteratorImpl(
+      const std::vector<rocksdb::Iterator*>& i) :
+      iters(i), dbiter(i.front()), forward(true) { }
     //virtual ~RocksDBWholeSpaceIteratorImpl() { }
     ~RocksDBWholeSpaceIteratorImpl();
 
@@ -206,12 +275,17 @@ public:
     const rocksdb::Snapshot *snapshot;
   public:
     RocksDBSnapshotIteratorImpl(rocksdb::DB *db, const rocksdb::Snapshot *s,
-				rocksdb::Iterator *iter) :
-      RocksDBWholeSpaceIteratorImpl(iter), db(db), snapshot(s) { }
+				const std::vector<rocksdb::Iterator*>& i) :
+      RocksDBWholeSpaceIteratorImpl(i), db(db), snapshot(s) { }
 
     ~RocksDBSnapshotIteratorImpl();
   };
 
+  int set_merge_operator(const std::string& prefix,
+			 std::shared_ptr<KeyValueDB::MergeOperator> mop);
+  int set_column_family(const std::string& prefix,
+			const std::string& options);
+
   /// Utility
   static string combine_strings(const string &prefix, const string &value);
   static int split_key(rocksdb::Slice in, string *prefix, string *key);
@@ -219,6 +293,8 @@ public:
   static string past_prefix(const string &prefix);
 
   virtual uint64_t get_estimated_size(map<string,uint64_t> &extra) {
+    _update_cf_stats();
+
     DIR *store_dir = opendir(path.c_str());
     if (!store_dir) {
       lderr(cct) << __func__ << " something happened opening the store: "
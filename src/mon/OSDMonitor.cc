@@ -2927,7 +2927,9 @@ namespace {
     MIN_WRITE_RECENCY_FOR_PROMOTE, FAST_READ,
     HIT_SET_GRADE_DECAY_RATE, HIT_SET_SEARCH_LAST_N,
     SCRUB_MIN_INTERVAL, SCRUB_MAX_INTERVAL, DEEP_SCRUB_INTERVAL,
-    RECOVERY_PRIORITY, RECOVERY_OP_PRIORITY};
+    RECOVERY_PRIORITY, RECOVERY_OP_PRIORITY,
+    COMPRESSION_MODE, COMPRESSION_ALGORITHM, COMPRESSION_REQUIRED_RATIO,
+    KSTORE_STRIPE_SIZE};
 
   std::set<osd_pool_get_choices>
     subtract_second_from_first(const std::set<osd_pool_get_choices>& first,
@@ -3408,7 +3410,11 @@ bool OSDMonitor::preprocess_command(MonOpRequestRef op)
       ("scrub_max_interval", SCRUB_MAX_INTERVAL)
       ("deep_scrub_interval", DEEP_SCRUB_INTERVAL)
       ("recovery_priority", RECOVERY_PRIORITY)
-      ("recovery_op_priority", RECOVERY_OP_PRIORITY);
+      ("recovery_op_priority", RECOVERY_OP_PRIORITY)
+      ("compression_mode", COMPRESSION_MODE)
+      ("compression_algorithm", COMPRESSION_ALGORITHM)
+      ("compression_required_ratio", COMPRESSION_REQUIRED_RATIO)
+      ("kstore_stripe_size", KSTORE_STRIPE_SIZE);
 
     typedef std::set<osd_pool_get_choices> choices_set_t;
 
@@ -3592,6 +3598,10 @@ bool OSDMonitor::preprocess_command(MonOpRequestRef op)
 	  case DEEP_SCRUB_INTERVAL:
           case RECOVERY_PRIORITY:
           case RECOVERY_OP_PRIORITY:
+	  case COMPRESSION_MODE:
+	  case COMPRESSION_ALGORITHM:
+	  case COMPRESSION_REQUIRED_RATIO:
+	  case KSTORE_STRIPE_SIZE:
 	    for (i = ALL_CHOICES.begin(); i != ALL_CHOICES.end(); ++i) {
 	      if (i->second == *it)
 		break;
@@ -3725,6 +3735,10 @@ bool OSDMonitor::preprocess_command(MonOpRequestRef op)
 	  case DEEP_SCRUB_INTERVAL:
           case RECOVERY_PRIORITY:
           case RECOVERY_OP_PRIORITY:
+	  case COMPRESSION_MODE:
+	  case COMPRESSION_ALGORITHM:
+	  case COMPRESSION_REQUIRED_RATIO:
+	  case KSTORE_STRIPE_SIZE:
 	    for (i = ALL_CHOICES.begin(); i != ALL_CHOICES.end(); ++i) {
 	      if (i->second == *it)
 		break;
@@ -5145,6 +5159,26 @@ int OSDMonitor::prepare_command_pool_set(map<string,cmd_vartype> &cmdmap,
       return -EINVAL;
     }
     p.min_write_recency_for_promote = n;
+  } else if (var == "allow_ec_overwrites") {
+    if (!p.is_erasure()) {
+      ss << "ec overwrites can only be enabled for an erasure coded pool";
+      return -EINVAL;
+    }
+    if (val == "true" || (interr.empty() && n == 1)) {
+      if (!g_ceph_context->check_experimental_feature_enabled("ec_overwrites")) {
+	ss << "ec overwrites are experimental and must be enabled with "
+	   << "enable_experimental_unrecoverable_data_corrupting_features";
+	return -EPERM;
+      }
+      p.set_flag(pg_pool_t::FLAG_EC_OVERWRITES);
+    } else if (val == "false" || (interr.empty() && n == 0)) {
+      // objects may already have lost their chunk hashes
+      ss << "ec overwrites cannot be disabled once enabled";
+      return -EINVAL;
+    } else {
+      ss << "expecting value 'true', 'false', '0', or '1'";
+      return -EINVAL;
+    }
   } else if (var == "fast_read") {
     if (val == "true" || (interr.empty() && n == 1)) {
       if (p.is_replicated()) {
@@ -5156,6 +5190,27 @@ int OSDMonitor::prepare_command_pool_set(map<string,cmd_vartype> &cmdmap,
       p.fast_read = false;
     }
   } else if (pool_opts_t::is_opt_name(var)) {
+    if (var == "compression_mode") {
+      if (!val.empty() &&
+	  val != "none" && val != "passive" && val != "aggressive") {
+	ss << "unrecognized compression mode '" << val << "'"
+	   << " (must be none, passive or aggressive)";
+	return -EINVAL;
+      }
+    } else if (var == "compression_required_ratio") {
+      if (floaterr.empty() && (f < 0 || f > 1)) {
+	ss << "compression_required_ratio is out of range (0-1): '"
+	   << val << "'";
+	return -EINVAL;
+      }
+    } else if (var == "kstore_stripe_size") {
+      if (interr.empty() &&
+	  (n < 0 || n > KSTORE_STRIPE_SIZE_MAX || (n & (n - 1)))) {
+	ss << "kstore_stripe_size must be a power of two no larger than "
+	   << KSTORE_STRIPE_SIZE_MAX << " (or 0 to unset)";
+	return -EINVAL;
+      }
+    }
     pool_opts_t::opt_desc_t desc = pool_opts_t::get_opt_desc(var);
     switch (desc.type) {
     case pool_opts_t::STR:
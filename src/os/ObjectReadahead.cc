@@ -0,0 +1,106 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "ObjectReadahead.h"
+
+#include "common/config.h"
+#include "common/debug.h"
+#include "include/rados.h"
+
+#define dout_subsys ceph_subsys_osd
+#undef dout_prefix
+#define dout_prefix *_dout << "readahead "
+
+ObjectReadahead::ObjectReadahead(CephContext *cct)
+  : cct(cct)
+{
+  uint32_t num_shards = MAX(cct->_conf->osd_objectstore_readahead_shards, 1u);
+  for (uint32_t i = 0; i < num_shards; ++i)
+    shards.push_back(new Shard);
+}
+
+ObjectReadahead::~ObjectReadahead()
+{
+  clear();
+  for (auto shard : shards)
+    delete shard;
+}
+
+ObjectReadahead::Stream *ObjectReadahead::_get_stream(Shard *shard,
+						      const ghobject_t& oid)
+{
+  ceph::unordered_map<ghobject_t, Stream*>::iterator p =
+    shard->streams.find(oid);
+  if (p != shard->streams.end()) {
+    shard->lru.splice(shard->lru.begin(), shard->lru, p->second->lru_pos);
+    return p->second;
+  }
+
+  uint64_t max_streams =
+    (cct->_conf->osd_objectstore_readahead_streams + shards.size() - 1) /
+    shards.size();
+  while (!shard->lru.empty() && shard->streams.size() >= max_streams) {
+    _remove(shard, shard->streams.find(shard->lru.back()));
+  }
+  Stream *s = new Stream;
+  s->ra.set_trigger_requests(
+    cct->_conf->osd_objectstore_readahead_trigger_requests);
+  s->ra.set_min_readahead_size(cct->_conf->osd_objectstore_readahead_min_bytes);
+  s->ra.set_max_readahead_size(cct->_conf->osd_objectstore_readahead_max_bytes);
+  shard->lru.push_front(oid);
+  s->lru_pos = shard->lru.begin();
+  shard->streams[oid] = s;
+  return s;
+}
+
+void ObjectReadahead::_remove(
+  Shard *shard,
+  ceph::unordered_map<ghobject_t, Stream*>::iterator p)
+{
+  shard->lru.erase(p->second->lru_pos);
+  delete p->second;
+  shard->streams.erase(p);
+}
+
+Readahead::extent_t ObjectReadahead::update(const ghobject_t& oid,
+					    uint64_t offset, uint64_t length,
+					    uint64_t size, uint32_t op_flags)
+{
+  // checked before taking any lock, so disabled read-ahead costs
+  // nothing
+  if (cct->_conf->osd_objectstore_readahead_streams == 0 ||
+      length == 0 ||
+      (op_flags & CEPH_OSD_OP_FLAG_FADVISE_RANDOM)) {
+    return Readahead::extent_t(0, 0);
+  }
+
+  Shard *shard = get_shard(oid);
+  Mutex::Locker l(shard->lock);
+  Stream *s = _get_stream(shard, oid);
+  if (op_flags & CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL)
+    s->ra.set_trigger_requests(0);
+  Readahead::extent_t e = s->ra.update(offset, length, size);
+  if (e.second) {
+    dout(20) << __func__ << " " << oid << " read " << offset << "~" << length
+	     << " prefetch " << e.first << "~" << e.second << dendl;
+  }
+  return e;
+}
+
+void ObjectReadahead::clear()
+{
+  for (auto shard : shards) {
+    Mutex::Locker l(shard->lock);
+    while (!shard->streams.empty())
+      _remove(shard, shard->streams.begin());
+  }
+}
@@ -0,0 +1,87 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_OBJECTREADAHEAD_H
+#define CEPH_OS_OBJECTREADAHEAD_H
+
+#include <list>
+#include <vector>
+
+#include "common/Mutex.h"
+#include "common/Readahead.h"
+#include "common/hobject.h"
+#include "include/unordered_map.h"
+
+class CephContext;
+
+/**
+ * Sequential read detection for ObjectStore backends
+ *
+ * Keeps a Readahead for each of the most recently read objects and,
+ * after every read, tells the store which range of the object it should
+ * prefetch, if any.  How to prefetch is up to the store.
+ *
+ * Reads flagged CEPH_OSD_OP_FLAG_FADVISE_RANDOM are not tracked, and
+ * reads flagged CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL start read-ahead
+ * right away instead of waiting for
+ * osd_objectstore_readahead_trigger_requests sequential reads.
+ *
+ * Streams are spread over osd_objectstore_readahead_shards shards by
+ * object, each with its own lock and LRU, so that reads of different
+ * objects rarely contend.  Each shard holds its share of
+ * osd_objectstore_readahead_streams, rounded up.
+ */
+class ObjectReadahead {
+  struct Stream {
+    Readahead ra;
+    std::list<ghobject_t>::iterator lru_pos;
+  };
+
+  struct Shard {
+    Mutex lock;
+    ceph::unordered_map<ghobject_t, Stream*> streams;
+    std::list<ghobject_t> lru;  ///< most recently read at the front
+    Shard() : lock("ObjectReadahead::Shard::lock") {}
+  };
+
+  CephContext *cct;
+  std::vector<Shard*> shards;
+
+  Shard *get_shard(const ghobject_t& oid) {
+    return shards[std::hash<ghobject_t>()(oid) % shards.size()];
+  }
+  Stream *_get_stream(Shard *shard, const ghobject_t& oid);
+  void _remove(Shard *shard,
+	       ceph::unordered_map<ghobject_t, Stream*>::iterator p);
+
+public:
+  explicit ObjectReadahead(CephContext *cct);
+  ~ObjectReadahead();
+
+  /**
+   * record a read and get the range to prefetch
+   *
+   * @param oid object read
+   * @param offset offset of the read
+   * @param length bytes actually read
+   * @param size size of the object
+   * @param op_flags CEPH_OSD_OP_FLAG_* of the read
+   * @returns extent to prefetch; zero length for none
+   */
+  Readahead::extent_t update(const ghobject_t& oid,
+			     uint64_t offset, uint64_t length,
+			     uint64_t size, uint32_t op_flags);
+
+  void clear();
+};
+
+#endif
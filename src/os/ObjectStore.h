@@ -69,6 +69,13 @@ enum {
   l_os_bytes,
   l_os_apply_lat,
   l_os_queue_lat,
+  l_os_fdcache_hit,
+  l_os_fdcache_miss,
+  l_os_fdcache_lookup_lat,
+  l_os_omap_cache_hit,
+  l_os_omap_cache_miss,
+  l_os_omap_cache_lock_wait,
+  l_os_readahead_bytes,
   l_os_last,
 };
 
@@ -502,6 +509,11 @@ public:
 
     bufferptr op_ptr;
 
+    /// index entries used by the last op; most transactions issue runs
+    /// of ops against the same collection and object
+    const pair<const coll_t, __le32> *last_coll {nullptr};
+    const pair<const ghobject_t, __le32> *last_object {nullptr};
+
     list<Context *> on_applied;
     list<Context *> on_commit;
     list<Context *> on_applied_sync;
@@ -530,6 +542,8 @@ public:
       data_bl(std::move(other.data_bl)),
       op_bl(std::move(other.op_bl)),
       op_ptr(std::move(other.op_ptr)),
+      last_coll(other.last_coll),
+      last_object(other.last_object),
       on_applied(std::move(other.on_applied)),
       on_commit(std::move(other.on_commit)),
       on_applied_sync(std::move(other.on_applied_sync)) {
@@ -537,6 +551,8 @@ public:
       other.use_tbl = false;
       other.coll_id = 0;
       other.object_id = 0;
+      other.last_coll = nullptr;
+      other.last_object = nullptr;
     }
 
     Transaction& operator=(Transaction&& other) {
@@ -551,6 +567,8 @@ public:
       data_bl = std::move(other.data_bl);
       op_bl = std::move(other.op_bl);
       op_ptr = std::move(other.op_ptr);
+      last_coll = other.last_coll;
+      last_object = other.last_object;
       on_applied = std::move(other.on_applied);
       on_commit = std::move(other.on_commit);
       on_applied_sync = std::move(other.on_applied_sync);
@@ -558,11 +576,71 @@ public:
       other.use_tbl = false;
       other.coll_id = 0;
       other.object_id = 0;
+      other.last_coll = nullptr;
+      other.last_object = nullptr;
       return *this;
     }
 
-    Transaction(const Transaction& other) = default;
-    Transaction& operator=(const Transaction& other) = default;
+    // the index hints point into the other's maps and the rest of its
+    // op_ptr may still be handed out to its own ops, so neither is copied
+    Transaction(const Transaction& other) :
+      data(other.data),
+      osr(other.osr),
+      use_tbl(other.use_tbl),
+      tbl(other.tbl),
+      coll_index(other.coll_index),
+      object_index(other.object_index),
+      coll_id(other.coll_id),
+      object_id(other.object_id),
+      data_bl(other.data_bl),
+      op_bl(other.op_bl),
+      on_applied(other.on_applied),
+      on_commit(other.on_commit),
+      on_applied_sync(other.on_applied_sync) {
+    }
+
+    Transaction& operator=(const Transaction& other) {
+      if (this == &other)
+	return *this;
+      data = other.data;
+      osr = other.osr;
+      use_tbl = other.use_tbl;
+      tbl = other.tbl;
+      coll_index = other.coll_index;
+      object_index = other.object_index;
+      coll_id = other.coll_id;
+      object_id = other.object_id;
+      data_bl = other.data_bl;
+      op_bl = other.op_bl;
+      op_ptr = bufferptr();
+      last_coll = nullptr;
+      last_object = nullptr;
+      on_applied = other.on_applied;
+      on_commit = other.on_commit;
+      on_applied_sync = other.on_applied_sync;
+      return *this;
+    }
+
+    /**
+     * reserve space for ops we are about to add
+     *
+     * Size the op buffer to hold @ops more ops in one piece, and, if no
+     * arguments have been added yet, preallocate @arg_bytes for them.
+     * Write payloads are referenced rather than copied and need not be
+     * counted.  This is only a hint; going over it is fine.
+     */
+    void reserve(unsigned ops, unsigned arg_bytes = 0) {
+      if (use_tbl)
+	return;
+      unsigned op_bytes = ops * sizeof(Op);
+      if (op_ptr.length() == 0 ||
+	  op_ptr.length() - op_ptr.offset() < op_bytes) {
+	op_ptr = bufferptr(op_bytes);
+      }
+      if (arg_bytes && data_bl.length() == 0) {
+	data_bl = bufferlist(arg_bytes);
+      }
+    }
 
     /* Operations on callback contexts */
     void register_on_applied(Context *c) {
@@ -643,6 +721,9 @@ public:
       std::swap(object_index, other.object_index);
       std::swap(coll_id, other.coll_id);
       std::swap(object_id, other.object_id);
+      std::swap(last_coll, other.last_coll);
+      std::swap(last_object, other.last_object);
+      std::swap(op_ptr, other.op_ptr);
       op_bl.swap(other.op_bl);
       data_bl.swap(other.data_bl);
     }
@@ -992,35 +1073,38 @@ private:
      * form of seat belts for the decoder.
      */
     Op* _get_next_op() {
-      if (op_ptr.length() == 0 || op_ptr.offset() >= op_ptr.length()) {
+      if (op_ptr.length() == 0 ||
+	  op_ptr.length() - op_ptr.offset() < sizeof(Op)) {
         op_ptr = bufferptr(sizeof(Op) * OPS_PER_PTR);
       }
-      bufferptr ptr(op_ptr, 0, sizeof(Op));
-      op_bl.append(ptr);
+      char* p = op_ptr.c_str();
+      // ops carved out of the same op_ptr merge into a single segment of
+      // op_bl, so iterating or encoding the ops needs no rebuild
+      op_bl.append(op_ptr, 0, sizeof(Op));
 
       op_ptr.set_offset(op_ptr.offset() + sizeof(Op));
 
-      char* p = ptr.c_str();
       memset(p, 0, sizeof(Op));
       return reinterpret_cast<Op*>(p);
     }
     __le32 _get_coll_id(const coll_t& coll) {
-      map<coll_t, __le32>::iterator c = coll_index.find(coll);
-      if (c != coll_index.end())
-        return c->second;
-
-      __le32 index_id = coll_id++;
-      coll_index[coll] = index_id;
-      return index_id;
+      if (last_coll && last_coll->first == coll)
+	return last_coll->second;
+      map<coll_t, __le32>::iterator c = coll_index.lower_bound(coll);
+      if (c == coll_index.end() || c->first != coll)
+	c = coll_index.insert(c, make_pair(coll, coll_id++));
+      last_coll = &*c;
+      return c->second;
     }
     __le32 _get_object_id(const ghobject_t& oid) {
-      map<ghobject_t, __le32, ghobject_t::BitwiseComparator>::iterator o = object_index.find(oid);
-      if (o != object_index.end())
-        return o->second;
-
-      __le32 index_id = object_id++;
-      object_index[oid] = index_id;
-      return index_id;
+      if (last_object && last_object->first == oid)
+	return last_object->second;
+      map<ghobject_t, __le32, ghobject_t::BitwiseComparator>::iterator o =
+	object_index.lower_bound(oid);
+      if (o == object_index.end() || o->first != oid)
+	o = object_index.insert(o, make_pair(oid, object_id++));
+      last_object = &*o;
+      return o->second;
     }
 
 public:
@@ -1744,6 +1828,8 @@ public:
       if (!decoded && struct_v >= 8) {
         ::decode(data_bl, bl);
         ::decode(op_bl, bl);
+        last_coll = nullptr;
+        last_object = nullptr;
         ::decode(coll_index, bl);
         ::decode(object_index, bl);
         data.decode(bl);
@@ -1871,7 +1957,14 @@ public:
   virtual bool test_mount_in_use() = 0;
   virtual int mount() = 0;
   virtual int umount() = 0;
-  virtual int fsck() {
+  /**
+   * check the store for consistency
+   *
+   * @param deep also check data that is not needed to find leaked or
+   *             doubly-referenced space (e.g. omap and overlay contents)
+   * @returns number of errors found, or negative error code
+   */
+  virtual int fsck(bool deep) {
     return -EOPNOTSUPP;
   }
   virtual unsigned get_max_object_name_length() = 0;
@@ -1984,6 +2077,10 @@ public:
    * Note: if reading from an offset past the end of the object, we
    * return 0 (not, say, -EINVAL).
    *
+   * Stores that prefetch for sequential readers (see ObjectReadahead)
+   * do so at once for CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL and never for
+   * CEPH_OSD_OP_FLAG_FADVISE_RANDOM.
+   *
    * @param cid collection for object
    * @param oid oid of object
    * @param offset location offset of first byte to be read
@@ -2210,6 +2307,23 @@ public:
     return -EOPNOTSUPP;
   }
 
+  /**
+   * set the pool options that apply to a collection
+   *
+   * These are not persisted by the backend; the caller is expected to
+   * (re)apply them whenever the collection is loaded or the pool
+   * changes.  A backend that does not make use of any pool option
+   * (e.g., FileStore) can choose to ignore them.
+   *
+   * @param c collection
+   * @param opts pool options
+   * @returns 0 on success, -ENOENT if the collection does not exist,
+   *          -EOPNOTSUPP if not supported by the backend
+   */
+  virtual int set_collection_opts(const coll_t& c, const pool_opts_t& opts) {
+    return -EOPNOTSUPP;
+  }
+
   /**
    * list contents of a collection that fall in the range [start, end) and no more than a specified many result
    *
@@ -44,7 +44,7 @@ public:
 
   virtual void shutdown() = 0;
 
-  static Allocator *create(string type);
+  static Allocator *create(string type, uint64_t size, uint64_t block_size);
 };
 
 #endif
@@ -0,0 +1,366 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "BitMapAllocator.h"
+#include "bluestore_types.h"
+#include "include/intarith.h"
+#include "common/debug.h"
+#include "global/global_context.h"
+
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "bitmapalloc "
+
+BitMapAllocator::BitMapAllocator(uint64_t device_size, uint64_t bs)
+  : num_free(0),
+    num_uncommitted(0),
+    num_committing(0),
+    num_reserved(0),
+    block_size(bs),
+    block_order(0),
+    num_blocks(0),
+    zone_blocks(0),
+    num_zones(0),
+    last_zone(0)
+{
+  assert(block_size && (block_size & (block_size - 1)) == 0);
+  while ((1ull << block_order) < block_size)
+    ++block_order;
+  num_blocks = device_size >> block_order;
+  zone_blocks = ROUND_UP_TO(
+    MAX((uint64_t)g_conf->bluestore_bitmap_zone_blocks, 64ull), 64ull);
+  num_zones = (num_blocks + zone_blocks - 1) / zone_blocks;
+
+  // everything starts out allocated; init_add_free carves out free space.
+  // blocks past the end of the device are never cleared.
+  bits.assign(num_zones * zone_blocks / 64, ~0ull);
+  zones.reset(new Zone[num_zones]);
+  dout(10) << __func__ << " " << num_blocks << " blocks of " << block_size
+	   << " in " << num_zones << " zones of " << zone_blocks << " blocks"
+	   << dendl;
+}
+
+BitMapAllocator::~BitMapAllocator()
+{
+}
+
+void BitMapAllocator::_set_bits(uint64_t b, uint64_t n)
+{
+  while (n) {
+    uint64_t bit = b & 63;
+    uint64_t cnt = MIN(64 - bit, n);
+    uint64_t mask = cnt == 64 ? ~0ull : ((1ull << cnt) - 1) << bit;
+    assert((bits[b >> 6] & mask) == 0);
+    bits[b >> 6] |= mask;
+    b += cnt;
+    n -= cnt;
+  }
+}
+
+void BitMapAllocator::_clear_bits(uint64_t b, uint64_t n)
+{
+  while (n) {
+    uint64_t bit = b & 63;
+    uint64_t cnt = MIN(64 - bit, n);
+    uint64_t mask = cnt == 64 ? ~0ull : ((1ull << cnt) - 1) << bit;
+    assert((bits[b >> 6] & mask) == mask);
+    bits[b >> 6] &= ~mask;
+    b += cnt;
+    n -= cnt;
+  }
+}
+
+uint64_t BitMapAllocator::_count_free(uint64_t b, uint64_t max) const
+{
+  uint64_t n = 0;
+  while (n < max) {
+    uint64_t pos = b + n;
+    uint64_t w = bits[pos >> 6] >> (pos & 63);
+    if (w == 0) {
+      n += 64 - (pos & 63);
+      continue;
+    }
+    n += __builtin_ctzll(w);
+    break;
+  }
+  return MIN(n, max);
+}
+
+bool BitMapAllocator::_find_in_zone(
+  uint64_t z, uint64_t unit, uint64_t want, uint64_t min,
+  uint64_t *start, uint64_t *len) const
+{
+  uint64_t zend = MIN((z + 1) * zone_blocks, num_blocks);
+  uint64_t b = ROUND_UP_TO(z * zone_blocks, unit);
+  uint64_t best = 0, best_len = 0;
+  while (b + min <= zend) {
+    uint64_t w = bits[b >> 6];
+    if (w == ~0ull) {
+      b = ROUND_UP_TO((b | 63) + 1, unit);
+      continue;
+    }
+    if (_test(b)) {
+      // skip to the next clear bit in this word, if any
+      uint64_t clear = ~w >> (b & 63);
+      b = clear ? b + __builtin_ctzll(clear) : (b | 63) + 1;
+      b = ROUND_UP_TO(b, unit);
+      continue;
+    }
+    uint64_t n = _count_free(b, MIN(want, zend - b));
+    if (n >= want) {
+      *start = b;
+      *len = want;
+      return true;
+    }
+    if (n >= min && n > best_len) {
+      best = b;
+      best_len = n;
+    }
+    b = ROUND_UP_TO(b + n + 1, unit);
+  }
+  if (best_len) {
+    *start = best;
+    *len = best_len - best_len % unit;
+    return true;
+  }
+  return false;
+}
+
+int64_t BitMapAllocator::_alloc_in_zone(
+  uint64_t z, uint64_t unit, uint64_t want, uint64_t min,
+  uint64_t *start, uint64_t *len)
+{
+  Zone& zone = zones[z];
+  // the caller took the zone lock
+  std::lock_guard<std::mutex> l(zone.lock, std::adopt_lock);
+  if (zone.num_free < (int64_t)min)
+    return 0;
+  if (!_find_in_zone(z, unit, want, min, start, len))
+    return 0;
+  _set_bits(*start, *len);
+  zone.num_free -= *len;
+  return *len;
+}
+
+void BitMapAllocator::_mark(uint64_t offset, uint64_t length, bool free)
+{
+  assert((offset & (block_size - 1)) == 0);
+  assert((length & (block_size - 1)) == 0);
+  uint64_t b = offset >> block_order;
+  uint64_t n = length >> block_order;
+  assert(b + n <= num_blocks);
+  while (n) {
+    uint64_t z = b / zone_blocks;
+    uint64_t cnt = MIN(n, (z + 1) * zone_blocks - b);
+    std::lock_guard<std::mutex> l(zones[z].lock);
+    if (free) {
+      _clear_bits(b, cnt);
+      zones[z].num_free += cnt;
+    } else {
+      _set_bits(b, cnt);
+      zones[z].num_free -= cnt;
+    }
+    b += cnt;
+    n -= cnt;
+  }
+}
+
+int BitMapAllocator::reserve(uint64_t need)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " need " << need << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  if ((int64_t)need > num_free - num_reserved)
+    return -ENOSPC;
+  num_reserved += need;
+  return 0;
+}
+
+void BitMapAllocator::unreserve(uint64_t unused)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " unused " << unused << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  assert(num_reserved >= (int64_t)unused);
+  num_reserved -= unused;
+}
+
+int BitMapAllocator::allocate(
+  uint64_t need_size, uint64_t alloc_unit, int64_t hint,
+  uint64_t *offset, uint32_t *length)
+{
+  dout(10) << __func__ << " need_size " << need_size
+	   << " alloc_unit " << alloc_unit
+	   << " hint " << hint
+	   << dendl;
+  assert((alloc_unit & (block_size - 1)) == 0);
+  uint64_t unit = MAX(alloc_unit >> block_order, 1ull);
+  uint64_t want = ROUND_UP_TO(MAX(alloc_unit, need_size), block_size)
+    >> block_order;
+  assert(unit <= zone_blocks);
+
+  // an extent never spans zones, and must fit in the 32-bit length
+  want = MIN(want, zone_blocks - zone_blocks % unit);
+  want = MIN(want, (0x80000000ull >> block_order) / unit * unit);
+  if (g_conf->bluestore_debug_small_allocations) {
+    uint64_t max = unit * (rand() % g_conf->bluestore_debug_small_allocations);
+    if (max && want > max) {
+      dout(10) << __func__ << " shortening allocation of "
+	       << (want << block_order) << " -> " << (max << block_order)
+	       << " due to debug_small_allocations" << dendl;
+      want = max;
+    }
+  }
+
+  uint64_t first;
+  if (hint && (uint64_t)hint >> block_order < num_blocks)
+    first = ((uint64_t)hint >> block_order) / zone_blocks;
+  else
+    first = last_zone.load();
+
+  // pass 0: full length, skipping zones another thread is working in
+  // pass 1: full length, waiting for busy zones
+  // pass 2: any run of at least alloc_unit
+  uint64_t start = 0, len = 0, z = 0;
+  for (int pass = 0; pass < 3; ++pass) {
+    uint64_t min = pass < 2 ? want : unit;
+    for (uint64_t i = 0; i < num_zones; ++i) {
+      z = (first + i) % num_zones;
+      if (zones[z].num_free < (int64_t)min)
+	continue;
+      if (pass == 0) {
+	if (!zones[z].lock.try_lock())
+	  continue;
+      } else {
+	zones[z].lock.lock();
+      }
+      if (_alloc_in_zone(z, unit, want, min, &start, &len))
+	goto found;
+    }
+  }
+
+  assert(0 == "caller didn't reserve?");
+  return -ENOSPC;
+
+ found:
+  *offset = start << block_order;
+  *length = len << block_order;
+  last_zone = z;
+  dout(30) << __func__ << " got " << *offset << "~" << *length << " from zone "
+	   << z << dendl;
+
+  std::lock_guard<std::mutex> l(lock);
+  num_free -= *length;
+  num_reserved -= *length;
+  assert(num_free >= 0);
+  assert(num_reserved >= 0);
+  return 0;
+}
+
+int BitMapAllocator::release(
+  uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uncommitted.insert(offset, length);
+  num_uncommitted += length;
+  return 0;
+}
+
+uint64_t BitMapAllocator::get_free()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return num_free;
+}
+
+void BitMapAllocator::dump(ostream& out)
+{
+  for (uint64_t z = 0; z < num_zones; ++z) {
+    std::lock_guard<std::mutex> zl(zones[z].lock);
+    if (!zones[z].num_free)
+      continue;
+    dout(30) << __func__ << " zone " << z << ": " << zones[z].num_free
+	     << " free blocks" << dendl;
+    uint64_t zend = MIN((z + 1) * zone_blocks, num_blocks);
+    for (uint64_t b = z * zone_blocks; b < zend; ) {
+      uint64_t n = _count_free(b, zend - b);
+      if (n) {
+	dout(30) << __func__ << "  " << (b << block_order) << "~"
+		 << (n << block_order) << dendl;
+	b += n;
+      } else {
+	++b;
+      }
+    }
+  }
+  std::lock_guard<std::mutex> l(lock);
+  dout(30) << __func__ << " committing: "
+	   << committing.num_intervals() << " extents" << dendl;
+  for (auto p = committing.begin();
+       p != committing.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+  dout(30) << __func__ << " uncommitted: "
+	   << uncommitted.num_intervals() << " extents" << dendl;
+  for (auto p = uncommitted.begin();
+       p != uncommitted.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+}
+
+void BitMapAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _mark(offset, length, true);
+  std::lock_guard<std::mutex> l(lock);
+  num_free += length;
+}
+
+void BitMapAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _mark(offset, length, false);
+  std::lock_guard<std::mutex> l(lock);
+  num_free -= length;
+  assert(num_free >= 0);
+}
+
+void BitMapAllocator::shutdown()
+{
+  dout(1) << __func__ << dendl;
+}
+
+void BitMapAllocator::commit_start()
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " releasing " << num_uncommitted
+	   << " in extents " << uncommitted.num_intervals() << dendl;
+  assert(committing.empty());
+  committing.swap(uncommitted);
+  num_committing = num_uncommitted;
+  num_uncommitted = 0;
+}
+
+void BitMapAllocator::commit_finish()
+{
+  // never hold the allocator lock while taking a zone lock
+  btree_interval_set<uint64_t> released;
+  int64_t num_released;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    dout(10) << __func__ << " released " << num_committing
+	     << " in extents " << committing.num_intervals() << dendl;
+    released.swap(committing);
+    num_released = num_committing;
+    num_committing = 0;
+  }
+  for (auto p = released.begin();
+       p != released.end();
+       ++p) {
+    _mark(p.get_start(), p.get_len(), true);
+  }
+  std::lock_guard<std::mutex> l(lock);
+  num_free += num_released;
+}
@@ -0,0 +1,97 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_BITMAPALLOCATOR_H
+#define CEPH_OS_BLUESTORE_BITMAPALLOCATOR_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Allocator.h"
+#include "include/btree_interval_set.h"
+
+/**
+ * Allocator backed by a fixed-size bitmap with one bit per device block.
+ *
+ * The bitmap is split into zones of bluestore_bitmap_zone_blocks blocks.
+ * Each zone has its own lock and a free block count (the summary level),
+ * so allocations that land in different zones proceed in parallel and
+ * full zones are skipped without touching their bits.  Memory use is
+ * proportional to the device size only, regardless of fragmentation.
+ *
+ * A set bit means the block is in use.  The bitmap starts fully
+ * allocated, so loading the freelist at mount is a series of word-wide
+ * clears.  Released extents follow the same uncommitted -> committing ->
+ * free cycle as StupidAllocator.
+ */
+class BitMapAllocator : public Allocator {
+  struct Zone {
+    std::mutex lock;
+    std::atomic<int64_t> num_free;  ///< free blocks in this zone
+    Zone() : num_free(0) {}
+  };
+
+  std::mutex lock;      ///< protects the counters and release sets below
+
+  int64_t num_free;     ///< total bytes free
+  int64_t num_uncommitted;
+  int64_t num_committing;
+  int64_t num_reserved; ///< reserved bytes
+
+  btree_interval_set<uint64_t> uncommitted; ///< released but not yet usable
+  btree_interval_set<uint64_t> committing;  ///< released but not yet usable
+
+  uint64_t block_size;
+  unsigned block_order;       ///< log2(block_size)
+  uint64_t num_blocks;
+  uint64_t zone_blocks;       ///< blocks per zone (multiple of 64)
+  uint64_t num_zones;
+
+  std::vector<uint64_t> bits;             ///< 1 == allocated
+  std::unique_ptr<Zone[]> zones;
+  std::atomic<uint64_t> last_zone;        ///< where to start without a hint
+
+  bool _test(uint64_t b) const {
+    return bits[b >> 6] & (1ull << (b & 63));
+  }
+  void _set_bits(uint64_t b, uint64_t n);
+  void _clear_bits(uint64_t b, uint64_t n);
+  uint64_t _count_free(uint64_t b, uint64_t max) const;
+  bool _find_in_zone(uint64_t z, uint64_t unit, uint64_t want, uint64_t min,
+		     uint64_t *start, uint64_t *len) const;
+  int64_t _alloc_in_zone(uint64_t z, uint64_t unit, uint64_t want,
+			 uint64_t min, uint64_t *start, uint64_t *len);
+
+  /// mark [offset, offset+length) free (free=true) or used, zone by zone
+  void _mark(uint64_t offset, uint64_t length, bool free);
+
+public:
+  BitMapAllocator(uint64_t device_size, uint64_t block_size);
+  ~BitMapAllocator();
+
+  int reserve(uint64_t need);
+  void unreserve(uint64_t unused);
+
+  int allocate(
+    uint64_t need_size, uint64_t alloc_unit, int64_t hint,
+    uint64_t *offset, uint32_t *length);
+
+  int release(
+    uint64_t offset, uint64_t length);
+
+  void commit_start();
+  void commit_finish();
+
+  uint64_t get_free();
+
+  void dump(std::ostream& out);
+
+  void init_add_free(uint64_t offset, uint64_t length);
+  void init_rm_free(uint64_t offset, uint64_t length);
+
+  void shutdown();
+};
+
+#endif
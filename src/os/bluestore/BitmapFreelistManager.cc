@@ -0,0 +1,314 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "BitmapFreelistManager.h"
+#include "kv/KeyValueDB.h"
+#include "kv.h"
+
+#include "common/debug.h"
+
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "freelist "
+
+struct XorMergeOperator : public KeyValueDB::MergeOperator {
+  void merge_nonexistent(
+    const char *rdata, size_t rlen, std::string *new_value) {
+    *new_value = std::string(rdata, rlen);
+  }
+  void merge(
+    const char *ldata, size_t llen,
+    const char *rdata, size_t rlen,
+    std::string *new_value) {
+    assert(llen == rlen);
+    *new_value = std::string(ldata, llen);
+    for (size_t i = 0; i < rlen; ++i) {
+      (*new_value)[i] ^= rdata[i];
+    }
+  }
+  // We use each operator name and each prefix to construct the
+  // overall RocksDB operator name for consistency check at open time.
+  string name() const {
+    return "bitwise_xor";
+  }
+};
+
+void BitmapFreelistManager::setup_merge_operator(KeyValueDB *db, string prefix)
+{
+  std::shared_ptr<XorMergeOperator> merge_op(new XorMergeOperator);
+  db->set_merge_operator(prefix, merge_op);
+}
+
+BitmapFreelistManager::BitmapFreelistManager(KeyValueDB *db,
+					     string meta_prefix,
+					     string bitmap_prefix)
+  : kvdb(db),
+    meta_prefix(meta_prefix),
+    bitmap_prefix(bitmap_prefix),
+    size(0),
+    bytes_per_block(0),
+    blocks_per_key(0),
+    bytes_per_key(0),
+    key_mask(0),
+    enumerate_done(false),
+    enumerate_offset(0),
+    enumerate_bl_pos(0)
+{
+}
+
+int BitmapFreelistManager::create(uint64_t new_size, uint64_t block_size,
+				  KeyValueDB::Transaction txn)
+{
+  size = new_size;
+  bytes_per_block = block_size;
+  blocks_per_key = g_conf->bluestore_freelist_blocks_per_key;
+  if (blocks_per_key < 8 || (blocks_per_key & (blocks_per_key - 1))) {
+    derr << __func__ << " bluestore_freelist_blocks_per_key " << blocks_per_key
+	 << " must be a power of 2 >= 8" << dendl;
+    return -EINVAL;
+  }
+  _init_misc();
+  dout(1) << __func__ << " size " << size
+	  << " bytes_per_block " << bytes_per_block
+	  << " blocks_per_key " << blocks_per_key << dendl;
+  {
+    bufferlist bl;
+    ::encode(bytes_per_block, bl);
+    txn->set(meta_prefix, "bytes_per_block", bl);
+  }
+  {
+    bufferlist bl;
+    ::encode(blocks_per_key, bl);
+    txn->set(meta_prefix, "blocks_per_key", bl);
+  }
+  {
+    bufferlist bl;
+    ::encode(size, bl);
+    txn->set(meta_prefix, "size", bl);
+  }
+  return 0;
+}
+
+int BitmapFreelistManager::init()
+{
+  dout(1) << __func__ << " meta prefix " << meta_prefix
+	  << " bitmap prefix " << bitmap_prefix << dendl;
+
+  const char *keys[] = { "bytes_per_block", "blocks_per_key", "size" };
+  uint64_t *vals[] = { &bytes_per_block, &blocks_per_key, &size };
+  for (unsigned i = 0; i < 3; ++i) {
+    bufferlist bl;
+    int r = kvdb->get(meta_prefix, keys[i], &bl);
+    if (r < 0) {
+      derr << __func__ << " unable to read " << keys[i] << dendl;
+      return -EIO;
+    }
+    bufferlist::iterator p = bl.begin();
+    ::decode(*vals[i], p);
+  }
+  _init_misc();
+  dout(10) << __func__ << " size " << size
+	   << " bytes_per_block " << bytes_per_block
+	   << " blocks_per_key " << blocks_per_key << dendl;
+  return 0;
+}
+
+void BitmapFreelistManager::_init_misc()
+{
+  bytes_per_key = bytes_per_block * blocks_per_key;
+  key_mask = ~(bytes_per_key - 1);
+
+  bufferptr z(blocks_per_key >> 3);
+  memset(z.c_str(), 0xff, z.length());
+  all_set_bl.clear();
+  all_set_bl.append(z);
+}
+
+void BitmapFreelistManager::shutdown()
+{
+  dout(1) << __func__ << dendl;
+}
+
+void BitmapFreelistManager::dump()
+{
+  std::lock_guard<std::mutex> l(lock);
+  KeyValueDB::Iterator it = kvdb->get_iterator(bitmap_prefix);
+  it->lower_bound(string());
+  while (it->valid()) {
+    uint64_t offset;
+    string k = it->key();
+    _key_decode_u64(k.c_str(), &offset);
+    bufferlist bl = it->value();
+    dout(30) << __func__ << " 0x" << std::hex << offset << std::dec << ":\n";
+    bl.hexdump(*_dout);
+    *_dout << dendl;
+    it->next();
+  }
+}
+
+void BitmapFreelistManager::enumerate_reset()
+{
+  std::lock_guard<std::mutex> l(lock);
+  enumerate_p.reset();
+  enumerate_done = false;
+  enumerate_offset = 0;
+  enumerate_bl.clear();
+  enumerate_bl_pos = 0;
+}
+
+bool BitmapFreelistManager::_enumerate_load()
+{
+  if (enumerate_bl.length() && enumerate_bl_pos < blocks_per_key)
+    return true;
+  if (enumerate_done)
+    return false;
+  if (!enumerate_p) {
+    enumerate_p = kvdb->get_iterator(bitmap_prefix);
+    enumerate_p->lower_bound(string());
+  } else {
+    enumerate_p->next();
+  }
+  if (!enumerate_p->valid()) {
+    enumerate_done = true;
+    enumerate_bl.clear();
+    return false;
+  }
+  string k = enumerate_p->key();
+  _key_decode_u64(k.c_str(), &enumerate_offset);
+  enumerate_bl = enumerate_p->value();
+  assert(enumerate_bl.length() == blocks_per_key >> 3);
+  enumerate_bl_pos = 0;
+  return true;
+}
+
+bool BitmapFreelistManager::_enumerate_find(bool free)
+{
+  const unsigned char *p = (const unsigned char *)enumerate_bl.c_str();
+  unsigned char skip = free ? 0 : 0xff;
+  while (enumerate_bl_pos < blocks_per_key) {
+    unsigned char c = p[enumerate_bl_pos >> 3];
+    if ((enumerate_bl_pos & 7) == 0 && c == skip) {
+      enumerate_bl_pos += 8;
+      continue;
+    }
+    if (!!(c & (1 << (enumerate_bl_pos & 7))) == free)
+      return true;
+    ++enumerate_bl_pos;
+  }
+  return false;
+}
+
+bool BitmapFreelistManager::enumerate_next(uint64_t *offset, uint64_t *length)
+{
+  std::lock_guard<std::mutex> l(lock);
+
+  // find the start of the next free run
+  while (true) {
+    if (!_enumerate_load())
+      return false;
+    if (_enumerate_find(true))
+      break;
+  }
+  *offset = enumerate_offset + enumerate_bl_pos * bytes_per_block;
+
+  // find its end; a run may continue into the next key if it is adjacent
+  uint64_t end;
+  while (true) {
+    if (_enumerate_find(false)) {
+      end = enumerate_offset + enumerate_bl_pos * bytes_per_block;
+      break;
+    }
+    uint64_t next = enumerate_offset + bytes_per_key;
+    if (!_enumerate_load() || enumerate_offset != next) {
+      end = next;
+      break;
+    }
+  }
+  *length = end - *offset;
+  dout(30) << __func__ << " " << *offset << "~" << *length << dendl;
+  return true;
+}
+
+int BitmapFreelistManager::allocate(
+  uint64_t offset, uint64_t length,
+  KeyValueDB::Transaction txn)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _xor(offset, length, txn);
+  return 0;
+}
+
+int BitmapFreelistManager::release(
+  uint64_t offset, uint64_t length,
+  KeyValueDB::Transaction txn)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _xor(offset, length, txn);
+  return 0;
+}
+
+void BitmapFreelistManager::_xor(
+  uint64_t offset, uint64_t length,
+  KeyValueDB::Transaction txn)
+{
+  assert((offset & (bytes_per_block - 1)) == 0);
+  assert((length & (bytes_per_block - 1)) == 0);
+  assert(length);
+  assert(offset + length <= size);
+
+  uint64_t first_key = offset & key_mask;
+  uint64_t last_key = (offset + length - 1) & key_mask;
+  uint64_t s = (offset & ~key_mask) / bytes_per_block;
+  uint64_t e = ((offset + length - 1) & ~key_mask) / bytes_per_block;
+  dout(20) << __func__ << " first_key 0x" << std::hex << first_key
+	   << " last_key 0x" << last_key << std::dec << dendl;
+
+  if (first_key == last_key) {
+    bufferptr p(blocks_per_key >> 3);
+    p.zero();
+    for (uint64_t i = s; i <= e; ++i) {
+      p[i >> 3] ^= 1 << (i & 7);
+    }
+    string k;
+    _key_encode_u64(first_key, &k);
+    bufferlist bl;
+    bl.append(p);
+    txn->merge(bitmap_prefix, k, bl);
+  } else {
+    // first key
+    {
+      bufferptr p(blocks_per_key >> 3);
+      p.zero();
+      for (uint64_t i = s; i < blocks_per_key; ++i) {
+	p[i >> 3] ^= 1 << (i & 7);
+      }
+      string k;
+      _key_encode_u64(first_key, &k);
+      bufferlist bl;
+      bl.append(p);
+      txn->merge(bitmap_prefix, k, bl);
+      first_key += bytes_per_key;
+    }
+    // middle keys
+    while (first_key < last_key) {
+      string k;
+      _key_encode_u64(first_key, &k);
+      txn->merge(bitmap_prefix, k, all_set_bl);
+      first_key += bytes_per_key;
+    }
+    assert(first_key == last_key);
+    // last key
+    {
+      bufferptr p(blocks_per_key >> 3);
+      p.zero();
+      for (uint64_t i = 0; i <= e; ++i) {
+	p[i >> 3] ^= 1 << (i & 7);
+      }
+      string k;
+      _key_encode_u64(first_key, &k);
+      bufferlist bl;
+      bl.append(p);
+      txn->merge(bitmap_prefix, k, bl);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_BITMAPFREELISTMANAGER_H
+#define CEPH_OS_BLUESTORE_BITMAPFREELISTMANAGER_H
+
+#include <string>
+#include <mutex>
+#include "FreelistManager.h"
+
+/**
+ * Freelist stored as fixed-size bitmap chunks, one bit per block.
+ *
+ * Each key in bitmap_prefix covers blocks_per_key blocks and is named by
+ * the device offset of its first block.  A set bit means the block is
+ * free; a missing key means every block it covers is in use.  Both
+ * allocate and release flip bits, so they are written as XOR merges and
+ * never need to read the current value.  Geometry is kept in meta_prefix.
+ */
+class BitmapFreelistManager : public FreelistManager {
+  KeyValueDB *kvdb;
+  std::string meta_prefix, bitmap_prefix;
+  std::mutex lock;
+
+  uint64_t size;            ///< size of device (bytes)
+  uint64_t bytes_per_block; ///< bytes per block (device block size)
+  uint64_t blocks_per_key;  ///< blocks (bits) per key/value pair
+  uint64_t bytes_per_key;   ///< bytes of device covered by one key
+  uint64_t key_mask;        ///< mask to convert offset to key offset
+
+  bufferlist all_set_bl;    ///< value with every bit set
+
+  KeyValueDB::Iterator enumerate_p;
+  bool enumerate_done;
+  uint64_t enumerate_offset; ///< device offset of enumerate_bl
+  bufferlist enumerate_bl;   ///< current key value
+  uint64_t enumerate_bl_pos; ///< next bit to look at in enumerate_bl
+
+  void _init_misc();
+  void _xor(uint64_t offset, uint64_t length, KeyValueDB::Transaction txn);
+  bool _enumerate_load();
+  bool _enumerate_find(bool free);
+
+public:
+  BitmapFreelistManager(KeyValueDB *kvdb, std::string meta_prefix,
+			std::string bitmap_prefix);
+
+  static void setup_merge_operator(KeyValueDB *kvdb, std::string prefix);
+
+  int create(uint64_t size, uint64_t block_size,
+	     KeyValueDB::Transaction txn);
+  int init();
+  void shutdown();
+
+  void dump();
+
+  void enumerate_reset();
+  bool enumerate_next(uint64_t *offset, uint64_t *length);
+
+  int allocate(
+    uint64_t offset, uint64_t length,
+    KeyValueDB::Transaction txn);
+  int release(
+    uint64_t offset, uint64_t length,
+    KeyValueDB::Transaction txn);
+};
+
+#endif
@@ -96,7 +96,7 @@ public:
   virtual int aio_zero(uint64_t off, uint64_t len, IOContext *ioc) = 0;
   virtual int flush() = 0;
 
-  void queue_reap_ioc(IOContext *ioc);
+  virtual void queue_reap_ioc(IOContext *ioc);
   void reap_ioc();
 
   // for managing buffered readers/writers
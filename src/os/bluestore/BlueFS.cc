@@ -5,6 +5,7 @@
 
 #include "common/debug.h"
 #include "common/errno.h"
+#include "common/perf_counters.h"
 #include "BlockDevice.h"
 #include "Allocator.h"
 #include "StupidAllocator.h"
@@ -17,12 +18,15 @@
 BlueFS::BlueFS()
   : ino_last(0),
     log_seq(0),
-    log_writer(NULL)
+    log_writer(NULL),
+    logger(NULL)
 {
+  _init_logger();
 }
 
 BlueFS::~BlueFS()
 {
+  _shutdown_logger();
   for (auto p : bdev) {
     p->close();
     delete p;
@@ -32,6 +36,27 @@ BlueFS::~BlueFS()
   }
 }
 
+void BlueFS::_init_logger()
+{
+  PerfCountersBuilder b(g_ceph_context, "BlueFS",
+                        l_bluefs_first, l_bluefs_last);
+  b.add_u64_counter(l_bluefs_bytes_written_wal, "bytes_written_wal", "Sum for bytes written to rocksdb wal files");
+  b.add_u64_counter(l_bluefs_bytes_written_sst, "bytes_written_sst", "Sum for bytes written to other files");
+  b.add_u64_counter(l_bluefs_bytes_written_log, "bytes_written_log", "Sum for bytes written to the bluefs log");
+  b.add_u64_counter(l_bluefs_fsync, "fsync", "Sum for file fsyncs");
+  b.add_u64_counter(l_bluefs_fsync_log, "fsync_log", "Sum for file fsyncs that had to commit the bluefs log");
+  b.add_u64_counter(l_bluefs_log_compactions, "log_compactions", "Sum for bluefs log compactions");
+  b.add_u64_counter(l_bluefs_wal_preextend_bytes, "wal_preextend_bytes", "Sum for bytes zeroed to preextend new wal files");
+  logger = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(logger);
+}
+
+void BlueFS::_shutdown_logger()
+{
+  g_ceph_context->get_perfcounters_collection()->remove(logger);
+  delete logger;
+}
+
 /*static void aio_cb(void *priv, void *priv2)
 {
   BlueFS *fs = static_cast<BlueFS*>(priv);
@@ -813,6 +838,7 @@ void BlueFS::_compact_log()
   // the big compacted log, while continuing to log at the end of the old log
   // file, and once it's done swap out the old log extents for the new ones.
   dout(10) << __func__ << dendl;
+  logger->inc(l_bluefs_log_compactions);
   File *log_file = log_writer->file.get();
 
   // clear out log (be careful who calls us!!!)
@@ -930,6 +956,8 @@ int BlueFS::_flush_log()
   assert(r == 0);
   _flush_wait(log_writer);
   _flush_bdev();
+  std::fill(log_writer->dirty_devs.begin(), log_writer->dirty_devs.end(),
+	    false);
 
   // clean dirty files
   dirty_file_list_t::iterator p = dirty_files.begin();
@@ -1026,6 +1054,16 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   h->pos = offset + length;
   h->tail_block.clear();
 
+  if (h->file->fnode.ino == 1)
+    logger->inc(l_bluefs_bytes_written_log, length);
+  else if (h->is_wal)
+    logger->inc(l_bluefs_bytes_written_wal, length);
+  else
+    logger->inc(l_bluefs_bytes_written_sst, length);
+
+  // wal appends are never read back in normal operation; skip the page
+  // cache and let the device see them as soon as they are submitted.
+  bool buffered = !(h->is_wal && g_conf->bluefs_wal_direct_io);
   uint64_t bloff = 0;
   while (length > 0) {
     uint64_t x_len = MIN(p->length - x_off, length);
@@ -1038,7 +1076,8 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
       h->tail_block.substr_of(bl, bl.length() - tail, tail);
       t.append_zero(super.block_size - tail);
     }
-    bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev], true);
+    bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev],
+			     buffered);
     bloff += x_len;
     length -= x_len;
     ++p;
@@ -1047,6 +1086,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   for (unsigned i = 0; i < bdev.size(); ++i) {
     if (h->iocv[i]->has_aios()) {
       bdev[i]->aio_submit(h->iocv[i]);
+      h->dirty_devs[i] = true;
     }
   }
   dout(20) << __func__ << " h " << h << " pos now " << h->pos << dendl;
@@ -1121,13 +1161,20 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
 void BlueFS::_fsync(FileWriter *h)
 {
   dout(10) << __func__ << " " << h << " " << h->file->fnode << dendl;
+  logger->inc(l_bluefs_fsync);
   _flush(h, true);
   _flush_wait(h);
   if (h->file->dirty) {
     dout(20) << __func__ << " file metadata is dirty, flushing log on "
 	     << h->file->fnode << dendl;
+    logger->inc(l_bluefs_fsync_log);
     _flush_log();
     assert(!h->file->dirty);
+    std::fill(h->dirty_devs.begin(), h->dirty_devs.end(), false);
+  } else {
+    // metadata is unchanged (overwrite of a recycled or preextended
+    // file); the data only needs to reach stable storage.
+    _flush_bdev(h);
   }
 }
 
@@ -1139,6 +1186,17 @@ void BlueFS::_flush_bdev()
   }
 }
 
+void BlueFS::_flush_bdev(FileWriter *h)
+{
+  for (unsigned i = 0; i < bdev.size(); ++i) {
+    if (h->dirty_devs[i]) {
+      dout(20) << __func__ << " " << h << " bdev " << i << dendl;
+      bdev[i]->flush();
+      h->dirty_devs[i] = false;
+    }
+  }
+}
+
 int BlueFS::_allocate(unsigned id, uint64_t len, vector<bluefs_extent_t> *ev)
 {
   dout(10) << __func__ << " len " << len << " from " << id << dendl;
@@ -1198,6 +1256,41 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
   return 0;
 }
 
+int BlueFS::_preextend(unsigned id, uint64_t len,
+			vector<bluefs_extent_t> *extents,
+			std::unique_lock<std::mutex>& l)
+{
+  dout(10) << __func__ << " " << len << " on bdev " << id << dendl;
+  assert(extents->empty());
+  int r = _allocate(id, len, extents);
+  if (r < 0)
+    return r;
+
+  // zero the whole file and make sure the zeros are stable before the
+  // new size is logged, so that replay never finds stale data in the
+  // tail that rocksdb has not written yet.  this is up to
+  // bluefs_preextend_wal_size of io; do not stall every other bluefs
+  // op (wal fsyncs in particular) behind it.  the extents belong to no
+  // file yet, so nothing can see or log them meanwhile.
+  l.unlock();
+  vector<IOContext*> iocv(bdev.size(), nullptr);
+  for (auto& e : *extents) {
+    if (!iocv[e.bdev])
+      iocv[e.bdev] = new IOContext(NULL);
+    bdev[e.bdev]->aio_zero(e.offset, e.length, iocv[e.bdev]);
+  }
+  for (unsigned i = 0; i < bdev.size(); ++i) {
+    if (!iocv[i])
+      continue;
+    bdev[i]->aio_submit(iocv[i]);
+    iocv[i]->aio_wait();
+    bdev[i]->flush();
+    bdev[i]->queue_reap_ioc(iocv[i]);
+  }
+  l.lock();
+  return 0;
+}
+
 void BlueFS::sync_metadata()
 {
   std::lock_guard<std::mutex> l(lock);
@@ -1226,14 +1319,54 @@ int BlueFS::open_for_write(
   FileWriter **h,
   bool overwrite)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::unique_lock<std::mutex> l(lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
+
+  uint8_t prefer_bdev = 0;
+  if (dirname.length() > 5) {
+    // the "db.slow" and "db.wal" directory names are hard-coded at
+    // match up with bluestore.  the slow device is always the second
+    // one (when a dedicated block.db device is present and used at
+    // bdev 0).  the wal device is always last.
+    if (strcmp(dirname.c_str() + dirname.length() - 5, ".slow") == 0) {
+      assert(bdev.size() > 1);
+      prefer_bdev = 1;
+    } else if (strcmp(dirname.c_str() + dirname.length() - 4, ".wal") == 0) {
+      assert(bdev.size() > 1);
+      prefer_bdev = bdev.size() - 1;
+    }
+  }
+
+  // rocksdb wal files are named NNNNNN.log
+  bool is_wal = filename.length() > 4 &&
+    filename.compare(filename.length() - 4, 4, ".log") == 0;
+
+  // zero a new wal before the file exists anywhere (file_map, a dir, or
+  // the log), since the lock is dropped while we do it.  appends within
+  // the preextended size do not change the fnode, so fsync on this file
+  // does not need to commit the bluefs log.
+  vector<bluefs_extent_t> preextended;
+  if (is_wal && !overwrite && g_conf->bluefs_preextend_wal_size) {
+    map<string,DirRef>::iterator p = dir_map.find(dirname);
+    if (p != dir_map.end() && p->second->file_map.count(filename) == 0) {
+      int r = _preextend(prefer_bdev, g_conf->bluefs_preextend_wal_size,
+			 &preextended, l);
+      if (r < 0) {
+	derr << __func__ << " failed to preextend " << dirname << "/"
+	     << filename << ": " << cpp_strerror(r) << dendl;
+	preextended.clear();
+      }
+    }
+  }
+
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   DirRef dir;
   if (p == dir_map.end()) {
     // implicitly create the dir
     dout(20) << __func__ << "  dir " << dirname
 	     << " does not exist" << dendl;
+    for (auto& e : preextended)
+      alloc[e.bdev]->release(e.offset, e.length);
     return -ENOENT;
   } else {
     dir = p->second;
@@ -1252,11 +1385,24 @@ int BlueFS::open_for_write(
     file = new File;
     file->fnode.ino = ++ino_last;
     file->fnode.mtime = ceph_clock_now(NULL);
+    if (!preextended.empty()) {
+      file->fnode.extents.swap(preextended);
+      file->fnode.size = file->fnode.get_allocated();
+      logger->inc(l_bluefs_wal_preextend_bytes, file->fnode.size);
+    }
     file_map[ino_last] = file;
     dir->file_map[filename] = file;
     ++file->refs;
     create = true;
   } else {
+    if (!preextended.empty()) {
+      // somebody else created it while we were zeroing
+      dout(20) << __func__ << " " << dirname << "/" << filename
+	       << " appeared while preextending, releasing " << preextended
+	       << dendl;
+      for (auto& e : preextended)
+	alloc[e.bdev]->release(e.offset, e.length);
+    }
     // overwrite existing file?
     file = q->second;
     if (overwrite) {
@@ -1276,22 +1422,10 @@ int BlueFS::open_for_write(
     file->fnode.mtime = ceph_clock_now(NULL);
   }
 
-  if (dirname.length() > 5) {
-    // the "db.slow" and "db.wal" directory names are hard-coded at
-    // match up with bluestore.  the slow device is always the second
-    // one (when a dedicated block.db device is present and used at
-    // bdev 0).  the wal device is always last.
-    if (strcmp(dirname.c_str() + dirname.length() - 5, ".slow") == 0) {
-      assert(bdev.size() > 1);
-      dout(20) << __func__ << " mapping " << dirname << "/" << filename
-	       << " to bdev 1" << dendl;
-      file->fnode.prefer_bdev = 1;
-    } else if (strcmp(dirname.c_str() + dirname.length() - 4, ".wal") == 0) {
-      assert(bdev.size() > 1);
-      file->fnode.prefer_bdev = bdev.size() - 1;
-      dout(20) << __func__ << " mapping " << dirname << "/" << filename
-	       << " to bdev " << (int)file->fnode.prefer_bdev << dendl;
-    }
+  if (prefer_bdev) {
+    dout(20) << __func__ << " mapping " << dirname << "/" << filename
+	     << " to bdev " << (int)prefer_bdev << dendl;
+    file->fnode.prefer_bdev = prefer_bdev;
   }
 
   log_t.op_file_update(file->fnode);
@@ -1299,6 +1433,7 @@ int BlueFS::open_for_write(
     log_t.op_dir_link(dirname, filename, file->fnode.ino);
 
   *h = new FileWriter(file, bdev.size());
+  (*h)->is_wal = is_wal;
   dout(10) << __func__ << " h " << *h << " on " << file->fnode << dendl;
   return 0;
 }
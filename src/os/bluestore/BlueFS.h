@@ -14,6 +14,19 @@
 #include <boost/intrusive_ptr.hpp>
 
 class Allocator;
+class PerfCounters;
+
+enum {
+  l_bluefs_first = 732600,
+  l_bluefs_bytes_written_wal,
+  l_bluefs_bytes_written_sst,
+  l_bluefs_bytes_written_log,
+  l_bluefs_fsync,
+  l_bluefs_fsync_log,
+  l_bluefs_log_compactions,
+  l_bluefs_wal_preextend_bytes,
+  l_bluefs_last,
+};
 
 class BlueFS {
 public:
@@ -81,12 +94,16 @@ public:
 
     std::mutex lock;
     vector<IOContext*> iocv;  ///< one for each bdev
+    vector<bool> dirty_devs;  ///< bdevs written to since the last fsync
+    bool is_wal;              ///< rocksdb wal file (may be preextended)
 
     FileWriter(FileRef f, unsigned num_bdev)
       : file(f),
-	pos(0) {
+	pos(0),
+	is_wal(false) {
       ++file->num_writers;
       iocv.resize(num_bdev);
+      dirty_devs.resize(num_bdev, false);
       for (unsigned i = 0; i < num_bdev; ++i) {
 	iocv[i] = new IOContext(NULL);
       }
@@ -172,6 +189,8 @@ private:
   FileWriter *log_writer;     ///< writer for the log
   bluefs_transaction_t log_t; ///< pending, unwritten log transaction
 
+  PerfCounters *logger;
+
   /*
    * - there can be from 1 to 3 block devices.
    *
@@ -192,6 +211,9 @@ private:
   vector<interval_set<uint64_t> > block_all;  ///< extents in bdev we own
   vector<Allocator*> alloc;                   ///< allocators for bdevs
 
+  void _init_logger();
+  void _shutdown_logger();
+
   void _init_alloc();
   void _stop_alloc();
 
@@ -214,8 +236,11 @@ private:
   //void _aio_finish(void *priv);
 
   void _flush_bdev();
+  void _flush_bdev(FileWriter *h);
 
   int _preallocate(FileRef f, uint64_t off, uint64_t len);
+  int _preextend(unsigned id, uint64_t len, vector<bluefs_extent_t> *extents,
+		 std::unique_lock<std::mutex>& l);
   int _truncate(FileWriter *h, uint64_t off);
 
   int _read(
@@ -202,7 +202,9 @@ class BlueRocksWritableFile : public rocksdb::WritableFile {
     size_t block_size;
     size_t last_allocated_block;
     GetPreallocationStatus(&block_size, &last_allocated_block);
-    if (last_allocated_block > 0) {
+    // wal files keep their full (preextended) size so that they can be
+    // recycled without growing the fnode again.
+    if (last_allocated_block > 0 && !h->is_wal) {
       int r = fs->truncate(h, h->pos);
       if (r < 0)
 	return err_to_status(r);
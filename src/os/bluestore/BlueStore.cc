@@ -18,11 +18,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <thread>
 
 #include "BlueStore.h"
 #include "kv.h"
 #include "include/compat.h"
 #include "include/stringify.h"
+#include "include/str_list.h"
+#include "common/admin_socket.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
 #include "Allocator.h"
@@ -63,6 +66,7 @@ const string PREFIX_OVERLAY = "V"; // u64 + offset -> data
 const string PREFIX_OMAP = "M";    // u64 + keyname -> value
 const string PREFIX_WAL = "L";     // id -> wal_transaction_t
 const string PREFIX_ALLOC = "B";   // u64 offset -> u64 length (freelist)
+const string PREFIX_ALLOC_BITMAP = "b"; // u64 offset -> bitmap chunk (freelist)
 
 // write a label in the first block.  always use this size.  note that
 // bluefs makes a matching assumption about the location of its
@@ -477,30 +481,305 @@ void BlueStore::Onode::flush()
   dout(20) << __func__ << " done" << dendl;
 }
 
-// OnodeHashLRU
+void BlueStore::Onode::invalidate_cache()
+{
+  if (!cache)
+    return;
+  std::lock_guard<std::mutex> l(cache->lock);
+  if (!owner)
+    return;
+  cache->_discard_buffers(this);
+  cache->_adjust_onode(this);
+}
+
+uint64_t BlueStore::Onode::estimate_bytes() const
+{
+  // per-entry overhead of the std::map nodes, roughly
+  const uint64_t node_overhead = 48;
+  uint64_t bytes = sizeof(Onode) + key.length() + tail_bl.length();
+  for (map<string,bufferptr>::const_iterator p = onode.attrs.begin();
+       p != onode.attrs.end();
+       ++p) {
+    bytes += node_overhead + p->first.length() + p->second.length();
+  }
+  bytes += onode.block_map.size() *
+    (node_overhead + sizeof(bluestore_extent_t));
+  bytes += onode.overlay_map.size() *
+    (node_overhead + sizeof(bluestore_overlay_t));
+  return bytes;
+}
+
+// Cache
 
 #undef dout_prefix
-#define dout_prefix *_dout << "bluestore.lru(" << this << ") "
+#define dout_prefix *_dout << "bluestore.cache(" << this << ") "
 
-void BlueStore::OnodeHashLRU::_touch(OnodeRef o)
+void BlueStore::Cache::_add_onode(Onode *o)
 {
-  lru_list_t::iterator p = lru.iterator_to(*o);
-  lru.erase(p);
-  lru.push_front(*o);
+  o->cache = this;
+  o->cache_bytes = o->estimate_bytes();
+  onode_bytes += o->cache_bytes;
+  onode_lru.push_front(*o);
+  logger->inc(l_bluestore_onodes);
+  logger->inc(l_bluestore_onode_bytes, o->cache_bytes);
 }
 
-void BlueStore::OnodeHashLRU::add(const ghobject_t& oid, OnodeRef o)
+void BlueStore::Cache::_touch_onode(Onode *o)
+{
+  onode_lru_list_t::iterator p = onode_lru.iterator_to(*o);
+  onode_lru.erase(p);
+  onode_lru.push_front(*o);
+}
+
+void BlueStore::Cache::_rm_onode(Onode *o)
+{
+  _discard_buffers(o);
+  onode_lru_list_t::iterator p = onode_lru.iterator_to(*o);
+  onode_lru.erase(p);
+  onode_bytes -= o->cache_bytes;
+  logger->dec(l_bluestore_onodes);
+  logger->dec(l_bluestore_onode_bytes, o->cache_bytes);
+  o->cache_bytes = 0;
+  o->owner = NULL;
+}
+
+void BlueStore::Cache::_adjust_onode(Onode *o)
+{
+  uint64_t bytes = o->estimate_bytes();
+  onode_bytes = onode_bytes - o->cache_bytes + bytes;
+  if (bytes > o->cache_bytes)
+    logger->inc(l_bluestore_onode_bytes, bytes - o->cache_bytes);
+  else
+    logger->dec(l_bluestore_onode_bytes, o->cache_bytes - bytes);
+  o->cache_bytes = bytes;
+}
+
+bool BlueStore::Cache::_read_buffers(Onode *o, uint64_t offset,
+				     uint64_t length, bufferlist *bl)
+{
+  uint64_t end = offset + length;
+  map<uint64_t,Buffer*>::iterator p = o->buffer_map.upper_bound(offset);
+  if (p == o->buffer_map.begin())
+    return false;
+  --p;
+
+  // only serve the read if we have all of it
+  vector<Buffer*> hit;
+  uint64_t pos = offset;
+  while (pos < end) {
+    if (p == o->buffer_map.end() || p->first > pos || p->second->end() <= pos)
+      return false;
+    hit.push_back(p->second);
+    pos = MIN(end, p->second->end());
+    ++p;
+  }
+
+  pos = offset;
+  for (vector<Buffer*>::iterator q = hit.begin(); q != hit.end(); ++q) {
+    Buffer *b = *q;
+    uint64_t x_len = MIN(end, b->end()) - pos;
+    bufferlist t;
+    t.substr_of(b->data, pos - b->offset, x_len);
+    bl->claim_append(t);
+    pos += x_len;
+    if (b->hot) {
+      buffer_lru_list_t::iterator i = buffer_hot.iterator_to(*b);
+      buffer_hot.erase(i);
+      buffer_hot.push_front(*b);
+    }
+    // 2q: a1in hits stay where they are; a re-read after eviction promotes
+  }
+  return true;
+}
+
+void BlueStore::Cache::_add_buffer(Onode *o, uint64_t offset, bufferlist& bl)
+{
+  uint64_t length = bl.length();
+  _discard_buffers(o, offset, length);
+
+  // copy, so that we do not pin larger (e.g. aio or compressed) buffers
+  Buffer *b = new Buffer(o, offset);
+  bufferptr bp = buffer::create(length);
+  bl.copy(0, length, bp.c_str());
+  b->data.append(bp);
+
+  if (use_2q) {
+    auto g = ghost_map.find(ghost_key_t(o->key, offset));
+    if (g != ghost_map.end()) {
+      dout(20) << __func__ << " " << o->oid << " " << offset << "~" << length
+	       << " was a ghost, promoting" << dendl;
+      ghost_bytes -= g->second->second;
+      ghost_list.erase(g->second);
+      ghost_map.erase(g);
+      b->hot = true;
+    }
+  } else {
+    b->hot = true;
+  }
+  if (b->hot) {
+    buffer_hot.push_front(*b);
+  } else {
+    buffer_warm.push_front(*b);
+    buffer_warm_bytes += length;
+  }
+  o->buffer_map[offset] = b;
+  buffer_bytes += length;
+  logger->inc(l_bluestore_buffers);
+  logger->inc(l_bluestore_buffer_bytes, length);
+}
+
+void BlueStore::Cache::_rm_buffer(Buffer *b, bool ghost)
+{
+  uint64_t length = b->data.length();
+  if (b->hot) {
+    buffer_lru_list_t::iterator p = buffer_hot.iterator_to(*b);
+    buffer_hot.erase(p);
+  } else {
+    buffer_lru_list_t::iterator p = buffer_warm.iterator_to(*b);
+    buffer_warm.erase(p);
+    buffer_warm_bytes -= length;
+    if (ghost && use_2q) {
+      ghost_key_t key(b->onode->key, b->offset);
+      if (ghost_map.count(key) == 0) {
+	ghost_list.push_front(make_pair(key, length));
+	ghost_map[key] = ghost_list.begin();
+	ghost_bytes += length;
+      }
+    }
+  }
+  b->onode->buffer_map.erase(b->offset);
+  buffer_bytes -= length;
+  logger->dec(l_bluestore_buffers);
+  logger->dec(l_bluestore_buffer_bytes, length);
+  delete b;
+}
+
+void BlueStore::Cache::_discard_buffers(Onode *o, uint64_t offset,
+					uint64_t length)
+{
+  uint64_t end = length > (uint64_t)-1 - offset ? (uint64_t)-1
+    : offset + length;
+  map<uint64_t,Buffer*>::iterator p = o->buffer_map.lower_bound(offset);
+  if (p != o->buffer_map.begin()) {
+    map<uint64_t,Buffer*>::iterator q = p;
+    --q;
+    if (q->second->end() > offset)
+      p = q;
+  }
+  while (p != o->buffer_map.end() && p->first < end) {
+    Buffer *b = p->second;
+    ++p;
+    _rm_buffer(b, false);
+  }
+}
+
+bool BlueStore::Cache::read(Onode *o, uint64_t offset, uint64_t length,
+			    bufferlist *bl)
 {
   std::lock_guard<std::mutex> l(lock);
+  if (!o->owner || !_read_buffers(o, offset, length, bl)) {
+    logger->inc(l_bluestore_buffer_miss_bytes, length);
+    return false;
+  }
+  dout(20) << __func__ << " " << o->oid << " " << offset << "~" << length
+	   << " hit" << dendl;
+  logger->inc(l_bluestore_buffer_hit_bytes, length);
+  return true;
+}
+
+void BlueStore::Cache::add(Onode *o, uint64_t offset, bufferlist& bl)
+{
+  std::lock_guard<std::mutex> l(lock);
+  // only cache data for onodes we are tracking; anything else would
+  // outlive its accounting
+  if (!o->owner)
+    return;
+  // a single read larger than the data budget would only flush the cache
+  if (bl.length() > max_bytes * (1.0 - g_conf->bluestore_cache_meta_ratio))
+    return;
+  dout(20) << __func__ << " " << o->oid << " " << offset << "~"
+	   << bl.length() << dendl;
+  _add_buffer(o, offset, bl);
+  _trim();
+}
+
+void BlueStore::Cache::trim()
+{
+  std::lock_guard<std::mutex> l(lock);
+  _trim();
+}
+
+void BlueStore::Cache::_trim()
+{
+  uint64_t onode_max = max_bytes * g_conf->bluestore_cache_meta_ratio;
+  dout(20) << __func__ << " onodes " << onode_lru.size() << " " << onode_bytes
+	   << "/" << onode_max << " buffers " << buffer_bytes << dendl;
+
+  // onodes, oldest first; skip any that are in use
+  onode_lru_list_t::iterator p = onode_lru.end();
+  while (onode_bytes > onode_max && p != onode_lru.begin()) {
+    --p;
+    Onode *o = &*p;
+    int refs = o->nref.load();
+    if (refs > 1) {
+      dout(20) << __func__ << "  " << o->oid << " has " << refs
+	       << " refs; skipping" << dendl;
+      continue;
+    }
+    dout(30) << __func__ << "  trim " << o->oid << dendl;
+    ++p;  // keep our place; o is about to be unlinked
+    OnodeHashLRU *owner = o->owner;
+    o->get();  // paranoia
+    _rm_onode(o);
+    owner->_rm(o);
+    o->put();
+  }
+
+  // data gets whatever the onodes are not using
+  uint64_t buffer_max = max_bytes - MIN(onode_bytes, onode_max);
+  uint64_t warm_max = buffer_max * g_conf->bluestore_2q_cache_kin_ratio;
+  while (buffer_bytes > buffer_max) {
+    Buffer *b;
+    if (!buffer_warm.empty() &&
+	(buffer_warm_bytes > warm_max || buffer_hot.empty())) {
+      b = &*buffer_warm.rbegin();
+    } else if (!buffer_hot.empty()) {
+      b = &*buffer_hot.rbegin();
+    } else {
+      break;
+    }
+    dout(30) << __func__ << "  trim " << b->onode->oid << " " << b->offset
+	     << "~" << b->data.length() << dendl;
+    _rm_buffer(b, true);
+  }
+
+  uint64_t ghost_max = buffer_max * g_conf->bluestore_2q_cache_kout_ratio;
+  while (ghost_bytes > ghost_max && !ghost_list.empty()) {
+    ghost_bytes -= ghost_list.back().second;
+    ghost_map.erase(ghost_list.back().first);
+    ghost_list.pop_back();
+  }
+}
+
+// OnodeHashLRU
+
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.lru(" << this << ") "
+
+void BlueStore::OnodeHashLRU::add(const ghobject_t& oid, OnodeRef o)
+{
+  std::lock_guard<std::mutex> l(cache->lock);
   dout(30) << __func__ << " " << oid << " " << o << dendl;
   assert(onode_map.count(oid) == 0);
   onode_map[oid] = o;
-  lru.push_front(*o);
+  o->owner = this;
+  cache->_add_onode(o.get());
+  cache->logger->inc(l_bluestore_onode_misses);
 }
 
 BlueStore::OnodeRef BlueStore::OnodeHashLRU::lookup(const ghobject_t& oid)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> l(cache->lock);
   dout(30) << __func__ << dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
   if (p == onode_map.end()) {
@@ -508,22 +787,27 @@ BlueStore::OnodeRef BlueStore::OnodeHashLRU::lookup(const ghobject_t& oid)
     return OnodeRef();
   }
   dout(30) << __func__ << " " << oid << " hit " << p->second << dendl;
-  _touch(p->second);
+  cache->_touch_onode(p->second.get());
+  cache->logger->inc(l_bluestore_onode_hits);
   return p->second;
 }
 
 void BlueStore::OnodeHashLRU::clear()
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> l(cache->lock);
   dout(10) << __func__ << dendl;
-  lru.clear();
+  for (ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.begin();
+       p != onode_map.end();
+       ++p) {
+    cache->_rm_onode(p->second.get());
+  }
   onode_map.clear();
 }
 
 void BlueStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
 				    const ghobject_t& new_oid)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> l(cache->lock);
   dout(30) << __func__ << " " << old_oid << " -> " << new_oid << dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
   po = onode_map.find(old_oid);
@@ -533,19 +817,19 @@ void BlueStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
   assert(po != onode_map.end());
   if (pn != onode_map.end()) {
     dout(30) << __func__ << "  removing target " << pn->second << dendl;
-    lru_list_t::iterator p = lru.iterator_to(*pn->second);
-    lru.erase(p);
+    cache->_rm_onode(pn->second.get());
     onode_map.erase(pn);
   }
   OnodeRef o = po->second;
 
   // install a non-existent onode at old location
   po->second.reset(new Onode(old_oid, o->key));
-  lru.push_back(*po->second);
+  po->second->owner = this;
+  cache->_add_onode(po->second.get());
 
   // add at new position and fix oid, key
   onode_map.insert(make_pair(new_oid, o));
-  _touch(o);
+  cache->_touch_onode(o.get());
   o->oid = new_oid;
   get_object_key(new_oid, &o->key);
 }
@@ -554,67 +838,30 @@ bool BlueStore::OnodeHashLRU::get_next(
   const ghobject_t& after,
   pair<ghobject_t,OnodeRef> *next)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> l(cache->lock);
   dout(20) << __func__ << " after " << after << dendl;
 
+  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p;
   if (after == ghobject_t()) {
-    if (lru.empty()) {
-      return false;
-    }
-    ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.begin();
+    p = onode_map.begin();
+  } else {
+    // the caller holds a ref to after, so it cannot have been trimmed
+    p = onode_map.find(after);
     assert(p != onode_map.end());
-    next->first = p->first;
-    next->second = p->second;
-    return true;
+    ++p;
   }
-
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(after);
-  assert(p != onode_map.end()); // for now
-  lru_list_t::iterator pi = lru.iterator_to(*p->second);
-  ++pi;
-  if (pi == lru.end()) {
+  if (p == onode_map.end()) {
     return false;
   }
-  next->first = pi->oid;
-  next->second = onode_map[pi->oid];
+  next->first = p->first;
+  next->second = p->second;
   return true;
 }
 
-int BlueStore::OnodeHashLRU::trim(int max)
+void BlueStore::OnodeHashLRU::_rm(Onode *o)
 {
-  std::lock_guard<std::mutex> l(lock);
-  dout(20) << __func__ << " max " << max
-	   << " size " << onode_map.size() << dendl;
-  int trimmed = 0;
-  int num = onode_map.size() - max;
-  if (onode_map.size() == 0 || num <= 0)
-    return 0; // don't even try
-  
-  lru_list_t::iterator p = lru.end();
-  if (num)
-    --p;
-  while (num > 0) {
-    Onode *o = &*p;
-    int refs = o->nref.load();
-    if (refs > 1) {
-      dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs; stopping with " << num << " left to trim" << dendl;
-      break;
-    }
-    dout(30) << __func__ << "  trim " << o->oid << dendl;
-    if (p != lru.begin()) {
-      lru.erase(p--);
-    } else {
-      lru.erase(p);
-      assert(num == 1);
-    }
-    o->get();  // paranoia
-    onode_map.erase(o->oid);
-    o->put();
-    --num;
-    ++trimmed;
-  }
-  return trimmed;
+  dout(30) << __func__ << " " << o->oid << dendl;
+  onode_map.erase(o->oid);
 }
 
 // =======================================================
@@ -629,7 +876,9 @@ BlueStore::Collection::Collection(BlueStore *ns, coll_t c)
     cid(c),
     lock("BlueStore::Collection::lock", true, false),
     exists(true),
-    onode_map(),
+    cache(ns->cache_shards[std::hash<string>()(c.to_str()) %
+			   ns->cache_shards.size()]),
+    onode_map(cache),
     enode_set(g_conf->bluestore_onode_map_size)
 {
 }
@@ -748,6 +997,10 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
     bdev(NULL),
     fm(NULL),
     alloc(NULL),
+    csum_type(bluestore_extent_t::CSUM_NONE),
+    csum_chunk_order(0),
+    async_compressor(NULL),
+    async_comp_alg(bluestore_extent_t::COMP_ALG_NONE),
     path_fd(-1),
     fsid_fd(-1),
     mounted(false),
@@ -773,15 +1026,37 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
 	     cct->_conf->bluestore_wal_thread_suicide_timeout,
 	     &wal_tp),
     finisher(cct),
+    readahead(cct),
+    readahead_finisher(cct, "readahead", "bstore_readahd"),
     kv_sync_thread(this),
     kv_stop(false),
+    kv_finalize_thread(this),
+    kv_finalize_stop(false),
+    kv_finalize_in_progress(false),
     logger(NULL)
 {
   _init_logger();
+  int num_shards = MAX(cct->_conf->bluestore_cache_shards, 1);
+  bool use_2q = cct->_conf->bluestore_cache_type == "2q";
+  if (!use_2q && cct->_conf->bluestore_cache_type != "lru") {
+    derr << __func__ << " unrecognized bluestore_cache_type '"
+	 << cct->_conf->bluestore_cache_type << "', using lru" << dendl;
+  }
+  for (int i = 0; i < num_shards; ++i) {
+    cache_shards.push_back(
+      new Cache(logger, cct->_conf->bluestore_cache_size / num_shards,
+		use_2q));
+  }
 }
 
 BlueStore::~BlueStore()
 {
+  for (vector<Cache*>::iterator p = cache_shards.begin();
+       p != cache_shards.end();
+       ++p) {
+    delete *p;
+  }
+  cache_shards.clear();
   _shutdown_logger();
   assert(!mounted);
   assert(db == NULL);
@@ -806,6 +1081,26 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_state_wal_done_lat, "state_wal_done_lat", "Average wal_done state latency");
   b.add_time_avg(l_bluestore_state_finishing_lat, "state_finishing_lat", "Average finishing state latency");
   b.add_time_avg(l_bluestore_state_done_lat, "state_done_lat", "Average done state latency");
+  b.add_time_avg(l_bluestore_compress_lat, "compress_lat", "Average compress latency");
+  b.add_time_avg(l_bluestore_decompress_lat, "decompress_lat", "Average decompress latency");
+  b.add_u64(l_bluestore_compress_success_count, "compress_success_count", "Sum for allocation units stored compressed");
+  b.add_u64(l_bluestore_compress_rejected_count, "compress_rejected_count", "Sum for allocation units that did not compress well enough");
+  b.add_u64(l_bluestore_onodes, "onodes", "Number of onodes in cache");
+  b.add_u64(l_bluestore_onode_bytes, "onode_bytes", "Estimated bytes of onodes in cache");
+  b.add_u64_counter(l_bluestore_onode_hits, "onode_hits", "Sum for onode lookups hitting the cache");
+  b.add_u64_counter(l_bluestore_onode_misses, "onode_misses", "Sum for onode lookups missing the cache");
+  b.add_u64(l_bluestore_buffers, "buffers", "Number of data buffers in cache");
+  b.add_u64(l_bluestore_buffer_bytes, "buffer_bytes", "Bytes of data buffers in cache");
+  b.add_u64_counter(l_bluestore_buffer_hit_bytes, "buffer_hit_bytes", "Sum for bytes of reads served from cache");
+  b.add_u64_counter(l_bluestore_buffer_miss_bytes, "buffer_miss_bytes", "Sum for bytes of reads not served from cache");
+  b.add_u64_counter(l_bluestore_wal_write_ops, "wal_write_ops", "Sum for wal write ops applied");
+  b.add_u64_counter(l_bluestore_wal_write_ios, "wal_write_ios", "Sum for device writes issued by wal write ops, after merging");
+  b.add_u64_avg(l_bluestore_wal_batch_txcs, "wal_batch_txcs", "Average transactions per wal apply batch");
+  b.add_time_avg(l_bluestore_kv_lat, "kv_lat", "Average kv sync thread commit cycle latency");
+  b.add_time_avg(l_bluestore_kv_flush_lat, "kv_flush_lat", "Average kv sync thread block device flush latency");
+  b.add_time_avg(l_bluestore_kv_commit_lat, "kv_commit_lat", "Average kv sync thread submit and sync latency");
+  b.add_time_avg(l_bluestore_kv_finalize_lat, "kv_finalize_lat", "Average kv finalize thread completion latency");
+  b.add_u64_counter(l_bluestore_readahead_bytes, "readahead_bytes", "Sum for bytes prefetched into the cache for sequential readers");
   logger = b.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
 }
@@ -979,25 +1274,69 @@ void BlueStore::_close_bdev()
   bdev = NULL;
 }
 
-int BlueStore::_open_alloc()
+int BlueStore::_open_alloc(bool create)
 {
   assert(fm == NULL);
   assert(alloc == NULL);
-  fm = new FreelistManager();
-  int r = fm->init(db, PREFIX_ALLOC);
+  string freelist_type;
+  int r;
+  if (create) {
+    freelist_type = g_conf->bluestore_freelist_type;
+    if (freelist_type == "bitmap" && g_conf->bluestore_backend != "rocksdb") {
+      derr << __func__ << " bitmap freelist requires the rocksdb backend"
+	   << dendl;
+      return -EINVAL;
+    }
+    r = write_meta("freelist_type", freelist_type);
+    if (r < 0)
+      return r;
+  } else {
+    r = read_meta("freelist_type", &freelist_type);
+    if (r == -ENOENT) {
+      freelist_type = "extent";  // created before freelist_type was recorded
+    } else if (r < 0) {
+      derr << __func__ << " unable to read 'freelist_type' meta" << dendl;
+      return -EIO;
+    }
+  }
+  dout(10) << __func__ << " freelist_type = " << freelist_type << dendl;
+
+  fm = FreelistManager::create(freelist_type, db, PREFIX_ALLOC,
+			       PREFIX_ALLOC_BITMAP);
+  if (!fm)
+    return -EINVAL;
+  if (create) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    r = fm->create(bdev->get_size(), bdev->get_block_size(), t);
+    if (r < 0) {
+      delete fm;
+      fm = NULL;
+      return r;
+    }
+    db->submit_transaction_sync(t);
+  }
+  r = fm->init();
   if (r < 0) {
     delete fm;
     fm = NULL;
     return r;
   }
 
-  alloc = Allocator::create("stupid");
+  alloc = Allocator::create(g_conf->bluestore_allocator,
+			    bdev->get_size(), bdev->get_block_size());
+  if (!alloc) {
+    fm->shutdown();
+    delete fm;
+    fm = NULL;
+    return -EINVAL;
+  }
   uint64_t num = 0, bytes = 0;
-  const auto& fl = fm->get_freelist();
-  for (auto& p : fl) {
-    alloc->init_add_free(p.first, p.second);
+  uint64_t offset, length;
+  fm->enumerate_reset();
+  while (fm->enumerate_next(&offset, &length)) {
+    alloc->init_add_free(offset, length);
     ++num;
-    bytes += p.second;
+    bytes += length;
   }
   dout(10) << __func__ << " loaded " << pretty_si_t(bytes)
 	   << " in " << num << " extents"
@@ -1017,6 +1356,96 @@ void BlueStore::_close_alloc()
   fm = NULL;
 }
 
+int BlueStore::_set_csum()
+{
+  int t = bluestore_extent_t::get_csum_string_type(
+    g_conf->bluestore_csum_type);
+  if (t < 0) {
+    derr << __func__ << " unrecognized bluestore_csum_type '"
+	 << g_conf->bluestore_csum_type << "'" << dendl;
+    return -EINVAL;
+  }
+  uint64_t chunk = g_conf->bluestore_csum_block_size;
+  uint64_t block_size = bdev->get_block_size();
+  if (chunk < block_size || (chunk & (chunk - 1)) ||
+      chunk > g_conf->bluestore_min_alloc_size) {
+    derr << __func__ << " bluestore_csum_block_size " << chunk
+	 << " must be a power of 2 between " << block_size
+	 << " and bluestore_min_alloc_size; using " << block_size << dendl;
+    chunk = block_size;
+  }
+  csum_type = t;
+  csum_chunk_order = __builtin_ctzll(chunk);
+  dout(10) << __func__ << " csum_type "
+	   << bluestore_extent_t::get_csum_type_string(csum_type)
+	   << " chunk size " << chunk << dendl;
+  return 0;
+}
+
+void BlueStore::_open_compressor()
+{
+  assert(async_compressor == NULL);
+  int alg = bluestore_extent_t::get_comp_alg_type(
+    g_conf->async_compressor_type);
+  if (alg <= 0 || !_get_compressor(alg)) {
+    derr << __func__ << " unusable async_compressor_type '"
+	 << g_conf->async_compressor_type << "', async compression disabled"
+	 << dendl;
+    return;
+  }
+  async_comp_alg = alg;
+  async_compressor = new AsyncCompressor(g_ceph_context);
+  async_compressor->init();
+  dout(10) << __func__ << " " << g_conf->async_compressor_type << dendl;
+}
+
+void BlueStore::_close_compressor()
+{
+  if (async_compressor) {
+    async_compressor->terminate();
+    delete async_compressor;
+    async_compressor = NULL;
+  }
+  async_comp_alg = bluestore_extent_t::COMP_ALG_NONE;
+  std::lock_guard<std::mutex> l(compressor_lock);
+  compressors.clear();
+}
+
+CompressorRef BlueStore::_get_compressor(int alg)
+{
+  std::lock_guard<std::mutex> l(compressor_lock);
+  map<int,CompressorRef>::iterator p = compressors.find(alg);
+  if (p != compressors.end())
+    return p->second;
+  CompressorRef cp = Compressor::create(
+    g_ceph_context, bluestore_extent_t::get_comp_alg_name(alg));
+  if (cp)
+    compressors[alg] = cp;
+  return cp;
+}
+
+int BlueStore::_compress(int alg, bufferlist& in, bufferlist *out)
+{
+  CompressorRef cp = _get_compressor(alg);
+  if (!cp)
+    return -EOPNOTSUPP;
+  return cp->compress(in, *out);
+}
+
+int BlueStore::_decompress(int alg, bufferlist& in, bufferlist *out)
+{
+  // a single synchronous request gains nothing from the compressor
+  // threads, so only _do_write_compressed hands work to them
+  CompressorRef cp = _get_compressor(alg);
+  if (!cp)
+    return -EOPNOTSUPP;
+  utime_t start = ceph_clock_now(g_ceph_context);
+  int r = cp->decompress(in, *out);
+  logger->tinc(l_bluestore_decompress_lat,
+	       ceph_clock_now(g_ceph_context) - start);
+  return r;
+}
+
 int BlueStore::_open_fsid(bool create)
 {
   assert(fsid_fd < 0);
@@ -1336,8 +1765,26 @@ int BlueStore::_open_db(bool create)
     return -EIO;
   }
   
-  if (kv_backend == "rocksdb")
+  if (kv_backend == "rocksdb") {
     options = g_conf->bluestore_rocksdb_options;
+    // space separated prefix:options pairs
+    list<string> cfs;
+    get_str_list(g_conf->bluestore_rocksdb_cfs, " \t", cfs);
+    for (auto& p : cfs) {
+      size_t pos = p.find(':');
+      string prefix = p.substr(0, pos);
+      string cf_options = pos == string::npos ? string() : p.substr(pos + 1);
+      r = db->set_column_family(prefix, cf_options);
+      if (r < 0) {
+	derr << __func__ << " ignoring column family '" << p << "': "
+	     << cpp_strerror(r) << dendl;
+      } else {
+	dout(10) << __func__ << " column family " << prefix << " options "
+		 << cf_options << dendl;
+      }
+    }
+  }
+  FreelistManager::setup_merge_operators(db, PREFIX_ALLOC_BITMAP);
   db->init(options);
   if (create)
     r = db->create_and_open(err);
@@ -1730,7 +2177,7 @@ int BlueStore::mkfs()
   if (r < 0)
     goto out_close_bdev;
 
-  r = _open_alloc();
+  r = _open_alloc(true);
   if (r < 0)
     goto out_close_db;
 
@@ -1816,7 +2263,7 @@ int BlueStore::mount()
   dout(1) << __func__ << " path " << path << dendl;
 
   if (g_conf->bluestore_fsck_on_mount) {
-    int rc = fsck();
+    int rc = fsck(g_conf->bluestore_fsck_on_mount_deep);
     if (rc < 0)
       return rc;
     if (rc > 0) {
@@ -1844,11 +2291,15 @@ int BlueStore::mount()
   if (r < 0)
     goto out_fsid;
 
+  r = _set_csum();
+  if (r < 0)
+    goto out_bdev;
+
   r = _open_db(false);
   if (r < 0)
     goto out_bdev;
 
-  r = _open_alloc();
+  r = _open_alloc(false);
   if (r < 0)
     goto out_db;
 
@@ -1867,8 +2318,11 @@ int BlueStore::mount()
   }
 
   finisher.start();
+  readahead_finisher.start();
   wal_tp.start();
   kv_sync_thread.create("bstore_kv_sync");
+  kv_finalize_thread.create("bstore_kv_final");
+  _open_compressor();
 
   r = _wal_replay();
   if (r < 0)
@@ -1878,11 +2332,14 @@ int BlueStore::mount()
   return 0;
 
  out_stop:
+  _close_compressor();
   _kv_stop();
   wal_wq.drain();
   wal_tp.stop();
   finisher.wait_for_empty();
   finisher.stop();
+  readahead_finisher.wait_for_empty();
+  readahead_finisher.stop();
  out_coll:
   coll_map.clear();
  out_alloc:
@@ -1903,6 +2360,11 @@ int BlueStore::umount()
   assert(mounted);
   dout(1) << __func__ << dendl;
 
+  dout(20) << __func__ << " draining readahead" << dendl;
+  readahead_finisher.wait_for_empty();
+  readahead_finisher.stop();
+  readahead.clear();
+
   _sync();
   _reap_collections();
   coll_map.clear();
@@ -1913,6 +2375,8 @@ int BlueStore::umount()
   wal_wq.drain();
   dout(20) << __func__ << " stopping wal_tp" << dendl;
   wal_tp.stop();
+  dout(20) << __func__ << " stopping compressor" << dendl;
+  _close_compressor();
   dout(20) << __func__ << " draining finisher" << dendl;
   finisher.wait_for_empty();
   dout(20) << __func__ << " stopping finisher" << dendl;
@@ -1927,7 +2391,7 @@ int BlueStore::umount()
   _close_path();
 
   if (g_conf->bluestore_fsck_on_umount) {
-    int rc = fsck();
+    int rc = fsck(g_conf->bluestore_fsck_on_umount_deep);
     if (rc < 0)
       return rc;
     if (rc > 0) {
@@ -1940,16 +2404,16 @@ int BlueStore::umount()
 
 int BlueStore::_verify_enode_shared(
   EnodeRef enode,
-  vector<bluestore_extent_t>& v)
+  vector<bluestore_extent_t>& v,
+  interval_set<uint64_t> *span)
 {
   int errors = 0;
-  interval_set<uint64_t> span;
   bluestore_extent_ref_map_t ref_map;
   dout(10) << __func__ << " hash " << enode->hash << " v " << v << dendl;
   for (auto& p : v) {
     interval_set<uint64_t> t, i;
-    t.insert(p.offset, p.length);
-    i.intersection_of(t, span);
+    t.insert(p.offset, p.get_disk_length());
+    i.intersection_of(t, *span);
     t.subtract(i);
     dout(20) << __func__ << "  extent " << p << " t " << t << " i " << i
 	     << dendl;
@@ -1959,25 +2423,327 @@ int BlueStore::_verify_enode_shared(
     for (interval_set<uint64_t>::iterator q = i.begin(); q != i.end(); ++q) {
       ref_map.get(q.get_start(), q.get_len());
     }
-    span.insert(t);
-  }
-  if (enode->ref_map != ref_map) {
-    derr << " hash " << enode->hash << " ref_map " << enode->ref_map
-	 << " != expected " << ref_map << dendl;
-    ++errors;
+    span->insert(t);
+  }
+  if (enode->ref_map != ref_map) {
+    derr << " hash " << enode->hash << " ref_map " << enode->ref_map
+	 << " != expected " << ref_map << dendl;
+    ++errors;
+  }
+  return errors;
+}
+
+/*
+ * Shared state for one fsck run.  Used space is tracked in a bitmap
+ * with one bit per device block, updated with atomic ors so that the
+ * collection workers never need a common lock for it; a bit that is
+ * already set when we try to set it is a double allocation.
+ */
+struct BlueStore::FsckState {
+  bool deep;
+  unsigned block_order;
+  uint64_t num_blocks;
+  std::unique_ptr<std::atomic<uint64_t>[]> used_blocks;
+
+  std::mutex lock;  ///< protects used_nids, used_omap_head, phase
+  set<uint64_t> used_nids;
+  set<uint64_t> used_omap_head;
+  string phase;
+
+  std::atomic<int> errors = {0};
+  std::atomic<uint64_t> num_objects = {0};
+  std::atomic<unsigned> collections_done = {0};
+  unsigned num_collections = 0;
+  utime_t start;
+
+  FsckState(bool d, uint64_t size, uint64_t block_size)
+    : deep(d), block_order(0) {
+    while ((1ull << block_order) < block_size)
+      ++block_order;
+    num_blocks = ROUND_UP_TO(size, block_size) >> block_order;
+    uint64_t words = (num_blocks + 63) / 64;
+    used_blocks.reset(new std::atomic<uint64_t>[words]);
+    for (uint64_t i = 0; i < words; ++i)
+      used_blocks[i] = 0;
+    start = ceph_clock_now(NULL);
+  }
+
+  void set_phase(const string& p) {
+    std::lock_guard<std::mutex> l(lock);
+    phase = p;
+  }
+
+  void dump(Formatter *f) {
+    std::lock_guard<std::mutex> l(lock);
+    f->open_object_section("fsck");
+    f->dump_string("phase", phase);
+    f->dump_bool("deep", deep);
+    f->dump_unsigned("collections_done", collections_done.load());
+    f->dump_unsigned("collections", num_collections);
+    f->dump_unsigned("objects", num_objects.load());
+    f->dump_int("errors", errors.load());
+    f->dump_stream("elapsed") << (ceph_clock_now(NULL) - start);
+    f->close_section();
+  }
+};
+
+class BlueStore::FsckHook : public AdminSocketHook {
+  FsckState *st;
+public:
+  explicit FsckHook(FsckState *s) : st(s) {}
+  bool call(std::string command, cmdmap_t& cmdmap, std::string format,
+	    bufferlist& out) {
+    Formatter *f = Formatter::create(format, "json-pretty", "json-pretty");
+    st->dump(f);
+    stringstream ss;
+    f->flush(ss);
+    delete f;
+    out.append(ss);
+    return true;
+  }
+};
+
+bool BlueStore::_fsck_mark_used(FsckState& st, uint64_t offset,
+				uint64_t length)
+{
+  uint64_t b = offset >> st.block_order;
+  uint64_t e = MIN(
+    (offset + length + (1ull << st.block_order) - 1) >> st.block_order,
+    st.num_blocks);
+  bool ok = true;
+  while (b < e) {
+    uint64_t bit = b & 63;
+    uint64_t cnt = MIN(64 - bit, e - b);
+    uint64_t mask = cnt == 64 ? ~0ull : ((1ull << cnt) - 1) << bit;
+    uint64_t prev = st.used_blocks[b >> 6].fetch_or(mask);
+    if (prev & mask)
+      ok = false;
+    b += cnt;
+  }
+  return ok;
+}
+
+int BlueStore::_fsck_enode(FsckState& st, EnodeRef enode,
+			   vector<bluestore_extent_t>& hash_shared)
+{
+  interval_set<uint64_t> span;
+  int errors = _verify_enode_shared(enode, hash_shared, &span);
+  // shared extents are referenced by several onodes; count their
+  // union once per enode.
+  for (auto p = span.begin(); p != span.end(); ++p) {
+    if (!_fsck_mark_used(st, p.get_start(), p.get_len())) {
+      derr << " hash " << enode->hash << " shared extent " << p.get_start()
+	   << "~" << p.get_len() << " already allocated" << dendl;
+      ++errors;
+    }
+  }
+  return errors;
+}
+
+int BlueStore::_fsck_onode(FsckState& st, const ghobject_t& oid,
+			   const bluestore_onode_t& onode,
+			   vector<bluestore_extent_t> *hash_shared)
+{
+  int errors = 0;
+  if (onode.nid) {
+    std::lock_guard<std::mutex> l(st.lock);
+    if (!st.used_nids.insert(onode.nid).second) {
+      derr << " " << oid << " nid " << onode.nid << " already in use"
+	   << dendl;
+      return 1;
+    }
+  }
+  // blocks
+  for (auto& b : onode.block_map) {
+    if (b.second.end() > bdev->get_size()) {
+      derr << " " << oid << " extent " << b.first << ": " << b.second
+	   << " past end of block device" << dendl;
+      ++errors;
+      continue;
+    }
+    if (b.second.has_flag(bluestore_extent_t::FLAG_SHARED)) {
+      hash_shared->push_back(b.second);
+      continue;
+    }
+    if (!_fsck_mark_used(st, b.second.offset, b.second.get_disk_length())) {
+      derr << " " << oid << " extent " << b.first << ": " << b.second
+	   << " already allocated" << dendl;
+      ++errors;
+    }
+  }
+  // overlays
+  set<string> overlay_keys;
+  map<uint64_t,int> refs;
+  for (auto& v : onode.overlay_map) {
+    if (v.first + v.second.length > onode.size) {
+      derr << " " << oid << " overlay " << v.first << " " << v.second
+	   << " extends past end of object" << dendl;
+      ++errors;
+      continue; // go for next overlay
+    }
+    if (v.second.key > onode.last_overlay_key) {
+      derr << " " << oid << " overlay " << v.first << " " << v.second
+	   << " is > last_overlay_key " << onode.last_overlay_key
+	   << dendl;
+      ++errors;
+      continue; // go for next overlay
+    }
+    ++refs[v.second.key];
+    if (!st.deep)
+      continue;
+    string key;
+    bufferlist val;
+    get_overlay_key(onode.nid, v.second.key, &key);
+    overlay_keys.insert(key);
+    int r = db->get(PREFIX_OVERLAY, key, &val);
+    if (r < 0) {
+      derr << " " << oid << " overlay " << v.first << " " << v.second
+	   << " failed to fetch: " << cpp_strerror(r) << dendl;
+      ++errors;
+      continue;
+    }
+    if (val.length() < v.second.value_offset + v.second.length) {
+      derr << " " << oid << " overlay " << v.first << " " << v.second
+	   << " too short, " << val.length() << dendl;
+      ++errors;
+    }
+  }
+  for (auto& vr : onode.overlay_refs) {
+    if (refs[vr.first] != vr.second) {
+      derr << " " << oid << " overlay key " << vr.first
+	   << " says " << vr.second << " refs but we have "
+	   << refs[vr.first] << dendl;
+      ++errors;
+    }
+    refs.erase(vr.first);
+  }
+  for (auto& p : refs) {
+    if (p.second > 1) {
+      derr << " " << oid << " overlay key " << p.first
+	   << " has " << p.second << " refs but they are not recorded"
+	   << dendl;
+      ++errors;
+    }
+  }
+  if (st.deep) {
+    string start;
+    get_overlay_key(onode.nid, 0, &start);
+    KeyValueDB::Iterator it = db->get_iterator(PREFIX_OVERLAY);
+    for (it->lower_bound(start); it->valid(); it->next()) {
+      string k = it->key();
+      const char *p = k.c_str();
+      uint64_t nid;
+      p = _key_decode_u64(p, &nid);
+      if (nid != onode.nid)
+	break;
+      if (!overlay_keys.count(k)) {
+	derr << " " << oid << " has stray overlay kv pair for "
+	     << k << dendl;
+	++errors;
+      }
+    }
+  }
+  // omap
+  if (onode.omap_head) {
+    {
+      std::lock_guard<std::mutex> l(st.lock);
+      if (!st.used_omap_head.insert(onode.omap_head).second) {
+	derr << " " << oid << " omap_head " << onode.omap_head
+	     << " already in use" << dendl;
+	return errors + 1;
+      }
+    }
+    if (st.deep) {
+      KeyValueDB::Iterator it = db->get_iterator(PREFIX_OMAP);
+      string head, tail;
+      get_omap_header(onode.omap_head, &head);
+      get_omap_tail(onode.omap_head, &tail);
+      for (it->lower_bound(head); it->valid(); it->next()) {
+	if (it->key() == head) {
+	  dout(30) << __func__ << "  got header" << dendl;
+	} else if (it->key() >= tail) {
+	  dout(30) << __func__ << "  reached tail" << dendl;
+	  break;
+	} else {
+	  string user_key;
+	  decode_omap_key(it->key(), &user_key);
+	  dout(30) << __func__
+		   << "  got " << pretty_binary_string(it->key())
+		   << " -> " << user_key << dendl;
+	}
+      }
+    }
   }
   return errors;
 }
 
-int BlueStore::fsck()
+void BlueStore::_fsck_collection(FsckState& st, CollectionRef c)
 {
-  dout(1) << __func__ << dendl;
+  dout(1) << __func__ << " collection " << c->cid << dendl;
+  RWLock::RLocker l(c->lock);
+  string temp_start, temp_end, start, end;
+  get_coll_key_range(c->cid, c->cnode.bits, &temp_start, &temp_end,
+		     &start, &end);
+  const pair<string,string> ranges[2] = {
+    make_pair(temp_start, temp_end),
+    make_pair(start, end)
+  };
+
+  // decode onodes straight from the iterator; going through the onode
+  // cache would load (and then trim) every object in the store.
   int errors = 0;
-  set<uint64_t> used_nids;
-  set<uint64_t> used_omap_head;
-  interval_set<uint64_t> used_blocks;
-  KeyValueDB::Iterator it;
+  EnodeRef enode;
   vector<bluestore_extent_t> hash_shared;
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OBJ);
+  for (auto& range : ranges) {
+    for (it->upper_bound(range.first);
+	 it->valid() && it->key() <= range.second;
+	 it->next()) {
+      if (is_enode_key(it->key()))
+	continue;
+      ghobject_t oid;
+      if (get_key_object(it->key(), &oid) < 0) {
+	derr << __func__ << " bad object key "
+	     << pretty_binary_string(it->key()) << dendl;
+	++errors;
+	continue;
+      }
+      dout(10) << __func__ << "  " << oid << dendl;
+      bluestore_onode_t onode;
+      bufferlist bl = it->value();
+      bufferlist::iterator p = bl.begin();
+      try {
+	::decode(onode, p);
+      } catch (buffer::error& e) {
+	derr << __func__ << " " << oid << " failed to decode onode" << dendl;
+	++errors;
+	continue;
+      }
+      ++st.num_objects;
+      if (!enode || enode->hash != oid.hobj.get_hash()) {
+	if (enode)
+	  errors += _fsck_enode(st, enode, hash_shared);
+	enode = c->get_enode(oid.hobj.get_hash());
+	hash_shared.clear();
+      }
+      errors += _fsck_onode(st, oid, onode, &hash_shared);
+    }
+  }
+  if (enode)
+    errors += _fsck_enode(st, enode, hash_shared);
+  st.errors += errors;
+  ++st.collections_done;
+}
+
+int BlueStore::fsck(bool deep)
+{
+  dout(1) << __func__ << (deep ? " (deep)" : " (shallow)") << dendl;
+  int errors = 0;
+  KeyValueDB::Iterator it;
+  std::unique_ptr<FsckState> st;
+  std::unique_ptr<FsckHook> hook;
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  bool hook_registered = false;
 
   int r = _open_path();
   if (r < 0)
@@ -2002,7 +2768,7 @@ int BlueStore::fsck()
   if (r < 0)
     goto out_bdev;
 
-  r = _open_alloc();
+  r = _open_alloc(false);
   if (r < 0)
     goto out_db;
 
@@ -2014,9 +2780,25 @@ int BlueStore::fsck()
   if (r < 0)
     goto out_alloc;
 
-  used_blocks.insert(0, BLUEFS_START);
+  st.reset(new FsckState(deep, bdev->get_size(), bdev->get_block_size()));
+  st->num_collections = coll_map.size();
+  hook.reset(new FsckHook(st.get()));
+  if (admin_socket) {
+    // only one fsck at a time can report progress
+    hook_registered = admin_socket->register_command(
+      "bluestore fsck status", "bluestore fsck status", hook.get(),
+      "show progress of a running bluestore fsck") == 0;
+  }
+
+  _fsck_mark_used(*st, 0, BLUEFS_START);
   if (bluefs) {
-    used_blocks.insert(bluefs_extents);
+    for (auto p = bluefs_extents.begin(); p != bluefs_extents.end(); ++p) {
+      if (!_fsck_mark_used(*st, p.get_start(), p.get_len())) {
+	derr << __func__ << " bluefs extent " << p.get_start() << "~"
+	     << p.get_len() << " already allocated" << dendl;
+	++errors;
+      }
+    }
     r = bluefs->fsck();
     if (r < 0) {
       coll_map.clear();
@@ -2027,180 +2809,39 @@ int BlueStore::fsck()
   }
 
   // walk collections, objects
-  for (ceph::unordered_map<coll_t, CollectionRef>::iterator p = coll_map.begin();
-       p != coll_map.end();
-       ++p) {
-    dout(1) << __func__ << " collection " << p->first << dendl;
-    CollectionRef c = _get_collection(p->first);
-    RWLock::RLocker l(c->lock);
-    ghobject_t pos;
-    EnodeRef enode;
-    while (true) {
-      vector<ghobject_t> ols;
-      int r = collection_list(p->first, pos, ghobject_t::get_max(), true,
-			      100, &ols, &pos);
-      if (r < 0) {
-	++errors;
-	break;
-      }
-      if (ols.empty()) {
-	break;
-      }
-      for (auto& oid : ols) {
-	dout(10) << __func__ << "  " << oid << dendl;
-	OnodeRef o = c->get_onode(oid, false);
-	if (!o || !o->exists) {
-	  ++errors;
-	  continue; // go for next object
-	}
-	if (!enode || enode->hash != o->oid.hobj.get_hash()) {
-	  if (enode)
-	    errors += _verify_enode_shared(enode, hash_shared);
-	  enode = c->get_enode(o->oid.hobj.get_hash());
-	  hash_shared.clear();
-	}
-	if (o->onode.nid) {
-	  if (used_nids.count(o->onode.nid)) {
-	    derr << " " << oid << " nid " << o->onode.nid << " already in use"
-		 << dendl;
-	    ++errors;
-	    continue; // go for next object
-	  }
-	  used_nids.insert(o->onode.nid);
-	}
-	// blocks
-	for (auto& b : o->onode.block_map) {
-	  if (b.second.has_flag(bluestore_extent_t::FLAG_SHARED))
-	    hash_shared.push_back(b.second);
-	  if (used_blocks.intersects(b.second.offset, b.second.length)) {
-	    derr << " " << oid << " extent " << b.first << ": " << b.second
-		 << " already allocated" << dendl;
-	    ++errors;
-	    continue;
-	  }
-	  used_blocks.insert(b.second.offset, b.second.length);
-	  if (b.second.end() > bdev->get_size()) {
-	    derr << " " << oid << " extent " << b.first << ": " << b.second
-		 << " past end of block device" << dendl;
-	    ++errors;
-	  }
-	}
-	// overlays
-	set<string> overlay_keys;
-	map<uint64_t,int> refs;
-	for (auto& v : o->onode.overlay_map) {
-	  if (v.first + v.second.length > o->onode.size) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " extends past end of object" << dendl;
-	    ++errors;
-            continue; // go for next overlay
-	  }
-	  if (v.second.key > o->onode.last_overlay_key) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " is > last_overlay_key " << o->onode.last_overlay_key
-		 << dendl;
-	    ++errors;
-            continue; // go for next overlay
-	  }
-	  ++refs[v.second.key];
-	  string key;
-	  bufferlist val;
-	  get_overlay_key(o->onode.nid, v.second.key, &key);
-	  overlay_keys.insert(key);
-	  int r = db->get(PREFIX_OVERLAY, key, &val);
-	  if (r < 0) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " failed to fetch: " << cpp_strerror(r) << dendl;
-	    ++errors;
-            continue;
-	  }
-	  if (val.length() < v.second.value_offset + v.second.length) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " too short, " << val.length() << dendl;
-	    ++errors;
-	  }
-	}
-	for (auto& vr : o->onode.overlay_refs) {
-	  if (refs[vr.first] != vr.second) {
-	    derr << " " << oid << " overlay key " << vr.first
-		 << " says " << vr.second << " refs but we have "
-		 << refs[vr.first] << dendl;
-	    ++errors;
-	  }
-	  refs.erase(vr.first);
-	}
-	for (auto& p : refs) {
-	  if (p.second > 1) {
-	    derr << " " << oid << " overlay key " << p.first
-		 << " has " << p.second << " refs but they are not recorded"
-		 << dendl;
-	    ++errors;
-	  }
-	}
-	do {
-	  string start;
-	  get_overlay_key(o->onode.nid, 0, &start);
-	  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OVERLAY);
-	  if (!it)
-	    break;
-	  for (it->lower_bound(start); it->valid(); it->next()) {
-	    string k = it->key();
-	    const char *p = k.c_str();
-	    uint64_t nid;
-	    p = _key_decode_u64(p, &nid);
-	    if (nid != o->onode.nid)
-	      break;
-	    if (!overlay_keys.count(k)) {
-	      derr << " " << oid << " has stray overlay kv pair for "
-		   << k << dendl;
-	      ++errors;
-	    }
-	  }
-	} while (false);
-	// omap
-	while (o->onode.omap_head) {
-	  if (used_omap_head.count(o->onode.omap_head)) {
-	    derr << " " << oid << " omap_head " << o->onode.omap_head
-		 << " already in use" << dendl;
-	    ++errors;
-	    break;
-	  }
-	  used_omap_head.insert(o->onode.omap_head);
-	  // hrm, scan actual key/value pairs?
-	  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OMAP);
-	  if (!it)
-	    break;
-	  string head, tail;
-	  get_omap_header(o->onode.omap_head, &head);
-	  get_omap_tail(o->onode.omap_head, &tail);
-	  it->lower_bound(head);
-	  while (it->valid()) {
-	    if (it->key() == head) {
-	      dout(30) << __func__ << "  got header" << dendl;
-	    } else if (it->key() >= tail) {
-	      dout(30) << __func__ << "  reached tail" << dendl;
-	      break;
-	    } else {
-	      string user_key;
-	      decode_omap_key(it->key(), &user_key);
-	      dout(30) << __func__
-		       << "  got " << pretty_binary_string(it->key())
-		       << " -> " << user_key << dendl;
-	      assert(it->key() < tail);
-	    }
-	    it->next();
-	  }
-	  break;
-	}
-      }
-    }
-  }
-
-  dout(1) << __func__ << " checking for stray objects" << dendl;
-  it = db->get_iterator(PREFIX_OBJ);
-  if (it) {
+  st->set_phase("collections");
+  {
+    vector<CollectionRef> colls;
+    for (auto& p : coll_map)
+      colls.push_back(p.second);
+    std::atomic<unsigned> next = {0};
+    auto worker = [&]() {
+      unsigned i;
+      while ((i = next++) < colls.size())
+	_fsck_collection(*st, colls[i]);
+    };
+    unsigned num_threads = MIN(
+      (unsigned)MAX(g_conf->bluestore_fsck_threads, 1), colls.size());
+    dout(1) << __func__ << " checking " << colls.size() << " collections with "
+	    << num_threads << " threads" << dendl;
+    vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; ++i)
+      threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+      t.join();
+  }
+  dout(1) << __func__ << " checked " << st->num_objects.load()
+	  << " objects" << dendl;
+
+  if (deep) {
+    dout(1) << __func__ << " checking for stray objects" << dendl;
+    st->set_phase("stray objects");
+    it = db->get_iterator(PREFIX_OBJ);
     CollectionRef c;
     for (it->lower_bound(string()); it->valid(); it->next()) {
+      if (is_enode_key(it->key()))
+	continue;
       ghobject_t oid;
       int r = get_key_object(it->key(), &oid);
       if (r < 0) {
@@ -2231,29 +2872,29 @@ int BlueStore::fsck()
   }
 
   dout(1) << __func__ << " checking for stray overlay data" << dendl;
+  st->set_phase("stray overlay data");
   it = db->get_iterator(PREFIX_OVERLAY);
-  if (it) {
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      string key = it->key();
-      const char *p = key.c_str();
-      uint64_t nid;
-      p = _key_decode_u64(p, &nid);
-      if (used_nids.count(nid) == 0) {
-	derr << __func__ << " found stray overlay data on nid " << nid << dendl;
-	++errors;
-      }
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    string key = it->key();
+    const char *p = key.c_str();
+    uint64_t nid;
+    p = _key_decode_u64(p, &nid);
+    if (st->used_nids.count(nid) == 0) {
+      derr << __func__ << " found stray overlay data on nid " << nid << dendl;
+      ++errors;
     }
   }
 
-  dout(1) << __func__ << " checking for stray omap data" << dendl;
-  it = db->get_iterator(PREFIX_OMAP);
-  if (it) {
+  if (deep) {
+    dout(1) << __func__ << " checking for stray omap data" << dendl;
+    st->set_phase("stray omap data");
+    it = db->get_iterator(PREFIX_OMAP);
     for (it->lower_bound(string()); it->valid(); it->next()) {
       string key = it->key();
       const char *p = key.c_str();
       uint64_t omap_head;
       p = _key_decode_u64(p, &omap_head);
-      if (used_omap_head.count(omap_head) == 0) {
+      if (st->used_omap_head.count(omap_head) == 0) {
 	derr << __func__ << " found stray omap data on omap_head " << omap_head
 	     << dendl;
 	++errors;
@@ -2262,56 +2903,72 @@ int BlueStore::fsck()
   }
 
   dout(1) << __func__ << " checking wal events" << dendl;
-  {
-    it = db->get_iterator(PREFIX_WAL);
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      bufferlist bl = it->value();
-      bufferlist::iterator p = bl.begin();
-      bluestore_wal_transaction_t wt;
-      try {
-	::decode(wt, p);
-      } catch (buffer::error& e) {
-	derr << __func__ << " failed to decode wal txn "
-	     << pretty_binary_string(it->key()) << dendl;
-	r = -EIO;
-        goto out_scan;
+  st->set_phase("wal events");
+  it = db->get_iterator(PREFIX_WAL);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    bufferlist bl = it->value();
+    bufferlist::iterator p = bl.begin();
+    bluestore_wal_transaction_t wt;
+    try {
+      ::decode(wt, p);
+    } catch (buffer::error& e) {
+      derr << __func__ << " failed to decode wal txn "
+	   << pretty_binary_string(it->key()) << dendl;
+      r = -EIO;
+      goto out_scan;
+    }
+    dout(20) << __func__ << "  wal " << wt.seq
+	     << " ops " << wt.ops.size()
+	     << " released " << wt.released << dendl;
+    for (auto q = wt.released.begin(); q != wt.released.end(); ++q) {
+      if (!_fsck_mark_used(*st, q.get_start(), q.get_len())) {
+	derr << __func__ << " wal " << wt.seq << " released extent "
+	     << q.get_start() << "~" << q.get_len()
+	     << " is still allocated" << dendl;
+	++errors;
       }
-      dout(20) << __func__ << "  wal " << wt.seq
-	       << " ops " << wt.ops.size()
-	       << " released " << wt.released << dendl;
-      used_blocks.insert(wt.released);
     }
   }
 
   dout(1) << __func__ << " checking freelist vs allocated" << dendl;
+  st->set_phase("freelist");
   {
-    const auto& free = fm->get_freelist();
-    for (auto p = free.begin();
-	 p != free.end(); ++p) {
-      if (used_blocks.intersects(p->first, p->second)) {
-	derr << __func__ << " free extent " << p->first << "~" << p->second
+    uint64_t offset, length;
+    fm->enumerate_reset();
+    while (fm->enumerate_next(&offset, &length)) {
+      if (!_fsck_mark_used(*st, offset, length)) {
+	derr << __func__ << " free extent " << offset << "~" << length
 	     << " intersects allocated blocks" << dendl;
-	interval_set<uint64_t> free, overlap;
-	free.insert(p->first, p->second);
-	overlap.intersection_of(free, used_blocks);
-	derr << __func__ << " overlap: " << overlap << dendl;
 	++errors;
+      }
+    }
+    uint64_t leaked = 0;
+    for (uint64_t b = 0; b < st->num_blocks; ++b) {
+      uint64_t w = st->used_blocks[b >> 6].load();
+      if ((b & 63) == 0 && w == ~0ull && b + 64 <= st->num_blocks) {
+	b += 63;
 	continue;
       }
-      used_blocks.insert(p->first, p->second);
+      if (!(w & (1ull << (b & 63)))) {
+	dout(20) << __func__ << "  leaked block 0x" << std::hex
+		 << (b << st->block_order) << std::dec << dendl;
+	++leaked;
+      }
     }
-    if (!used_blocks.contains(0, bdev->get_size())) {
-      derr << __func__ << " leaked some space; free+used = "
-	   << used_blocks
-	   << " != expected 0~" << bdev->get_size()
-	   << dendl;
+    if (leaked) {
+      derr << __func__ << " leaked " << leaked << " blocks ("
+	   << (leaked << st->block_order) << " bytes) that are neither"
+	   << " used nor free" << dendl;
       ++errors;
     }
   }
 
  out_scan:
+  errors += st->errors.load();
   coll_map.clear();
  out_alloc:
+  if (hook_registered)
+    admin_socket->unregister_command("bluestore fsck status");
   _close_alloc();
  out_db:
   it.reset();  // before db is closed
@@ -2331,6 +2988,74 @@ int BlueStore::fsck()
   return errors;
 }
 
+void BlueStore::inject_leaked(uint64_t len)
+{
+  // allocated in the freelist but referenced by nothing
+  int r = alloc->reserve(len);
+  assert(r == 0);
+  uint64_t offset;
+  uint32_t length;
+  r = alloc->allocate(len, g_conf->bluestore_min_alloc_size, 0,
+		      &offset, &length);
+  assert(r == 0);
+  if (length < len)
+    alloc->unreserve(len - length);
+  KeyValueDB::Transaction t = db->get_transaction();
+  fm->allocate(offset, length, t);
+  db->submit_transaction_sync(t);
+  dout(1) << __func__ << " " << offset << "~" << length << dendl;
+}
+
+void BlueStore::inject_misreference(const coll_t& cid, const ghobject_t& oid1,
+				    const ghobject_t& oid2)
+{
+  // point the first extent of oid2 at that of oid1 and free the
+  // blocks oid2 had there, so the only damage is the double reference
+  CollectionRef c = _get_collection(cid);
+  assert(c);
+  RWLock::WLocker l(c->lock);
+  OnodeRef o1 = c->get_onode(oid1, false);
+  OnodeRef o2 = c->get_onode(oid2, false);
+  assert(o1 && o2);
+  assert(!o1->onode.block_map.empty() && !o2->onode.block_map.empty());
+  const bluestore_extent_t& e1 = o1->onode.block_map.begin()->second;
+  bluestore_extent_t& e2 = o2->onode.block_map.begin()->second;
+  assert(e1.get_disk_length() == e2.get_disk_length());
+  KeyValueDB::Transaction t = db->get_transaction();
+  fm->release(e2.offset, e2.get_disk_length(), t);
+  dout(1) << __func__ << " " << oid2 << " " << e2 << " -> " << e1.offset
+	  << dendl;
+  e2.offset = e1.offset;
+  bufferlist bl;
+  ::encode(o2->onode, bl);
+  t->set(PREFIX_OBJ, o2->key, bl);
+  db->submit_transaction_sync(t);
+}
+
+void BlueStore::inject_shared_ref(const coll_t& cid, const ghobject_t& oid)
+{
+  // count one reference too many to the first shared extent of oid
+  CollectionRef c = _get_collection(cid);
+  assert(c);
+  RWLock::WLocker l(c->lock);
+  OnodeRef o = c->get_onode(oid, false);
+  assert(o);
+  EnodeRef e = c->get_enode(oid.hobj.get_hash());
+  auto p = o->onode.block_map.begin();
+  while (p != o->onode.block_map.end() &&
+	 !p->second.has_flag(bluestore_extent_t::FLAG_SHARED))
+    ++p;
+  assert(p != o->onode.block_map.end());
+  e->ref_map.get(p->second.offset, p->second.get_disk_length());
+  dout(1) << __func__ << " hash " << e->hash << " ref_map now " << e->ref_map
+	  << dendl;
+  KeyValueDB::Transaction t = db->get_transaction();
+  bufferlist bl;
+  ::encode(e->ref_map, bl);
+  t->set(PREFIX_OBJ, e->key, bl);
+  db->submit_transaction_sync(t);
+}
+
 void BlueStore::_sync()
 {
   dout(10) << __func__ << dendl;
@@ -2338,11 +3063,22 @@ void BlueStore::_sync()
   // flush aios in flght
   bdev->flush();
 
-  std::unique_lock<std::mutex> l(kv_lock);
-  while (!kv_committing.empty() ||
-	 !kv_queue.empty()) {
-    dout(20) << " waiting for kv to commit" << dendl;
-    kv_sync_cond.wait(l);
+  {
+    std::unique_lock<std::mutex> l(kv_lock);
+    while (!kv_committing.empty() ||
+	   !kv_queue.empty()) {
+      dout(20) << " waiting for kv to commit" << dendl;
+      kv_sync_cond.wait(l);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> l(kv_finalize_lock);
+    while (!kv_committed.empty() ||
+	   !wal_cleaned.empty() ||
+	   kv_finalize_in_progress) {
+      dout(20) << " waiting for kv to finalize" << dendl;
+      kv_finalize_sync_cond.wait(l);
+    }
   }
 
   dout(10) << __func__ << " done" << dendl;
@@ -2353,7 +3089,7 @@ int BlueStore::statfs(struct statfs *buf)
   memset(buf, 0, sizeof(*buf));
   buf->f_blocks = bdev->get_size() / bdev->get_block_size();
   buf->f_bsize = bdev->get_block_size();
-  buf->f_bfree = fm->get_total_free() / bdev->get_block_size();
+  buf->f_bfree = alloc->get_free() / bdev->get_block_size();
   buf->f_bavail = buf->f_bfree;
   dout(20) << __func__ << " free " << pretty_si_t(buf->f_bfree * buf->f_bsize)
 	   << " / " << pretty_si_t(buf->f_blocks * buf->f_bsize) << dendl;
@@ -2472,6 +3208,19 @@ int BlueStore::stat(
   return 0;
 }
 
+struct BlueStore::C_Readahead : public Context {
+  BlueStore *store;
+  CollectionRef c;
+  ghobject_t oid;
+  uint64_t offset, length;
+  C_Readahead(BlueStore *s, CollectionRef c, const ghobject_t& oid,
+	      uint64_t off, uint64_t len)
+    : store(s), c(c), oid(oid), offset(off), length(len) {}
+  void finish(int r) {
+    store->_readahead(c, oid, offset, length);
+  }
+};
+
 int BlueStore::read(
   const coll_t& cid,
   const ghobject_t& oid,
@@ -2518,15 +3267,65 @@ int BlueStore::read(
   if (offset == length && offset == 0)
     length = o->onode.size;
 
+  if (offset < o->onode.size && length > 0) {
+    uint64_t end = MIN(offset + length, o->onode.size);
+    if (c->cache->read(o.get(), offset, end - offset, &bl)) {
+      r = bl.length();
+      goto out;
+    }
+  }
+
   r = _do_read(o, offset, length, bl, op_flags);
+  if (r > 0 &&
+      (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		   CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+    c->cache->add(o.get(), offset, bl);
+  }
+  if (r == -EIO && !allow_eio && g_conf->bluestore_fail_eio) {
+    derr << __func__ << " " << cid << " " << oid << " " << offset << "~"
+	 << length << " eio on read" << dendl;
+    assert(0 == "eio on read");
+  }
 
  out:
+  // cache hits count too, or a reader we prefetched for would stop
+  // being seen as sequential
+  if (r > 0 &&
+      (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		   CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+    Readahead::extent_t ra = readahead.update(oid, offset, r, o->onode.size,
+					      op_flags);
+    if (ra.second) {
+      readahead_finisher.queue(
+	new C_Readahead(this, c, oid, ra.first, ra.second));
+    }
+  }
   dout(10) << __func__ << " " << cid << " " << oid
 	   << " " << offset << "~" << length
 	   << " = " << r << dendl;
   return r;
 }
 
+void BlueStore::_readahead(CollectionRef c, const ghobject_t& oid,
+			   uint64_t offset, uint64_t length)
+{
+  if (!c->exists)
+    return;
+  RWLock::RLocker l(c->lock);
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists || offset >= o->onode.size)
+    return;
+  length = MIN(length, o->onode.size - offset);
+  dout(20) << __func__ << " " << c->cid << " " << oid << " "
+	   << offset << "~" << length << dendl;
+  bufferlist bl;
+  int r = _do_read(o, offset, length, bl, 0);
+  if (r > 0) {
+    c->cache->add(o.get(), offset, bl);
+    logger->inc(l_bluestore_readahead_bytes, r);
+  }
+}
+
 int BlueStore::_do_read(
     OnodeRef o,
     uint64_t offset,
@@ -2628,20 +3427,48 @@ int BlueStore::_do_read(
     if (bp != bend && bp->first <= offset) {
       uint64_t x_off = offset - bp->first;
       x_len = MIN(x_len, bp->second.length - x_off);
-      if (!bp->second.has_flag(bluestore_extent_t::FLAG_UNWRITTEN)) {
+      if (bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED)) {
+	dout(30) << __func__ << " compressed " << bp->first << ": "
+		 << bp->second << " use " << x_off << "~" << x_len << dendl;
+	bufferlist raw;
+	r = _do_read_compressed(o, bp->first, bp->second, &raw, buffered);
+	if (r < 0) {
+	  goto out;
+	}
+	bufferlist u;
+	u.substr_of(raw, x_off, x_len);
+	bl.claim_append(u);
+      } else if (!bp->second.has_flag(bluestore_extent_t::FLAG_UNWRITTEN)) {
 	dout(30) << __func__ << " data " << bp->first << ": " << bp->second
 		 << " use " << x_off << "~" << x_len
 		 << " final offset " << x_off + bp->second.offset
 		 << dendl;
-	uint64_t front_extra = x_off % block_size;
+	// read whole csum chunks so that we can verify them
+	uint64_t align = block_size;
+	if (bp->second.has_csum())
+	  align = MAX(align, bp->second.get_csum_chunk_size());
+	uint64_t front_extra = x_off % align;
 	uint64_t r_off = x_off - front_extra;
-	uint64_t r_len = ROUND_UP_TO(x_len + front_extra, block_size);
+	uint64_t r_len = ROUND_UP_TO(x_len + front_extra, align);
 	dout(30) << __func__ << "  reading " << r_off << "~" << r_len << dendl;
 	bufferlist t;
 	r = bdev->read(r_off + bp->second.offset, r_len, &t, &ioc, buffered);
 	if (r < 0) {
 	  goto out;
 	}
+	if (bp->second.has_csum()) {
+	  uint64_t bad_off = 0;
+	  r = bp->second.verify_csum(r_off, t, &bad_off);
+	  if (r < 0) {
+	    derr << __func__ << " bad "
+		 << bluestore_extent_t::get_csum_type_string(
+		   bp->second.csum_type)
+		 << " csum at " << bp->first + bad_off << " of extent "
+		 << bp->first << ": " << bp->second << " on " << o->oid
+		 << dendl;
+	    goto out;
+	  }
+	}
 	r = r_len;
 	bufferlist u;
 	u.substr_of(t, front_extra, x_len);
@@ -2678,6 +3505,43 @@ int BlueStore::_do_read(
   return r;
 }
 
+int BlueStore::_do_read_compressed(
+  OnodeRef o,
+  uint64_t x_offset,
+  const bluestore_extent_t& e,
+  bufferlist *raw,
+  bool buffered)
+{
+  assert(e.has_flag(bluestore_extent_t::FLAG_COMPRESSED));
+  IOContext ioc(NULL);
+  bufferlist t;
+  int r = bdev->read(e.offset, e.disk_length, &t, &ioc, buffered);
+  if (r < 0)
+    return r;
+  if (e.has_csum()) {
+    uint64_t bad_off = 0;
+    r = e.verify_csum(0, t, &bad_off);
+    if (r < 0) {
+      derr << __func__ << " bad "
+	   << bluestore_extent_t::get_csum_type_string(e.csum_type)
+	   << " csum at disk offset " << e.offset + bad_off << " of extent "
+	   << x_offset << ": " << e << " on " << o->oid << dendl;
+      return r;
+    }
+  }
+  bufferlist cbl;
+  cbl.substr_of(t, 0, e.comp_length);
+  raw->clear();
+  r = _decompress(e.comp_alg, cbl, raw);
+  if (r < 0 || raw->length() != e.length) {
+    derr << __func__ << " failed to decompress extent " << x_offset << ": "
+	 << e << " on " << o->oid << ": r = " << r << ", got "
+	 << raw->length() << " bytes" << dendl;
+    return -EIO;
+  }
+  return 0;
+}
+
 int BlueStore::fiemap(
   const coll_t& cid,
   const ghobject_t& oid,
@@ -2914,6 +3778,19 @@ int BlueStore::collection_bits(const coll_t& cid)
   return c->cnode.bits;
 }
 
+int BlueStore::set_collection_opts(
+  const coll_t& cid,
+  const pool_opts_t& opts)
+{
+  CollectionRef c = _get_collection(cid);
+  if (!c)
+    return -ENOENT;
+  dout(15) << __func__ << " " << cid << " options " << opts << dendl;
+  RWLock::WLocker l(c->lock);
+  c->pool_opts = opts;
+  return 0;
+}
+
 int BlueStore::collection_list(
   const coll_t& cid, ghobject_t start, ghobject_t end,
   bool sort_bitwise, int max,
@@ -3555,6 +4432,9 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       txc->state = TransContext::STATE_KV_QUEUED;
       if (!g_conf->bluestore_sync_transaction) {
 	std::lock_guard<std::mutex> l(kv_lock);
+	// freelist updates go in queue order, while the kv thread is
+	// committing the previous batch
+	_txc_update_fm(txc);
 	if (g_conf->bluestore_sync_submit_transaction) {
 	  db->submit_transaction(txc->t);
 	}
@@ -3562,11 +4442,22 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	kv_cond.notify_one();
 	return;
       }
+      {
+	std::lock_guard<std::mutex> l(kv_lock);
+	_txc_update_fm(txc);
+      }
       db->submit_transaction_sync(txc->t);
       break;
 
     case TransContext::STATE_KV_QUEUED:
+      // only with bluestore_sync_transaction; the kv thread moves queued
+      // txcs on to kv_committing itself
       txc->log_state_latency(logger, l_bluestore_state_kv_queued_lat);
+      txc->state = TransContext::STATE_KV_COMMITTING;
+      // ** fall-thru **
+
+    case TransContext::STATE_KV_COMMITTING:
+      txc->log_state_latency(logger, l_bluestore_state_kv_committing_lat);
       txc->state = TransContext::STATE_KV_DONE;
       _txc_finish_kv(txc);
       // ** fall-thru **
@@ -3576,7 +4467,12 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       if (txc->wal_txn) {
 	txc->state = TransContext::STATE_WAL_QUEUED;
 	if (g_conf->bluestore_sync_wal_apply) {
-	  _wal_apply(txc);
+	  if (kv_finalize_thread.am_self()) {
+	    // applied as one batch once this commit has been processed
+	    kv_wal_apply.push_back(txc);
+	  } else {
+	    _wal_apply(txc);
+	  }
 	} else {
 	  wal_wq.queue(txc);
 	}
@@ -3774,7 +4670,7 @@ void BlueStore::_osr_reap_done(OpSequencer *osr)
     }
 
     if (txc->first_collection) {
-      txc->first_collection->onode_map.trim(g_conf->bluestore_onode_map_size);
+      txc->first_collection->cache->trim();
     }
 
     osr->q.pop_front();
@@ -3786,6 +4682,69 @@ void BlueStore::_osr_reap_done(OpSequencer *osr)
   }
 }
 
+void BlueStore::_txc_update_fm(TransContext *txc)
+{
+  if (txc->wal_txn)
+    dout(20) << __func__ << " txc " << txc
+	     << " allocated " << txc->allocated
+	     << " (will release " << txc->released << " after wal)"
+	     << dendl;
+  else
+    dout(20) << __func__ << " txc " << txc
+	     << " allocated " << txc->allocated
+	     << " released " << txc->released
+	     << dendl;
+  for (interval_set<uint64_t>::iterator p = txc->allocated.begin();
+       p != txc->allocated.end();
+       ++p) {
+    fm->allocate(p.get_start(), p.get_len(), txc->t);
+  }
+  if (txc->wal_txn) {
+    txc->wal_txn->released.swap(txc->released);
+    assert(txc->released.empty());
+  } else {
+    for (interval_set<uint64_t>::iterator p = txc->released.begin();
+	 p != txc->released.end();
+	 ++p) {
+      fm->release(p.get_start(), p.get_len(), txc->t);
+    }
+  }
+}
+
+void BlueStore::_kv_sync_update_fm(KeyValueDB::Transaction t,
+				   vector<bluestore_extent_t> *bluefs_gift_extents)
+{
+  // caller holds kv_lock
+  for (std::deque<TransContext *>::iterator it = wal_cleaning.begin();
+       it != wal_cleaning.end();
+       ++it) {
+    TransContext *txc = *it;
+    for (interval_set<uint64_t>::iterator p = txc->wal_txn->released.begin();
+	 p != txc->wal_txn->released.end();
+	 ++p) {
+      dout(20) << __func__ << " release " << p.get_start()
+	       << "~" << p.get_len() << dendl;
+      fm->release(p.get_start(), p.get_len(), t);
+    }
+  }
+
+  if (bluefs) {
+    int r = _balance_bluefs_freespace(bluefs_gift_extents, t);
+    assert(r >= 0);
+    if (r > 0) {
+      for (auto& p : *bluefs_gift_extents) {
+	fm->allocate(p.offset, p.length, t);
+	bluefs_extents.insert(p.offset, p.length);
+      }
+      bufferlist bl;
+      ::encode(bluefs_extents, bl);
+      dout(10) << __func__ << " bluefs_extents now " << bluefs_extents
+	       << dendl;
+      t->set(PREFIX_SUPER, "bluefs_extents", bl);
+    }
+  }
+}
+
 void BlueStore::_kv_sync_thread()
 {
   dout(10) << __func__ << " start" << dendl;
@@ -3799,56 +4758,18 @@ void BlueStore::_kv_sync_thread()
       dout(20) << __func__ << " sleep" << dendl;
       kv_sync_cond.notify_all();
       kv_cond.wait(l);
-      dout(20) << __func__ << " wake" << dendl;
-    } else {
-      dout(20) << __func__ << " committing " << kv_queue.size()
-	       << " cleaning " << wal_cleanup_queue.size() << dendl;
-      kv_committing.swap(kv_queue);
-      wal_cleaning.swap(wal_cleanup_queue);
-      utime_t start = ceph_clock_now(NULL);
-      l.unlock();
-
-      dout(30) << __func__ << " committing txc " << kv_committing << dendl;
-      dout(30) << __func__ << " wal_cleaning txc " << wal_cleaning << dendl;
-
-      // one transaction to force a sync
-      KeyValueDB::Transaction t = db->get_transaction();
-
-      // allocations and deallocations
-      interval_set<uint64_t> released;
-      for (std::deque<TransContext *>::iterator it = kv_committing.begin();
-	   it != kv_committing.end();
-	   ++it) {
-	TransContext *txc = *it;
-	if (txc->wal_txn)
-	  dout(20) << __func__ << " txc " << txc
-		   << " allocated " << txc->allocated
-		   << " (will release " << txc->released << " after wal)"
-		   << dendl;
-	else
-	  dout(20) << __func__ << " txc " << *it
-		   << " allocated " << txc->allocated
-		   << " released " << txc->released
-		   << dendl;
-	for (interval_set<uint64_t>::iterator p = txc->allocated.begin();
-	     p != txc->allocated.end();
-	     ++p) {
-	  fm->allocate(p.get_start(), p.get_len(), txc->t);
-	}
-	if (txc->wal_txn) {
-	  txc->wal_txn->released.swap(txc->released);
-	  assert(txc->released.empty());
-	} else {
-	  released.insert(txc->released);
-	  for (interval_set<uint64_t>::iterator p = txc->released.begin();
-	       p != txc->released.end();
-	       ++p) {
-	    dout(20) << __func__ << " release " << p.get_start()
-		     << "~" << p.get_len() << dendl;
-	    fm->release(p.get_start(), p.get_len(), txc->t);
-	  }
-	}
-      }
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      dout(20) << __func__ << " committing " << kv_queue.size()
+	       << " cleaning " << wal_cleanup_queue.size() << dendl;
+      kv_committing.swap(kv_queue);
+      wal_cleaning.swap(wal_cleanup_queue);
+      utime_t start = ceph_clock_now(NULL);
+
+      // one transaction to force a sync
+      KeyValueDB::Transaction t = db->get_transaction();
+
+      interval_set<uint64_t> released;
       for (std::deque<TransContext *>::iterator it = wal_cleaning.begin();
 	   it != wal_cleaning.end();
 	   ++it) {
@@ -3858,16 +4779,30 @@ void BlueStore::_kv_sync_thread()
 		   << " (post-wal) released " << txc->wal_txn->released
 		   << dendl;
 	  released.insert(txc->wal_txn->released);
-	  for (interval_set<uint64_t>::iterator p =
-		 txc->wal_txn->released.begin();
-	       p != txc->wal_txn->released.end();
-	       ++p) {
-	    dout(20) << __func__ << " release " << p.get_start()
-		     << "~" << p.get_len() << dendl;
-	    fm->release(p.get_start(), p.get_len(), t);
-	  }
 	}
       }
+
+      // freelist updates for the txcs were made, in order, as they were
+      // queued under kv_lock; do ours before letting the next batch in.
+      // With sync submit those txcs also hit the kv store right away, so
+      // ours wait until after the flush and go in under kv_lock below.
+      vector<bluestore_extent_t> bluefs_gift_extents;
+      if (!g_conf->bluestore_sync_submit_transaction)
+	_kv_sync_update_fm(t, &bluefs_gift_extents);
+      l.unlock();
+
+      dout(30) << __func__ << " committing txc " << kv_committing << dendl;
+      dout(30) << __func__ << " wal_cleaning txc " << wal_cleaning << dendl;
+
+      for (std::deque<TransContext *>::iterator it = kv_committing.begin();
+	   it != kv_committing.end();
+	   ++it) {
+	TransContext *txc = *it;
+	txc->log_state_latency(logger, l_bluestore_state_kv_queued_lat);
+	txc->state = TransContext::STATE_KV_COMMITTING;
+	if (!txc->wal_txn)
+	  released.insert(txc->released);
+      }
       for (interval_set<uint64_t>::iterator p = released.begin();
 	   p != released.end();
 	   ++p) {
@@ -3877,27 +4812,13 @@ void BlueStore::_kv_sync_thread()
 	  alloc->release(p.get_start(), p.get_len());
       }
 
-      vector<bluestore_extent_t> bluefs_gift_extents;
-      if (bluefs) {
-	int r = _balance_bluefs_freespace(&bluefs_gift_extents, t);
-	assert(r >= 0);
-	if (r > 0) {
-	  for (auto& p : bluefs_gift_extents) {
-	    fm->allocate(p.offset, p.length, t);
-	    bluefs_extents.insert(p.offset, p.length);
-	  }
-	  bufferlist bl;
-	  ::encode(bluefs_extents, bl);
-	  dout(10) << __func__ << " bluefs_extents now " << bluefs_extents
-		   << dendl;
-	  t->set(PREFIX_SUPER, "bluefs_extents", bl);
-	}
-      }
-
       alloc->commit_start();
 
       // flush/barrier on block device
+      utime_t flush_start = ceph_clock_now(NULL);
       bdev->flush();
+      utime_t commit_start = ceph_clock_now(NULL);
+      logger->tinc(l_bluestore_kv_flush_lat, commit_start - flush_start);
 
       if (!g_conf->bluestore_sync_submit_transaction) {
 	for (std::deque<TransContext *>::iterator it = kv_committing.begin();
@@ -3927,35 +4848,102 @@ void BlueStore::_kv_sync_thread()
 	get_wal_key(wt.seq, &key);
 	t->rmkey(PREFIX_WAL, key);
       }
+      if (g_conf->bluestore_sync_submit_transaction) {
+	// the releases must land atomically with the wal cleanup, and
+	// ordered against the freelist updates of txcs submitted since
+	l.lock();
+	_kv_sync_update_fm(t, &bluefs_gift_extents);
+	db->submit_transaction(t);
+	l.unlock();
+	t = db->get_transaction();
+      }
       db->submit_transaction_sync(t);
       utime_t finish = ceph_clock_now(NULL);
-      utime_t dur = finish - start;
+      logger->tinc(l_bluestore_kv_commit_lat, finish - commit_start);
+      logger->tinc(l_bluestore_kv_lat, finish - start);
       dout(20) << __func__ << " committed " << kv_committing.size()
 	       << " cleaned " << wal_cleaning.size()
-	       << " in " << dur << dendl;
-      while (!kv_committing.empty()) {
-	TransContext *txc = kv_committing.front();
-	_txc_state_proc(txc);
-	kv_committing.pop_front();
-      }
-      while (!wal_cleaning.empty()) {
-	TransContext *txc = wal_cleaning.front();
-	_txc_state_proc(txc);
-	wal_cleaning.pop_front();
-      }
+	       << " in " << (finish - start) << dendl;
 
+      // released space is usable once the release is durable
       alloc->commit_finish();
 
-      // this is as good a place as any ...
-      _reap_collections();
-
       if (bluefs) {
 	if (!bluefs_gift_extents.empty()) {
 	  _commit_bluefs_freespace(bluefs_gift_extents);
 	}
       }
 
+      // hand the batch to the finalize thread, so that completions run
+      // while we commit the next one
+      {
+	std::lock_guard<std::mutex> fl(kv_finalize_lock);
+	kv_committed.insert(kv_committed.end(),
+			    kv_committing.begin(), kv_committing.end());
+	wal_cleaned.insert(wal_cleaned.end(),
+			   wal_cleaning.begin(), wal_cleaning.end());
+	kv_finalize_cond.notify_one();
+      }
+
+      l.lock();
+      // _sync waits for an empty kv_committing, so only clear it now
+      kv_committing.clear();
+      wal_cleaning.clear();
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_kv_finalize_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  deque<TransContext*> kv_finalizing, wal_finalizing;
+  std::unique_lock<std::mutex> l(kv_finalize_lock);
+  while (true) {
+    assert(kv_finalizing.empty());
+    assert(wal_finalizing.empty());
+    if (kv_committed.empty() && wal_cleaned.empty()) {
+      if (kv_finalize_stop)
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_finalize_sync_cond.notify_all();
+      kv_finalize_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      kv_finalizing.swap(kv_committed);
+      wal_finalizing.swap(wal_cleaned);
+      kv_finalize_in_progress = true;
+      l.unlock();
+      utime_t start = ceph_clock_now(NULL);
+      dout(20) << __func__ << " finalizing " << kv_finalizing.size()
+	       << " cleaned " << wal_finalizing.size() << dendl;
+
+      while (!kv_finalizing.empty()) {
+	TransContext *txc = kv_finalizing.front();
+	_txc_state_proc(txc);
+	kv_finalizing.pop_front();
+      }
+      while (!kv_wal_apply.empty()) {
+	list<TransContext*> batch;
+	unsigned max = MAX(g_conf->bluestore_wal_max_batch, 1);
+	while (!kv_wal_apply.empty() && batch.size() < max) {
+	  batch.push_back(kv_wal_apply.front());
+	  kv_wal_apply.pop_front();
+	}
+	_wal_apply(batch);
+      }
+      while (!wal_finalizing.empty()) {
+	TransContext *txc = wal_finalizing.front();
+	_txc_state_proc(txc);
+	wal_finalizing.pop_front();
+      }
+
+      // this is as good a place as any ...
+      _reap_collections();
+
+      logger->tinc(l_bluestore_kv_finalize_lat, ceph_clock_now(NULL) - start);
       l.lock();
+      kv_finalize_in_progress = false;
     }
   }
   dout(10) << __func__ << " finish" << dendl;
@@ -3973,21 +4961,44 @@ bluestore_wal_op_t *BlueStore::_get_wal_op(TransContext *txc, OnodeRef o)
 
 int BlueStore::_wal_apply(TransContext *txc)
 {
-  bluestore_wal_transaction_t& wt = *txc->wal_txn;
-  dout(20) << __func__ << " txc " << txc << " seq " << wt.seq << dendl;
-  txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat);
-  txc->state = TransContext::STATE_WAL_APPLYING;
-
-  assert(txc->ioc.pending_aios.empty());
-  vector<OnodeRef>::iterator q = txc->wal_op_onodes.begin();
-  for (list<bluestore_wal_op_t>::iterator p = wt.ops.begin();
-       p != wt.ops.end();
-       ++p, ++q) {
-    int r = _do_wal_op(*p, &txc->ioc);
-    assert(r == 0);
+  list<TransContext*> txcs;
+  txcs.push_back(txc);
+  return _wal_apply(txcs);
+}
+
+int BlueStore::_wal_apply(const list<TransContext*>& txcs)
+{
+  dout(20) << __func__ << " " << txcs.size() << " txcs" << dendl;
+  logger->inc(l_bluestore_wal_batch_txcs, txcs.size());
+
+  // writes from every txc are gathered by block, so that overwrites of
+  // the same block collapse and adjacent ones go out as a single io
+  WALBatch batch(bdev->get_block_size());
+  for (list<TransContext*>::const_iterator i = txcs.begin();
+       i != txcs.end();
+       ++i) {
+    TransContext *txc = *i;
+    bluestore_wal_transaction_t& wt = *txc->wal_txn;
+    dout(20) << __func__ << " txc " << txc << " seq " << wt.seq << dendl;
+    txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat);
+    txc->state = TransContext::STATE_WAL_APPLYING;
+
+    assert(txc->ioc.pending_aios.empty());
+    for (list<bluestore_wal_op_t>::iterator p = wt.ops.begin();
+	 p != wt.ops.end();
+	 ++p) {
+      int r = _do_wal_op(*p, &txc->ioc, &batch);
+      assert(r == 0);
+    }
   }
+  // wal writes are buffered, so the ioc only sees them for logging
+  _wal_batch_submit(&batch, &txcs.back()->ioc);
 
-  _txc_state_proc(txc);
+  for (list<TransContext*>::const_iterator i = txcs.begin();
+       i != txcs.end();
+       ++i) {
+    _txc_state_proc(*i);
+  }
   return 0;
 }
 
@@ -4003,7 +5014,56 @@ int BlueStore::_wal_finish(TransContext *txc)
   return 0;
 }
 
-int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
+void BlueStore::_wal_read_block(uint64_t offset, bufferlist *bl,
+				IOContext *ioc, WALBatch *batch)
+{
+  if (batch) {
+    map<uint64_t,bufferptr>::iterator p = batch->blocks.find(offset);
+    if (p != batch->blocks.end()) {
+      dout(20) << __func__ << " " << offset << " from batch" << dendl;
+      bl->append(p->second);
+      return;
+    }
+  }
+  int r = bdev->read(offset, bdev->get_block_size(), bl, ioc, true);
+  assert(r == 0);
+}
+
+void BlueStore::_wal_batch_write(WALBatch *batch, uint64_t offset,
+				 bufferlist& bl)
+{
+  assert(offset % batch->block_size == 0);
+  assert(bl.length() % batch->block_size == 0);
+  if (bl.buffers().size() > 1)
+    bl.rebuild();
+  const bufferptr& bp = bl.buffers().front();
+  for (uint64_t pos = 0; pos < bl.length(); pos += batch->block_size) {
+    batch->blocks[offset + pos] = bufferptr(bp, pos, batch->block_size);
+  }
+}
+
+void BlueStore::_wal_batch_submit(WALBatch *batch, IOContext *ioc)
+{
+  map<uint64_t,bufferptr>::iterator p = batch->blocks.begin();
+  while (p != batch->blocks.end()) {
+    uint64_t offset = p->first;
+    bufferlist bl;
+    do {
+      bl.append(p->second);
+      ++p;
+    } while (p != batch->blocks.end() &&
+	     p->first == offset + bl.length() &&
+	     bl.buffers().size() < IOV_MAX);
+    dout(20) << __func__ << " " << offset << "~" << bl.length() << dendl;
+    int r = bdev->aio_write(offset, bl, ioc, true);
+    assert(r == 0);
+    logger->inc(l_bluestore_wal_write_ios);
+  }
+  batch->blocks.clear();
+}
+
+int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc,
+			  WALBatch *batch)
 {
   const uint64_t block_size = bdev->get_block_size();
   const uint64_t block_mask = ~(block_size - 1);
@@ -4012,6 +5072,12 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
   // read all the overlay data first for apply
   _do_read_all_overlays(wo);
 
+  // anything but a write reads and writes the device directly, so it must
+  // see the batched writes that came before it
+  if (batch && wo.op != bluestore_wal_op_t::OP_WRITE) {
+    _wal_batch_submit(batch, ioc);
+  }
+
   // NOTE: we are doing all reads and writes buffered so that we can
   // avoid worrying about multiple RMW cycles over the same blocks.
 
@@ -4034,8 +5100,7 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       offset = offset & block_mask;
       dout(20) << __func__ << "  reading initial partial block "
 	       << src_offset << "~" << block_size << dendl;
-      r = bdev->read(src_offset, block_size, &first, ioc, true);
-      assert(r == 0);
+      _wal_read_block(src_offset, &first, ioc, batch);
       bufferlist t;
       t.substr_of(first, 0, first_len);
       t.claim_append(bl);
@@ -4053,8 +5118,7 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       } else {
 	dout(20) << __func__ << "  reading trailing partial block "
 		 << last_offset << "~" << block_size << dendl;
-	r = bdev->read(last_offset, block_size, &last, ioc, true);
-        assert(r == 0);
+	_wal_read_block(last_offset, &last, ioc, batch);
       }
       bufferlist t;
       uint64_t endoff = wo.extent.end() & ~block_mask;
@@ -4062,8 +5126,14 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       bl.claim_append(t);
     }
     assert((bl.length() & ~block_mask) == 0);
-    r = bdev->aio_write(offset, bl, ioc, true);
-    assert(r == 0);
+    logger->inc(l_bluestore_wal_write_ops);
+    if (batch) {
+      _wal_batch_write(batch, offset, bl);
+    } else {
+      r = bdev->aio_write(offset, bl, ioc, true);
+      assert(r == 0);
+      logger->inc(l_bluestore_wal_write_ios);
+    }
   }
   break;
 
@@ -4778,6 +5848,7 @@ int BlueStore::_do_write_overlays(TransContext *txc,
       if (bp->second.has_flag(bluestore_extent_t::FLAG_UNWRITTEN)) {
 	dout(10) << __func__ << " zero new allocation " << bp->second << dendl;
 	bdev->aio_zero(bp->second.offset, bp->second.length, &txc->ioc);
+	bp->second.calc_csum_zero(0, bp->second.length);
 	bp->second.clear_flag(bluestore_extent_t::FLAG_UNWRITTEN);
       }
     }
@@ -4788,6 +5859,7 @@ int BlueStore::_do_write_overlays(TransContext *txc,
 	     << offset << "~" << length << dendl;
     op->extent.offset = bp->second.offset + x_off;
     op->extent.length = length;
+    bp->second.invalidate_csum(x_off, length);
     op = NULL;
 
     if (p == o->onode.overlay_map.end() || p->first >= orig_offset + orig_length) {
@@ -4994,6 +6066,93 @@ void BlueStore::_pad_zeros_tail(
   *_dout << dendl;
 }
 
+/*
+ * Release the extents (or portions of extents) backing the logical
+ * range offset~length and drop them from the block_map.
+ */
+void BlueStore::_do_release_range(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset, uint64_t length,
+  uint64_t *hint)
+{
+  map<uint64_t, bluestore_extent_t>::iterator bp =
+    o->onode.seek_extent(offset);
+  while (bp != o->onode.block_map.end() &&
+	 bp->first < offset + length &&
+	 bp->first + bp->second.length > offset) {
+    dout(30) << "   bp " << bp->first << ": " << bp->second << dendl;
+    // compressed extents cover exactly one allocation unit and are
+    // expanded by the caller unless they are entirely overwritten.
+    assert(!bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED) ||
+	   (bp->first >= offset &&
+	    bp->first + bp->second.length <= offset + length));
+    if (bp->first < offset) {
+      uint64_t left = offset - bp->first;
+      if (bp->first + bp->second.length <= offset + length) {
+	dout(20) << "  trim tail " << bp->first << ": " << bp->second << dendl;
+	_txc_release(
+	  txc, c, o,
+	  bp->second.offset + left,
+	  bp->second.length - left,
+	  bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
+	bp->second.length = left;
+	dout(20) << "        now " << bp->first << ": " << bp->second << dendl;
+	*hint = bp->first + bp->second.length;
+	++bp;
+      } else {
+	dout(20) << "      split " << bp->first << ": " << bp->second << dendl;
+	_txc_release(
+	  txc, c, o,
+	  bp->second.offset + left, length,
+	  bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
+	bluestore_extent_t& right = o->onode.block_map[offset + length] =
+	  bluestore_extent_t(
+	    bp->second.offset + left + length,
+	    bp->second.length - (left + length),
+	    bp->second.flags);
+	bp->second.split_csum(left + length, &right);
+	bp->second.length = left;
+	dout(20) << "       left " << bp->first << ": " << bp->second << dendl;
+	++bp;
+	dout(20) << "      right " << bp->first << ": " << bp->second << dendl;
+	assert(bp->first == offset + length);
+	*hint = bp->first + bp->second.length;
+      }
+    } else {
+      assert(bp->first >= offset);
+      if (bp->first + bp->second.length > offset + length) {
+	uint64_t overlap = offset + length - bp->first;
+	dout(20) << "  trim head " << bp->first << ": " << bp->second
+		 << " (overlap " << overlap << ")" << dendl;
+	_txc_release(
+	  txc, c, o,
+	  bp->second.offset, overlap,
+	  bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
+	bluestore_extent_t& right = o->onode.block_map[bp->first + overlap] =
+	  bluestore_extent_t(
+	    bp->second.offset + overlap,
+	    bp->second.length - overlap,
+	    bp->second.flags);
+	bp->second.split_csum(overlap, &right);
+	o->onode.block_map.erase(bp++);
+	dout(20) << "        now " << bp->first << ": " << bp->second << dendl;
+	assert(bp->first == offset + length);
+	*hint = bp->first;
+      } else {
+	dout(20) << "    dealloc " << bp->first << ": " << bp->second << dendl;
+	_txc_release(
+	  txc, c, o,
+	  bp->second.offset, bp->second.get_disk_length(),
+	  bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
+	*hint = bp->first + bp->second.length;
+	o->onode.block_map.erase(bp++);
+      }
+    }
+  }
+}
+
 /*
  * Allocate extents for the given range.  In general, allocate new space
  * for any min_alloc_size blocks that we overwrite.  For the head/tail and/or
@@ -5178,72 +6337,7 @@ int BlueStore::_do_allocate(
     }
 
     // deallocate existing extents
-    bp = o->onode.seek_extent(offset);
-    while (bp != o->onode.block_map.end() &&
-	   bp->first < offset + length &&
-	   bp->first + bp->second.length > offset) {
-      dout(30) << "   bp " << bp->first << ": " << bp->second << dendl;
-      if (bp->first < offset) {
-	uint64_t left = offset - bp->first;
-	if (bp->first + bp->second.length <= offset + length) {
-	  dout(20) << "  trim tail " << bp->first << ": " << bp->second << dendl;
-	  _txc_release(
-	    txc, c, o,
-	    bp->second.offset + left,
-	    bp->second.length - left,
-	    bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
-	  bp->second.length = left;
-	  dout(20) << "        now " << bp->first << ": " << bp->second << dendl;
-	  hint = bp->first + bp->second.length;
-	  ++bp;
-	} else {
-	  dout(20) << "      split " << bp->first << ": " << bp->second << dendl;
-	  _txc_release(
-	    txc, c, o,
-	    bp->second.offset + left, length,
-	    bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
-	  o->onode.block_map[offset + length] =
-	    bluestore_extent_t(
-	      bp->second.offset + left + length,
-	      bp->second.length - (left + length),
-	      bp->second.flags);
-	  bp->second.length = left;
-	  dout(20) << "       left " << bp->first << ": " << bp->second << dendl;
-	  ++bp;
-	  dout(20) << "      right " << bp->first << ": " << bp->second << dendl;
-	  assert(bp->first == offset + length);
-	  hint = bp->first + bp->second.length;
-	}
-      } else {
-	assert(bp->first >= offset);
-	if (bp->first + bp->second.length > offset + length) {
-	  uint64_t overlap = offset + length - bp->first;
-	  dout(20) << "  trim head " << bp->first << ": " << bp->second
-		   << " (overlap " << overlap << ")" << dendl;
-	  _txc_release(
-	    txc, c, o,
-	    bp->second.offset, overlap,
-	    bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
-	  o->onode.block_map[bp->first + overlap] =
-	    bluestore_extent_t(
-	      bp->second.offset + overlap,
-	      bp->second.length - overlap,
-	      bp->second.flags);
-	  o->onode.block_map.erase(bp++);
-	  dout(20) << "        now " << bp->first << ": " << bp->second << dendl;
-	  assert(bp->first == offset + length);
-	  hint = bp->first;
-	} else {
-	  dout(20) << "    dealloc " << bp->first << ": " << bp->second << dendl;
-	  _txc_release(
-	    txc, c, o,
-	    bp->second.offset, bp->second.length,
-	    bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
-	  hint = bp->first + bp->second.length;
-	  o->onode.block_map.erase(bp++);
-	}
-      }
-    }
+    _do_release_range(txc, c, o, offset, length, &hint);
 
     // allocate our new extent(s)
     uint64_t alloc_start = offset;
@@ -5256,6 +6350,9 @@ int BlueStore::_do_allocate(
 			      &e.offset, &e.length);
       assert(r == 0);
       assert(e.length <= length);  // bc length is a multiple of min_alloc_size
+      if (csum_type != bluestore_extent_t::CSUM_NONE) {
+	e.init_csum(csum_type, csum_chunk_order);
+      }
       if (offset == alloc_start) {
 	if (cow_head_op) {
 	  // we set the COW flag to indicate that all or part of this new extent
@@ -5339,6 +6436,12 @@ int BlueStore::_do_write(
   uint64_t cow_rmw_head = 0;
   uint64_t cow_rmw_tail = 0;
 
+  r = _do_decompress_range(txc, c, o, orig_offset, orig_length);
+  if (r < 0) {
+    derr << __func__ << " decompress failed, " << cpp_strerror(r) << dendl;
+    goto out;
+  }
+
   r = _do_allocate(txc, c, o, orig_offset, orig_length, fadvise_flags, true,
 		   &cow_rmw_head, &cow_rmw_tail);
   if (r < 0) {
@@ -5364,6 +6467,7 @@ int BlueStore::_do_write(
 	       << " of prior extent " << pp->first << ": " << pp->second
 	       << dendl;
       bdev->aio_zero(pp->second.offset + x_off, x_len, &txc->ioc);
+      pp->second.calc_csum_zero(x_off, x_len);
     }
   }
 
@@ -5424,6 +6528,7 @@ int BlueStore::_do_write(
 	  dout(20) << __func__ << " zero " << bp->second.offset << "~" << x_off
 		   << dendl;
 	  bdev->aio_zero(bp->second.offset, x_off, &txc->ioc);
+	  bp->second.calc_csum_zero(0, x_off);
 	}
       } else {
 	// the trailing block is zeroed from EOF to the end
@@ -5434,12 +6539,14 @@ int BlueStore::_do_write(
 	  dout(20) << __func__ << " zero " << from << "~" << z_len
 		   << " x_off " << zx_off << dendl;
 	  bdev->aio_zero(bp->second.offset + zx_off, z_len, &txc->ioc);
+	  bp->second.calc_csum_zero(zx_off, z_len);
 	}
 	bp->second.clear_flag(bluestore_extent_t::FLAG_COW_HEAD);
       }
       dout(20) << __func__ << " write " << offset << "~" << length
 	       << " x_off " << x_off << dendl;
       bdev->aio_write(bp->second.offset + x_off, bl, &txc->ioc, buffered);
+      bp->second.calc_csum(x_off, bl);
       bp->second.clear_flag(bluestore_extent_t::FLAG_UNWRITTEN);
       ++bp;
       continue;
@@ -5486,6 +6593,7 @@ int BlueStore::_do_write(
       dout(20) << __func__ << " write " << offset << "~" << length
 	       << " x_off " << x_off << dendl;
       bdev->aio_write(bp->second.offset + x_off, bl, &txc->ioc, buffered);
+      bp->second.calc_csum(x_off, bl);
       ++bp;
       continue;
     }
@@ -5510,6 +6618,7 @@ int BlueStore::_do_write(
 	uint64_t z_len = z_end - bp->first;
 	dout(20) << __func__ << " zero " << bp->first << "~" << z_len << dendl;
 	bdev->aio_zero(bp->second.offset, z_len, &txc->ioc);
+	bp->second.calc_csum_zero(0, z_len);
       }
       uint64_t end = ROUND_UP_TO(offset + length, block_size);
       if (end < bp->first + bp->second.length &&
@@ -5520,6 +6629,7 @@ int BlueStore::_do_write(
 	dout(20) << __func__ << " zero " << end << "~" << z_len
 		 << " x_off " << x_off << dendl;
 	bdev->aio_zero(bp->second.offset + x_off, z_len, &txc->ioc);
+	bp->second.calc_csum_zero(x_off, z_len);
       }
       if ((offset & ~block_mask) != 0 && !cow_rmw_head) {
 	_pad_zeros_head(o, &bl, &offset, &length, block_size);
@@ -5532,6 +6642,7 @@ int BlueStore::_do_write(
 	dout(20) << __func__ << " write " << offset << "~" << length
 		 << " x_off " << x_off << dendl;
 	bdev->aio_write(bp->second.offset + x_off, bl, &txc->ioc, buffered);
+	bp->second.calc_csum(x_off, bl);
 	bp->second.clear_flag(bluestore_extent_t::FLAG_UNWRITTEN);
 	bp->second.clear_flag(bluestore_extent_t::FLAG_COW_HEAD);
 	bp->second.clear_flag(bluestore_extent_t::FLAG_COW_TAIL);
@@ -5566,6 +6677,9 @@ int BlueStore::_do_write(
     op->extent.offset = bp->second.offset + offset - bp->first;
     op->extent.length = length;
     op->data = bl;
+    // partial blocks are read-modify-written by the wal; calc_csum
+    // forgets any chunk that we do not fully cover here.
+    bp->second.calc_csum(offset - bp->first, bl);
     if (offset + length - bp->first > bp->second.length) {
       op->extent.length = offset + length - bp->first;
     }
@@ -5606,6 +6720,285 @@ int BlueStore::_do_write(
   return r;
 }
 
+bool BlueStore::_want_compress(
+  CollectionRef& c,
+  uint32_t fadvise_flags,
+  int *alg,
+  double *required_ratio)
+{
+  string mode = g_conf->bluestore_compression;
+  c->pool_opts.get(pool_opts_t::COMPRESSION_MODE, &mode);
+  if (mode == "aggressive") {
+    // compress everything we can
+  } else if (mode == "passive") {
+    // only compress data the client tells us is cold
+    if ((fadvise_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+			  CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0)
+      return false;
+  } else {
+    return false;
+  }
+
+  *alg = async_comp_alg;
+  string alg_name;
+  if (c->pool_opts.get(pool_opts_t::COMPRESSION_ALGORITHM, &alg_name)) {
+    *alg = bluestore_extent_t::get_comp_alg_type(alg_name);
+    if (*alg < 0) {
+      dout(10) << __func__ << " unrecognized compression_algorithm '"
+	       << alg_name << "'" << dendl;
+      return false;
+    }
+  }
+  if (*alg == bluestore_extent_t::COMP_ALG_NONE)
+    return false;
+
+  *required_ratio = g_conf->bluestore_compression_required_ratio;
+  c->pool_opts.get(pool_opts_t::COMPRESSION_REQUIRED_RATIO, required_ratio);
+  return true;
+}
+
+/*
+ * Compression works in whole min_alloc_size units: each unit that the
+ * write fully covers is compressed and stored in its own extent, which
+ * occupies only as many blocks as the compressed data needs.  Partial
+ * units at the head and tail go through the normal write path, as does
+ * any unit that does not compress to within required_ratio.
+ */
+int BlueStore::_do_write_compressed(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  uint64_t length,
+  bufferlist& bl,
+  uint32_t fadvise_flags,
+  int alg,
+  double required_ratio)
+{
+  uint64_t min_alloc_size = g_conf->bluestore_min_alloc_size;
+  uint64_t block_size = bdev->get_block_size();
+  uint64_t start = ROUND_UP_TO(offset, min_alloc_size);
+  uint64_t end = (offset + length) - (offset + length) % min_alloc_size;
+  if (start >= end) {
+    return _do_write(txc, c, o, offset, length, bl, fadvise_flags);
+  }
+
+  dout(20) << __func__ << " " << o->oid << " " << offset << "~" << length
+	   << " units " << start << "~" << end - start
+	   << " alg " << bluestore_extent_t::get_comp_alg_name(alg)
+	   << dendl;
+
+  bool buffered = fadvise_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED;
+  int r = 0;
+
+  // queue all units on the compressor threads before doing anything else
+  utime_t cstart = ceph_clock_now(g_ceph_context);
+  bool async = async_compressor && alg == async_comp_alg;
+  vector<bufferlist> raw((end - start) / min_alloc_size);
+  vector<uint64_t> jobs;
+  unsigned i;
+  for (i = 0; i < raw.size(); ++i) {
+    raw[i].substr_of(bl, start - offset + i * min_alloc_size, min_alloc_size);
+    if (async)
+      jobs.push_back(async_compressor->async_compress(raw[i]));
+  }
+  i = 0;
+
+  if (start > offset) {
+    bufferlist head;
+    head.substr_of(bl, 0, start - offset);
+    r = _do_write(txc, c, o, offset, start - offset, head, fadvise_flags);
+    if (r < 0)
+      goto out;
+  } else if (offset > o->onode.size) {
+    // zero the tail of the prior extent, as _do_write would
+    r = _do_truncate(txc, c, o, offset);
+    if (r < 0)
+      goto out;
+  }
+
+  for (; i < raw.size(); ++i) {
+    uint64_t pos = start + i * min_alloc_size;
+    bufferlist cbl;
+    if (async) {
+      // queued at cstart
+      bool finished = false;
+      r = async_compressor->get_compress_data(jobs[i], cbl, true, &finished);
+      jobs[i] = 0;
+    } else {
+      cstart = ceph_clock_now(g_ceph_context);
+      r = _compress(alg, raw[i], &cbl);
+    }
+    logger->tinc(l_bluestore_compress_lat,
+		 ceph_clock_now(g_ceph_context) - cstart);
+    if (r == 0 &&
+	cbl.length() > 0 &&
+	ROUND_UP_TO(cbl.length(), block_size) <=
+	  min_alloc_size * required_ratio) {
+      logger->inc(l_bluestore_compress_success_count);
+      r = _do_write_compressed_unit(txc, c, o, pos, raw[i], cbl, alg,
+				    buffered);
+      if (r != -EAGAIN) {
+	if (r < 0)
+	  goto out;
+	continue;
+      }
+    } else {
+      dout(20) << __func__ << " unit " << pos << " compressed to "
+	       << cbl.length() << " (r = " << r << "), storing raw" << dendl;
+      logger->inc(l_bluestore_compress_rejected_count);
+    }
+    r = _do_write(txc, c, o, pos, min_alloc_size, raw[i], fadvise_flags);
+    if (r < 0)
+      goto out;
+  }
+  jobs.clear();
+
+  if (offset + length > end) {
+    bufferlist tail;
+    tail.substr_of(bl, end - offset, offset + length - end);
+    r = _do_write(txc, c, o, end, offset + length - end, tail, fadvise_flags);
+  }
+
+ out:
+  // reap any jobs we did not collect (on error)
+  for (i = 0; i < jobs.size(); ++i) {
+    if (jobs[i]) {
+      bufferlist t;
+      bool finished;
+      async_compressor->get_compress_data(jobs[i], t, true, &finished);
+    }
+  }
+  return r;
+}
+
+int BlueStore::_do_write_compressed_unit(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  bufferlist& raw,
+  bufferlist& cbl,
+  int alg,
+  bool buffered)
+{
+  uint64_t min_alloc_size = g_conf->bluestore_min_alloc_size;
+  uint64_t block_size = bdev->get_block_size();
+  uint64_t disk_length = ROUND_UP_TO(cbl.length(), block_size);
+
+  int r = alloc->reserve(disk_length);
+  if (r < 0) {
+    derr << __func__ << " failed to reserve " << disk_length << dendl;
+    return r;
+  }
+  bluestore_extent_t e(0, min_alloc_size,
+		       bluestore_extent_t::FLAG_COMPRESSED);
+  uint32_t got = 0;
+  r = alloc->allocate(disk_length, block_size, 0, &e.offset, &got);
+  assert(r == 0);
+  if (got < disk_length) {
+    // free space is too fragmented; store the unit raw instead
+    dout(20) << __func__ << " only got " << e.offset << "~" << got
+	     << " of " << disk_length << ", giving up" << dendl;
+    alloc->release(e.offset, got);
+    alloc->unreserve(disk_length - got);
+    return -EAGAIN;
+  }
+
+  // drop whatever we had here before
+  uint64_t hint = 0;
+  _do_release_range(txc, c, o, offset, min_alloc_size, &hint);
+  _do_overlay_trim(txc, o, offset, min_alloc_size);
+  if (o->tail_bl.length() &&
+      offset + min_alloc_size > (o->onode.size & ~(block_size - 1))) {
+    dout(20) << __func__ << " clearing cached tail" << dendl;
+    o->clear_tail();
+  }
+
+  e.comp_alg = alg;
+  e.comp_length = cbl.length();
+  e.disk_length = disk_length;
+  if (csum_type != bluestore_extent_t::CSUM_NONE) {
+    e.init_csum(csum_type, csum_chunk_order);
+  }
+  if (disk_length > cbl.length())
+    cbl.append_zero(disk_length - cbl.length());
+  bdev->aio_write(e.offset, cbl, &txc->ioc, buffered);
+  e.calc_csum(0, cbl);
+  txc->allocated.insert(e.offset, disk_length);
+  txc->compressed_raw[e.offset] = raw;
+  o->onode.block_map[offset] = e;
+  dout(20) << __func__ << " " << offset << ": " << e << dendl;
+
+  if (offset + min_alloc_size > o->onode.size) {
+    dout(20) << __func__ << " extending size to "
+	     << offset + min_alloc_size << dendl;
+    o->onode.size = offset + min_alloc_size;
+  }
+  return 0;
+}
+
+/*
+ * Replace a compressed extent with a plain one holding the same data,
+ * so that it can be partially overwritten, zeroed or truncated.
+ */
+int BlueStore::_do_decompress_extent(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  map<uint64_t,bluestore_extent_t>::iterator bp)
+{
+  uint64_t x_offset = bp->first;
+  bluestore_extent_t e = bp->second;
+  dout(20) << __func__ << " " << x_offset << ": " << e << dendl;
+
+  bufferlist raw;
+  map<uint64_t,bufferlist>::iterator q = txc->compressed_raw.find(e.offset);
+  if (q != txc->compressed_raw.end()) {
+    // we wrote it ourselves; it may not have hit the disk yet
+    raw = q->second;
+  } else {
+    o->flush();
+    int r = _do_read_compressed(o, x_offset, e, &raw, false);
+    if (r < 0)
+      return r;
+  }
+
+  _txc_release(txc, c, o, e.offset, e.get_disk_length(),
+	       e.has_flag(bluestore_extent_t::FLAG_SHARED));
+  o->onode.block_map.erase(bp);
+
+  assert(x_offset < o->onode.size);
+  uint64_t x_len = MIN(e.length, o->onode.size - x_offset);
+  bufferlist bl;
+  bl.substr_of(raw, 0, x_len);
+  return _do_write(txc, c, o, x_offset, x_len, bl, 0);
+}
+
+int BlueStore::_do_decompress_range(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  uint64_t length)
+{
+  map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.seek_extent(offset);
+  while (bp != o->onode.block_map.end() &&
+	 bp->first < offset + length) {
+    uint64_t x_end = bp->first + bp->second.length;
+    if (bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED) &&
+	(bp->first < offset || x_end > offset + length)) {
+      int r = _do_decompress_extent(txc, c, o, bp);
+      if (r < 0)
+	return r;
+      bp = o->onode.seek_extent(x_end);
+      continue;
+    }
+    ++bp;
+  }
+  return 0;
+}
+
 int BlueStore::_write(TransContext *txc,
 		      CollectionRef& c,
 		      OnodeRef& o,
@@ -5617,7 +7010,14 @@ int BlueStore::_write(TransContext *txc,
 	   << " " << offset << "~" << length
 	   << dendl;
   _assign_nid(txc, o);
-  int r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
+  int alg;
+  double required_ratio;
+  int r;
+  if (_want_compress(c, fadvise_flags, &alg, &required_ratio))
+    r = _do_write_compressed(txc, c, o, offset, length, bl, fadvise_flags,
+			     alg, required_ratio);
+  else
+    r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
   txc->write_onode(o);
 
   dout(10) << __func__ << " " << c->cid << " " << o->oid
@@ -5672,6 +7072,7 @@ int BlueStore::_zero(TransContext *txc,
 	       << " of prior extent " << pp->first << ": " << pp->second
 	       << dendl;
       bdev->aio_zero(pp->second.offset + x_off, x_len, &txc->ioc);
+      pp->second.calc_csum_zero(x_off, x_len);
     }
   }
 
@@ -5687,7 +7088,7 @@ int BlueStore::_zero(TransContext *txc,
 	       << bp->second << dendl;
       _txc_release(
 	txc, c, o,
-	bp->second.offset, bp->second.length,
+	bp->second.offset, bp->second.get_disk_length(),
 	bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
       o->onode.block_map.erase(bp++);
       continue;
@@ -5700,7 +7101,8 @@ int BlueStore::_zero(TransContext *txc,
     }
     uint64_t x_len = MIN(offset + length - bp->first,
 			 bp->second.length) - x_off;
-    if (bp->second.has_flag(bluestore_extent_t::FLAG_SHARED)) {
+    if (bp->second.has_flag(bluestore_extent_t::FLAG_SHARED) ||
+	bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED)) {
       uint64_t end = bp->first + x_off + x_len;
       _do_write_zero(txc, c, o, bp->first + x_off, x_len);
       // we probably invalidated bp.  move past the extent we just
@@ -5717,6 +7119,7 @@ int BlueStore::_zero(TransContext *txc,
       op->op = bluestore_wal_op_t::OP_ZERO;
       op->extent.offset = bp->second.offset + x_off;
       op->extent.length = x_len;
+      bp->second.calc_csum_zero(x_off, x_len);
       dout(20) << __func__ << "  wal zero " << x_off << "~" << x_len
 	       << " " << op->extent << dendl;
     }
@@ -5755,6 +7158,18 @@ int BlueStore::_do_truncate(
     o->clear_tail();
   }
 
+  // expand a compressed extent we are truncating into
+  if (offset < o->onode.size) {
+    map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.find_extent(offset);
+    if (bp != o->onode.block_map.end() &&
+	bp->first < offset &&
+	bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED)) {
+      int r = _do_decompress_extent(txc, c, o, bp);
+      if (r < 0)
+	return r;
+    }
+  }
+
   // trim down fragments
   map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.block_map.end();
   if (bp != o->onode.block_map.begin())
@@ -5768,7 +7183,7 @@ int BlueStore::_do_truncate(
 	       << bp->second << dendl;
       _txc_release(
 	txc, c, o,
-	bp->second.offset, bp->second.length,
+	bp->second.offset, bp->second.get_disk_length(),
 	bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
       if (bp != o->onode.block_map.begin()) {
 	o->onode.block_map.erase(bp--);
@@ -5780,6 +7195,7 @@ int BlueStore::_do_truncate(
     } else {
       assert(bp->first + bp->second.length > alloc_end);
       assert(bp->first < alloc_end);
+      assert(!bp->second.has_flag(bluestore_extent_t::FLAG_COMPRESSED));
       uint64_t newlen = alloc_end - bp->first;
       assert(newlen % min_alloc_size == 0);
       dout(20) << __func__ << " trunc " << bp->first << ": " << bp->second
@@ -5818,6 +7234,7 @@ int BlueStore::_do_truncate(
 	op->op = bluestore_wal_op_t::OP_ZERO;
 	op->extent.offset = bp->second.offset + x_off;
 	op->extent.length = x_len;
+	bp->second.calc_csum_zero(x_off, x_len);
 	dout(20) << __func__ << "  wal zero " << x_off << "~" << x_len
 		 << " " << op->extent << dendl;
       }
@@ -5836,6 +7253,7 @@ int BlueStore::_do_truncate(
 	op->op = bluestore_wal_op_t::OP_ZERO;
 	op->extent.offset = bp->second.offset + offset - bp->first;
 	op->extent.length = block_size - offset % block_size;
+	bp->second.calc_csum_zero(offset - bp->first, op->extent.length);
 	dout(20) << __func__ << " wal zero tail " << offset << "~" << z_len
 		 << " at " << op->extent << dendl;
       }
@@ -6189,10 +7607,10 @@ int BlueStore::_clone(TransContext *txc,
     bool marked = false;
     for (auto& p : oldo->onode.block_map) {
       if (p.second.has_flag(bluestore_extent_t::FLAG_SHARED)) {
-	e->ref_map.get(p.second.offset, p.second.length);
+	e->ref_map.get(p.second.offset, p.second.get_disk_length());
       } else {
 	p.second.set_flag(bluestore_extent_t::FLAG_SHARED);
-	e->ref_map.add(p.second.offset, p.second.length, 2);
+	e->ref_map.add(p.second.offset, p.second.get_disk_length(), 2);
 	marked = true;
       }
     }
@@ -34,6 +34,8 @@
 #include "common/RWLock.h"
 #include "common/WorkQueue.h"
 #include "common/perf_counters.h"
+#include "compressor/AsyncCompressor.h"
+#include "os/ObjectReadahead.h"
 #include "os/ObjectStore.h"
 #include "os/fs/FS.h"
 #include "kv/KeyValueDB.h"
@@ -60,6 +62,26 @@ enum {
   l_bluestore_state_wal_done_lat,
   l_bluestore_state_finishing_lat,
   l_bluestore_state_done_lat,
+  l_bluestore_compress_lat,
+  l_bluestore_decompress_lat,
+  l_bluestore_compress_success_count,
+  l_bluestore_compress_rejected_count,
+  l_bluestore_onodes,
+  l_bluestore_onode_bytes,
+  l_bluestore_onode_hits,
+  l_bluestore_onode_misses,
+  l_bluestore_buffers,
+  l_bluestore_buffer_bytes,
+  l_bluestore_buffer_hit_bytes,
+  l_bluestore_buffer_miss_bytes,
+  l_bluestore_wal_write_ops,
+  l_bluestore_wal_write_ios,
+  l_bluestore_wal_batch_txcs,
+  l_bluestore_kv_lat,
+  l_bluestore_kv_flush_lat,
+  l_bluestore_kv_commit_lat,
+  l_bluestore_kv_finalize_lat,
+  l_bluestore_readahead_bytes,
   l_bluestore_last
 };
 
@@ -125,6 +147,26 @@ public:
     }
   };
 
+  struct Onode;
+  struct OnodeHashLRU;
+  struct Cache;
+
+  /// clean cached data for a logical range of an object
+  struct Buffer {
+    Onode *onode;      ///< owner
+    uint64_t offset;   ///< logical offset in the object
+    bufferlist data;
+    bool hot;          ///< on the hot (lru, or 2q am) list
+    boost::intrusive::list_member_hook<> lru_item;
+
+    Buffer(Onode *o, uint64_t off)
+      : onode(o), offset(off), hot(false) {}
+
+    uint64_t end() const {
+      return offset + data.length();
+    }
+  };
+
   /// an in-memory object
   struct Onode {
     std::atomic_int nref;  ///< reference count
@@ -133,6 +175,11 @@ public:
     string key;     ///< key under PREFIX_OBJ where we are stored
     boost::intrusive::list_member_hook<> lru_item;
 
+    Cache *cache;          ///< shard we are accounted in; protected by its lock
+    OnodeHashLRU *owner;   ///< map we are cached in, if any
+    uint64_t cache_bytes;  ///< bytes charged for the onode itself
+    map<uint64_t,Buffer*> buffer_map;  ///< cached data, by logical offset
+
     EnodeRef enode;  ///< ref to Enode [optional]
 
     bluestore_onode_t onode;  ///< metadata stored as value in kv store
@@ -150,11 +197,19 @@ public:
       : nref(0),
 	oid(o),
 	key(k),
+	cache(NULL),
+	owner(NULL),
+	cache_bytes(0),
 	dirty(false),
 	exists(false) {
     }
 
     void flush();
+
+    /// drop cached data and re-account our size; call when modified
+    void invalidate_cache();
+    /// estimate of our in-memory footprint
+    uint64_t estimate_bytes() const;
     void get() {
       ++nref;
     }
@@ -170,27 +225,110 @@ public:
   };
   typedef boost::intrusive_ptr<Onode> OnodeRef;
 
-  struct OnodeHashLRU {
+  /**
+   * One shard of the onode and data cache, bounded in bytes.
+   *
+   * Collections are spread over shards by hash, and each shard has its
+   * own lock, so OSD shards working on different PGs rarely contend.  The
+   * lock also protects the OnodeHashLRU maps of every collection in the
+   * shard and the buffer_map of every onode in them.
+   *
+   * Onodes are kept in lru order and may use up to
+   * bluestore_cache_meta_ratio of the shard; data buffers use the rest.
+   * Buffers are kept either in lru order or with 2Q, where buffers read
+   * once sit in a fifo (a1in) and only move to the lru (am) when they are
+   * read again or re-read soon after eviction (a1out, kept as ghosts).
+   */
+  struct Cache {
     typedef boost::intrusive::list<
       Onode,
       boost::intrusive::member_hook<
         Onode,
 	boost::intrusive::list_member_hook<>,
-	&Onode::lru_item> > lru_list_t;
+	&Onode::lru_item> > onode_lru_list_t;
+    typedef boost::intrusive::list<
+      Buffer,
+      boost::intrusive::member_hook<
+        Buffer,
+	boost::intrusive::list_member_hook<>,
+	&Buffer::lru_item> > buffer_lru_list_t;
 
     std::mutex lock;
+    PerfCounters *logger;
+    uint64_t max_bytes;
+    bool use_2q;
+
+    onode_lru_list_t onode_lru;
+    buffer_lru_list_t buffer_hot;    ///< lru, or 2q am
+    buffer_lru_list_t buffer_warm;   ///< 2q a1in
+    uint64_t onode_bytes, buffer_bytes, buffer_warm_bytes;
+
+    /// 2q a1out: recently evicted a1in buffers, by (onode key, offset)
+    typedef pair<string,uint64_t> ghost_key_t;
+    struct ghost_key_hash {
+      size_t operator()(const ghost_key_t& k) const {
+	return std::hash<string>()(k.first) ^
+	  (std::hash<uint64_t>()(k.second) * 0x9e3779b97f4a7c15ull);
+      }
+    };
+    typedef list<pair<ghost_key_t,uint64_t> > ghost_list_t;
+    ghost_list_t ghost_list;  ///< (key, length), newest first
+    ceph::unordered_map<ghost_key_t, ghost_list_t::iterator,
+			ghost_key_hash> ghost_map;
+    uint64_t ghost_bytes;
+
+    Cache(PerfCounters *l, uint64_t max, bool q)
+      : logger(l),
+	max_bytes(max),
+	use_2q(q),
+	onode_bytes(0),
+	buffer_bytes(0),
+	buffer_warm_bytes(0),
+	ghost_bytes(0) {}
+    ~Cache() {
+      assert(onode_lru.empty());
+      assert(buffer_hot.empty() && buffer_warm.empty());
+    }
+
+    void _add_onode(Onode *o);
+    void _touch_onode(Onode *o);
+    void _rm_onode(Onode *o);
+    void _adjust_onode(Onode *o);
+
+    bool _read_buffers(Onode *o, uint64_t offset, uint64_t length,
+		       bufferlist *bl);
+    void _add_buffer(Onode *o, uint64_t offset, bufferlist& bl);
+    void _rm_buffer(Buffer *b, bool ghost);
+    void _discard_buffers(Onode *o, uint64_t offset, uint64_t length);
+    void _discard_buffers(Onode *o) {
+      _discard_buffers(o, 0, (uint64_t)-1);
+    }
+
+    /// cached read; false unless all of offset~length is cached
+    bool read(Onode *o, uint64_t offset, uint64_t length, bufferlist *bl);
+    /// remember clean data just read from disk
+    void add(Onode *o, uint64_t offset, bufferlist& bl);
+
+    void trim();
+    void _trim();
+  };
+
+  /// per-collection onode map; lru order and locking live in the Cache
+  struct OnodeHashLRU {
+    Cache *cache;
     ceph::unordered_map<ghobject_t,OnodeRef> onode_map;  ///< forward lookups
-    lru_list_t lru;                                      ///< lru
 
-    OnodeHashLRU() {}
+    explicit OnodeHashLRU(Cache *c) : cache(c) {}
+    ~OnodeHashLRU() {
+      clear();
+    }
 
     void add(const ghobject_t& oid, OnodeRef o);
-    void _touch(OnodeRef o);
     OnodeRef lookup(const ghobject_t& o);
     void rename(const ghobject_t& old_oid, const ghobject_t& new_oid);
     void clear();
     bool get_next(const ghobject_t& after, pair<ghobject_t,OnodeRef> *next);
-    int trim(int max=-1);
+    void _rm(Onode *o);
   };
 
   struct Collection : public CollectionImpl {
@@ -201,12 +339,13 @@ public:
 
     bool exists;
 
-    // cache onodes on a per-collection basis to avoid lock
-    // contention.
+    Cache *cache;            ///< our shard of the onode and data cache
     OnodeHashLRU onode_map;
 
     EnodeSet enode_set;      ///< open Enodes
 
+    pool_opts_t pool_opts;   ///< options of the pool we belong to
+
     OnodeRef get_onode(const ghobject_t& oid, bool create);
     EnodeRef get_enode(uint32_t hash);
 
@@ -316,6 +455,9 @@ public:
 
     interval_set<uint64_t> allocated, released;
 
+    /// raw contents of extents we compressed, by disk offset
+    map<uint64_t,bufferlist> compressed_raw;
+
     IOContext ioc;
 
     CollectionRef first_collection;  ///< first referenced collection
@@ -341,6 +483,7 @@ public:
     }
 
     void write_onode(OnodeRef &o) {
+      o->invalidate_cache();
       onodes.insert(o);
     }
     void write_enode(EnodeRef &e) {
@@ -410,13 +553,21 @@ public:
     }
   };
 
-  class WALWQ : public ThreadPool::WorkQueue<TransContext> {
+  /// wal writes of a batch of txcs, by device block, not yet issued
+  struct WALBatch {
+    map<uint64_t,bufferptr> blocks;  ///< block offset -> contents
+    uint64_t block_size;
+    explicit WALBatch(uint64_t bs) : block_size(bs) {}
+  };
+
+  class WALWQ : public ThreadPool::BatchWorkQueue<TransContext> {
     // We need to order WAL items within each Sequencer.  To do that,
-    // queue each txc under osr, and queue the osr's here.  When we
-    // dequeue an txc, requeue the osr if there are more pending, and
-    // do it at the end of the list so that the next thread does not
-    // get a conflicted txc.  Hold an osr mutex while doing the wal to
-    // preserve the ordering.
+    // queue each txc under osr, and queue the osr's here.  A batch takes
+    // the queued txcs of as many osrs as it can (up to
+    // bluestore_wal_max_batch txcs), holding each osr's mutex while the
+    // wal is applied to preserve the ordering.  If an osr still has
+    // pending txcs it is requeued at the end of the list so that the
+    // next thread does not get a conflicted txc.
   public:
     typedef boost::intrusive::list<
       OpSequencer,
@@ -431,7 +582,8 @@ public:
 
   public:
     WALWQ(BlueStore *s, time_t ti, time_t sti, ThreadPool *tp)
-      : ThreadPool::WorkQueue<TransContext>("BlueStore::WALWQ", ti, sti, tp),
+      : ThreadPool::BatchWorkQueue<TransContext>("BlueStore::WALWQ", ti, sti,
+						 tp),
 	store(s) {
     }
     bool _empty() {
@@ -447,26 +599,46 @@ public:
     void _dequeue(TransContext *p) {
       assert(0 == "not needed, not implemented");
     }
-    TransContext *_dequeue() {
-      if (wal_queue.empty())
-	return NULL;
-      OpSequencer *osr = &wal_queue.front();
-      TransContext *i = &osr->wal_q.front();
-      osr->wal_q.pop_front();
-      wal_queue.pop_front();
-      if (!osr->wal_q.empty()) {
-	// requeue at the end to minimize contention
-	wal_queue.push_back(*i->osr);
+    void _dequeue(list<TransContext*> *out) {
+      unsigned max = MAX(g_conf->bluestore_wal_max_batch, 1);
+      wal_osr_queue_t::iterator p = wal_queue.begin();
+      while (p != wal_queue.end() && out->size() < max) {
+	OpSequencer *osr = &*p;
+	// take the osr lock while still holding the queue lock.  wait for
+	// the first osr; skip any others another thread is applying.
+	if (out->empty()) {
+	  osr->wal_apply_lock.lock();
+	} else if (!osr->wal_apply_lock.try_lock()) {
+	  ++p;
+	  continue;
+	}
+	while (!osr->wal_q.empty() && out->size() < max) {
+	  out->push_back(&osr->wal_q.front());
+	  osr->wal_q.pop_front();
+	}
+	p = wal_queue.erase(p);
+	if (!osr->wal_q.empty()) {
+	  // the batch is full; requeue at the end to minimize contention
+	  wal_queue.push_back(*osr);
+	}
       }
-
-      // preserve wal ordering for this sequencer by taking the lock
-      // while still holding the queue lock
-      i->osr->wal_apply_lock.lock();
-      return i;
     }
-    void _process(TransContext *i, ThreadPool::TPHandle &) override {
-      store->_wal_apply(i);
-      i->osr->wal_apply_lock.unlock();
+    void _process(const list<TransContext*> &items,
+		  ThreadPool::TPHandle &) override {
+      // the txcs may be gone once applied; remember their osrs
+      vector<OpSequencerRef> osrs;
+      for (list<TransContext*>::const_iterator i = items.begin();
+	   i != items.end();
+	   ++i) {
+	if (osrs.empty() || osrs.back() != (*i)->osr)
+	  osrs.push_back((*i)->osr);
+      }
+      store->_wal_apply(items);
+      for (vector<OpSequencerRef>::iterator p = osrs.begin();
+	   p != osrs.end();
+	   ++p) {
+	(*p)->wal_apply_lock.unlock();
+      }
     }
     void _clear() {
       assert(wal_queue.empty());
@@ -490,6 +662,14 @@ public:
       return NULL;
     }
   };
+  struct KVFinalizeThread : public Thread {
+    BlueStore *store;
+    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_kv_finalize_thread();
+      return NULL;
+    }
+  };
 
   // --------------------------------------------------------
   // members
@@ -502,6 +682,12 @@ private:
   BlockDevice *bdev;
   FreelistManager *fm;
   Allocator *alloc;
+  int csum_type;              ///< bluestore_extent_t::CSUM_* for new extents
+  unsigned csum_chunk_order;  ///< log2 csum chunk size for new extents
+  AsyncCompressor *async_compressor;
+  int async_comp_alg;         ///< bluestore_extent_t::COMP_ALG_* it implements
+  std::mutex compressor_lock;
+  map<int,CompressorRef> compressors;  ///< by COMP_ALG_*
   uuid_d fsid;
   int path_fd;  ///< open handle to $path
   int fsid_fd;  ///< open handle (locked) to $path/fsid
@@ -510,6 +696,8 @@ private:
   RWLock coll_lock;    ///< rwlock to protect coll_map
   ceph::unordered_map<coll_t, CollectionRef> coll_map;
 
+  vector<Cache*> cache_shards;  ///< onode and data cache, by collection hash
+
   std::mutex nid_lock;
   uint64_t nid_last;
   uint64_t nid_max;
@@ -526,6 +714,12 @@ private:
 
   Finisher finisher;
 
+  // sequential readers: prefetch into the buffer cache from our own
+  // thread, so the read that triggers it does not wait
+  ObjectReadahead readahead;
+  Finisher readahead_finisher;
+  struct C_Readahead;
+
   KVSyncThread kv_sync_thread;
   std::mutex kv_lock;
   std::condition_variable kv_cond, kv_sync_cond;
@@ -533,6 +727,16 @@ private:
   deque<TransContext*> kv_queue, kv_committing;
   deque<TransContext*> wal_cleanup_queue, wal_cleaning;
 
+  // committed batches are completed by the finalize thread, so that the
+  // kv thread can commit the next batch meanwhile
+  KVFinalizeThread kv_finalize_thread;
+  std::mutex kv_finalize_lock;
+  std::condition_variable kv_finalize_cond, kv_finalize_sync_cond;
+  bool kv_finalize_stop;
+  bool kv_finalize_in_progress;
+  deque<TransContext*> kv_committed, wal_cleaned;
+  list<TransContext*> kv_wal_apply;  ///< sync wal apply batch (finalize thread)
+
   PerfCounters *logger;
 
   std::mutex reap_lock;
@@ -556,8 +760,14 @@ private:
   void _close_bdev();
   int _open_db(bool create);
   void _close_db();
-  int _open_alloc();
+  int _open_alloc(bool create);
   void _close_alloc();
+  int _set_csum();
+  void _open_compressor();
+  void _close_compressor();
+  CompressorRef _get_compressor(int alg);
+  int _compress(int alg, bufferlist& in, bufferlist *out);
+  int _decompress(int alg, bufferlist& in, bufferlist *out);
   int _open_collections(int *errors=0);
   void _close_collections();
 
@@ -603,7 +813,11 @@ private:
 
   void _osr_reap_done(OpSequencer *osr);
 
+  void _txc_update_fm(TransContext *txc);
+  void _kv_sync_update_fm(KeyValueDB::Transaction t,
+			  vector<bluestore_extent_t> *bluefs_gift_extents);
   void _kv_sync_thread();
+  void _kv_finalize_thread();
   void _kv_stop() {
     {
       std::lock_guard<std::mutex> l(kv_lock);
@@ -612,16 +826,38 @@ private:
     }
     kv_sync_thread.join();
     kv_stop = false;
+    {
+      std::lock_guard<std::mutex> l(kv_finalize_lock);
+      kv_finalize_stop = true;
+      kv_finalize_cond.notify_all();
+    }
+    kv_finalize_thread.join();
+    kv_finalize_stop = false;
   }
 
   bluestore_wal_op_t *_get_wal_op(TransContext *txc, OnodeRef o);
   int _wal_apply(TransContext *txc);
+  int _wal_apply(const list<TransContext*>& txcs);
   int _wal_finish(TransContext *txc);
-  int _do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc);
+  int _do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc, WALBatch *batch);
+  void _wal_read_block(uint64_t offset, bufferlist *bl, IOContext *ioc,
+		       WALBatch *batch);
+  void _wal_batch_write(WALBatch *batch, uint64_t offset, bufferlist& bl);
+  void _wal_batch_submit(WALBatch *batch, IOContext *ioc);
   int _wal_replay();
 
   // for fsck
-  int _verify_enode_shared(EnodeRef enode, vector<bluestore_extent_t>& v);
+  struct FsckState;
+  class FsckHook;
+  int _verify_enode_shared(EnodeRef enode, vector<bluestore_extent_t>& v,
+			   interval_set<uint64_t> *span);
+  bool _fsck_mark_used(FsckState& st, uint64_t offset, uint64_t length);
+  void _fsck_collection(FsckState& st, CollectionRef c);
+  int _fsck_onode(FsckState& st, const ghobject_t& oid,
+		  const bluestore_onode_t& onode,
+		  vector<bluestore_extent_t> *hash_shared);
+  int _fsck_enode(FsckState& st, EnodeRef enode,
+		  vector<bluestore_extent_t>& hash_shared);
 
 public:
   BlueStore(CephContext *cct, const string& path);
@@ -643,7 +879,13 @@ public:
   int umount();
   void _sync();
 
-  int fsck();
+  int fsck(bool deep);
+
+  /// for fsck tests: damage a mounted, idle store behind its back
+  void inject_leaked(uint64_t len);
+  void inject_misreference(const coll_t& cid, const ghobject_t& oid1,
+			   const ghobject_t& oid2);
+  void inject_shared_ref(const coll_t& cid, const ghobject_t& oid);
 
   unsigned get_max_object_name_length() {
     return 4096;
@@ -694,6 +936,14 @@ public:
     size_t len,
     bufferlist& bl,
     uint32_t op_flags = 0);
+  int _do_read_compressed(
+    OnodeRef o,
+    uint64_t x_offset,
+    const bluestore_extent_t& e,
+    bufferlist *raw,
+    bool buffered);
+  void _readahead(CollectionRef c, const ghobject_t& oid,
+		  uint64_t offset, uint64_t length);
 
   int fiemap(const coll_t& cid, const ghobject_t& oid,
 	     uint64_t offset, size_t len, bufferlist& bl) override;
@@ -717,6 +967,7 @@ public:
   bool collection_exists(const coll_t& c);
   bool collection_empty(const coll_t& c);
   int collection_bits(const coll_t& c);
+  int set_collection_opts(const coll_t& cid, const pool_opts_t& opts) override;
 
   int collection_list(const coll_t& cid, ghobject_t start, ghobject_t end,
 		      bool sort_bitwise, int max,
@@ -853,6 +1104,11 @@ private:
   void _pad_zeros_tail(OnodeRef o, bufferlist *bl,
 		       uint64_t offset, uint64_t *length,
 		       uint64_t block_size);
+  void _do_release_range(TransContext *txc,
+			 CollectionRef& c,
+			 OnodeRef o,
+			 uint64_t offset, uint64_t length,
+			 uint64_t *hint);
   int _do_allocate(TransContext *txc,
 		   CollectionRef& c,
 		   OnodeRef o,
@@ -867,6 +1123,31 @@ private:
 		uint64_t offset, uint64_t length,
 		bufferlist& bl,
 		uint32_t fadvise_flags);
+  bool _want_compress(CollectionRef& c, uint32_t fadvise_flags,
+		      int *alg, double *required_ratio);
+  int _do_write_compressed(TransContext *txc,
+			   CollectionRef &c,
+			   OnodeRef o,
+			   uint64_t offset, uint64_t length,
+			   bufferlist& bl,
+			   uint32_t fadvise_flags,
+			   int alg, double required_ratio);
+  int _do_write_compressed_unit(TransContext *txc,
+				CollectionRef &c,
+				OnodeRef o,
+				uint64_t offset,
+				bufferlist& raw,
+				bufferlist& cbl,
+				int alg,
+				bool buffered);
+  int _do_decompress_extent(TransContext *txc,
+			    CollectionRef &c,
+			    OnodeRef o,
+			    map<uint64_t,bluestore_extent_t>::iterator bp);
+  int _do_decompress_range(TransContext *txc,
+			   CollectionRef &c,
+			   OnodeRef o,
+			   uint64_t offset, uint64_t length);
   int _touch(TransContext *txc,
 	     CollectionRef& c,
 	     OnodeRef& o);
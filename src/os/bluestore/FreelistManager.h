@@ -5,51 +5,50 @@
 #define CEPH_OS_BLUESTORE_FREELISTMANAGER_H
 
 #include <string>
-#include <map>
-#include <mutex>
 #include <ostream>
 #include "kv/KeyValueDB.h"
 
-#include "include/cpp-btree/btree_map.h"
-
+/**
+ * Persistent record of which device extents are free.
+ *
+ * A new store starts with no free space; the caller releases what it
+ * wants to make available.
+ */
 class FreelistManager {
-  std::string prefix;
-  std::mutex lock;
-  uint64_t total_free;
-
-  typedef btree::btree_map<uint64_t,uint64_t> map_t;
-  static const bool map_t_has_stable_iterators = false;
-
-  map_t kv_free;    ///< mirrors our kv values in the db
+public:
+  FreelistManager() {}
+  virtual ~FreelistManager() {}
 
-  void _audit();
-  void _dump();
+  /// create a freelist of the given type ("extent" or "bitmap")
+  static FreelistManager *create(
+    std::string type,
+    KeyValueDB *kvdb,
+    std::string prefix,
+    std::string bitmap_prefix);
 
-public:
-  FreelistManager() :
-    total_free(0) {
-  }
+  /// register the merge operators needed by any freelist type
+  static void setup_merge_operators(KeyValueDB *kvdb,
+				    std::string bitmap_prefix);
 
-  int init(KeyValueDB *kvdb, std::string prefix);
-  void shutdown();
+  /// initialize on-disk state for a new device (mkfs)
+  virtual int create(uint64_t size, uint64_t block_size,
+		     KeyValueDB::Transaction txn) = 0;
 
-  void dump();
+  virtual int init() = 0;
+  virtual void shutdown() = 0;
 
-  uint64_t get_total_free() {
-    std::lock_guard<std::mutex> l(lock);
-    return total_free;
-  }
+  virtual void dump() = 0;
 
-  const map_t& get_freelist() {
-    return kv_free;
-  }
+  /// walk the free extents in offset order
+  virtual void enumerate_reset() = 0;
+  virtual bool enumerate_next(uint64_t *offset, uint64_t *length) = 0;
 
-  int allocate(
+  virtual int allocate(
     uint64_t offset, uint64_t length,
-    KeyValueDB::Transaction txn);
-  int release(
+    KeyValueDB::Transaction txn) = 0;
+  virtual int release(
     uint64_t offset, uint64_t length,
-    KeyValueDB::Transaction txn);
+    KeyValueDB::Transaction txn) = 0;
 };
 
 
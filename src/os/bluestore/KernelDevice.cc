@@ -37,11 +37,9 @@ KernelDevice::KernelDevice(aio_callback_t cb, void *cbpriv)
     fs(NULL), aio(false), dio(false),
     debug_lock("KernelDevice::debug_lock"),
     flush_lock("KernelDevice::flush_lock"),
-    aio_queue(g_conf->bdev_aio_max_queue_depth),
     aio_callback(cb),
     aio_callback_priv(cbpriv),
     aio_stop(false),
-    aio_thread(this),
     injecting_crash(0)
 {
   zeros = buffer::create_page_aligned(1048576);
@@ -200,13 +198,25 @@ int KernelDevice::flush()
 int KernelDevice::_aio_start()
 {
   if (aio) {
-    dout(10) << __func__ << dendl;
-    int r = aio_queue.init();
-    if (r < 0) {
-      derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
-      return r;
+    unsigned n = MAX(g_conf->bdev_aio_queues, 1);
+    dout(10) << __func__ << " " << n << " queues"
+	     << (g_conf->bdev_aio_busy_poll ? ", busy polling" : "") << dendl;
+    assert(aio_shards.empty());
+    for (unsigned i = 0; i < n; ++i) {
+      AioShard *shard = new AioShard(this, i,
+				     g_conf->bdev_aio_max_queue_depth);
+      int r = shard->aio_queue.init();
+      if (r < 0) {
+	derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+	delete shard;
+	_aio_stop();
+	return r;
+      }
+      aio_shards.push_back(shard);
+    }
+    for (auto shard : aio_shards) {
+      shard->aio_thread.create("bstore_aio");
     }
-    aio_thread.create("bstore_aio");
   }
   return 0;
 }
@@ -216,22 +226,32 @@ void KernelDevice::_aio_stop()
   if (aio) {
     dout(10) << __func__ << dendl;
     aio_stop = true;
-    aio_thread.join();
+    for (auto shard : aio_shards) {
+      if (shard->aio_thread.is_started())
+	shard->aio_thread.join();
+    }
     aio_stop = false;
-    aio_queue.shutdown();
+    for (auto shard : aio_shards) {
+      _aio_reap(shard);
+      shard->aio_queue.shutdown();
+      delete shard;
+    }
+    aio_shards.clear();
   }
 }
 
-void KernelDevice::_aio_thread()
+void KernelDevice::_aio_thread(unsigned n)
 {
-  dout(10) << __func__ << " start" << dendl;
-  int inject_crash_count = 0;
+  dout(10) << __func__ << " " << n << " start" << dendl;
+  AioShard *shard = aio_shards[n];
+  bool busy_poll = g_conf->bdev_aio_busy_poll;
+  int poll_ms = busy_poll ? 0 : g_conf->bdev_aio_poll_ms;
+  utime_t start = ceph_clock_now(NULL);
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
     int max = 16;
     FS::aio_t *aio[max];
-    int r = aio_queue.get_next_completed(g_conf->bdev_aio_poll_ms,
-					 aio, max);
+    int r = shard->aio_queue.get_next_completed(poll_ms, aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
     }
@@ -256,10 +276,10 @@ void KernelDevice::_aio_thread()
 	}
       }
     }
-    reap_ioc();
+    _aio_reap(shard);
     if (g_conf->bdev_inject_crash) {
-      ++inject_crash_count;
-      if (inject_crash_count * g_conf->bdev_aio_poll_ms / 1000 >
+      utime_t elapsed = ceph_clock_now(NULL) - start;
+      if (elapsed.sec() >
 	  g_conf->bdev_inject_crash + g_conf->bdev_inject_crash_flush_delay) {
 	derr << __func__ << " bdev_inject_crash trigger from aio thread"
 	     << dendl;
@@ -268,7 +288,35 @@ void KernelDevice::_aio_thread()
       }
     }
   }
-  dout(10) << __func__ << " end" << dendl;
+  dout(10) << __func__ << " " << n << " end" << dendl;
+}
+
+void KernelDevice::_aio_reap(AioShard *shard)
+{
+  if (shard->reap_count.load()) {
+    std::lock_guard<std::mutex> l(shard->reap_lock);
+    for (auto p : shard->reap_queue) {
+      dout(20) << __func__ << " reap ioc " << p << dendl;
+      delete p;
+    }
+    shard->reap_queue.clear();
+    --shard->reap_count;
+  }
+}
+
+void KernelDevice::queue_reap_ioc(IOContext *ioc)
+{
+  if (aio_shards.empty()) {
+    BlockDevice::queue_reap_ioc(ioc);
+    return;
+  }
+  // the ioc may still be in use by the thread that completed it, so only
+  // that thread may free it
+  AioShard *shard = _get_aio_shard(ioc);
+  std::lock_guard<std::mutex> l(shard->reap_lock);
+  if (shard->reap_count.load() == 0)
+    ++shard->reap_count;
+  shard->reap_queue.push_back(ioc);
 }
 
 void KernelDevice::_aio_log_start(
@@ -319,6 +367,9 @@ void KernelDevice::aio_submit(IOContext *ioc)
   ioc->num_pending -= pending;
   assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
 
+  // every aio of an ioc goes to the same queue; see _aio_reap
+  AioShard *shard = _get_aio_shard(ioc);
+
   bool done = false;
   while (!done) {
     FS::aio_t& aio = *p;
@@ -339,7 +390,7 @@ void KernelDevice::aio_submit(IOContext *ioc)
     // do not dereference txc (or it's contents) after we submit (if
     // done == true and we don't loop)
     int retries = 0;
-    int r = aio_queue.submit(*cur, &retries);
+    int r = shard->aio_queue.submit(*cur, &retries);
     if (retries)
       derr << __func__ << " retries " << retries << dendl;
     if (r) {
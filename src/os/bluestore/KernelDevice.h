@@ -16,6 +16,7 @@
 #define CEPH_OS_BLUESTORE_KERNELDEVICE_H
 
 #include <atomic>
+#include <mutex>
 
 #include "os/fs/FS.h"
 #include "include/interval_set.h"
@@ -37,23 +38,48 @@ class KernelDevice : public BlockDevice {
   Mutex flush_lock;
   atomic_t io_since_flush;
 
-  FS::aio_queue_t aio_queue;
   aio_callback_t aio_callback;
   void *aio_callback_priv;
   bool aio_stop;
 
   struct AioCompletionThread : public Thread {
     KernelDevice *bdev;
-    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    unsigned shard;
+    AioCompletionThread(KernelDevice *b, unsigned s) : bdev(b), shard(s) {}
     void *entry() {
-      bdev->_aio_thread();
+      bdev->_aio_thread(shard);
       return NULL;
     }
-  } aio_thread;
+  };
+
+  /**
+   * One aio context and the thread that reaps its completions.
+   *
+   * An IOContext always maps to the same shard, so all of its aios
+   * complete in one thread and that thread may safely reap it once the
+   * owner is done with it.
+   */
+  struct AioShard {
+    FS::aio_queue_t aio_queue;
+    AioCompletionThread aio_thread;
+    std::mutex reap_lock;
+    vector<IOContext*> reap_queue;
+    std::atomic_int reap_count = {0};
+
+    AioShard(KernelDevice *b, unsigned s, unsigned max_iodepth)
+      : aio_queue(max_iodepth), aio_thread(b, s) {}
+  };
+  vector<AioShard*> aio_shards;
+
+  AioShard *_get_aio_shard(IOContext *ioc) {
+    uint64_t h = (uintptr_t)ioc * 0x9e3779b97f4a7c15ull;
+    return aio_shards[(h >> 32) % aio_shards.size()];
+  }
 
   std::atomic_int injecting_crash;
 
-  void _aio_thread();
+  void _aio_thread(unsigned shard);
+  void _aio_reap(AioShard *shard);
   int _aio_start();
   void _aio_stop();
 
@@ -66,6 +92,7 @@ public:
   KernelDevice(aio_callback_t cb, void *cbpriv);
 
   void aio_submit(IOContext *ioc) override;
+  void queue_reap_ioc(IOContext *ioc) override;
 
   uint64_t get_size() const override {
     return size;
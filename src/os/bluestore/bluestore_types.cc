@@ -14,6 +14,8 @@
 
 #include "bluestore_types.h"
 #include "common/Formatter.h"
+#include "include/crc32c.h"
+#include "include/intarith.h"
 #include "include/stringify.h"
 
 // bluestore_bdev_label_t
@@ -122,14 +124,253 @@ string bluestore_extent_t::get_flags_string(unsigned flags)
       s += '+';
     s += "cow_tail";
   }
+  if (flags & FLAG_COMPRESSED) {
+    if (s.length())
+      s += '+';
+    s += "compressed";
+  }
   return s;
 }
 
+const char *bluestore_extent_t::get_comp_alg_name(unsigned a)
+{
+  switch (a) {
+  case COMP_ALG_NONE: return "none";
+  case COMP_ALG_SNAPPY: return "snappy";
+  case COMP_ALG_ZLIB: return "zlib";
+  }
+  return "???";
+}
+
+int bluestore_extent_t::get_comp_alg_type(const string& s)
+{
+  if (s == "none")
+    return COMP_ALG_NONE;
+  if (s == "snappy")
+    return COMP_ALG_SNAPPY;
+  if (s == "zlib")
+    return COMP_ALG_ZLIB;
+  return -EINVAL;
+}
+
+const char *bluestore_extent_t::get_csum_type_string(unsigned t)
+{
+  switch (t) {
+  case CSUM_NONE: return "none";
+  case CSUM_CRC32C: return "crc32c";
+  }
+  return "???";
+}
+
+int bluestore_extent_t::get_csum_string_type(const string& s)
+{
+  if (s == "none")
+    return CSUM_NONE;
+  if (s == "crc32c")
+    return CSUM_CRC32C;
+  return -EINVAL;
+}
+
+static uint32_t _csum_calc(unsigned type, const char *p, unsigned len)
+{
+  switch (type) {
+  case bluestore_extent_t::CSUM_CRC32C:
+    // a NULL pointer makes ceph_crc32c treat the buffer as zeros
+    return ceph_crc32c(-1, (const unsigned char *)p, len);
+  }
+  assert(0 == "unrecognized csum type");
+  return 0;
+}
+
+static uint32_t _csum_calc(unsigned type, const bufferlist& bl,
+			   uint64_t off, unsigned len)
+{
+  if (bl.buffers().size() == 1) {
+    return _csum_calc(type, bl.buffers().front().c_str() + off, len);
+  }
+  bufferlist t;
+  t.substr_of(bl, off, len);
+  switch (type) {
+  case bluestore_extent_t::CSUM_CRC32C:
+    return t.crc32c(-1);
+  }
+  assert(0 == "unrecognized csum type");
+  return 0;
+}
+
+void bluestore_extent_t::init_csum(unsigned type, unsigned order)
+{
+  csum_type = type;
+  csum_chunk_order = order;
+  csum_data.clear();
+  if (type != CSUM_NONE)
+    csum_data.resize(get_disk_length() >> order, 0);
+}
+
+void bluestore_extent_t::invalidate_csum(uint64_t x_off, uint64_t len)
+{
+  if (!has_csum() || len == 0)
+    return;
+  uint64_t first = x_off >> csum_chunk_order;
+  uint64_t last = (x_off + len - 1) >> csum_chunk_order;
+  for (uint64_t i = first; i <= last && i < csum_data.size(); ++i)
+    csum_data[i] = 0;
+}
+
+void bluestore_extent_t::calc_csum(uint64_t x_off, const bufferlist& bl)
+{
+  if (!has_csum() || bl.length() == 0)
+    return;
+  uint64_t chunk = get_csum_chunk_size();
+  uint64_t end = x_off + bl.length();
+  uint64_t first = ROUND_UP_TO(x_off, chunk);
+  uint64_t last = end & ~(chunk - 1);
+  if (first >= last) {
+    // no whole chunk was written
+    invalidate_csum(x_off, bl.length());
+    return;
+  }
+  invalidate_csum(x_off, first - x_off);
+  invalidate_csum(last, end - last);
+  for (uint64_t pos = first; pos < last; pos += chunk) {
+    uint64_t i = pos >> csum_chunk_order;
+    if (i >= csum_data.size())
+      break;
+    csum_data[i] = _csum_calc(csum_type, bl, pos - x_off, chunk);
+  }
+}
+
+void bluestore_extent_t::calc_csum_zero(uint64_t x_off, uint64_t len)
+{
+  if (!has_csum() || len == 0)
+    return;
+  uint64_t chunk = get_csum_chunk_size();
+  uint64_t end = x_off + len;
+  uint64_t first = ROUND_UP_TO(x_off, chunk);
+  uint64_t last = end & ~(chunk - 1);
+  if (first >= last) {
+    invalidate_csum(x_off, len);
+    return;
+  }
+  invalidate_csum(x_off, first - x_off);
+  invalidate_csum(last, end - last);
+  uint32_t zero_csum = _csum_calc(csum_type, NULL, chunk);
+  for (uint64_t pos = first; pos < last; pos += chunk) {
+    uint64_t i = pos >> csum_chunk_order;
+    if (i >= csum_data.size())
+      break;
+    csum_data[i] = zero_csum;
+  }
+}
+
+int bluestore_extent_t::verify_csum(uint64_t x_off, const bufferlist& bl,
+				    uint64_t *bad_off) const
+{
+  if (!has_csum())
+    return 0;
+  uint64_t chunk = get_csum_chunk_size();
+  assert((x_off & (chunk - 1)) == 0);
+  unsigned count = get_csum_count();
+  for (uint64_t pos = 0; pos + chunk <= bl.length(); pos += chunk) {
+    uint64_t i = (x_off + pos) >> csum_chunk_order;
+    if (i >= count)
+      break;
+    if (csum_data[i] == 0)
+      continue;  // not known
+    if (_csum_calc(csum_type, bl, pos, chunk) != csum_data[i]) {
+      if (bad_off)
+	*bad_off = x_off + pos;
+      return -EIO;
+    }
+  }
+  return 0;
+}
+
+void bluestore_extent_t::split_csum(uint64_t x_off,
+				    bluestore_extent_t *r) const
+{
+  r->clear_csum();
+  if (!has_csum() ||
+      (x_off & (get_csum_chunk_size() - 1)))
+    return;
+  r->csum_type = csum_type;
+  r->csum_chunk_order = csum_chunk_order;
+  unsigned first = x_off >> csum_chunk_order;
+  unsigned count = r->length >> csum_chunk_order;
+  r->csum_data.resize(count, 0);
+  for (unsigned i = 0; i < count && first + i < csum_data.size(); ++i)
+    r->csum_data[i] = csum_data[first + i];
+}
+
+void bluestore_extent_t::encode_csum(bufferlist& bl) const
+{
+  ::encode(csum_type, bl);
+  if (csum_type != CSUM_NONE) {
+    ::encode(csum_chunk_order, bl);
+    // only encode csums for chunks still covered by the extent
+    unsigned count = get_csum_count();
+    ::encode(count, bl);
+    for (unsigned i = 0; i < count; ++i)
+      ::encode(csum_data[i], bl);
+  }
+}
+
+void bluestore_extent_t::decode_csum(bufferlist::iterator& p)
+{
+  ::decode(csum_type, p);
+  csum_data.clear();
+  if (csum_type != CSUM_NONE) {
+    ::decode(csum_chunk_order, p);
+    unsigned count;
+    ::decode(count, p);
+    csum_data.resize(count);
+    for (unsigned i = 0; i < count; ++i)
+      ::decode(csum_data[i], p);
+  } else {
+    csum_chunk_order = 0;
+  }
+}
+
+void bluestore_extent_t::encode_compression(bufferlist& bl) const
+{
+  if (has_flag(FLAG_COMPRESSED)) {
+    ::encode(comp_alg, bl);
+    ::encode(comp_length, bl);
+    ::encode(disk_length, bl);
+  }
+}
+
+void bluestore_extent_t::decode_compression(bufferlist::iterator& p)
+{
+  if (has_flag(FLAG_COMPRESSED)) {
+    ::decode(comp_alg, p);
+    ::decode(comp_length, p);
+    ::decode(disk_length, p);
+  } else {
+    comp_alg = COMP_ALG_NONE;
+    comp_length = 0;
+    disk_length = 0;
+  }
+}
+
 void bluestore_extent_t::dump(Formatter *f) const
 {
   f->dump_unsigned("offset", offset);
   f->dump_unsigned("length", length);
   f->dump_unsigned("flags", flags);
+  if (has_flag(FLAG_COMPRESSED)) {
+    f->dump_string("comp_alg", get_comp_alg_name(comp_alg));
+    f->dump_unsigned("comp_length", comp_length);
+    f->dump_unsigned("disk_length", disk_length);
+  }
+  if (has_csum()) {
+    f->dump_string("csum_type", get_csum_type_string(csum_type));
+    f->dump_unsigned("csum_chunk_order", csum_chunk_order);
+    f->open_array_section("csum_data");
+    for (unsigned i = 0; i < get_csum_count(); ++i)
+      f->dump_unsigned("csum", csum_data[i]);
+    f->close_section();
+  }
 }
 
 void bluestore_extent_t::generate_test_instances(list<bluestore_extent_t*>& o)
@@ -144,6 +385,12 @@ ostream& operator<<(ostream& out, const bluestore_extent_t& e)
   out << e.offset << "~" << e.length;
   if (e.flags)
     out << ":" << bluestore_extent_t::get_flags_string(e.flags);
+  if (e.has_flag(bluestore_extent_t::FLAG_COMPRESSED))
+    out << ":" << bluestore_extent_t::get_comp_alg_name(e.comp_alg)
+	<< "/" << e.comp_length << "/" << e.disk_length;
+  if (e.has_csum())
+    out << ":" << bluestore_extent_t::get_csum_type_string(e.csum_type)
+	<< "/" << e.get_csum_chunk_size();
   return out;
 }
 
@@ -398,7 +645,7 @@ ostream& operator<<(ostream& out, const bluestore_overlay_t& o)
 
 void bluestore_onode_t::encode(bufferlist& bl) const
 {
-  ENCODE_START(1, 1, bl);
+  ENCODE_START(3, 1, bl);
   ::encode(nid, bl);
   ::encode(size, bl);
   ::encode(attrs, bl);
@@ -409,12 +656,16 @@ void bluestore_onode_t::encode(bufferlist& bl) const
   ::encode(omap_head, bl);
   ::encode(expected_object_size, bl);
   ::encode(expected_write_size, bl);
+  for (auto& p : block_map)
+    p.second.encode_csum(bl);
+  for (auto& p : block_map)
+    p.second.encode_compression(bl);
   ENCODE_FINISH(bl);
 }
 
 void bluestore_onode_t::decode(bufferlist::iterator& p)
 {
-  DECODE_START(1, p);
+  DECODE_START(3, p);
   ::decode(nid, p);
   ::decode(size, p);
   ::decode(attrs, p);
@@ -425,6 +676,14 @@ void bluestore_onode_t::decode(bufferlist::iterator& p)
   ::decode(omap_head, p);
   ::decode(expected_object_size, p);
   ::decode(expected_write_size, p);
+  if (struct_v >= 2) {
+    for (auto& q : block_map)
+      q.second.decode_csum(p);
+  }
+  if (struct_v >= 3) {
+    for (auto& q : block_map)
+      q.second.decode_compression(p);
+  }
   DECODE_FINISH(p);
 }
 
@@ -477,6 +736,18 @@ void bluestore_onode_t::dump(Formatter *f) const
 void bluestore_onode_t::generate_test_instances(list<bluestore_onode_t*>& o)
 {
   o.push_back(new bluestore_onode_t());
+  o.push_back(new bluestore_onode_t());
+  o.back()->nid = 1;
+  o.back()->size = 8192;
+  o.back()->block_map[0] = bluestore_extent_t(65536, 8192);
+  o.back()->block_map[0].init_csum(bluestore_extent_t::CSUM_CRC32C, 12);
+  o.back()->block_map[0].csum_data[0] = 0x1234;
+  o.back()->size = 131072;
+  o.back()->block_map[65536] = bluestore_extent_t(
+    131072, 65536, bluestore_extent_t::FLAG_COMPRESSED);
+  o.back()->block_map[65536].comp_alg = bluestore_extent_t::COMP_ALG_SNAPPY;
+  o.back()->block_map[65536].comp_length = 1000;
+  o.back()->block_map[65536].disk_length = 4096;
   // FIXME
 }
 
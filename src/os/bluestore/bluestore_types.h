@@ -61,18 +61,48 @@ struct bluestore_extent_t {
     FLAG_SHARED = 2,      ///< extent is shared by another object, and refcounted
     FLAG_COW_HEAD = 4,    ///< extent has pending wal OP_COPY for head
     FLAG_COW_TAIL = 8,    ///< extent has pending wal OP_COPY for tail
+    FLAG_COMPRESSED = 16, ///< extent holds compressed data; length is logical
   };
   static string get_flags_string(unsigned flags);
 
+  enum {
+    COMP_ALG_NONE = 0,
+    COMP_ALG_SNAPPY = 1,
+    COMP_ALG_ZLIB = 2,
+  };
+  static const char *get_comp_alg_name(unsigned a);
+  static int get_comp_alg_type(const string& s);
+
+  enum {
+    CSUM_NONE = 0,
+    CSUM_CRC32C = 1,
+  };
+  static const char *get_csum_type_string(unsigned t);
+  static int get_csum_string_type(const string& s);
+
   uint64_t offset;
   uint32_t length;
   uint32_t flags;  /// or reserved
 
+  uint8_t csum_type;          ///< CSUM_*
+  uint8_t csum_chunk_order;   ///< csum chunk size is 1 << csum_chunk_order
+  vector<uint32_t> csum_data; ///< one csum per chunk; 0 == not known
+
+  uint8_t comp_alg;           ///< COMP_ALG_*, if FLAG_COMPRESSED
+  uint32_t comp_length;       ///< bytes of compressed data, if FLAG_COMPRESSED
+  uint32_t disk_length;       ///< bytes allocated on disk, if FLAG_COMPRESSED
+
   bluestore_extent_t(uint64_t o=0, uint32_t l=0, uint32_t f=0)
-    : offset(o), length(l), flags(f) {}
+    : offset(o), length(l), flags(f),
+      csum_type(CSUM_NONE), csum_chunk_order(0),
+      comp_alg(COMP_ALG_NONE), comp_length(0), disk_length(0) {}
 
+  /// length of the extent on disk (differs from length if compressed)
+  uint32_t get_disk_length() const {
+    return has_flag(FLAG_COMPRESSED) ? disk_length : length;
+  }
   uint64_t end() const {
-    return offset + length;
+    return offset + get_disk_length();
   }
 
   bool has_flag(unsigned f) const {
@@ -85,6 +115,45 @@ struct bluestore_extent_t {
     flags &= ~f;
   }
 
+  bool has_csum() const {
+    return csum_type != CSUM_NONE;
+  }
+  uint64_t get_csum_chunk_size() const {
+    return 1ull << csum_chunk_order;
+  }
+  /// number of csum chunks that still fall within the extent
+  unsigned get_csum_count() const {
+    return std::min<unsigned>(csum_data.size(),
+			      get_disk_length() >> csum_chunk_order);
+  }
+
+  /// start tracking checksums; all chunks begin as unknown
+  void init_csum(unsigned type, unsigned order);
+  /// forget all checksums
+  void clear_csum() {
+    csum_type = CSUM_NONE;
+    csum_chunk_order = 0;
+    csum_data.clear();
+  }
+  /// mark chunks overlapping x_off~len as unknown
+  void invalidate_csum(uint64_t x_off, uint64_t len);
+  /// update csums for data written at x_off (partial chunks are invalidated)
+  void calc_csum(uint64_t x_off, const bufferlist& bl);
+  /// update csums for zeros written at x_off~len
+  void calc_csum_zero(uint64_t x_off, uint64_t len);
+  /**
+   * verify data read from x_off against the stored csums
+   *
+   * @param x_off offset within the extent (chunk aligned)
+   * @param bl data read
+   * @param bad_off [out] extent offset of the first bad chunk
+   * @returns 0 on success, -EIO on mismatch
+   */
+  int verify_csum(uint64_t x_off, const bufferlist& bl,
+		  uint64_t *bad_off) const;
+  /// move the csums covering [x_off, end) to r (x_off must be chunk aligned)
+  void split_csum(uint64_t x_off, bluestore_extent_t *r) const;
+
   void encode(bufferlist& bl) const {
     ::encode(offset, bl);
     ::encode(length, bl);
@@ -95,6 +164,11 @@ struct bluestore_extent_t {
     ::decode(length, p);
     ::decode(flags, p);
   }
+  void encode_csum(bufferlist& bl) const;
+  void decode_csum(bufferlist::iterator& p);
+  /// compression metadata; nothing is encoded unless FLAG_COMPRESSED is set
+  void encode_compression(bufferlist& bl) const;
+  void decode_compression(bufferlist::iterator& p);
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_extent_t*>& o);
 };
@@ -17,6 +17,8 @@
 
 #include "common/debug.h"
 #include "common/config.h"
+#include "common/perf_counters.h"
+#include "os/ObjectStore.h"
 #include "include/assert.h"
 
 #define dout_subsys ceph_subsys_filestore
@@ -1073,41 +1075,102 @@ int DBObjectMap::write_state(KeyValueDB::Transaction _t) {
 }
 
 
-DBObjectMap::Header DBObjectMap::_lookup_map_header(
-  const MapHeaderLock &l,
-  const ghobject_t &oid)
+void DBObjectMap::lock_cache_shard(HeaderCacheShard *shard)
 {
-  assert(l.get_locked() == oid);
+  if (shard->lock.TryLock())
+    return;
+  if (!logger) {
+    shard->lock.Lock();
+    return;
+  }
+  utime_t start = ceph_clock_now(g_ceph_context);
+  shard->lock.Lock();
+  logger->tinc(l_os_omap_cache_lock_wait,
+	       ceph_clock_now(g_ceph_context) - start);
+}
 
-  _Header *header = new _Header();
-  {
-    Mutex::Locker l(cache_lock);
-    if (caches.lookup(oid, header)) {
-      assert(!in_use.count(header->seq));
-      in_use.insert(header->seq);
-      return Header(header, RemoveOnDelete(this));
+bool DBObjectMap::cache_lookup(const ghobject_t &oid, _Header *out)
+{
+  HeaderCacheShard *shard = get_cache_shard(oid);
+  lock_cache_shard(shard);
+  auto p = shard->contents.find(oid);
+  bool hit = p != shard->contents.end();
+  if (hit) {
+    *out = p->second->second;
+    shard->lru.splice(shard->lru.begin(), shard->lru, p->second);
+  }
+  shard->lock.Unlock();
+  if (logger)
+    logger->inc(hit ? l_os_omap_cache_hit : l_os_omap_cache_miss);
+  return hit;
+}
+
+void DBObjectMap::cache_add(const ghobject_t &oid, const _Header &header)
+{
+  HeaderCacheShard *shard = get_cache_shard(oid);
+  lock_cache_shard(shard);
+  auto p = shard->contents.find(oid);
+  if (p != shard->contents.end()) {
+    p->second->second = header;
+    shard->lru.splice(shard->lru.begin(), shard->lru, p->second);
+  } else {
+    shard->lru.push_front(make_pair(oid, header));
+    shard->contents[oid] = shard->lru.begin();
+    while (shard->lru.size() > shard->max_size) {
+      shard->contents.erase(shard->lru.back().first);
+      shard->lru.pop_back();
     }
   }
+  shard->lock.Unlock();
+}
 
-  bufferlist out;
-  int r = db->get(HOBJECT_TO_SEQ, map_header_key(oid), &out);
-  if (r < 0 || out.length()==0) {
-    delete header;
-    return Header();
+void DBObjectMap::cache_clear(const ghobject_t &oid)
+{
+  HeaderCacheShard *shard = get_cache_shard(oid);
+  lock_cache_shard(shard);
+  auto p = shard->contents.find(oid);
+  if (p != shard->contents.end()) {
+    shard->lru.erase(p->second);
+    shard->contents.erase(p);
   }
+  shard->lock.Unlock();
+}
+
+bool DBObjectMap::read_map_header(
+  const MapHeaderLock &l,
+  const ghobject_t &oid,
+  _Header *out)
+{
+  assert(l.get_locked() == oid);
 
-  Header ret(header, RemoveOnDelete(this));
-  bufferlist::iterator iter = out.begin();
+  if (cache_lookup(oid, out))
+    return true;
 
-  ret->decode(iter);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.add(oid, *ret);
+  bufferlist bl;
+  int r = db->get(HOBJECT_TO_SEQ, map_header_key(oid), &bl);
+  if (r < 0 || bl.length()==0)
+    return false;
+
+  bufferlist::iterator iter = bl.begin();
+  out->decode(iter);
+  cache_add(oid, *out);
+  return true;
+}
+
+DBObjectMap::Header DBObjectMap::lookup_map_header(
+  const MapHeaderLock &hl,
+  const ghobject_t &oid)
+{
+  _Header *header = new _Header();
+  if (!read_map_header(hl, oid, header)) {
+    delete header;
+    return Header();
   }
 
+  Mutex::Locker l(header_lock);
   assert(!in_use.count(header->seq));
   in_use.insert(header->seq);
-  return ret;
+  return Header(header, RemoveOnDelete(this));
 }
 
 DBObjectMap::Header DBObjectMap::_generate_new_header(const ghobject_t &oid,
@@ -1164,12 +1227,18 @@ DBObjectMap::Header DBObjectMap::lookup_create_map_header(
   const ghobject_t &oid,
   KeyValueDB::Transaction t)
 {
+  _Header *found = new _Header();
+  bool exists = read_map_header(hl, oid, found);
+
   Mutex::Locker l(header_lock);
-  Header header = _lookup_map_header(hl, oid);
-  if (!header) {
-    header = _generate_new_header(oid, Header());
-    set_map_header(hl, oid, *header, t);
+  if (exists) {
+    assert(!in_use.count(found->seq));
+    in_use.insert(found->seq);
+    return Header(found, RemoveOnDelete(this));
   }
+  delete found;
+  Header header = _generate_new_header(oid, Header());
+  set_map_header(hl, oid, *header, t);
   return header;
 }
 
@@ -1205,10 +1274,7 @@ void DBObjectMap::remove_map_header(
   set<string> to_remove;
   to_remove.insert(map_header_key(oid));
   t->rmkeys(HOBJECT_TO_SEQ, to_remove);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.clear(oid);
-  }
+  cache_clear(oid);
 }
 
 void DBObjectMap::set_map_header(
@@ -1223,10 +1289,7 @@ void DBObjectMap::set_map_header(
   map<string, bufferlist> to_set;
   header.encode(to_set[map_header_key(oid)]);
   t->set(HOBJECT_TO_SEQ, to_set);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.add(oid, header);
-  }
+  cache_add(oid, header);
 }
 
 bool DBObjectMap::check_spos(const ghobject_t &oid,
@@ -6,6 +6,7 @@
 #include <set>
 #include <map>
 #include <string>
+#include <list>
 
 #include <vector>
 #include "include/memory.h"
@@ -16,11 +17,13 @@
 #include "osd/osd_types.h"
 #include "common/Mutex.h"
 #include "common/Cond.h"
-#include "common/simple_cache.hpp"
+#include "include/unordered_map.h"
 #include <boost/optional/optional_io.hpp>
 
 #include "SequencerPosition.h"
 
+class PerfCounters;
+
 /**
  * DBObjectMap: Implements ObjectMap in terms of KeyValueDB
  *
@@ -116,9 +119,21 @@ public:
   };
 
   explicit DBObjectMap(KeyValueDB *db) : db(db), header_lock("DBOBjectMap"),
-           	                         cache_lock("DBObjectMap::CacheLock"),
-      	                                 caches(g_conf->filestore_omap_header_cache_size)
-    {}
+					 logger(NULL) {
+    int shards = MAX(g_conf->filestore_omap_header_cache_shards, 1);
+    size_t per_shard = MAX(g_conf->filestore_omap_header_cache_size / shards, 1);
+    for (int i = 0; i < shards; ++i)
+      header_cache.push_back(new HeaderCacheShard(per_shard));
+  }
+  ~DBObjectMap() {
+    for (auto s : header_cache)
+      delete s;
+  }
+
+  /// account header cache hits, misses and lock waits in l_os_* counters
+  void set_logger(PerfCounters *l) {
+    logger = l;
+  }
 
   int set_keys(
     const ghobject_t &oid,
@@ -328,8 +343,35 @@ public:
 private:
   /// Implicit lock on Header->seq
   typedef ceph::shared_ptr<_Header> Header;
-  Mutex cache_lock;
-  SimpleLRU<ghobject_t, _Header, ghobject_t::BitwiseComparator> caches;
+
+  /**
+   * Leaf header cache, sharded by object hash
+   *
+   * Each shard has its own lock and LRU so that lookups on different
+   * objects do not serialize.  Callers hold the MapHeaderLock for the
+   * oid, so the cache is never consulted under header_lock.
+   */
+  struct HeaderCacheShard {
+    typedef list<pair<ghobject_t, _Header> > lru_list_t;
+    Mutex lock;
+    size_t max_size;
+    ceph::unordered_map<ghobject_t, lru_list_t::iterator> contents;
+    lru_list_t lru;
+    explicit HeaderCacheShard(size_t max_size)
+      : lock("DBObjectMap::HeaderCacheShard::lock"), max_size(max_size) {
+      contents.rehash(max_size);
+    }
+  };
+  vector<HeaderCacheShard*> header_cache;
+  PerfCounters *logger;
+
+  HeaderCacheShard *get_cache_shard(const ghobject_t &oid) {
+    return header_cache[oid.hobj.get_hash() % header_cache.size()];
+  }
+  void lock_cache_shard(HeaderCacheShard *shard);
+  bool cache_lookup(const ghobject_t &oid, _Header *out);
+  void cache_add(const ghobject_t &oid, const _Header &header);
+  void cache_clear(const ghobject_t &oid);
 
   string map_header_key(const ghobject_t &oid);
   string header_key(uint64_t seq);
@@ -459,16 +501,16 @@ private:
     return _generate_new_header(oid, parent);
   }
 
+  /// Read leaf header for c oid from the cache or the db, no header_lock
+  bool read_map_header(
+    const MapHeaderLock &l,
+    const ghobject_t &oid,
+    _Header *out);
+
   /// Lookup leaf header for c oid
-  Header _lookup_map_header(
+  Header lookup_map_header(
     const MapHeaderLock &l,
     const ghobject_t &oid);
-  Header lookup_map_header(
-    const MapHeaderLock &l2,
-    const ghobject_t &oid) {
-    Mutex::Locker l(header_lock);
-    return _lookup_map_header(l2, oid);
-  }
 
   /// Lookup header node for input
   Header lookup_parent(Header input);
@@ -1256,9 +1256,19 @@ void FileJournal::write_thread_entry()
 #ifdef HAVE_LIBAIO
     if (aio) {
       Mutex::Locker locker(aio_lock);
-      // should we back off to limit aios in flight?  try to do this
-      // adaptively so that we submit larger aios once we have lots of
-      // them in flight.
+      // with a fixed queue depth, keep up to that many aios in flight and
+      // only wait for a free slot.  the aio context holds 128 events and a
+      // batch may take a few, so leave some headroom.
+      int depth = MIN(g_conf->journal_aio_queue_depth, 96);
+      while (depth > 0 && aio_num >= depth) {
+	dout(20) << "write_thread_entry aio queue depth " << depth
+		 << " reached (" << aio_bytes << " bytes), waiting" << dendl;
+	aio_cond.Wait(aio_lock);
+	dout(20) << "write_thread_entry woke up" << dendl;
+      }
+      // otherwise, should we back off to limit aios in flight?  try to do
+      // this adaptively so that we submit larger aios once we have lots
+      // of them in flight.
       //
       // NOTE: our condition here is based on aio_num (protected by
       // aio_lock) and throttle_bytes (part of the write queue).  when
@@ -1267,7 +1277,7 @@ void FileJournal::write_thread_entry()
       // but should be fine given that we will have plenty of aios in
       // flight if we hit this limit to ensure we keep the device
       // saturated.
-      while (aio_num > 0) {
+      while (depth <= 0 && aio_num > 0) {
 	int exp = MIN(aio_num * 2, 24);
 	long unsigned min_new = 1ull << exp;
 	long unsigned cur = throttle_bytes.get_current();
@@ -1357,6 +1367,9 @@ void FileJournal::do_aio_write(bufferlist& bl)
 	   << (hbp.length() ? " + header":"")
 	   << dendl;
 
+  // every piece of this batch goes to the kernel in one io_submit
+  vector<iocb*> iocbs;
+
   // split?
   off64_t split = 0;
   if (pos + bl.length() > header.max_size) {
@@ -1367,7 +1380,7 @@ void FileJournal::do_aio_write(bufferlist& bl)
     assert(first.length() + second.length() == bl.length());
     dout(10) << "do_aio_write wrapping, first bit at " << pos << "~" << first.length() << dendl;
 
-    if (write_aio_bl(pos, first, 0)) {
+    if (write_aio_bl(pos, first, 0, &iocbs)) {
       derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
 	   << ") failed" << dendl;
       ceph_abort();
@@ -1379,7 +1392,7 @@ void FileJournal::do_aio_write(bufferlist& bl)
       pos = 0;          // we included the header
     } else
       pos = get_top();  // no header, start after that
-    if (write_aio_bl(pos, second, writing_seq)) {
+    if (write_aio_bl(pos, second, writing_seq, &iocbs)) {
       derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
 	   << ") failed" << dendl;
       ceph_abort();
@@ -1390,18 +1403,19 @@ void FileJournal::do_aio_write(bufferlist& bl)
       bufferlist hbl;
       hbl.push_back(hbp);
       loff_t pos = 0;
-      if (write_aio_bl(pos, hbl, 0)) {
+      if (write_aio_bl(pos, hbl, 0, &iocbs)) {
 	derr << "FileJournal::do_aio_write: write_aio_bl(header) failed" << dendl;
 	ceph_abort();
       }
     }
 
-    if (write_aio_bl(pos, bl, writing_seq)) {
+    if (write_aio_bl(pos, bl, writing_seq, &iocbs)) {
       derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
 	   << ") failed" << dendl;
       ceph_abort();
     }
   }
+  submit_aio(iocbs);
 
   write_pos = pos;
   if (write_pos == header.max_size)
@@ -1410,12 +1424,16 @@ void FileJournal::do_aio_write(bufferlist& bl)
 }
 
 /**
- * write a buffer using aio
+ * prepare aios to write a buffer
+ *
+ * The aios are queued on aio_queue and their iocbs added to iocbs; the
+ * caller hands them all to submit_aio() at once.
  *
  * @param seq seq to trigger when this aio completes.  if 0, do not update any state
  * on completion.
  */
-int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
+int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq,
+			      vector<iocb*> *iocbs)
 {
   align_bl(pos, bl);
 
@@ -1439,8 +1457,9 @@ int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
     bl.splice(0, len, &tbl);  // move bytes from bl -> tbl
 
     // lock only aio_queue, current aio, aio_num, aio_bytes, which may be
-    // modified in check_aio_completion
-    aio_lock.Lock();
+    // modified in check_aio_completion.  the entry stays put until it is
+    // done, and it can't be done before it is submitted.
+    Mutex::Locker locker(aio_lock);
     aio_queue.push_back(aio_info(tbl, pos, bl.length() > 0 ? 0 : seq));
     aio_info& aio = aio_queue.back();
     aio.iov = iov;
@@ -1452,36 +1471,36 @@ int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
 
     aio_num++;
     aio_bytes += aio.len;
+    iocbs->push_back(&aio.iocb);
+    pos += aio.len;
+  }
+  return 0;
+}
 
-    // need to save current aio len to update write_pos later because current
-    // aio could be ereased from aio_queue once it is done
-    uint64_t cur_len = aio.len;
-    // unlock aio_lock because following io_submit might take time to return
-    aio_lock.Unlock();
-
-    iocb *piocb = &aio.iocb;
-    int attempts = 10;
-    do {
-      int r = io_submit(aio_ctx, 1, &piocb);
-      dout(20) << "write_aio_bl io_submit return value: " << r << dendl;
-      if (r < 0) {
-	derr << "io_submit to " << aio.off << "~" << cur_len
-	     << " got " << cpp_strerror(r) << dendl;
-	if (r == -EAGAIN && attempts-- > 0) {
-	  usleep(500);
-	  continue;
-	}
-	assert(0 == "io_submit got unexpected error");
-      } else {
-	break;
+void FileJournal::submit_aio(vector<iocb*>& iocbs)
+{
+  if (iocbs.empty())
+    return;
+  unsigned done = 0;
+  int attempts = 10;
+  while (done < iocbs.size()) {
+    int r = io_submit(aio_ctx, iocbs.size() - done, &iocbs[done]);
+    dout(20) << "submit_aio io_submit " << (iocbs.size() - done)
+	     << " return value: " << r << dendl;
+    if (r < 0) {
+      derr << "io_submit of " << (iocbs.size() - done) << " aios got "
+	   << cpp_strerror(r) << dendl;
+      if (r == -EAGAIN && attempts-- > 0) {
+	usleep(500);
+	continue;
       }
-    } while (true);
-    pos += cur_len;
+      assert(0 == "io_submit got unexpected error");
+    }
+    // a short submit leaves the rest for another try
+    done += r;
   }
-  aio_lock.Lock();
+  Mutex::Locker locker(aio_lock);
   write_finish_cond.Signal();
-  aio_lock.Unlock();
-  return 0;
 }
 #endif
 
@@ -1619,6 +1638,23 @@ int FileJournal::prepare_entry(vector<ObjectStore::Transaction>& tls, bufferlist
        << " (bl alignment " << data_align << ")"
        << dendl;
   bufferlist ebl;
+  if (data_align < 0) {
+    // no payload worth keeping in place: lay the whole entry out in one
+    // aligned buffer, header and footer included, rather than appending
+    // the pieces and then copying them again to align them
+    bufferptr bp = buffer::create_page_aligned(size);
+    char *p = bp.c_str();
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    bl.copy(0, bl.length(), p);
+    p += bl.length();
+    memset(p, 0, post_pad);
+    p += post_pad;
+    memcpy(p, &h, sizeof(h));
+    ebl.push_back(std::move(bp));
+    tbl->claim(ebl);
+    return h.len;
+  }
   // header
   ebl.append((const char*)&h, sizeof(h));
   if (h.pre_pad) {
@@ -1631,6 +1667,7 @@ int FileJournal::prepare_entry(vector<ObjectStore::Transaction>& tls, bufferlist
   }
   // footer
   ebl.append((const char*)&h, sizeof(h));
+  // only the pieces around the aligned payload get copied
   ebl.rebuild_aligned(CEPH_MINIMUM_BLOCK_SIZE);
   tbl->claim(ebl);
   return h.len;
@@ -67,6 +67,7 @@
 #include "common/perf_counters.h"
 #include "common/sync_filesystem.h"
 #include "common/fd.h"
+#include "common/HeartbeatMap.h"
 #include "HashIndex.h"
 #include "DBObjectMap.h"
 #include "kv/KeyValueDB.h"
@@ -261,13 +262,17 @@ int FileStore::lfn_open(const coll_t& cid,
     ((*index).index)->access_lock.get_write();
   }
   if (!replaying) {
+    utime_t start = ceph_clock_now(g_ceph_context);
     *outfd = fdcache.lookup(oid);
+    logger->tinc(l_os_fdcache_lookup_lat, ceph_clock_now(g_ceph_context) - start);
     if (*outfd) {
+      logger->inc(l_os_fdcache_hit);
       if (need_lock) {
         ((*index).index)->access_lock.put_write();
       }
       return 0;
     }
+    logger->inc(l_os_fdcache_miss);
   }
 
 
@@ -518,13 +523,14 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   stop(false), sync_thread(this),
   fdcache(g_ceph_context),
   wbthrottle(g_ceph_context),
+  readahead(g_ceph_context),
   next_osr_id(0),
   throttle_ops(g_ceph_context, "filestore_ops", g_conf->filestore_queue_max_ops),
   throttle_bytes(g_ceph_context, "filestore_bytes", g_conf->filestore_queue_max_bytes),
   m_ondisk_finisher_num(g_conf->filestore_ondisk_finisher_threads),
   m_apply_finisher_num(g_conf->filestore_apply_finisher_threads),
-  op_tp(g_ceph_context, "FileStore::op_tp", "tp_fstore_op", g_conf->filestore_op_threads, "filestore_op_threads"),
-  op_wq(this, g_conf->filestore_op_thread_timeout,
+  op_tp(g_ceph_context, "FileStore::op_tp", "tp_fstore_op", g_conf->filestore_op_threads),
+  op_wq(this, g_conf->filestore_op_threads, g_conf->filestore_op_thread_timeout,
 	g_conf->filestore_op_thread_suicide_timeout, &op_tp),
   logger(NULL),
   read_error_lock("FileStore::read_error_lock"),
@@ -608,6 +614,13 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   plb.add_time_avg(l_os_commit_lat, "commitcycle_latency", "Average latency of commit");
   plb.add_u64_counter(l_os_j_full, "journal_full", "Journal writes while full");
   plb.add_time_avg(l_os_queue_lat, "queue_transaction_latency_avg", "Store operation queue latency");
+  plb.add_u64_counter(l_os_fdcache_hit, "fdcache_hit", "FD cache hits");
+  plb.add_u64_counter(l_os_fdcache_miss, "fdcache_miss", "FD cache misses");
+  plb.add_time_avg(l_os_fdcache_lookup_lat, "fdcache_lookup_latency", "FD cache lookup latency, including shard lock wait");
+  plb.add_u64_counter(l_os_omap_cache_hit, "omap_header_cache_hit", "Omap header cache hits");
+  plb.add_u64_counter(l_os_omap_cache_miss, "omap_header_cache_miss", "Omap header cache misses");
+  plb.add_time_avg(l_os_omap_cache_lock_wait, "omap_header_cache_lock_wait", "Time waited for a contended omap header cache shard lock");
+  plb.add_u64_counter(l_os_readahead_bytes, "readahead_bytes", "Bytes prefetched for sequential readers");
 
   logger = plb.create_perf_counters();
 
@@ -1517,6 +1530,7 @@ int FileStore::mount()
     }
 
     DBObjectMap *dbomap = new DBObjectMap(omap_store);
+    dbomap->set_logger(logger);
     ret = dbomap->init(do_update);
     if (ret < 0) {
       delete dbomap;
@@ -1884,6 +1898,29 @@ void FileStore::_do_op(OpSequencer *osr, ThreadPool::TPHandle &handle)
 
 }
 
+void FileStore::OpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
+{
+  ShardData *sdata = shards[thread_index % shards.size()];
+  sdata->lock.Lock();
+  if (sdata->q.empty()) {
+    // wait briefly and go back to the pool, so it can pause or drain us
+    g_ceph_context->get_heartbeat_map()->reset_timeout(hb, 4, 0);
+    sdata->cond.WaitInterval(g_ceph_context, sdata->lock, utime_t(2, 0));
+    if (sdata->q.empty()) {
+      sdata->lock.Unlock();
+      return;
+    }
+  }
+  OpSequencer *osr = sdata->q.front();
+  sdata->q.pop_front();
+  sdata->lock.Unlock();
+
+  ThreadPool::TPHandle handle(g_ceph_context, hb, timeout_interval,
+			      suicide_interval);
+  store->_do_op(osr, handle);
+  store->_finish_op(osr);
+}
+
 void FileStore::_finish_op(OpSequencer *osr)
 {
   list<Context*> to_queue;
@@ -1895,7 +1932,6 @@ void FileStore::_finish_op(OpSequencer *osr)
   dout(10) << "_finish_op " << o << " seq " << o->op << " " << *osr << "/" << osr->parent << " lat " << lat << dendl;
   osr->apply_lock.Unlock();  // locked in _do_op
 
-  // called with tp lock held
   op_queue_release_throttle(o);
 
   logger->tinc(l_os_apply_lat, lat);
@@ -2976,6 +3012,19 @@ int FileStore::read(
     posix_fadvise(**fd, offset, len, POSIX_FADV_DONTNEED);
   if (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_RANDOM | CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL))
     posix_fadvise(**fd, offset, len, POSIX_FADV_NORMAL);
+
+  // a short read tells us where the object ends; otherwise let the
+  // kernel stop at eof
+  if (got > 0) {
+    Readahead::extent_t ra = readahead.update(
+      oid, offset, got,
+      (size_t)got < len ? offset + got : Readahead::NO_LIMIT,
+      op_flags);
+    if (ra.second) {
+      posix_fadvise(**fd, ra.first, ra.second, POSIX_FADV_WILLNEED);
+      logger->inc(l_os_readahead_bytes, ra.second);
+    }
+  }
 #endif
 
   if (m_filestore_sloppy_crc && (!replaying || backend->can_checkpoint())) {
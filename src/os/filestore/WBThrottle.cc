@@ -5,6 +5,9 @@
 
 #include "os/filestore/WBThrottle.h"
 #include "common/perf_counters.h"
+#include "common/debug.h"
+
+#define dout_subsys ceph_subsys_filestore
 
 WBThrottle::WBThrottle(CephContext *cct) :
   cur_ios(0), cur_size(0),
@@ -12,6 +15,13 @@ WBThrottle::WBThrottle(CephContext *cct) :
   logger(NULL),
   stopping(true),
   lock("WBThrottle::lock", false, true, false, cct),
+  adaptive(false),
+  num_flushers(1),
+  active_flushers(1),
+  flush_lat(0),
+  flush_lat_floor(0),
+  flush_size(0),
+  flush_ios(0),
   fs(XFS)
 {
   {
@@ -28,10 +38,28 @@ WBThrottle::WBThrottle(CephContext *cct) :
   b.add_u64(l_wbthrottle_ios_wb, "ios_wb", "Written operations");
   b.add_u64(l_wbthrottle_inodes_dirtied, "inodes_dirtied", "Entries waiting for write");
   b.add_u64(l_wbthrottle_inodes_wb, "inodes_wb", "Written entries");
+  b.add_time_avg(l_wbthrottle_flush_lat, "flush_lat", "Object flush latency");
+  b.add_u64(l_wbthrottle_flushers, "flushers", "Concurrent flushers");
+  b.add_u64(l_wbthrottle_bytes_start_flusher, "bytes_start_flusher",
+	    "Dirty data start_flusher limit");
+  b.add_u64(l_wbthrottle_bytes_hard_limit, "bytes_hard_limit",
+	    "Dirty data hard limit");
+  b.add_u64(l_wbthrottle_ios_start_flusher, "ios_start_flusher",
+	    "Dirty operations start_flusher limit");
+  b.add_u64(l_wbthrottle_ios_hard_limit, "ios_hard_limit",
+	    "Dirty operations hard limit");
+  b.add_u64(l_wbthrottle_inodes_start_flusher, "inodes_start_flusher",
+	    "Dirty entries start_flusher limit");
+  b.add_u64(l_wbthrottle_inodes_hard_limit, "inodes_hard_limit",
+	    "Dirty entries hard limit");
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
   for (unsigned i = l_wbthrottle_first + 1; i != l_wbthrottle_last; ++i)
     logger->set(i, 0);
+  {
+    Mutex::Locker l(lock);
+    update_limit_counters();
+  }
 
   cct->_conf->add_observer(this);
 }
@@ -48,8 +76,17 @@ void WBThrottle::start()
   {
     Mutex::Locker l(lock);
     stopping = false;
+    num_flushers = 1;
+    if (adaptive)
+      num_flushers = MAX(cct->_conf->filestore_wbthrottle_adaptive_max_flushers,
+			 1);
   }
   create("wb_throttle");
+  for (unsigned i = 1; i < num_flushers; ++i) {
+    FlushThread *t = new FlushThread(this, i);
+    t->create("wb_throttle");
+    flush_threads.push_back(t);
+  }
 }
 
 void WBThrottle::stop()
@@ -61,6 +98,11 @@ void WBThrottle::stop()
   }
 
   join();
+  for (auto t : flush_threads) {
+    t->join();
+    delete t;
+  }
+  flush_threads.clear();
 }
 
 const char** WBThrottle::get_tracked_conf_keys() const
@@ -78,6 +120,9 @@ const char** WBThrottle::get_tracked_conf_keys() const
     "filestore_wbthrottle_xfs_ios_hard_limit",
     "filestore_wbthrottle_xfs_inodes_start_flusher",
     "filestore_wbthrottle_xfs_inodes_hard_limit",
+    "filestore_wbthrottle_adaptive",
+    "filestore_wbthrottle_adaptive_start_ms",
+    "filestore_wbthrottle_adaptive_hard_ms",
     NULL
   };
   return KEYS;
@@ -87,37 +132,142 @@ void WBThrottle::set_from_conf()
 {
   assert(lock.is_locked());
   if (fs == BTRFS) {
-    size_limits.first =
+    conf_size_limits.first =
       cct->_conf->filestore_wbthrottle_btrfs_bytes_start_flusher;
-    size_limits.second =
+    conf_size_limits.second =
       cct->_conf->filestore_wbthrottle_btrfs_bytes_hard_limit;
-    io_limits.first =
+    conf_io_limits.first =
       cct->_conf->filestore_wbthrottle_btrfs_ios_start_flusher;
-    io_limits.second =
+    conf_io_limits.second =
       cct->_conf->filestore_wbthrottle_btrfs_ios_hard_limit;
-    fd_limits.first =
+    conf_fd_limits.first =
       cct->_conf->filestore_wbthrottle_btrfs_inodes_start_flusher;
-    fd_limits.second =
+    conf_fd_limits.second =
       cct->_conf->filestore_wbthrottle_btrfs_inodes_hard_limit;
   } else if (fs == XFS) {
-    size_limits.first =
+    conf_size_limits.first =
       cct->_conf->filestore_wbthrottle_xfs_bytes_start_flusher;
-    size_limits.second =
+    conf_size_limits.second =
       cct->_conf->filestore_wbthrottle_xfs_bytes_hard_limit;
-    io_limits.first =
+    conf_io_limits.first =
       cct->_conf->filestore_wbthrottle_xfs_ios_start_flusher;
-    io_limits.second =
+    conf_io_limits.second =
       cct->_conf->filestore_wbthrottle_xfs_ios_hard_limit;
-    fd_limits.first =
+    conf_fd_limits.first =
       cct->_conf->filestore_wbthrottle_xfs_inodes_start_flusher;
-    fd_limits.second =
+    conf_fd_limits.second =
       cct->_conf->filestore_wbthrottle_xfs_inodes_hard_limit;
   } else {
     assert(0 == "invalid value for fs");
   }
+  adaptive = cct->_conf->filestore_wbthrottle_adaptive;
+  if (adaptive && flush_lat > 0) {
+    adapt();
+  } else {
+    size_limits = conf_size_limits;
+    io_limits = conf_io_limits;
+    fd_limits = conf_fd_limits;
+    if (!adaptive)
+      active_flushers = 1;
+  }
+  if (logger)
+    update_limit_counters();
   cond.Signal();
 }
 
+/// Scale a start_flusher/hard limit pair to what the device drains in
+/// start/hard seconds at rate per second.  The configured limits bound
+/// the result from above, and the configured start_flusher limit bounds
+/// the hard limit from below so a few slow samples cannot stall writers.
+static pair<uint64_t, uint64_t> scale_limits(
+  double rate, double start, double hard,
+  const pair<uint64_t, uint64_t> &conf)
+{
+  uint64_t h = MIN(MAX((uint64_t)(rate * hard), conf.first), conf.second);
+  uint64_t s = MIN(MAX((uint64_t)(rate * start), 1ull), MAX(h / 2, 1ull));
+  return make_pair(s, h);
+}
+
+void WBThrottle::adapt()
+{
+  assert(lock.is_locked());
+  assert(flush_lat > 0);
+  double start = cct->_conf->filestore_wbthrottle_adaptive_start_ms / 1000.0;
+  double hard = cct->_conf->filestore_wbthrottle_adaptive_hard_ms / 1000.0;
+
+  // what the flushers drain per second at the current concurrency
+  double objs = active_flushers / flush_lat;
+  double bytes = objs * flush_size;
+  double ios = objs * flush_ios;
+  size_limits = scale_limits(bytes, start, hard, conf_size_limits);
+  io_limits = scale_limits(ios, start, hard, conf_io_limits);
+  fd_limits = scale_limits(objs, start, hard, conf_fd_limits);
+
+  // add a flusher while the backlog is large and the device still
+  // absorbs parallel flushes without slowing down; back off when the
+  // latency climbs or the backlog is small
+  double backlog = MAX((double)cur_size / MAX(bytes, 1.0),
+		       MAX((double)cur_ios / MAX(ios, 1.0),
+			   (double)pending_wbs.size() / objs));
+  flush_lat_floor = MIN(flush_lat_floor * 1.05, flush_lat);
+  unsigned was = active_flushers;
+  if (backlog > hard / 2 && flush_lat < 2 * flush_lat_floor &&
+      active_flushers < num_flushers)
+    ++active_flushers;
+  else if (active_flushers > 1 &&
+	   (flush_lat > 2 * flush_lat_floor || backlog < start))
+    --active_flushers;
+
+  ldout(cct, 10) << "wbthrottle adapt flush_lat " << flush_lat
+		 << " floor " << flush_lat_floor
+		 << " backlog " << backlog << "s"
+		 << " flushers " << was << " -> " << active_flushers
+		 << " bytes " << size_limits
+		 << " ios " << io_limits
+		 << " inodes " << fd_limits << dendl;
+}
+
+void WBThrottle::update_limit_counters()
+{
+  assert(lock.is_locked());
+  logger->set(l_wbthrottle_flushers, active_flushers);
+  logger->set(l_wbthrottle_bytes_start_flusher, size_limits.first);
+  logger->set(l_wbthrottle_bytes_hard_limit, size_limits.second);
+  logger->set(l_wbthrottle_ios_start_flusher, io_limits.first);
+  logger->set(l_wbthrottle_ios_hard_limit, io_limits.second);
+  logger->set(l_wbthrottle_inodes_start_flusher, fd_limits.first);
+  logger->set(l_wbthrottle_inodes_hard_limit, fd_limits.second);
+}
+
+void WBThrottle::flush_done(const PendingWB &wb, utime_t lat)
+{
+  assert(lock.is_locked());
+  logger->tinc(l_wbthrottle_flush_lat, lat);
+  if (!adaptive)
+    return;
+
+  const double alpha = 0.2; // weight of the newest sample
+  double secs = MAX((double)lat, 0.000001);
+  if (flush_lat == 0) {
+    flush_lat = flush_lat_floor = secs;
+    flush_size = wb.size;
+    flush_ios = wb.ios;
+  } else {
+    flush_lat = alpha * secs + (1 - alpha) * flush_lat;
+    flush_size = alpha * wb.size + (1 - alpha) * flush_size;
+    flush_ios = alpha * wb.ios + (1 - alpha) * flush_ios;
+  }
+
+  utime_t now = ceph_clock_now(cct);
+  if (now - last_adapt < utime_t(1, 0))
+    return;
+  last_adapt = now;
+  adapt();
+  update_limit_counters();
+  cond.Signal();
+}
+
+
 void WBThrottle::handle_conf_change(const md_config_t *conf,
 				    const std::set<std::string> &changed)
 {
@@ -131,11 +281,12 @@ void WBThrottle::handle_conf_change(const md_config_t *conf,
 }
 
 bool WBThrottle::get_next_should_flush(
+  unsigned index,
   boost::tuple<ghobject_t, FDRef, PendingWB> *next)
 {
   assert(lock.is_locked());
   assert(next);
-  while (!stopping && !beyond_limit())
+  while (!stopping && (index >= active_flushers || !beyond_limit()))
          cond.Wait(lock);
   if (stopping)
     return false;
@@ -151,11 +302,17 @@ bool WBThrottle::get_next_should_flush(
 
 
 void *WBThrottle::entry()
+{
+  flush_loop(0);
+  return 0;
+}
+
+void WBThrottle::flush_loop(unsigned index)
 {
   Mutex::Locker l(lock);
   boost::tuple<ghobject_t, FDRef, PendingWB> wb;
-  while (get_next_should_flush(&wb)) {
-    clearing = wb.get<0>();
+  while (get_next_should_flush(index, &wb)) {
+    clearing.insert(wb.get<0>());
     cur_ios -= wb.get<2>().ios;
     logger->dec(l_wbthrottle_ios_dirtied, wb.get<2>().ios);
     logger->inc(l_wbthrottle_ios_wb, wb.get<2>().ios);
@@ -165,6 +322,18 @@ void *WBThrottle::entry()
     logger->dec(l_wbthrottle_inodes_dirtied);
     logger->inc(l_wbthrottle_inodes_wb);
     lock.Unlock();
+    utime_t start = ceph_clock_now(cct);
+#ifdef HAVE_SYNC_FILE_RANGE
+    // start writeback of the dirty ranges in offset order before
+    // waiting on all of it
+    for (interval_set<uint64_t>::const_iterator p =
+	   wb.get<2>().extents.begin();
+	 p != wb.get<2>().extents.end();
+	 ++p) {
+      ::sync_file_range(**wb.get<1>(), p.get_start(), p.get_len(),
+			SYNC_FILE_RANGE_WRITE);
+    }
+#endif
 #ifdef HAVE_FDATASYNC
     ::fdatasync(**wb.get<1>());
 #else
@@ -176,12 +345,13 @@ void *WBThrottle::entry()
       assert(fa_r == 0);
     }
 #endif
+    utime_t lat = ceph_clock_now(cct) - start;
     lock.Lock();
-    clearing = ghobject_t();
+    flush_done(wb.get<2>(), lat);
+    clearing.erase(clearing.find(wb.get<0>()));
     cond.Signal();
     wb = boost::tuple<ghobject_t, FDRef, PendingWB>();
   }
-  return 0;
 }
 
 void WBThrottle::queue_wb(
@@ -208,6 +378,8 @@ void WBThrottle::queue_wb(
   logger->inc(l_wbthrottle_bytes_dirtied, len);
 
   wbiter->second.first.add(nocache, len, 1);
+  if (adaptive)
+    wbiter->second.first.add_extent(offset, len);
   insert_object(hoid);
   if (beyond_limit())
     cond.Signal();
@@ -241,7 +413,7 @@ void WBThrottle::clear()
 void WBThrottle::clear_object(const ghobject_t &hoid)
 {
   Mutex::Locker l(lock);
-  while (clearing == hoid)
+  while (clearing.count(hoid))
     cond.Wait(lock);
   ceph::unordered_map<ghobject_t, pair<PendingWB, FDRef> >::iterator i =
     pending_wbs.find(hoid);
@@ -34,6 +34,14 @@ enum {
   l_wbthrottle_ios_wb,
   l_wbthrottle_inodes_dirtied,
   l_wbthrottle_inodes_wb,
+  l_wbthrottle_flush_lat,
+  l_wbthrottle_flushers,
+  l_wbthrottle_bytes_start_flusher,
+  l_wbthrottle_bytes_hard_limit,
+  l_wbthrottle_ios_start_flusher,
+  l_wbthrottle_ios_hard_limit,
+  l_wbthrottle_inodes_start_flusher,
+  l_wbthrottle_inodes_hard_limit,
   l_wbthrottle_last
 };
 
@@ -41,13 +49,27 @@ enum {
  * WBThrottle
  *
  * Tracks, throttles, and flushes outstanding IO
+ *
+ * In adaptive mode (filestore_wbthrottle_adaptive) the configured
+ * limits become ceilings.  The effective limits are derived from the
+ * measured flush rate of the device so that the dirty backlog takes
+ * about filestore_wbthrottle_adaptive_start_ms to drain before the
+ * flusher starts and about filestore_wbthrottle_adaptive_hard_ms before
+ * writers block, and up to filestore_wbthrottle_adaptive_max_flushers
+ * threads flush concurrently while the device keeps up.
  */
 class WBThrottle : Thread, public md_config_obs_t {
-  ghobject_t clearing;
+  /// Objects currently being flushed, one entry per flusher
+  multiset<ghobject_t, ghobject_t::BitwiseComparator> clearing;
   /* *_limits.first is the start_flusher limit and
    * *_limits.second is the hard limit
    */
 
+  /// Configured limits, ceilings for the adaptive limits below
+  pair<uint64_t, uint64_t> conf_size_limits;
+  pair<uint64_t, uint64_t> conf_io_limits;
+  pair<uint64_t, uint64_t> conf_fd_limits;
+
   /// Limits on unflushed bytes
   pair<uint64_t, uint64_t> size_limits;
 
@@ -68,6 +90,7 @@ class WBThrottle : Thread, public md_config_obs_t {
     bool nocache;
     uint64_t size;
     uint64_t ios;
+    interval_set<uint64_t> extents; ///< dirty ranges, adaptive mode only
     PendingWB() : nocache(true), size(0), ios(0) {}
     void add(bool _nocache, uint64_t _size, uint64_t _ios) {
       if (!_nocache)
@@ -75,7 +98,27 @@ class WBThrottle : Thread, public md_config_obs_t {
       size += _size;
       ios += _ios;
     }
+    void add_extent(uint64_t offset, uint64_t len) {
+      if (!len)
+	return;
+      interval_set<uint64_t> e;
+      e.insert(offset, len);
+      extents.union_of(e);
+    }
+  };
+
+  /// Extra flusher thread, adaptive mode only
+  class FlushThread : public Thread {
+    WBThrottle *wbt;
+    unsigned index;
+  public:
+    FlushThread(WBThrottle *wbt, unsigned index) : wbt(wbt), index(index) {}
+    void *entry() {
+      wbt->flush_loop(index);
+      return 0;
+    }
   };
+  vector<FlushThread*> flush_threads;
 
   CephContext *cct;
   PerfCounters *logger;
@@ -83,6 +126,16 @@ class WBThrottle : Thread, public md_config_obs_t {
   Mutex lock;
   Cond cond;
 
+  /// Adaptive mode state, see adapt()
+  bool adaptive;
+  unsigned num_flushers;    ///< flusher threads started
+  unsigned active_flushers; ///< flushers allowed to run
+  double flush_lat;         ///< avg seconds to flush one object
+  double flush_lat_floor;   ///< lowest recent flush_lat
+  double flush_size;        ///< avg bytes per flushed object
+  double flush_ios;         ///< avg ios per flushed object
+  utime_t last_adapt;
+
 
   /**
    * Flush objects in lru order
@@ -116,8 +169,17 @@ class WBThrottle : Thread, public md_config_obs_t {
 
   /// get next flush to perform
   bool get_next_should_flush(
+    unsigned index,                                  ///< [in] flusher
     boost::tuple<ghobject_t, FDRef, PendingWB> *next ///< [out] next to flush
     ); ///< @return false if we are shutting down
+
+  /// flush objects until stopping
+  void flush_loop(unsigned index);
+
+  /// account a completed flush and retune the limits in adaptive mode
+  void flush_done(const PendingWB &wb, utime_t lat);
+  void adapt();
+  void update_limit_counters();
 public:
   enum FS {
     BTRFS,
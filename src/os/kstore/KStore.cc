@@ -421,6 +421,86 @@ void KStore::Onode::flush()
   dout(20) << __func__ << " done" << dendl;
 }
 
+// StripeCache
+
+#undef dout_prefix
+#define dout_prefix *_dout << "kstore.stripecache(" << this << ") "
+
+bool KStore::StripeCache::lookup(uint64_t nid, uint64_t offset,
+				 bufferlist *bl)
+{
+  Mutex::Locker l(lock);
+  map<key_t,lru_list_t::iterator>::iterator p =
+    index.find(make_pair(nid, offset));
+  if (p == index.end()) {
+    logger->inc(l_kstore_stripe_cache_miss);
+    return false;
+  }
+  lru.splice(lru.begin(), lru, p->second);
+  *bl = p->second->second;
+  logger->inc(l_kstore_stripe_cache_hit);
+  return true;
+}
+
+void KStore::StripeCache::add(uint64_t nid, uint64_t offset,
+			      const bufferlist& bl)
+{
+  Mutex::Locker l(lock);
+  key_t key = make_pair(nid, offset);
+  map<key_t,lru_list_t::iterator>::iterator p = index.find(key);
+  if (p != index.end())
+    _remove(p);
+  if (bl.length() == 0 || bl.length() > max_bytes)
+    return;
+  dout(30) << __func__ << " " << nid << " " << offset << " len "
+	   << bl.length() << dendl;
+  lru.push_front(make_pair(key, bl));
+  index[key] = lru.begin();
+  bytes += bl.length();
+  _trim();
+  logger->set(l_kstore_stripe_cache_bytes, bytes);
+}
+
+void KStore::StripeCache::remove(uint64_t nid, uint64_t offset)
+{
+  Mutex::Locker l(lock);
+  map<key_t,lru_list_t::iterator>::iterator p =
+    index.find(make_pair(nid, offset));
+  if (p == index.end())
+    return;
+  _remove(p);
+  logger->set(l_kstore_stripe_cache_bytes, bytes);
+}
+
+void KStore::StripeCache::clear()
+{
+  Mutex::Locker l(lock);
+  dout(10) << __func__ << " " << index.size() << " stripes, " << bytes
+	   << " bytes" << dendl;
+  index.clear();
+  lru.clear();
+  bytes = 0;
+  logger->set(l_kstore_stripe_cache_bytes, bytes);
+}
+
+void KStore::StripeCache::_remove(
+  map<key_t,lru_list_t::iterator>::iterator p)
+{
+  assert(bytes >= p->second->second.length());
+  bytes -= p->second->second.length();
+  lru.erase(p->second);
+  index.erase(p);
+}
+
+void KStore::StripeCache::_trim()
+{
+  while (bytes > max_bytes) {
+    assert(!lru.empty());
+    dout(30) << __func__ << " trim " << lru.back().first << dendl;
+    _remove(index.find(lru.back().first));
+  }
+}
+
 // OnodeHashLRU
 
 #undef dout_prefix
@@ -585,7 +665,8 @@ KStore::Collection::Collection(KStore *ns, coll_t c)
   : store(ns),
     cid(c),
     lock("KStore::Collection::lock", true, false),
-    onode_map()
+    onode_map(),
+    stripe_size(0)
 {
 }
 
@@ -664,6 +745,7 @@ KStore::KStore(CephContext *cct, const string& path)
     logger(NULL),
     reap_lock("KStore::reap_lock")
 {
+  stripe_cache.max_bytes = cct->_conf->kstore_stripe_cache_size;
   _init_logger();
 }
 
@@ -677,12 +759,23 @@ KStore::~KStore()
 
 void KStore::_init_logger()
 {
-  // XXX
+  PerfCountersBuilder b(g_ceph_context, "KStore",
+			l_kstore_first, l_kstore_last);
+  b.add_u64_counter(l_kstore_stripe_cache_hit, "stripe_cache_hit", "Sum for stripe reads served from the stripe cache");
+  b.add_u64_counter(l_kstore_stripe_cache_miss, "stripe_cache_miss", "Sum for stripe reads that went to the kv store");
+  b.add_u64(l_kstore_stripe_cache_bytes, "stripe_cache_bytes", "Bytes of stripes in the stripe cache");
+  b.add_u64_counter(l_kstore_stripe_rmw, "stripe_rmw", "Sum for partial stripe writes that read, modify and rewrite a stripe");
+  b.add_u64_counter(l_kstore_stripe_write, "stripe_write", "Sum for stripes written to the kv store");
+  b.add_u64_counter(l_kstore_stripe_write_merged, "stripe_write_merged", "Sum for stripe writes merged into a later write in the same transaction");
+  logger = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(logger);
+  stripe_cache.logger = logger;
 }
 
 void KStore::_shutdown_logger()
 {
-  // XXX
+  g_ceph_context->get_perfcounters_collection()->remove(logger);
+  delete logger;
 }
 
 int KStore::_open_path()
@@ -986,7 +1079,7 @@ int KStore::mount()
   dout(1) << __func__ << " path " << path << dendl;
 
   if (g_conf->kstore_fsck_on_mount) {
-    int rc = fsck();
+    int rc = fsck(false);
     if (rc < 0)
       return rc;
   }
@@ -1041,6 +1134,7 @@ int KStore::umount()
   _sync();
   _reap_collections();
   coll_map.clear();
+  stripe_cache.clear();
 
   dout(20) << __func__ << " stopping kv thread" << dendl;
   _kv_stop();
@@ -1057,7 +1151,7 @@ int KStore::umount()
   return 0;
 }
 
-int KStore::fsck()
+int KStore::fsck(bool deep)
 {
   dout(1) << __func__ << dendl;
   int errors = 0;
@@ -1701,6 +1795,27 @@ bool KStore::collection_exists(const coll_t& c)
   return coll_map.count(c);
 }
 
+int KStore::set_collection_opts(
+  const coll_t& cid,
+  const pool_opts_t& opts)
+{
+  CollectionRef c = _get_collection(cid);
+  if (!c)
+    return -ENOENT;
+  dout(15) << __func__ << " " << cid << " options " << opts << dendl;
+  int stripe_size = 0;
+  opts.get(pool_opts_t::KSTORE_STRIPE_SIZE, &stripe_size);
+  if (stripe_size < 0 || stripe_size > KSTORE_STRIPE_SIZE_MAX ||
+      (stripe_size & (stripe_size - 1))) {
+    derr << __func__ << " " << cid << " bad kstore_stripe_size "
+	 << stripe_size << dendl;
+    return -EINVAL;
+  }
+  RWLock::WLocker l(c->lock);
+  c->stripe_size = stripe_size;
+  return 0;
+}
+
 bool KStore::collection_empty(const coll_t& cid)
 {
   dout(15) << __func__ << " " << cid << dendl;
@@ -2238,6 +2353,18 @@ int KStore::_txc_finalize(OpSequencer *osr, TransContext *txc)
   dout(20) << __func__ << " osr " << osr << " txc " << txc
 	   << " onodes " << txc->onodes << dendl;
 
+  // write each dirty stripe once, however many ops touched it
+  for (map<string,bufferlist>::iterator p = txc->stripes.begin();
+       p != txc->stripes.end();
+       ++p) {
+    if (p->second.length())
+      txc->t->set(PREFIX_DATA, p->first, p->second);
+    else
+      txc->t->rmkey(PREFIX_DATA, p->first);
+  }
+  logger->inc(l_kstore_stripe_write, txc->stripes.size());
+  txc->stripes.clear();
+
   // finalize onodes
   for (set<OnodeRef>::iterator p = txc->onodes.begin();
        p != txc->onodes.end();
@@ -2295,6 +2422,14 @@ void KStore::_txc_finish(TransContext *txc)
     (*p)->flush_txns.erase(txc);
     if ((*p)->flush_txns.empty()) {
       (*p)->flush_cond.Signal();
+      // committed; keep what we wrote around for the next rmw or read
+      uint64_t nid = (*p)->onode.nid;
+      for (map<uint64_t,bufferlist>::iterator q =
+	     (*p)->pending_stripes.begin();
+	   q != (*p)->pending_stripes.end();
+	   ++q) {
+	stripe_cache.add(nid, q->first, q->second);
+      }
       (*p)->clear_pending_stripes();
     }
   }
@@ -2799,35 +2934,55 @@ void KStore::_dump_onode(OnodeRef o)
 
 void KStore::_do_read_stripe(OnodeRef o, uint64_t offset, bufferlist *pbl)
 {
-  map<uint64_t,bufferlist>::iterator p = o->pending_stripes.find(offset);
-  if (p == o->pending_stripes.end()) {
-    string key;
-    get_data_key(o->onode.nid, offset, &key);
-    db->get(PREFIX_DATA, key, pbl);
-    o->pending_stripes[offset] = *pbl;
-  } else {
-    *pbl = p->second;
+  {
+    Mutex::Locker l(o->flush_lock);
+    map<uint64_t,bufferlist>::iterator p = o->pending_stripes.find(offset);
+    if (p != o->pending_stripes.end()) {
+      *pbl = p->second;
+      return;
+    }
   }
+  if (stripe_cache.lookup(o->onode.nid, offset, pbl))
+    return;
+  string key;
+  get_data_key(o->onode.nid, offset, &key);
+  db->get(PREFIX_DATA, key, pbl);
+  stripe_cache.add(o->onode.nid, offset, *pbl);
 }
 
 void KStore::_do_write_stripe(TransContext *txc, OnodeRef o,
 			      uint64_t offset, bufferlist& bl)
 {
-  o->pending_stripes[offset] = bl;
+  {
+    Mutex::Locker l(o->flush_lock);
+    o->pending_stripes[offset] = bl;
+  }
+  stripe_cache.remove(o->onode.nid, offset);
   string key;
   get_data_key(o->onode.nid, offset, &key);
-  txc->t->set(PREFIX_DATA, key, bl);
+  bufferlist& v = txc->stripes[key];
+  if (v.length())
+    logger->inc(l_kstore_stripe_write_merged);
+  v = bl;
 }
 
 void KStore::_do_remove_stripe(TransContext *txc, OnodeRef o, uint64_t offset)
 {
-  o->pending_stripes.erase(offset);
+  {
+    Mutex::Locker l(o->flush_lock);
+    o->pending_stripes[offset] = bufferlist();
+  }
+  stripe_cache.remove(o->onode.nid, offset);
   string key;
   get_data_key(o->onode.nid, offset, &key);
-  txc->t->rmkey(PREFIX_DATA, key);
+  bufferlist& v = txc->stripes[key];
+  if (v.length())
+    logger->inc(l_kstore_stripe_write_merged);
+  v.clear();
 }
 
 int KStore::_do_write(TransContext *txc,
+			CollectionRef& c,
 			OnodeRef o,
 			uint64_t offset, uint64_t length,
 			bufferlist& orig_bl,
@@ -2848,7 +3003,8 @@ int KStore::_do_write(TransContext *txc,
 
   uint64_t stripe_size = o->onode.stripe_size;
   if (!stripe_size) {
-    o->onode.stripe_size = g_conf->kstore_default_stripe_size;
+    o->onode.stripe_size = c->stripe_size ? c->stripe_size :
+      g_conf->kstore_default_stripe_size;
     stripe_size = o->onode.stripe_size;
   }
 
@@ -2869,6 +3025,7 @@ int KStore::_do_write(TransContext *txc,
     uint64_t stripe_off = offset - offset_rem;
     bufferlist prev;
     _do_read_stripe(o, stripe_off, &prev);
+    logger->inc(l_kstore_stripe_rmw);
     dout(20) << __func__ << " read previous stripe " << stripe_off
 	     << ", got " << prev.length() << dendl;
     bufferlist bl;
@@ -2930,7 +3087,7 @@ int KStore::_write(TransContext *txc,
   RWLock::WLocker l(c->lock);
   OnodeRef o = c->get_onode(oid, true);
   _assign_nid(txc, o);
-  int r = _do_write(txc, o, offset, length, bl, fadvise_flags);
+  int r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
   txc->write_onode(o);
 
   dout(10) << __func__ << " " << c->cid << " " << oid
@@ -3468,7 +3625,7 @@ int KStore::_clone(TransContext *txc,
   if (r < 0)
     goto out;
 
-  r = _do_write(txc, newo, 0, oldo->onode.size, bl, 0);
+  r = _do_write(txc, c, newo, 0, oldo->onode.size, bl, 0);
 
   newo->onode.attrs = oldo->onode.attrs;
 
@@ -3541,7 +3698,7 @@ int KStore::_clone_range(TransContext *txc,
   if (r < 0)
     goto out;
 
-  r = _do_write(txc, newo, dstoff, bl.length(), bl, 0);
+  r = _do_write(txc, c, newo, dstoff, bl.length(), bl, 0);
 
   txc->write_onode(newo);
 
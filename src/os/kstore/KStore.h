@@ -25,6 +25,7 @@
 #include "common/Finisher.h"
 #include "common/RWLock.h"
 #include "common/WorkQueue.h"
+#include "common/perf_counters.h"
 #include "os/ObjectStore.h"
 #include "os/fs/FS.h"
 #include "kv/KeyValueDB.h"
@@ -33,6 +34,17 @@
 
 #include "boost/intrusive/list.hpp"
 
+enum {
+  l_kstore_first = 832430,
+  l_kstore_stripe_cache_hit,
+  l_kstore_stripe_cache_miss,
+  l_kstore_stripe_cache_bytes,
+  l_kstore_stripe_rmw,
+  l_kstore_stripe_write,
+  l_kstore_stripe_write_merged,
+  l_kstore_last
+};
+
 class KStore : public ObjectStore {
   // -----------------------------------------------------
   // types
@@ -52,14 +64,15 @@ public:
     bool dirty;     // ???
     bool exists;
 
-    Mutex flush_lock;  ///< protect flush_txns
+    Mutex flush_lock;  ///< protect flush_txns, pending_stripes
     Cond flush_cond;   ///< wait here for unapplied txns
     set<TransContext*> flush_txns;   ///< committing txns
 
     uint64_t tail_offset;
     bufferlist tail_bl;
 
-    map<uint64_t,bufferlist> pending_stripes;  ///< unwritten stripes
+    /// uncommitted stripes; an empty bufferlist is a removed stripe
+    map<uint64_t,bufferlist> pending_stripes;
 
     Onode(const ghobject_t& o, const string& k);
 
@@ -82,6 +95,33 @@ public:
   };
   typedef boost::intrusive_ptr<Onode> OnodeRef;
 
+  /// committed stripes we recently read or wrote, by (nid, offset)
+  struct StripeCache {
+    typedef pair<uint64_t,uint64_t> key_t;
+    typedef list<pair<key_t,bufferlist> > lru_list_t;
+
+    Mutex lock;
+    map<key_t,lru_list_t::iterator> index;
+    lru_list_t lru;         ///< most recently touched at the front
+    uint64_t bytes;
+    uint64_t max_bytes;
+    PerfCounters *logger;
+
+    StripeCache()
+      : lock("KStore::StripeCache::lock"),
+	bytes(0),
+	max_bytes(0),
+	logger(NULL) {}
+
+    bool lookup(uint64_t nid, uint64_t offset, bufferlist *bl);
+    void add(uint64_t nid, uint64_t offset, const bufferlist& bl);
+    void remove(uint64_t nid, uint64_t offset);
+    void clear();
+  private:
+    void _remove(map<key_t,lru_list_t::iterator>::iterator p);
+    void _trim();
+  };
+
   struct OnodeHashLRU {
     typedef boost::intrusive::list<
       Onode,
@@ -116,6 +156,9 @@ public:
     // contention.
     OnodeHashLRU onode_map;
 
+    /// stripe size for new objects (pool option); 0 for the default
+    uint32_t stripe_size;
+
     OnodeRef get_onode(const ghobject_t& oid, bool create);
 
     bool contains(const ghobject_t& oid) {
@@ -189,6 +232,9 @@ public:
     uint64_t ops, bytes;
 
     set<OnodeRef> onodes;     ///< these onodes need to be updated/written
+    /// stripes to write by data key, merged across the transaction's ops;
+    /// an empty value removes the stripe
+    map<string,bufferlist> stripes;
     KeyValueDB::Transaction t; ///< then we will commit this
     Context *oncommit;         ///< signal on commit
     Context *onreadable;         ///< signal on readable
@@ -306,7 +352,9 @@ private:
   bool kv_stop;
   deque<TransContext*> kv_queue, kv_committing;
 
-  Logger *logger;
+  PerfCounters *logger;
+
+  StripeCache stripe_cache;
 
   Mutex reap_lock;
   list<CollectionRef> removed_collections;
@@ -386,7 +434,7 @@ public:
   int umount();
   void _sync();
 
-  int fsck();
+  int fsck(bool deep);
 
   unsigned get_max_object_name_length() {
     return 4096;
@@ -436,6 +484,7 @@ public:
   int list_collections(vector<coll_t>& ls);
   bool collection_exists(const coll_t& c);
   bool collection_empty(const coll_t& c);
+  int set_collection_opts(const coll_t& cid, const pool_opts_t& opts) override;
 
   using ObjectStore::collection_list;
   int collection_list(const coll_t& cid, ghobject_t start, ghobject_t end,
@@ -523,6 +572,7 @@ private:
 	     bufferlist& bl,
 	     uint32_t fadvise_flags);
   int _do_write(TransContext *txc,
+		CollectionRef& c,
 		OnodeRef o,
 		uint64_t offset, uint64_t length,
 		bufferlist& bl,
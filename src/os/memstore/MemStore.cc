@@ -1484,6 +1484,11 @@ thread_local PageSet::page_vector MemStore::PageSetObject::tls_pages;
 #define DEFINE_PAGE_VECTOR(name) PageSet::page_vector name;
 #endif
 
+static void put_page(void *page)
+{
+  static_cast<Page*>(page)->put();
+}
+
 int MemStore::PageSetObject::read(uint64_t offset, uint64_t len, bufferlist& bl)
 {
   const auto start = offset;
@@ -1493,6 +1498,28 @@ int MemStore::PageSetObject::read(uint64_t offset, uint64_t len, bufferlist& bl)
   DEFINE_PAGE_VECTOR(tls_pages);
   data.get_range(offset, len, tls_pages);
 
+  if (zero_copy_read) {
+    // reference the pages directly; a later write to a page that is
+    // still referenced goes to a copy, see PageSet::alloc_range()
+    for (auto &page : tls_pages) {
+      if (page->offset > offset) {
+        bl.append_zero(page->offset - offset);
+        offset = page->offset;
+      }
+      const auto page_offset = offset - page->offset;
+      const auto count = min(end - offset, data.get_page_size() - page_offset);
+      page->get(); // dropped by put_page() with the buffer
+      buffer::ptr p(buffer::claim_external(data.get_page_size(), page->data,
+                                           put_page, page.get()));
+      bl.append(p, page_offset, count);
+      offset += count;
+    }
+    if (offset < end)
+      bl.append_zero(end - offset);
+    tls_pages.clear(); // drop page refs
+    return len;
+  }
+
   // allocate a buffer for the data
   buffer::ptr buf(len);
 
@@ -1622,7 +1649,10 @@ int MemStore::PageSetObject::truncate(uint64_t size)
   data.get_range(page_offset, page_size, tls_pages);
   if (tls_pages.empty())
     return 0;
+  tls_pages.clear();
 
+  // the page may be shared with a zero-copy read, so get it for writing
+  data.alloc_range(size, page_offset + page_size - size, tls_pages);
   auto page = tls_pages.begin();
   auto data = (*page)->data;
   std::fill(data + (size - page_offset), data + page_size, 0);
@@ -124,13 +124,16 @@ public:
   struct PageSetObject : public Object {
     PageSet data;
     uint64_t data_len;
+    /// return bufferptrs that reference the pages instead of copying
+    const bool zero_copy_read;
 #if defined(__GLIBCXX__)
     // use a thread-local vector for the pages returned by PageSet, so we
     // can avoid allocations in read/write()
     static thread_local PageSet::page_vector tls_pages;
 #endif
 
-    explicit PageSetObject(size_t page_size) : data(page_size), data_len(0) {}
+    PageSetObject(size_t page_size, bool zero_copy_read)
+      : data(page_size), data_len(0), zero_copy_read(zero_copy_read) {}
 
     size_t get_size() const override { return data_len; }
 
@@ -176,7 +179,8 @@ public:
 
     ObjectRef create_object() const {
       if (use_page_set)
-        return new PageSetObject(cct->_conf->memstore_page_size);
+        return new PageSetObject(cct->_conf->memstore_page_size,
+                                 cct->_conf->memstore_page_zero_copy_read);
       return new BufferlistObject();
     }
 
@@ -18,41 +18,43 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
-#include <boost/intrusive/avl_set.hpp>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <boost/intrusive_ptr.hpp>
 
 #include "include/encoding.h"
 #include "include/Spinlock.h"
 
 
+class PageArena;
+
 struct Page {
   char *const data;
-  boost::intrusive::avl_set_member_hook<> hook;
   uint64_t offset;
 
   // avoid RefCountedObject because it has a virtual destructor
-  std::atomic<uint16_t> nrefs;
+  std::atomic<uint32_t> nrefs;
   void get() { ++nrefs; }
-  void put() { if (--nrefs == 0) delete this; }
+  inline void put();
+
+  // take a reference unless the page is already on its way back to the
+  // arena.  safe on a page that was freed concurrently, because page
+  // structures are recycled by the arena but never released
+  bool get_unless_zero() {
+    uint32_t n = nrefs.load(std::memory_order_relaxed);
+    while (n && !nrefs.compare_exchange_weak(n, n + 1))
+      ;
+    return n != 0;
+  }
 
   typedef boost::intrusive_ptr<Page> Ref;
   friend void intrusive_ptr_add_ref(Page *p) { p->get(); }
   friend void intrusive_ptr_release(Page *p) { p->put(); }
 
-  // key-value comparison functor for avl
-  struct Less {
-    bool operator()(uint64_t offset, const Page &page) const {
-      return offset < page.offset;
-    }
-    bool operator()(const Page &page, uint64_t offset) const {
-      return page.offset < offset;
-    }
-    bool operator()(const Page &lhs, const Page &rhs) const {
-      return lhs.offset < rhs.offset;
-    }
-  };
   void encode(bufferlist &bl, size_t page_size) const {
     bl.append(buffer::copy(data, page_size));
     ::encode(offset, bl);
@@ -62,54 +64,276 @@ struct Page {
     ::decode(offset, p);
   }
 
-  static Ref create(size_t page_size, uint64_t offset = 0) {
-    // allocate the Page and its data in a single buffer
-    auto buffer = new char[page_size + sizeof(Page)];
-    // place the Page structure at the end of the buffer
-    return new (buffer + page_size) Page(buffer, offset);
-  }
-
   // copy disabled
   Page(const Page&) = delete;
   const Page& operator=(const Page&) = delete;
 
- private: // private constructor, use create() instead
-  Page(char *data, uint64_t offset) : data(data), offset(offset), nrefs(1) {}
+ private: // private constructor, use PageArena::alloc() instead
+  friend class PageArena;
+  Page(char *data, PageArena *arena)
+    : data(data), offset(0), nrefs(0), arena(arena) {}
+
+  PageArena *const arena;
+};
+
+/**
+ * PageArena
+ *
+ * Hands out pages of a single size, carved from 2MB chunks that are
+ * backed by huge pages when the system has them reserved, or marked for
+ * transparent huge pages otherwise.  Freed pages go back on a free list;
+ * chunks and Page structures are only released with the arena, which
+ * lets PageSet readers look pages up without a lock.
+ */
+class PageArena {
+  static const size_t chunk_size = 2 << 20;
+  static const size_t max_chunk_pages = 512;
+
+  const size_t page_size;
+  size_t chunk_pages;
+  Spinlock mutex;
+  std::vector<Page*> free_list;
+  struct Chunk {
+    void *data;
+    size_t len;
+    bool mapped;
+    Page *pages;
+  };
+  std::vector<Chunk> chunks;
+
+  void grow() {
+    Chunk c;
+    c.len = chunk_pages * page_size;
+    c.data = MAP_FAILED;
+    c.mapped = false;
+#ifdef MAP_HUGETLB
+    if (c.len % chunk_size == 0)
+      c.data = ::mmap(nullptr, c.len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (c.data != MAP_FAILED) {
+      c.mapped = true;
+    } else {
+      // no reserved huge pages; align to the huge page size so the
+      // kernel can back the chunk with transparent huge pages
+      size_t align = c.len >= chunk_size ? chunk_size : sizeof(void*);
+      int r = ::posix_memalign(&c.data, align, c.len);
+      assert(r == 0);
+#ifdef MADV_HUGEPAGE
+      if (c.len >= chunk_size)
+        ::madvise(c.data, c.len, MADV_HUGEPAGE);
+#endif
+    }
+    c.pages = static_cast<Page*>(::operator new(sizeof(Page) * chunk_pages));
+    for (size_t i = 0; i < chunk_pages; i++) {
+      auto page = new (&c.pages[i]) Page(
+          static_cast<char*>(c.data) + i * page_size, this);
+      free_list.push_back(page);
+    }
+    chunks.push_back(c);
+  }
+
+ public:
+  explicit PageArena(size_t page_size)
+    : page_size(page_size),
+      chunk_pages(std::max<size_t>(std::min(chunk_size / page_size,
+                                            max_chunk_pages), 1)) {}
+  ~PageArena() {
+    for (auto &c : chunks) {
+      for (size_t i = 0; i < chunk_pages; i++)
+        c.pages[i].~Page();
+      ::operator delete(c.pages);
+      if (c.mapped)
+        ::munmap(c.data, c.len);
+      else
+        ::free(c.data);
+    }
+  }
+
+  // disable copy
+  PageArena(const PageArena&) = delete;
+  const PageArena& operator=(const PageArena&) = delete;
+
+  size_t get_page_size() const { return page_size; }
+
+  /// return a page with a single reference and undefined contents
+  Page::Ref alloc(uint64_t offset) {
+    Page *page;
+    {
+      std::lock_guard<Spinlock> lock(mutex);
+      if (free_list.empty())
+        grow();
+      page = free_list.back();
+      free_list.pop_back();
+    }
+    page->offset = offset;
+    page->nrefs.store(1, std::memory_order_release);
+    return Page::Ref(page, false);
+  }
 
-  static void operator delete(void *p) {
-    delete[] reinterpret_cast<Page*>(p)->data;
+  void free(Page *page) {
+    std::lock_guard<Spinlock> lock(mutex);
+    free_list.push_back(page);
+  }
+
+  /// arena shared by all PageSets with the given page size
+  static PageArena *get(size_t page_size) {
+    static std::mutex lock;
+    static std::map<size_t, std::unique_ptr<PageArena>> arenas;
+    std::lock_guard<std::mutex> l(lock);
+    auto &arena = arenas[page_size];
+    if (!arena)
+      arena.reset(new PageArena(page_size));
+    return arena.get();
   }
 };
 
+void Page::put()
+{
+  if (--nrefs == 0)
+    arena->free(this);
+}
+
+/**
+ * PageSet
+ *
+ * Sparse set of fixed-size pages indexed by a radix tree of 64-way
+ * nodes.  Writers serialize on a spinlock.  Readers walk the tree
+ * without locking: nodes are only freed with the PageSet, and a page
+ * reference is taken with get_unless_zero() and then checked against
+ * its slot, so a reader never sees a page after its slot was cleared.
+ *
+ * Pages returned by get_range() may be shared with readers that hold
+ * on to them (see MemStore's zero-copy reads), so alloc_range() copies
+ * any page with outside references before handing it out for writing.
+ */
 class PageSet {
  public:
   // alloc_range() and get_range() return page refs in a vector
   typedef std::vector<Page::Ref> page_vector;
 
  private:
-  // store pages in a boost intrusive avl_set
-  typedef Page::Less page_cmp;
-  typedef boost::intrusive::member_hook<Page,
-          boost::intrusive::avl_set_member_hook<>,
-          &Page::hook> member_option;
-  typedef boost::intrusive::avl_set<Page,
-          boost::intrusive::compare<page_cmp>, member_option> page_set;
-
-  typedef typename page_set::iterator iterator;
+  static const unsigned node_bits = 6;
+  static const uint64_t node_mask = (1 << node_bits) - 1;
+
+  struct Node {
+    const unsigned height; // 1 for leaves, whose slots point to pages
+    std::atomic<void*> slots[1 << node_bits];
+    explicit Node(unsigned height) : height(height) {
+      for (auto &slot : slots)
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+  };
 
-  page_set pages;
+  std::atomic<Node*> root;
+  std::vector<Node*> nodes; // every node, for destruction
+  size_t count;
   uint64_t page_size;
+  unsigned page_shift;
+  PageArena *arena;
 
   typedef Spinlock lock_type;
   lock_type mutex;
 
-  void free_pages(iterator cur, iterator end) {
-    while (cur != end) {
-      Page *page = &*cur;
-      cur = pages.erase(cur);
-      page->put();
+  void set_page_size(uint64_t size) {
+    assert(size && (size & (size - 1)) == 0);
+    page_size = size;
+    page_shift = 0;
+    while ((1ull << page_shift) < page_size)
+      page_shift++;
+    arena = PageArena::get(page_size);
+  }
+
+  static bool covers(const Node *n, uint64_t pgno) {
+    const unsigned bits = n->height * node_bits;
+    return bits >= 64 || (pgno >> bits) == 0;
+  }
+
+  // return the slot for page number pgno, creating nodes as needed.
+  // must hold the mutex
+  std::atomic<void*>& get_slot(uint64_t pgno) {
+    Node *n = root.load(std::memory_order_relaxed);
+    if (!n) {
+      n = new Node(1);
+      nodes.push_back(n);
+      root.store(n, std::memory_order_release);
+    }
+    while (!covers(n, pgno)) {
+      // grow the tree by adding a root above the current one
+      Node *r = new Node(n->height + 1);
+      nodes.push_back(r);
+      r->slots[0].store(n, std::memory_order_relaxed);
+      root.store(r, std::memory_order_release);
+      n = r;
+    }
+    for (unsigned h = n->height; h > 1; h--) {
+      auto &slot = n->slots[(pgno >> ((h - 1) * node_bits)) & node_mask];
+      Node *child = static_cast<Node*>(slot.load(std::memory_order_relaxed));
+      if (!child) {
+        child = new Node(h - 1);
+        nodes.push_back(child);
+        slot.store(child, std::memory_order_release);
+      }
+      n = child;
+    }
+    return n->slots[pgno & node_mask];
+  }
+
+  // call f(slot, pgno) for each populated slot with pgno in [first,last],
+  // in page order.  safe without the mutex
+  template <typename F>
+  static void walk(Node *n, uint64_t base, uint64_t first, uint64_t last,
+                   F &&f) {
+    const unsigned shift = (n->height - 1) * node_bits;
+    for (uint64_t i = 0; i <= node_mask; i++) {
+      // the top node of a full height tree has fewer usable slots
+      if (shift + node_bits > 64 && (i >> (64 - shift)))
+        break;
+      const uint64_t start = base + (i << shift);
+      const uint64_t end = start + ((1ull << shift) - 1);
+      if (end < first)
+        continue;
+      if (start > last)
+        break;
+      void *child = n->slots[i].load(std::memory_order_acquire);
+      if (!child)
+        continue;
+      if (n->height == 1)
+        f(n->slots[i], start);
+      else
+        walk(static_cast<Node*>(child), start, first, last, f);
     }
   }
+  template <typename F>
+  void walk(uint64_t first, uint64_t last, F &&f) const {
+    Node *n = root.load(std::memory_order_acquire);
+    if (n && first <= last)
+      walk(n, 0, first, last, f);
+  }
+
+  // take a reference to the page in slot, or return null if it was freed
+  static Page::Ref get_page(std::atomic<void*> &slot) {
+    Page *page = static_cast<Page*>(slot.load(std::memory_order_acquire));
+    while (page) {
+      if (page->get_unless_zero()) {
+        if (slot.load(std::memory_order_acquire) == page)
+          return Page::Ref(page, false);
+        page->put();
+      }
+      page = static_cast<Page*>(slot.load(std::memory_order_acquire));
+    }
+    return Page::Ref();
+  }
+
+  void free_pages(uint64_t first, uint64_t last) {
+    walk(first, last, [this](std::atomic<void*> &slot, uint64_t) {
+        Page *page = static_cast<Page*>(slot.load(std::memory_order_relaxed));
+        // clear the slot before dropping the ref, see get_page()
+        slot.store(nullptr, std::memory_order_release);
+        page->put();
+        count--;
+      });
+  }
 
   int count_pages(uint64_t offset, uint64_t len) const {
     // count the overlapping pages
@@ -126,41 +350,43 @@ class PageSet {
   }
 
  public:
-  explicit PageSet(size_t page_size) : page_size(page_size) {}
-  PageSet(PageSet &&rhs)
-    : pages(std::move(rhs.pages)), page_size(rhs.page_size) {}
+  explicit PageSet(size_t page_size) : root(nullptr), count(0) {
+    set_page_size(page_size);
+  }
   ~PageSet() {
-    free_pages(pages.begin(), pages.end());
+    free_pages(0, ~0ull);
+    for (auto n : nodes)
+      delete n;
   }
 
   // disable copy
   PageSet(const PageSet&) = delete;
   const PageSet& operator=(const PageSet&) = delete;
 
-  bool empty() const { return pages.empty(); }
-  size_t size() const { return pages.size(); }
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
   size_t get_page_size() const { return page_size; }
 
   // allocate all pages that intersect the range [offset,length)
   void alloc_range(uint64_t offset, uint64_t length, page_vector &range) {
-    // loop in reverse so we can provide hints to avl_set::insert_check()
-    //	and get O(1) insertions after the first
-    uint64_t position = offset + length - 1;
-
     range.resize(count_pages(offset, length));
-    auto out = range.rbegin();
+    auto out = range.begin();
 
     std::lock_guard<lock_type> lock(mutex);
-    iterator cur = pages.end();
-    while (length) {
-      const uint64_t page_offset = position & ~(page_size-1);
-
-      typename page_set::insert_commit_data commit;
-      auto insert = pages.insert_check(cur, page_offset, page_cmp(), commit);
-      if (insert.second) {
-        auto page = Page::create(page_size, page_offset);
-        cur = pages.insert_commit(*page, commit);
-
+    uint64_t pgno = offset >> page_shift;
+    for (; out != range.end(); ++out, ++pgno) {
+      auto &slot = get_slot(pgno);
+      Page *old = static_cast<Page*>(slot.load(std::memory_order_relaxed));
+      if (old && old->nrefs.load() == 1) {
+        out->reset(old);
+        continue;
+      }
+      *out = arena->alloc(pgno << page_shift);
+      Page *page = out->get();
+      if (old) {
+        // shared with a reader; write to a copy
+        std::copy(old->data, old->data + page_size, page->data);
+      } else {
         // assume that the caller will write to the range [offset,length),
         //  so we only need to zero memory outside of this range
 
@@ -171,55 +397,64 @@ class PageSet {
         // zero front of page between page_offset and offset
         if (offset > page->offset)
           std::fill(page->data, page->data + offset - page->offset, 0);
-      } else { // exists
-        cur = insert.first;
+        count++;
       }
-      // add a reference to output vector
-      out->reset(&*cur);
-      ++out;
-
-      auto c = std::min(length, (position & (page_size-1)) + 1);
-      position -= c;
-      length -= c;
+      // the slot holds its own reference
+      page->get();
+      slot.store(page, std::memory_order_release);
+      if (old)
+        old->put();
     }
-    // make sure we sized the vector correctly
-    assert(out == range.rend());
   }
 
-  // return all allocated pages that intersect the range [offset,length)
+  // return all allocated pages that intersect the range [offset,length).
+  // does not block writers
   void get_range(uint64_t offset, uint64_t length, page_vector &range) {
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    while (cur != pages.end() && cur->offset < offset + length)
-      range.push_back(&*cur++);
+    if (!length)
+      return;
+    const uint64_t first = offset >> page_shift;
+    const uint64_t last = (offset + length - 1) >> page_shift;
+    walk(first, last, [&range](std::atomic<void*> &slot, uint64_t) {
+        auto page = get_page(slot);
+        if (page)
+          range.push_back(std::move(page));
+      });
   }
 
   void free_pages_after(uint64_t offset) {
     std::lock_guard<lock_type> lock(mutex);
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    if (cur == pages.end())
-      return;
-    if (cur->offset < offset)
-      cur++;
-    free_pages(cur, pages.end());
+    // free the pages that start at or after offset
+    free_pages((offset + page_size - 1) >> page_shift, ~0ull);
   }
 
   void encode(bufferlist &bl) const {
     ::encode(page_size, bl);
-    unsigned count = pages.size();
+    unsigned count = this->count;
     ::encode(count, bl);
+    // pages are encoded in reverse order
+    std::vector<const Page*> pages;
+    pages.reserve(count);
+    walk(0, ~0ull, [&pages](std::atomic<void*> &slot, uint64_t) {
+        pages.push_back(static_cast<const Page*>(slot.load()));
+      });
     for (auto p = pages.rbegin(); p != pages.rend(); ++p)
-      p->encode(bl, page_size);
+      (*p)->encode(bl, page_size);
   }
   void decode(bufferlist::iterator &p) {
     assert(empty());
-    ::decode(page_size, p);
+    uint64_t size;
+    ::decode(size, p);
+    set_page_size(size);
     unsigned count;
     ::decode(count, p);
-    auto cur = pages.end();
+    std::lock_guard<lock_type> lock(mutex);
     for (unsigned i = 0; i < count; i++) {
-      auto page = Page::create(page_size);
+      auto page = arena->alloc(0);
       page->decode(p, page_size);
-      cur = pages.insert_before(cur, *page);
+      page->get();
+      get_slot(page->offset >> page_shift).store(
+          page.get(), std::memory_order_release);
+      this->count++;
     }
   }
 };
@@ -76,6 +76,7 @@ ostream &operator<<(ostream &lhs, const ECBackend::read_request_t &rhs)
   return lhs << "read_request_t(to_read=[" << rhs.to_read << "]"
 	     << ", need=" << rhs.need
 	     << ", want_attrs=" << rhs.want_attrs
+	     << ", subchunk=" << rhs.subchunk
 	     << ")";
 }
 
@@ -132,8 +133,10 @@ ostream &operator<<(ostream &lhs, const ECBackend::Op &rhs)
     rhs.client_op->get_req()->print(lhs);
   }
   lhs << " pending_commit=" << rhs.pending_commit
-      << " pending_apply=" << rhs.pending_apply
-      << ")";
+      << " pending_apply=" << rhs.pending_apply;
+  if (!rhs.pending_read.empty())
+    lhs << " pending_read=" << rhs.pending_read;
+  lhs << ")";
   return lhs;
 }
 
@@ -934,7 +937,8 @@ void ECBackend::handle_sub_read(
       // are read in sections, so the digest check here won't be done here.
       // Do NOT check osd_read_eio_on_bad_digest here.  We need to report
       // the state of our chunk in case other chunks could substitute.
-      if ((bl.length() == hinfo->get_total_chunk_size()) &&
+      if (hinfo->has_chunk_hash() &&
+	  (bl.length() == hinfo->get_total_chunk_size()) &&
 	  (j->get<0>() == 0)) {
 	dout(20) << __func__ << ": Checking hash of " << i->first << dendl;
 	bufferhash h(-1);
@@ -1020,20 +1024,36 @@ void ECBackend::handle_sub_read_reply(
       dout(20) << __func__ << " to_read skipping" << dendl;
       continue;
     }
+    const read_request_t &req = rop.to_read.find(i->first)->second;
     list<boost::tuple<uint64_t, uint64_t, uint32_t> >::const_iterator req_iter =
-      rop.to_read.find(i->first)->second.to_read.begin();
+      req.to_read.begin();
     list<
       boost::tuple<
 	uint64_t, uint64_t, map<pg_shard_t, bufferlist> > >::iterator riter =
       rop.complete[i->first].returned.begin();
+    int chunk = req.subchunk ? get_shard_data_chunk(from.shard) : -1;
     for (list<pair<uint64_t, bufferlist> >::iterator j = i->second.begin();
 	 j != i->second.end();
 	 ++j, ++req_iter, ++riter) {
-      assert(req_iter != rop.to_read.find(i->first)->second.to_read.end());
-      assert(riter != rop.complete[i->first].returned.end());
-      pair<uint64_t, uint64_t> adjusted =
-	sinfo.aligned_offset_len_to_chunk(
+      pair<uint64_t, uint64_t> adjusted;
+      if (req.subchunk) {
+	// from was not sent the extents it holds none of
+	assert(chunk >= 0);
+	while (true) {
+	  assert(req_iter != req.to_read.end());
+	  adjusted = sinfo.offset_len_to_chunk_shard(
+	    make_pair(req_iter->get<0>(), req_iter->get<1>()), chunk);
+	  if (adjusted.second)
+	    break;
+	  ++req_iter;
+	  ++riter;
+	}
+      } else {
+	assert(req_iter != req.to_read.end());
+	adjusted = sinfo.aligned_offset_len_to_chunk(
 	  make_pair(req_iter->get<0>(), req_iter->get<1>()));
+      }
+      assert(riter != rop.complete[i->first].returned.end());
       assert(adjusted.first == j->first);
       riter->get<2>()[from].claim(j->second);
     }
@@ -1076,6 +1096,16 @@ void ECBackend::handle_sub_read_reply(
         rop.complete.begin();
       iter != rop.complete.end();
       ++iter) {
+      if (rop.to_read.find(iter->first)->second.subchunk) {
+	// there is nothing to reconstruct a failed subchunk read from
+	if (!iter->second.errors.empty()) {
+	  rop.complete[iter->first].r = iter->second.errors.begin()->second;
+	  dout(20) << __func__ << " subchunk read of " << iter->first
+		   << " failed err=" << iter->second.r << dendl;
+	}
+	++is_complete;
+	continue;
+      }
       set<int> have;
       for (map<pg_shard_t, bufferlist>::const_iterator j =
           iter->second.returned.front().get<2>().begin();
@@ -1256,8 +1286,10 @@ void ECBackend::check_recovery_sources(const OSDMapRef osdmap)
 void ECBackend::on_change()
 {
   dout(10) << __func__ << dendl;
+  waiting_state.clear();
   writing.clear();
   tid_to_op_map.clear();
+  extent_cache.clear();
   for (map<ceph_tid_t, ReadOp>::iterator i = tid_to_read_map.begin();
        i != tid_to_read_map.end();
        ++i) {
@@ -1391,31 +1423,261 @@ void ECBackend::submit_transaction(
 	ref));
   }
 
-  for (vector<pg_log_entry_t>::iterator i = op->log_entries.begin();
-       i != op->log_entries.end();
+  dout(10) << __func__ << ": op " << *op << " starting" << dendl;
+  waiting_state.push_back(op);
+  try_start_writes();
+}
+
+bool ECBackend::ExtentCache::lookup(
+  const hobject_t &hoid, uint64_t off, bufferlist *bl) const
+{
+  map<hobject_t, map<uint64_t, Stripe>, hobject_t::BitwiseComparator>::const_iterator p =
+    objects.find(hoid);
+  if (p == objects.end())
+    return false;
+  map<uint64_t, Stripe>::const_iterator q = p->second.find(off);
+  if (q == p->second.end())
+    return false;
+  *bl = q->second.bl;
+  return true;
+}
+
+void ECBackend::ExtentCache::set(
+  const hobject_t &hoid, uint64_t off, const bufferlist &bl, ceph_tid_t tid)
+{
+  Stripe &stripe = objects[hoid][off];
+  bytes -= stripe.bl.length();
+  stripe.bl = bl;
+  bytes += stripe.bl.length();
+  stripe.pins.insert(tid);
+}
+
+void ECBackend::ExtentCache::release(
+  const hobject_t &hoid, uint64_t off, ceph_tid_t tid)
+{
+  map<hobject_t, map<uint64_t, Stripe>, hobject_t::BitwiseComparator>::iterator p =
+    objects.find(hoid);
+  if (p == objects.end())
+    return;
+  map<uint64_t, Stripe>::iterator q = p->second.find(off);
+  if (q == p->second.end())
+    return;
+  q->second.pins.erase(tid);
+  if (q->second.pins.empty()) {
+    bytes -= q->second.bl.length();
+    p->second.erase(q);
+    if (p->second.empty())
+      objects.erase(p);
+  }
+}
+
+void ECBackend::ExtentCache::invalidate(const hobject_t &hoid)
+{
+  map<hobject_t, map<uint64_t, Stripe>, hobject_t::BitwiseComparator>::iterator p =
+    objects.find(hoid);
+  if (p == objects.end())
+    return;
+  for (map<uint64_t, Stripe>::iterator q = p->second.begin();
+       q != p->second.end();
+       ++q) {
+    bytes -= q->second.bl.length();
+  }
+  objects.erase(p);
+}
+
+struct C_PartialStripeRead :
+  public GenContext<pair<RecoveryMessages*, ECBackend::read_result_t& > &> {
+  ECBackend *ec;
+  ceph_tid_t tid;
+  hobject_t hoid;
+  C_PartialStripeRead(ECBackend *ec, ceph_tid_t tid, const hobject_t &hoid)
+    : ec(ec), tid(tid), hoid(hoid) {}
+  void finish(pair<RecoveryMessages *, ECBackend::read_result_t &> &in) {
+    ec->handle_partial_stripe_read(tid, hoid, in.second);
+  }
+};
+
+void ECBackend::try_start_writes()
+{
+  while (!waiting_state.empty()) {
+    Op *op = waiting_state.front();
+    if (!op->partial_stripes_ready) {
+      if (!op->pending_read.empty() || !get_partial_stripes(op))
+	return;
+      if (!op->partial_stripes_ready)
+	return;
+    }
+    waiting_state.pop_front();
+    writing.push_back(op);
+    start_write(op);
+  }
+}
+
+bool ECBackend::get_partial_stripes(Op *op)
+{
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> partial;
+  op->t->get_partial_stripes(op->unstable_hash_infos, sinfo, &partial);
+
+  // every op ahead of this one has been generated, so the cache holds
+  // the latest contents of any stripe still in flight
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> to_read;
+  op->partial_stripes.clear();
+  for (map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator>::iterator i =
+	 partial.begin();
+       i != partial.end();
        ++i) {
-    MustPrependHashInfo vis;
-    i->mod_desc.visit(&vis);
-    if (vis.must_prepend_hash_info()) {
-      dout(10) << __func__ << ": stashing HashInfo for "
-	       << i->soid << " for entry " << *i << dendl;
-      assert(op->unstable_hash_infos.count(i->soid));
-      ObjectModDesc desc;
-      map<string, boost::optional<bufferlist> > old_attrs;
-      bufferlist old_hinfo;
-      ::encode(*(op->unstable_hash_infos[i->soid]), old_hinfo);
-      old_attrs[ECUtil::get_hinfo_key()] = old_hinfo;
-      desc.setattrs(old_attrs);
-      i->mod_desc.swap(desc);
-      i->mod_desc.claim_append(desc);
-      assert(i->mod_desc.can_rollback());
+    for (set<uint64_t>::iterator j = i->second.begin();
+	 j != i->second.end();
+	 ++j) {
+      bufferlist bl;
+      if (extent_cache.lookup(i->first, *j, &bl)) {
+	op->partial_stripes[i->first][*j].claim(bl);
+      } else {
+	to_read[i->first].insert(*j);
+      }
     }
   }
+  if (to_read.empty()) {
+    op->partial_stripes_ready = true;
+    return true;
+  }
 
-  dout(10) << __func__ << ": op " << *op << " starting" << dendl;
-  start_write(op);
-  writing.push_back(op);
-  dout(10) << "onreadable_sync: " << op->on_local_applied_sync << dendl;
+  // the shards may not have applied an in-flight op which rewrote one
+  // of these objects wholesale; wait for it rather than read stale data
+  for (list<Op*>::iterator i = writing.begin(); i != writing.end(); ++i) {
+    for (map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator>::iterator j =
+	   to_read.begin();
+	 j != to_read.end();
+	 ++j) {
+      if ((*i)->invalidated.count(j->first)) {
+	dout(10) << __func__ << ": " << *op << " waiting on " << **i
+		 << " to read " << j->first << dendl;
+	op->partial_stripes.clear();
+	return false;
+      }
+    }
+  }
+
+  read_partial_stripes(op, to_read, false);
+  return true;
+}
+
+void ECBackend::read_partial_stripes(
+  Op *op,
+  const map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> &to_read,
+  bool do_redundant_reads)
+{
+  set<int> want_to_read;
+  get_want_to_read_shards(&want_to_read);
+  map<hobject_t, read_request_t, hobject_t::BitwiseComparator> for_read_op;
+  for (map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator>::const_iterator i =
+	 to_read.begin();
+       i != to_read.end();
+       ++i) {
+    // coalesce adjacent stripes
+    list<boost::tuple<uint64_t, uint64_t, uint32_t> > offsets;
+    for (set<uint64_t>::const_iterator j = i->second.begin();
+	 j != i->second.end();
+	 ++j) {
+      if (!offsets.empty() &&
+	  offsets.back().get<0>() + offsets.back().get<1>() == *j) {
+	offsets.back().get<1>() += sinfo.get_stripe_width();
+      } else {
+	offsets.push_back(boost::make_tuple(*j, sinfo.get_stripe_width(), 0));
+      }
+    }
+    set<pg_shard_t> shards;
+    int r = get_min_avail_to_read_shards(
+      i->first,
+      want_to_read,
+      false,
+      do_redundant_reads,
+      &shards);
+    assert(r == 0);
+    dout(10) << __func__ << ": " << *op << " reading " << i->first
+	     << " " << offsets << " from " << shards << dendl;
+    for_read_op.insert(
+      make_pair(
+	i->first,
+	read_request_t(
+	  i->first,
+	  offsets,
+	  shards,
+	  false,
+	  new C_PartialStripeRead(this, op->tid, i->first))));
+    op->pending_read[i->first] = i->second;
+  }
+  start_read_op(
+    cct->_conf->osd_client_op_priority,
+    for_read_op,
+    op->client_op,
+    do_redundant_reads, false);
+}
+
+void ECBackend::handle_partial_stripe_read(
+  ceph_tid_t tid,
+  const hobject_t &hoid,
+  read_result_t &res)
+{
+  map<ceph_tid_t, Op>::iterator i = tid_to_op_map.find(tid);
+  assert(i != tid_to_op_map.end());
+  Op *op = &(i->second);
+  if (res.r != 0) {
+    // the read already fell back to the remaining shards; read again
+    // from every shard.  past that the write cannot be generated, and
+    // it already holds a version every later write is ordered behind,
+    // so force a new interval: on_change drops it (and everything
+    // queued after it) and the clients resend.
+    derr << __func__ << ": " << *op << " got " << res.r
+	 << " reading partial stripes of " << hoid << dendl;
+    map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> to_read;
+    to_read[hoid].swap(op->pending_read[hoid]);
+    op->pending_read.erase(hoid);
+    if (op->partial_read_retries < MAX_PARTIAL_READ_RETRIES) {
+      ++op->partial_read_retries;
+      read_partial_stripes(op, to_read, true);
+    } else {
+      set<pg_shard_t> bad;
+      for (map<pg_shard_t, int>::iterator j = res.errors.begin();
+	   j != res.errors.end();
+	   ++j)
+	bad.insert(j->first);
+      get_parent()->clog_error() << __func__ << ": " << hoid
+				 << " cannot be read, err " << res.r
+				 << " from shards " << bad
+				 << ", re-peering to abandon " << op->reqid
+				 << "\n";
+      op->pending_read.insert(to_read.begin(), to_read.end());
+      get_parent()->request_repeer(bad);
+    }
+    return;
+  }
+  assert(res.errors.empty());
+  map<uint64_t, bufferlist> &stripes = op->partial_stripes[hoid];
+  for (list<boost::tuple<uint64_t, uint64_t, map<pg_shard_t, bufferlist> > >::iterator j =
+	 res.returned.begin();
+       j != res.returned.end();
+       ++j) {
+    map<int, bufferlist> to_decode;
+    for (map<pg_shard_t, bufferlist>::iterator k = j->get<2>().begin();
+	 k != j->get<2>().end();
+	 ++k) {
+      to_decode[k->first.shard].claim(k->second);
+    }
+    bufferlist bl;
+    int r = ECUtil::decode(sinfo, ec_impl, to_decode, &bl);
+    assert(r == 0);
+    assert(bl.length() == j->get<1>());
+    for (uint64_t off = 0; off < bl.length(); off += sinfo.get_stripe_width()) {
+      stripes[j->get<0>() + off].substr_of(bl, off, sinfo.get_stripe_width());
+    }
+  }
+  op->pending_read.erase(hoid);
+  if (op->pending_read.empty()) {
+    dout(10) << __func__ << ": " << *op << " read its partial stripes" << dendl;
+    op->partial_stripes_ready = true;
+    try_start_writes();
+  }
 }
 
 int ECBackend::get_min_avail_to_read_shards(
@@ -1588,6 +1850,25 @@ void ECBackend::start_read_op(
 	  j->get<0>(),
 	  j->get<1>(),
 	  map<pg_shard_t, bufferlist>()));
+      if (i->second.subchunk) {
+	for (set<pg_shard_t>::const_iterator k = i->second.need.begin();
+	     k != i->second.need.end();
+	     ++k) {
+	  int chunk = get_shard_data_chunk(k->shard);
+	  assert(chunk >= 0);
+	  pair<uint64_t, uint64_t> chunk_off_len =
+	    sinfo.offset_len_to_chunk_shard(
+	      make_pair(j->get<0>(), j->get<1>()), chunk);
+	  if (chunk_off_len.second == 0)
+	    continue;
+	  messages[*k].to_read[i->first].push_back(
+	    boost::make_tuple(chunk_off_len.first,
+			      chunk_off_len.second,
+			      j->get<2>()));
+	}
+	assert(!need_attrs);
+	continue;
+      }
       pair<uint64_t, uint64_t> chunk_off_len =
 	sinfo.aligned_offset_len_to_chunk(make_pair(j->get<0>(), j->get<1>()));
       for (set<pg_shard_t>::const_iterator k = i->second.need.begin();
@@ -1759,8 +2040,20 @@ void ECBackend::check_op(Op *op)
     // done!
     assert(writing.front() == op);
     dout(10) << __func__ << " Completing " << *op << dendl;
+    for (map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator>::iterator i =
+	   op->pinned.begin();
+	 i != op->pinned.end();
+	 ++i) {
+      for (set<uint64_t>::iterator j = i->second.begin();
+	   j != i->second.end();
+	   ++j) {
+	extent_cache.release(i->first, *j, op->tid);
+      }
+    }
     writing.pop_front();
     tid_to_op_map.erase(op->tid);
+    // an op waiting to read behind this one may proceed now
+    try_start_writes();
   }
   for (map<ceph_tid_t, Op>::iterator i = tid_to_op_map.begin();
        i != tid_to_op_map.end();
@@ -1781,14 +2074,69 @@ void ECBackend::start_write(Op *op) {
   ObjectStore::Transaction empty;
   empty.set_use_tbl(parent->transaction_use_tbl());
 
+  // the HashInfo as of now, with every earlier op generated, is what a
+  // rollback must restore; an overwrite changes the size and clears the
+  // hashes, so it needs this just like an append
+  set<hobject_t, hobject_t::BitwiseComparator> overwritten;
+  op->t->get_overwrite_objects(&overwritten);
+
+  for (vector<pg_log_entry_t>::iterator i = op->log_entries.begin();
+       i != op->log_entries.end();
+       ++i) {
+    MustPrependHashInfo vis;
+    i->mod_desc.visit(&vis);
+    if (vis.must_prepend_hash_info() ||
+	(vis.state == MustPrependHashInfo::EMPTY &&
+	 i->mod_desc.rollback_info_open() &&
+	 overwritten.count(i->soid))) {
+      dout(10) << __func__ << ": stashing HashInfo for "
+	       << i->soid << " for entry " << *i << dendl;
+      assert(op->unstable_hash_infos.count(i->soid));
+      ObjectModDesc desc;
+      map<string, boost::optional<bufferlist> > old_attrs;
+      bufferlist old_hinfo;
+      ::encode(*(op->unstable_hash_infos[i->soid]), old_hinfo);
+      old_attrs[ECUtil::get_hinfo_key()] = old_hinfo;
+      desc.setattrs(old_attrs);
+      i->mod_desc.swap(desc);
+      i->mod_desc.claim_append(desc);
+      assert(i->mod_desc.can_rollback());
+    }
+  }
+
+  ECTransaction::stripe_map_t written;
   op->t->generate_transactions(
     op->unstable_hash_infos,
     ec_impl,
     get_parent()->get_info().pgid.pgid,
     sinfo,
+    op->partial_stripes,
+    &(op->log_entries),
     &trans,
     &(op->temp_added),
-    &(op->temp_cleared));
+    &(op->temp_cleared),
+    &written,
+    &(op->invalidated));
+  op->partial_stripes.clear();
+
+  for (set<hobject_t, hobject_t::BitwiseComparator>::iterator i =
+	 op->invalidated.begin();
+       i != op->invalidated.end();
+       ++i) {
+    extent_cache.invalidate(*i);
+  }
+  for (ECTransaction::stripe_map_t::iterator i = written.begin();
+       i != written.end();
+       ++i) {
+    for (map<uint64_t, bufferlist>::iterator j = i->second.begin();
+	 j != i->second.end();
+	 ++j) {
+      extent_cache.set(i->first, j->first, j->second, op->tid);
+      op->pinned[i->first].insert(j->first);
+    }
+  }
+  dout(20) << __func__ << ": extent cache " << extent_cache.get_bytes()
+	   << " bytes" << dendl;
 
   dout(10) << "onreadable_sync: " << op->on_local_applied_sync << dendl;
 
@@ -1905,18 +2253,69 @@ struct CallClientContexts :
       res.returned.pop_front();
     }
 out:
-    status->complete = true;
-    list<ECBackend::ClientAsyncReadStatus> &ip =
-      ec->in_progress_client_reads;
-    while (ip.size() && ip.front().complete) {
-      if (ip.front().on_complete) {
-	ip.front().on_complete->complete(res.r);
-	ip.front().on_complete = NULL;
+    ec->complete_client_read(status, res.r);
+  }
+  ~CallClientContexts() {
+    for (list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		   pair<bufferlist*, Context*> > >::iterator i = to_read.begin();
+	 i != to_read.end();
+	 to_read.erase(i++)) {
+      delete i->second.second;
+    }
+  }
+};
+
+struct CallClientSubchunks :
+  public GenContext<pair<RecoveryMessages*, ECBackend::read_result_t& > &> {
+  ECBackend *ec;
+  hobject_t hoid;
+  ECBackend::ClientAsyncReadStatus *status;
+  list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+	    pair<bufferlist*, Context*> > > to_read;
+  CallClientSubchunks(
+    ECBackend *ec,
+    const hobject_t &hoid,
+    ECBackend::ClientAsyncReadStatus *status,
+    const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		    pair<bufferlist*, Context*> > > &to_read)
+    : ec(ec), hoid(hoid), status(status), to_read(to_read) {}
+  void finish(pair<RecoveryMessages *, ECBackend::read_result_t &> &in) {
+    ECBackend::read_result_t &res = in.second;
+    if (res.r != 0) {
+      // fall back to reconstructing the stripes from any k shards
+      ec->objects_read_stripes(hoid, to_read, status, false);
+      to_read.clear();
+      return;
+    }
+    assert(res.returned.size() == to_read.size());
+    assert(res.errors.empty());
+    for (list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		   pair<bufferlist*, Context*> > >::iterator i = to_read.begin();
+	 i != to_read.end();
+	 to_read.erase(i++)) {
+      // shard extents by data chunk
+      map<int, bufferlist> chunks;
+      for (map<pg_shard_t, bufferlist>::iterator j =
+	     res.returned.front().get<2>().begin();
+	   j != res.returned.front().get<2>().end();
+	   ++j) {
+	int chunk = ec->get_shard_data_chunk(j->first.shard);
+	assert(chunk >= 0);
+	chunks[chunk].claim(j->second);
+      }
+      bufferlist bl;
+      ECUtil::assemble_subchunks(
+	ec->sinfo, i->first.get<0>(), i->first.get<1>(), chunks, &bl);
+      assert(i->second.first);
+      i->second.first->claim(bl);
+      if (i->second.second) {
+	i->second.second->complete(i->second.first->length());
       }
-      ip.pop_front();
+      res.returned.pop_front();
     }
+    ec->complete_client_read(status, res.r);
   }
-  ~CallClientContexts() {
+  ~CallClientSubchunks() {
     for (list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
 		   pair<bufferlist*, Context*> > >::iterator i = to_read.begin();
 	 i != to_read.end();
@@ -1926,6 +2325,19 @@ out:
   }
 };
 
+void ECBackend::complete_client_read(ClientAsyncReadStatus *status, int r)
+{
+  status->complete = true;
+  list<ClientAsyncReadStatus> &ip = in_progress_client_reads;
+  while (ip.size() && ip.front().complete) {
+    if (ip.front().on_complete) {
+      ip.front().on_complete->complete(r);
+      ip.front().on_complete = NULL;
+    }
+    ip.pop_front();
+  }
+}
+
 void ECBackend::objects_read_async(
   const hobject_t &hoid,
   const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
@@ -1934,8 +2346,81 @@ void ECBackend::objects_read_async(
   bool fast_read)
 {
   in_progress_client_reads.push_back(ClientAsyncReadStatus(on_complete));
-  CallClientContexts *c = new CallClientContexts(
-    this, &(in_progress_client_reads.back()), to_read);
+  ClientAsyncReadStatus *status = &(in_progress_client_reads.back());
+  // fast_read wants redundant reads of whole stripes
+  if (!fast_read && cct->_conf->osd_ec_subchunk_reads &&
+      objects_read_subchunks(hoid, to_read, status))
+    return;
+  objects_read_stripes(hoid, to_read, status, fast_read);
+}
+
+bool ECBackend::objects_read_subchunks(
+  const hobject_t &hoid,
+  const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		  pair<bufferlist*, Context*> > > &to_read,
+  ClientAsyncReadStatus *status)
+{
+  list<boost::tuple<uint64_t, uint64_t, uint32_t> > offsets;
+  set<int> want;
+  for (list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		 pair<bufferlist*, Context*> > >::const_iterator i =
+	 to_read.begin();
+       i != to_read.end();
+       ++i) {
+    offsets.push_back(i->first);
+    for (unsigned chunk = 0; chunk < ec_impl->get_data_chunk_count(); ++chunk) {
+      if (sinfo.offset_len_to_chunk_shard(
+	    make_pair(i->first.get<0>(), i->first.get<1>()), chunk).second)
+	want.insert(get_data_chunk_shard(chunk));
+    }
+  }
+  if (want.empty())
+    return false;
+
+  set<pg_shard_t> shards;
+  int r = get_min_avail_to_read_shards(
+    hoid,
+    want,
+    false,
+    false,
+    &shards);
+  if (r < 0 || shards.size() != want.size())
+    return false;
+  for (set<pg_shard_t>::iterator i = shards.begin(); i != shards.end(); ++i) {
+    if (!want.count(i->shard))
+      return false;
+  }
+  dout(20) << __func__ << ": " << hoid << " reading " << offsets
+	   << " from " << shards << dendl;
+
+  map<hobject_t, read_request_t, hobject_t::BitwiseComparator> for_read_op;
+  for_read_op.insert(
+    make_pair(
+      hoid,
+      read_request_t(
+	hoid,
+	offsets,
+	shards,
+	false,
+	new CallClientSubchunks(this, hoid, status, to_read),
+	true)));
+
+  start_read_op(
+    cct->_conf->osd_client_op_priority,
+    for_read_op,
+    OpRequestRef(),
+    false, false);
+  return true;
+}
+
+void ECBackend::objects_read_stripes(
+  const hobject_t &hoid,
+  const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		  pair<bufferlist*, Context*> > > &to_read,
+  ClientAsyncReadStatus *status,
+  bool fast_read)
+{
+  CallClientContexts *c = new CallClientContexts(this, status, to_read);
 
   list<boost::tuple<uint64_t, uint64_t, uint32_t> > offsets;
   pair<uint64_t, uint64_t> tmp;
@@ -2043,14 +2528,32 @@ void ECBackend::rollback_append(
   uint64_t old_size,
   ObjectStore::Transaction *t)
 {
-  assert(old_size % sinfo.get_stripe_width() == 0);
+  // with overwrites the old size need not be stripe aligned, but the
+  // shards always hold whole stripes
   t->truncate(
     coll,
     ghobject_t(hoid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-    sinfo.aligned_logical_offset_to_chunk_offset(
+    sinfo.logical_to_next_chunk_offset(
       old_size));
 }
 
+void ECBackend::rollback_extents(
+  const hobject_t &hoid,
+  version_t gen,
+  const vector<pair<uint64_t, uint64_t> > &extents,
+  ObjectStore::Transaction *t)
+{
+  assert(!hoid.is_temp());
+  ghobject_t goid(hoid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard);
+  ghobject_t stash(hoid, gen, get_parent()->whoami_shard().shard);
+  for (vector<pair<uint64_t, uint64_t> >::const_iterator i = extents.begin();
+       i != extents.end();
+       ++i) {
+    t->clone_range(coll, stash, goid, i->first, i->second, i->first);
+  }
+  t->remove(coll, stash);
+}
+
 void ECBackend::be_deep_scrub(
   const hobject_t &poid,
   uint32_t seed,
@@ -2100,6 +2603,14 @@ void ECBackend::be_deep_scrub(
     o.read_error = true;
     o.digest_present = false;
     return;
+  } else if (!hinfo->has_chunk_hash()) {
+    // overwritten: only the size can be checked
+    if (hinfo->get_total_chunk_size() != pos) {
+      dout(0) << "_scan_list  " << poid << " got incorrect size on read" << dendl;
+      o.read_error = true;
+      return;
+    }
+    o.digest_present = false;
   } else {
     if (hinfo->get_chunk_hash(get_parent()->whoami_shard().shard) != h.digest()) {
       dout(0) << "_scan_list  " << poid << " got incorrect hash on read" << dendl;
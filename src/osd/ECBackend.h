@@ -128,12 +128,19 @@ public:
    * maintain a queue of in progress reads (@see in_progress_client_reads)
    * to ensure that we always call the completion callback in order.
    *
+   * When every data shard holding the requested bytes is healthy, a
+   * client read only asks those shards for their part of each extent
+   * (@see read_request_t::subchunk) and CallClientSubchunks stitches
+   * the result together without decoding.  If any of those reads fail,
+   * it falls back to reading and decoding the full stripes.
+   *
    * Another subtely is that while we may read a degraded object, we will
    * still only perform a client read from shards in the acting set.  This
    * ensures that we won't ever have to restart a client initiated read in
    * check_recovery_sources.
    */
   friend struct CallClientContexts;
+  friend struct CallClientSubchunks;
   struct ClientAsyncReadStatus {
     bool complete;
     Context *on_complete;
@@ -149,6 +156,20 @@ public:
     bool fast_read = false);
 
 private:
+  /// @return false if some data shard needed is unavailable
+  bool objects_read_subchunks(
+    const hobject_t &hoid,
+    const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		    pair<bufferlist*, Context*> > > &to_read,
+    ClientAsyncReadStatus *status);
+  void objects_read_stripes(
+    const hobject_t &hoid,
+    const list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+		    pair<bufferlist*, Context*> > > &to_read,
+    ClientAsyncReadStatus *status,
+    bool fast_read);
+  void complete_client_read(ClientAsyncReadStatus *status, int r);
+
   friend struct ECRecoveryHandle;
   uint64_t get_recovery_chunk_size() const {
     return ROUND_UP_TO(cct->_conf->osd_recovery_max_chunk,
@@ -162,6 +183,18 @@ private:
       want_to_read->insert(chunk);
     }
   }
+  int get_data_chunk_shard(unsigned chunk) const {
+    const vector<int> &chunk_mapping = ec_impl->get_chunk_mapping();
+    return chunk_mapping.size() > chunk ? chunk_mapping[chunk] : (int)chunk;
+  }
+  /// data chunk held by shard, -1 for a coding shard
+  int get_shard_data_chunk(int shard) const {
+    for (unsigned i = 0; i < ec_impl->get_data_chunk_count(); ++i) {
+      if (get_data_chunk_shard(i) == shard)
+	return i;
+    }
+    return -1;
+  }
 
   /**
    * Recovery
@@ -277,15 +310,23 @@ public:
     const list<boost::tuple<uint64_t, uint64_t, uint32_t> > to_read;
     const set<pg_shard_t> need;
     const bool want_attrs;
+    /**
+     * to_read extents need not be stripe aligned, and each data shard
+     * in need is only sent the part of each extent it holds, skipping
+     * extents it holds none of.  The read fails unless every shard
+     * returns its part.
+     */
+    const bool subchunk;
     GenContext<pair<RecoveryMessages *, read_result_t& > &> *cb;
     read_request_t(
       const hobject_t &hoid,
       const list<boost::tuple<uint64_t, uint64_t, uint32_t> > &to_read,
       const set<pg_shard_t> &need,
       bool want_attrs,
-      GenContext<pair<RecoveryMessages *, read_result_t& > &> *cb)
+      GenContext<pair<RecoveryMessages *, read_result_t& > &> *cb,
+      bool subchunk = false)
       : to_read(to_read), need(need), want_attrs(want_attrs),
-	cb(cb) {}
+	subchunk(subchunk), cb(cb) {}
   };
   friend ostream &operator<<(ostream &lhs, const read_request_t &rhs);
 
@@ -344,6 +385,13 @@ public:
    * As with client reads, there is a possibility of out-of-order
    * completions. Thus, callbacks and completion are called in order
    * on the writing list.
+   *
+   * On pools allowing overwrites, a write which covers only part of a
+   * stripe holding data must first learn the rest of that stripe.  Ops
+   * therefore wait on waiting_state, in order, until the op at the front
+   * has the old contents of its partial stripes, either from the
+   * extent_cache or read back from the data shards, and only then have
+   * their transactions generated and move to writing.
    */
   struct Op {
     hobject_t hoid;
@@ -368,6 +416,22 @@ public:
     set<pg_shard_t> pending_apply;
 
     map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> unstable_hash_infos;
+
+    /// old contents of the stripes this op partially overwrites
+    ECTransaction::stripe_map_t partial_stripes;
+    bool partial_stripes_ready;
+    /// partial stripes still being read, by object
+    map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> pending_read;
+    /// failed partial stripe reads retried so far
+    unsigned partial_read_retries;
+    /// stripes this op pinned in the extent cache
+    map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> pinned;
+    /// objects rewritten other than through the extent cache
+    set<hobject_t, hobject_t::BitwiseComparator> invalidated;
+
+    Op() : on_local_applied_sync(0), on_all_applied(0), on_all_commit(0),
+	   tid(0), t(0), partial_stripes_ready(false),
+	   partial_read_retries(0) {}
     ~Op() {
       delete t;
       delete on_local_applied_sync;
@@ -397,8 +461,43 @@ public:
     RecoveryMessages *m);
 
   map<ceph_tid_t, Op> tid_to_op_map; /// lists below point into here
+  list<Op*> waiting_state;
   list<Op*> writing;
 
+  /**
+   * Extent cache
+   *
+   * Logical contents of the stripes written by ops which are not yet
+   * applied on every shard, by object and stripe offset.  A partial
+   * overwrite of one of those stripes takes its old contents from here
+   * rather than from the shards, which may not have applied the earlier
+   * write yet.  A stripe is pinned by each op writing it and dropped
+   * once none of them is in flight.
+   */
+  class ExtentCache {
+    struct Stripe {
+      bufferlist bl;
+      set<ceph_tid_t> pins;
+    };
+    map<hobject_t, map<uint64_t, Stripe>, hobject_t::BitwiseComparator> objects;
+    uint64_t bytes;
+  public:
+    ExtentCache() : bytes(0) {}
+    bool lookup(const hobject_t &hoid, uint64_t off, bufferlist *bl) const;
+    /// set the contents of a stripe, pinned by tid
+    void set(const hobject_t &hoid, uint64_t off, const bufferlist &bl,
+	     ceph_tid_t tid);
+    void release(const hobject_t &hoid, uint64_t off, ceph_tid_t tid);
+    void invalidate(const hobject_t &hoid);
+    void clear() {
+      objects.clear();
+      bytes = 0;
+    }
+    uint64_t get_bytes() const {
+      return bytes;
+    }
+  } extent_cache;
+
   CephContext *cct;
   ErasureCodeInterfaceRef ec_impl;
 
@@ -462,6 +561,19 @@ public:
   friend struct ReadCB;
   void check_op(Op *op);
   void start_write(Op *op);
+  friend struct C_PartialStripeRead;
+  void try_start_writes();
+  /// rereads of a partial stripe from every shard before re-peering
+  static const unsigned MAX_PARTIAL_READ_RETRIES = 2;
+  bool get_partial_stripes(Op *op);
+  void read_partial_stripes(
+    Op *op,
+    const map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> &to_read,
+    bool do_redundant_reads);
+  void handle_partial_stripe_read(
+    ceph_tid_t tid,
+    const hobject_t &hoid,
+    read_result_t &res);
 public:
   ECBackend(
     PGBackend::Listener *pg,
@@ -495,6 +607,12 @@ public:
     uint64_t old_size,
     ObjectStore::Transaction *t);
 
+  void rollback_extents(
+    const hobject_t &hoid,
+    version_t gen,
+    const vector<pair<uint64_t, uint64_t> > &extents,
+    ObjectStore::Transaction *t);
+
   bool scrub_supported() { return true; }
   bool auto_repair_supported() const { return true; }
 
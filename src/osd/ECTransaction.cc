@@ -21,6 +21,7 @@
 #include "ECBackend.h"
 #include "ECUtil.h"
 #include "os/ObjectStore.h"
+#include "include/interval_set.h"
 
 struct AppendObjectsGenerator: public boost::static_visitor<void> {
   set<hobject_t, hobject_t::BitwiseComparator> *out;
@@ -28,6 +29,9 @@ struct AppendObjectsGenerator: public boost::static_visitor<void> {
   void operator()(const ECTransaction::AppendOp &op) {
     out->insert(op.oid);
   }
+  void operator()(const ECTransaction::OverwriteOp &op) {
+    out->insert(op.oid);
+  }
   void operator()(const ECTransaction::TouchOp &op) {
     out->insert(op.oid);
   }
@@ -57,37 +61,253 @@ void ECTransaction::get_append_objects(
   reverse_visit(gen);
 }
 
+struct OverwriteObjectsGenerator: public boost::static_visitor<void> {
+  set<hobject_t, hobject_t::BitwiseComparator> *out;
+  explicit OverwriteObjectsGenerator(
+    set<hobject_t, hobject_t::BitwiseComparator> *out) : out(out) {}
+  void operator()(const ECTransaction::OverwriteOp &op) {
+    out->insert(op.oid);
+  }
+  template <typename T>
+  void operator()(const T &op) {}
+};
+void ECTransaction::get_overwrite_objects(
+  set<hobject_t, hobject_t::BitwiseComparator> *out) const
+{
+  OverwriteObjectsGenerator gen(out);
+  visit(gen);
+}
+
+/**
+ * Tracks, for each object touched by a transaction, which of its stripes
+ * still hold the data the object had on disk before the transaction.
+ *
+ * disk_size is the logical size of that data, source the object it lives
+ * in (other than the object itself once it has been cloned or renamed
+ * over), and stripes rewritten since are kept by the users.
+ */
+struct StripeTracker {
+  const map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos;
+  const ECUtil::stripe_info_t &sinfo;
+  map<hobject_t, uint64_t, hobject_t::BitwiseComparator> disk_size;
+  map<hobject_t, hobject_t, hobject_t::BitwiseComparator> source;
+
+  StripeTracker(
+    const map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
+    const ECUtil::stripe_info_t &sinfo)
+    : hash_infos(hash_infos), sinfo(sinfo) {}
+
+  void init(const hobject_t &oid) {
+    if (disk_size.count(oid))
+      return;
+    map<hobject_t, ECUtil::HashInfoRef,
+	hobject_t::BitwiseComparator>::const_iterator p = hash_infos.find(oid);
+    assert(p != hash_infos.end());
+    disk_size[oid] = sinfo.aligned_chunk_offset_to_logical_offset(
+      p->second->get_total_chunk_size());
+    source[oid] = oid;
+  }
+  void copy(const hobject_t &from, const hobject_t &to) {
+    init(from);
+    init(to);
+    disk_size[to] = disk_size[from];
+    source[to] = source[from];
+  }
+  void clear(const hobject_t &oid) {
+    init(oid);
+    disk_size[oid] = 0;
+  }
+  /// true if stripe off of oid must come from source(oid) on disk
+  bool on_disk(const hobject_t &oid, uint64_t off) {
+    init(oid);
+    return off < disk_size[oid];
+  }
+};
+
+struct PartialStripeGenerator : public boost::static_visitor<void> {
+  StripeTracker tracker;
+  const ECUtil::stripe_info_t &sinfo;
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> rewritten;
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> *out;
+
+  PartialStripeGenerator(
+    const map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
+    const ECUtil::stripe_info_t &sinfo,
+    map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> *out)
+    : tracker(hash_infos, sinfo), sinfo(sinfo), out(out) {}
+
+  void need(const hobject_t &oid, uint64_t off) {
+    if (!rewritten[oid].count(off) && tracker.on_disk(oid, off))
+      (*out)[tracker.source[oid]].insert(off);
+  }
+  void rewrite(const hobject_t &oid, uint64_t off, uint64_t len) {
+    uint64_t end = sinfo.logical_to_next_stripe_offset(off + len);
+    for (uint64_t s = sinfo.logical_to_prev_stripe_offset(off);
+	 s < end;
+	 s += sinfo.get_stripe_width())
+      rewritten[oid].insert(s);
+  }
+
+  void operator()(const ECTransaction::AppendOp &op) {
+    rewrite(op.oid, op.off, op.bl.length());
+  }
+  void operator()(const ECTransaction::OverwriteOp &op) {
+    uint64_t end = op.off + op.bl.length();
+    if (op.off % sinfo.get_stripe_width())
+      need(op.oid, sinfo.logical_to_prev_stripe_offset(op.off));
+    if (end % sinfo.get_stripe_width())
+      need(op.oid, sinfo.logical_to_prev_stripe_offset(end));
+    rewrite(op.oid, op.off, op.bl.length());
+  }
+  void operator()(const ECTransaction::CloneOp &op) {
+    tracker.copy(op.source, op.target);
+    rewritten[op.target] = rewritten[op.source];
+  }
+  void operator()(const ECTransaction::RenameOp &op) {
+    tracker.copy(op.source, op.destination);
+    rewritten[op.destination] = rewritten[op.source];
+    tracker.clear(op.source);
+    rewritten.erase(op.source);
+  }
+  void operator()(const ECTransaction::StashOp &op) {
+    tracker.clear(op.oid);
+    rewritten.erase(op.oid);
+  }
+  void operator()(const ECTransaction::RemoveOp &op) {
+    tracker.clear(op.oid);
+    rewritten.erase(op.oid);
+  }
+  template <typename T>
+  void operator()(const T &op) {}
+};
+void ECTransaction::get_partial_stripes(
+  const map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
+  const ECUtil::stripe_info_t &sinfo,
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> *out) const
+{
+  PartialStripeGenerator gen(hash_infos, sinfo, out);
+  visit(gen);
+}
+
 struct TransGenerator : public boost::static_visitor<void> {
   map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos;
 
   ErasureCodeInterfaceRef &ecimpl;
   const pg_t pgid;
   const ECUtil::stripe_info_t sinfo;
+  const ECTransaction::stripe_map_t &partial_stripes;
+  vector<pg_log_entry_t> *entries;
   map<shard_id_t, ObjectStore::Transaction> *trans;
   set<int> want;
   set<hobject_t, hobject_t::BitwiseComparator> *temp_added;
   set<hobject_t, hobject_t::BitwiseComparator> *temp_removed;
+  ECTransaction::stripe_map_t *written;
+  set<hobject_t, hobject_t::BitwiseComparator> *invalidated;
   stringstream *out;
+
+  StripeTracker tracker;
+  /// stripes rewritten by this transaction, with their new contents
+  ECTransaction::stripe_map_t rewritten;
+  /// chunk extents cloned aside for rollback, by object
+  map<hobject_t, interval_set<uint64_t>, hobject_t::BitwiseComparator> stashed;
+
   TransGenerator(
     map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
     ErasureCodeInterfaceRef &ecimpl,
     pg_t pgid,
     const ECUtil::stripe_info_t &sinfo,
+    const ECTransaction::stripe_map_t &partial_stripes,
+    vector<pg_log_entry_t> *entries,
     map<shard_id_t, ObjectStore::Transaction> *trans,
     set<hobject_t, hobject_t::BitwiseComparator> *temp_added,
     set<hobject_t, hobject_t::BitwiseComparator> *temp_removed,
+    ECTransaction::stripe_map_t *written,
+    set<hobject_t, hobject_t::BitwiseComparator> *invalidated,
     stringstream *out)
     : hash_infos(hash_infos),
       ecimpl(ecimpl), pgid(pgid),
       sinfo(sinfo),
+      partial_stripes(partial_stripes),
+      entries(entries),
       trans(trans),
       temp_added(temp_added), temp_removed(temp_removed),
-      out(out) {
+      written(written), invalidated(invalidated),
+      out(out),
+      tracker(hash_infos, sinfo) {
     for (unsigned i = 0; i < ecimpl->get_chunk_count(); ++i) {
       want.insert(i);
     }
   }
 
+  pg_log_entry_t *get_entry(const hobject_t &hoid) {
+    for (vector<pg_log_entry_t>::reverse_iterator i = entries->rbegin();
+	 i != entries->rend();
+	 ++i) {
+      if (i->soid == hoid)
+	return &*i;
+    }
+    return NULL;
+  }
+
+  /// current contents of stripe off of hoid
+  bufferlist get_stripe(const hobject_t &hoid, uint64_t off) {
+    map<uint64_t, bufferlist>::iterator p = rewritten[hoid].find(off);
+    if (p != rewritten[hoid].end())
+      return p->second;
+    bufferlist bl;
+    if (tracker.on_disk(hoid, off)) {
+      ECTransaction::stripe_map_t::const_iterator i =
+	partial_stripes.find(tracker.source[hoid]);
+      assert(i != partial_stripes.end());
+      map<uint64_t, bufferlist>::const_iterator j = i->second.find(off);
+      assert(j != i->second.end());
+      assert(j->second.length() == sinfo.get_stripe_width());
+      bl = j->second;
+    } else {
+      bl.append_zero(sinfo.get_stripe_width());
+    }
+    return bl;
+  }
+
+  void set_stripe(const hobject_t &hoid, uint64_t off, bufferlist &bl) {
+    rewritten[hoid][off] = bl;
+    (*written)[hoid][off] = bl;
+  }
+
+  void copy_stripes(const hobject_t &from, const hobject_t &to) {
+    tracker.copy(from, to);
+    rewritten[to] = rewritten[from];
+    written->erase(to);
+    invalidated->insert(to);
+  }
+
+  void clear_stripes(const hobject_t &hoid) {
+    tracker.clear(hoid);
+    rewritten.erase(hoid);
+    written->erase(hoid);
+    invalidated->insert(hoid);
+  }
+
+  /// record the rollback info for every object stashed
+  void finish() {
+    for (map<hobject_t, interval_set<uint64_t>,
+	   hobject_t::BitwiseComparator>::iterator i = stashed.begin();
+	 i != stashed.end();
+	 ++i) {
+      if (i->second.empty())
+	continue;
+      pg_log_entry_t *entry = get_entry(i->first);
+      assert(entry);
+      vector<pair<uint64_t, uint64_t> > extents;
+      for (interval_set<uint64_t>::iterator j = i->second.begin();
+	   j != i->second.end();
+	   ++j) {
+	extents.push_back(make_pair(j.get_start(), j.get_len()));
+      }
+      entry->mod_desc.rollback_extents(entry->version.version, extents);
+    }
+  }
+
   coll_t get_coll_ct(shard_id_t shard, const hobject_t &hoid) {
     if (hoid.is_temp()) {
       temp_removed->erase(hoid);
@@ -138,6 +358,7 @@ struct TransGenerator : public boost::static_visitor<void> {
 
     assert(hash_infos.count(op.oid));
     ECUtil::HashInfoRef hinfo = hash_infos[op.oid];
+    tracker.init(op.oid);
 
     // align
     if (bl.length() % sinfo.get_stripe_width())
@@ -151,6 +372,11 @@ struct TransGenerator : public boost::static_visitor<void> {
     hinfo->append(
       sinfo.aligned_logical_offset_to_chunk_offset(op.off),
       buffers);
+    for (uint64_t off = 0; off < bl.length(); off += sinfo.get_stripe_width()) {
+      bufferlist stripe;
+      stripe.substr_of(bl, off, sinfo.get_stripe_width());
+      set_stripe(op.oid, offset + off, stripe);
+    }
     bufferlist hbuf;
     ::encode(
       *hinfo,
@@ -177,9 +403,114 @@ struct TransGenerator : public boost::static_visitor<void> {
 	hbuf);
     }
   }
+  void operator()(const ECTransaction::OverwriteOp &op) {
+    const uint64_t stripe_width = sinfo.get_stripe_width();
+    const uint64_t op_end = op.off + op.bl.length();
+    uint64_t start = sinfo.logical_to_prev_stripe_offset(op.off);
+    uint64_t end = sinfo.logical_to_next_stripe_offset(op_end);
+    assert(op.bl.length());
+
+    assert(hash_infos.count(op.oid));
+    ECUtil::HashInfoRef hinfo = hash_infos[op.oid];
+    tracker.init(op.oid);
+
+    // merge the new data into the stripes it touches
+    bufferlist bl;
+    for (uint64_t s = start; s < end; s += stripe_width) {
+      bufferlist stripe;
+      if (op.off <= s && s + stripe_width <= op_end) {
+	stripe.substr_of(op.bl, s - op.off, stripe_width);
+      } else {
+	bufferlist old = get_stripe(op.oid, s);
+	uint64_t from = MAX(op.off, s);
+	uint64_t to = MIN(op_end, s + stripe_width);
+	if (from > s) {
+	  bufferlist head;
+	  head.substr_of(old, 0, from - s);
+	  stripe.claim_append(head);
+	}
+	bufferlist mid;
+	mid.substr_of(op.bl, from - op.off, to - from);
+	stripe.claim_append(mid);
+	if (to < s + stripe_width) {
+	  bufferlist tail;
+	  tail.substr_of(old, to - s, s + stripe_width - to);
+	  stripe.claim_append(tail);
+	}
+      }
+      set_stripe(op.oid, s, stripe);
+      bl.append(stripe);
+    }
+
+    map<int, bufferlist> buffers;
+    int r = ECUtil::encode(
+      sinfo, ecimpl, bl, want, &buffers);
+    assert(r == 0);
+
+    uint64_t chunk_off = sinfo.aligned_logical_offset_to_chunk_offset(start);
+    uint64_t chunk_end = sinfo.aligned_logical_offset_to_chunk_offset(end);
+
+    // clone aside the chunks about to be overwritten which still hold
+    // the data the object had before this transaction, unless the log
+    // entry already restores the object some other way
+    interval_set<uint64_t> to_stash;
+    pg_log_entry_t *entry = get_entry(op.oid);
+    if (entry && entry->mod_desc.rollback_info_open() &&
+	tracker.source[op.oid] == op.oid) {
+      uint64_t old_end = sinfo.aligned_logical_offset_to_chunk_offset(
+	tracker.disk_size[op.oid]);
+      if (chunk_off < old_end) {
+	to_stash.insert(chunk_off, MIN(chunk_end, old_end) - chunk_off);
+	interval_set<uint64_t> already;
+	already.intersection_of(to_stash, stashed[op.oid]);
+	to_stash.subtract(already);
+	stashed[op.oid].union_of(to_stash);
+      }
+    }
+
+    hinfo->set_total_chunk_size_clear_hash(
+      MAX(hinfo->get_total_chunk_size(), chunk_end));
+    bufferlist hbuf;
+    ::encode(
+      *hinfo,
+      hbuf);
+
+    for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans->begin();
+	 i != trans->end();
+	 ++i) {
+      assert(buffers.count(i->first));
+      bufferlist &enc_bl = buffers[i->first];
+      coll_t cid = get_coll_ct(i->first, op.oid);
+      ghobject_t goid(op.oid, ghobject_t::NO_GEN, i->first);
+      for (interval_set<uint64_t>::iterator j = to_stash.begin();
+	   j != to_stash.end();
+	   ++j) {
+	i->second.clone_range(
+	  cid,
+	  goid,
+	  ghobject_t(op.oid, entry->version.version, i->first),
+	  j.get_start(),
+	  j.get_len(),
+	  j.get_start());
+      }
+      i->second.write(
+	cid,
+	goid,
+	chunk_off,
+	enc_bl.length(),
+	enc_bl,
+	op.fadvise_flags);
+      i->second.setattr(
+	cid,
+	goid,
+	ECUtil::get_hinfo_key(),
+	hbuf);
+    }
+  }
   void operator()(const ECTransaction::CloneOp &op) {
     assert(hash_infos.count(op.source));
     assert(hash_infos.count(op.target));
+    copy_stripes(op.source, op.target);
     *(hash_infos[op.target]) = *(hash_infos[op.source]);
     for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans->begin();
 	 i != trans->end();
@@ -193,8 +524,10 @@ struct TransGenerator : public boost::static_visitor<void> {
   void operator()(const ECTransaction::RenameOp &op) {
     assert(hash_infos.count(op.source));
     assert(hash_infos.count(op.destination));
+    copy_stripes(op.source, op.destination);
+    clear_stripes(op.source);
     *(hash_infos[op.destination]) = *(hash_infos[op.source]);
-    hash_infos[op.source]->clear();
+    *(hash_infos[op.source]) = ECUtil::HashInfo(ecimpl->get_chunk_count());
     for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans->begin();
 	 i != trans->end();
 	 ++i) {
@@ -207,7 +540,8 @@ struct TransGenerator : public boost::static_visitor<void> {
   }
   void operator()(const ECTransaction::StashOp &op) {
     assert(hash_infos.count(op.oid));
-    hash_infos[op.oid]->clear();
+    clear_stripes(op.oid);
+    *(hash_infos[op.oid]) = ECUtil::HashInfo(ecimpl->get_chunk_count());
     for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans->begin();
 	 i != trans->end();
 	 ++i) {
@@ -221,7 +555,8 @@ struct TransGenerator : public boost::static_visitor<void> {
   }
   void operator()(const ECTransaction::RemoveOp &op) {
     assert(hash_infos.count(op.oid));
-    hash_infos[op.oid]->clear();
+    clear_stripes(op.oid);
+    *(hash_infos[op.oid]) = ECUtil::HashInfo(ecimpl->get_chunk_count());
     for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans->begin();
 	 i != trans->end();
 	 ++i) {
@@ -277,9 +612,13 @@ void ECTransaction::generate_transactions(
   ErasureCodeInterfaceRef &ecimpl,
   pg_t pgid,
   const ECUtil::stripe_info_t &sinfo,
+  const stripe_map_t &partial_stripes,
+  vector<pg_log_entry_t> *entries,
   map<shard_id_t, ObjectStore::Transaction> *transactions,
   set<hobject_t, hobject_t::BitwiseComparator> *temp_added,
   set<hobject_t, hobject_t::BitwiseComparator> *temp_removed,
+  stripe_map_t *written,
+  set<hobject_t, hobject_t::BitwiseComparator> *invalidated,
   stringstream *out) const
 {
   TransGenerator gen(
@@ -287,9 +626,14 @@ void ECTransaction::generate_transactions(
     ecimpl,
     pgid,
     sinfo,
+    partial_stripes,
+    entries,
     transactions,
     temp_added,
     temp_removed,
+    written,
+    invalidated,
     out);
   visit(gen);
+  gen.finish();
 }
@@ -32,6 +32,15 @@ public:
     AppendOp(const hobject_t &oid, uint64_t off, bufferlist &bl, uint32_t flags)
       : oid(oid), off(off), bl(bl), fadvise_flags(flags) {}
   };
+  struct OverwriteOp {
+    hobject_t oid;
+    uint64_t off;
+    bufferlist bl;
+    uint32_t fadvise_flags;
+    OverwriteOp(const hobject_t &oid, uint64_t off, bufferlist &bl,
+		uint32_t flags)
+      : oid(oid), off(off), bl(bl), fadvise_flags(flags) {}
+  };
   struct CloneOp {
     hobject_t source;
     hobject_t target;
@@ -88,6 +97,7 @@ public:
   struct NoOp {};
   typedef boost::variant<
     AppendOp,
+    OverwriteOp,
     CloneOp,
     RenameOp,
     StashOp,
@@ -100,6 +110,10 @@ public:
   list<Op> ops;
   uint64_t written;
 
+  /// logical contents of whole stripes, by object and stripe offset
+  typedef map<hobject_t, map<uint64_t, bufferlist>,
+	      hobject_t::BitwiseComparator> stripe_map_t;
+
   ECTransaction() : written(0) {}
   /// Write
   void touch(
@@ -120,6 +134,31 @@ public:
     assert(len == bl.length());
     ops.push_back(AppendOp(hoid, off, bl, fadvise_flags));
   }
+  /// Partial overwrite, only valid on pools which allow ec overwrites
+  void write(
+    const hobject_t &hoid,
+    uint64_t off,
+    uint64_t len,
+    bufferlist &bl,
+    uint32_t fadvise_flags) {
+    if (len == 0) {
+      touch(hoid);
+      return;
+    }
+    written += len;
+    assert(len == bl.length());
+    ops.push_back(OverwriteOp(hoid, off, bl, fadvise_flags));
+  }
+  void zero(
+    const hobject_t &hoid,
+    uint64_t off,
+    uint64_t len) {
+    if (len == 0)
+      return;
+    bufferlist bl;
+    bl.append_zero(len);
+    ops.push_back(OverwriteOp(hoid, off, bl, 0));
+  }
   void stash(
     const hobject_t &hoid,
     version_t former_version) {
@@ -194,14 +233,47 @@ public:
   }
   void get_append_objects(
      set<hobject_t, hobject_t::BitwiseComparator> *out) const;
+  void get_overwrite_objects(
+     set<hobject_t, hobject_t::BitwiseComparator> *out) const;
+
+  /**
+   * Stripes partially covered by an overwrite which hold data on disk
+   *
+   * Their current contents, keyed by the object as it exists before the
+   * transaction, must be passed to generate_transactions().
+   */
+  void get_partial_stripes(
+    const map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
+    const ECUtil::stripe_info_t &sinfo,
+    map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> *out) const;
+
+  /**
+   * Generate the shard transactions
+   *
+   * Overwrites re-encode only the stripes they touch, taking the old
+   * contents of partial stripes from partial_stripes.  Where the log
+   * entry for an overwritten object can still be rolled back, the old
+   * chunks are first cloned to the object at the entry's version and a
+   * rollback_extents record is added to the entry.
+   *
+   * @param [in] partial_stripes see get_partial_stripes()
+   * @param [in,out] entries log entries of the op
+   * @param [out] written stripes written, with their new contents
+   * @param [out] invalidated objects whose data changed other than
+   *              through written
+   */
   void generate_transactions(
     map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> &hash_infos,
     ErasureCodeInterfaceRef &ecimpl,
     pg_t pgid,
     const ECUtil::stripe_info_t &sinfo,
+    const stripe_map_t &partial_stripes,
+    vector<pg_log_entry_t> *entries,
     map<shard_id_t, ObjectStore::Transaction> *transactions,
     set<hobject_t, hobject_t::BitwiseComparator> *temp_added,
     set<hobject_t, hobject_t::BitwiseComparator> *temp_removed,
+    stripe_map_t *written,
+    set<hobject_t, hobject_t::BitwiseComparator> *invalidated,
     stringstream *out = 0) const;
 };
 
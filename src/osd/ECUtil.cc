@@ -96,6 +96,38 @@ int ECUtil::decode(
   return 0;
 }
 
+void ECUtil::assemble_subchunks(
+  const stripe_info_t &sinfo,
+  uint64_t off,
+  uint64_t len,
+  map<int, bufferlist> &chunks,
+  bufferlist *out) {
+  assert(out);
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  const uint64_t chunk_size = sinfo.get_chunk_size();
+  const uint64_t end = off + len;
+  for (uint64_t pos = off; pos < end; ) {
+    uint64_t in_stripe = pos % stripe_width;
+    int chunk = in_stripe / chunk_size;
+    uint64_t shard_off = (pos / stripe_width) * chunk_size +
+      in_stripe % chunk_size;
+    uint64_t piece_len = MIN(chunk_size - in_stripe % chunk_size, end - pos);
+    map<int, bufferlist>::iterator c = chunks.find(chunk);
+    assert(c != chunks.end());
+    uint64_t start = shard_off - sinfo.logical_to_chunk_shard_offset(off, chunk);
+    // a short shard read means the object ends here
+    if (start >= c->second.length())
+      break;
+    uint64_t avail = MIN(piece_len, c->second.length() - start);
+    bufferlist piece;
+    piece.substr_of(c->second, start, avail);
+    out->claim_append(piece);
+    if (avail < piece_len)
+      break;
+    pos += piece_len;
+  }
+}
+
 int ECUtil::encode(
   const stripe_info_t &sinfo,
   ErasureCodeInterfaceRef &ec_impl,
@@ -139,9 +171,13 @@ int ECUtil::encode(
 
 void ECUtil::HashInfo::append(uint64_t old_size,
 			      map<int, bufferlist> &to_append) {
-  assert(to_append.size() == cumulative_shard_hashes.size());
   assert(old_size == total_chunk_size);
   uint64_t size_to_append = to_append.begin()->second.length();
+  if (!has_chunk_hash()) {
+    total_chunk_size += size_to_append;
+    return;
+  }
+  assert(to_append.size() == cumulative_shard_hashes.size());
   for (map<int, bufferlist>::iterator i = to_append.begin();
        i != to_append.end();
        ++i) {
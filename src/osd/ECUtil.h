@@ -82,6 +82,31 @@ public:
       (in.first - off) + in.second);
     return make_pair(off, len);
   }
+  /// offset in the shard of data chunk chunk of the first byte >= offset
+  uint64_t logical_to_chunk_shard_offset(
+    uint64_t offset, unsigned chunk) const {
+    uint64_t in_stripe = offset % stripe_width;
+    uint64_t base = (offset / stripe_width) * chunk_size;
+    if (in_stripe < chunk * chunk_size)
+      return base;
+    if (in_stripe >= (chunk + 1) * chunk_size)
+      return base + chunk_size;
+    return base + in_stripe - chunk * chunk_size;
+  }
+  /**
+   * Part of the shard of data chunk chunk holding logical extent in
+   *
+   * The bytes of a logical extent held by any one data chunk are
+   * contiguous in its shard, so this is a single (offset, length),
+   * with a length of 0 if the extent does not touch that chunk.
+   */
+  pair<uint64_t, uint64_t> offset_len_to_chunk_shard(
+    pair<uint64_t, uint64_t> in, unsigned chunk) const {
+    uint64_t off = logical_to_chunk_shard_offset(in.first, chunk);
+    return make_pair(
+      off,
+      logical_to_chunk_shard_offset(in.first + in.second, chunk) - off);
+  }
 };
 
 int decode(
@@ -96,6 +121,22 @@ int decode(
   map<int, bufferlist> &to_decode,
   map<int, bufferlist*> &out);
 
+/**
+ * Reassemble logical extent [off, off + len) from the data chunk
+ * shards holding it
+ *
+ * chunks[chunk] holds the shard of data chunk chunk from
+ * logical_to_chunk_shard_offset(off, chunk) on.  Assembly stops at
+ * the first shard that comes up short, since that is where the
+ * object ends.
+ */
+void assemble_subchunks(
+  const stripe_info_t &sinfo,
+  uint64_t off,
+  uint64_t len,
+  map<int, bufferlist> &chunks,
+  bufferlist *out);
+
 int encode(
   const stripe_info_t &sinfo,
   ErasureCodeInterfaceRef &ec_impl,
@@ -129,6 +170,18 @@ public:
   uint64_t get_total_chunk_size() const {
     return total_chunk_size;
   }
+
+  /**
+   * Cumulative hashes cannot be maintained across partial overwrites,
+   * so an overwritten object only tracks its chunk size from then on.
+   */
+  bool has_chunk_hash() const {
+    return !cumulative_shard_hashes.empty();
+  }
+  void set_total_chunk_size_clear_hash(uint64_t new_chunk_size) {
+    cumulative_shard_hashes.clear();
+    total_chunk_size = new_chunk_size;
+  }
 };
 typedef ceph::shared_ptr<HashInfo> HashInfoRef;
 
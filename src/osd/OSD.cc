@@ -169,6 +169,41 @@ void PGQueueable::RunVis::operator()(PGScrub &op) {
   return pg->scrub(op.epoch_queued, handle);
 }
 
+int PGQueueable::OpTypeVis::operator()(const OpRequestRef &op) const {
+  switch (op->get_req()->get_type()) {
+  case CEPH_MSG_OSD_OP:
+    return client_op;
+  case MSG_OSD_PG_PUSH:
+  case MSG_OSD_PG_PULL:
+  case MSG_OSD_PG_PUSH_REPLY:
+  case MSG_OSD_PG_SCAN:
+  case MSG_OSD_PG_BACKFILL:
+    return bg_recovery;
+  default:
+    return osd_subop;
+  }
+}
+
+int PGQueueable::OpTypeVis::operator()(const PGSnapTrim &op) const {
+  return bg_snaptrim;
+}
+
+int PGQueueable::OpTypeVis::operator()(const PGScrub &op) const {
+  return bg_scrub;
+}
+
+ostream& operator<<(ostream& out, PGQueueable::op_type_t t)
+{
+  switch (t) {
+  case PGQueueable::client_op: return out << "client_op";
+  case PGQueueable::osd_subop: return out << "osd_subop";
+  case PGQueueable::bg_snaptrim: return out << "bg_snaptrim";
+  case PGQueueable::bg_recovery: return out << "bg_recovery";
+  case PGQueueable::bg_scrub: return out << "bg_scrub";
+  }
+  return out << "???";
+}
+
 //Initial features in new superblock.
 //Features here are also automatically upgraded
 CompatSet OSD::get_osd_initial_compat_set() {
@@ -475,6 +510,8 @@ void OSDService::shutdown()
   }
   osdmap = OSDMapRef();
   next_osdmap = OSDMapRef();
+  for (unsigned i = 0; i < RECENT_MAPS; ++i)
+    std::atomic_store(&recent_maps[i], OSDMapRef());
 }
 
 void OSDService::init()
@@ -1222,23 +1259,35 @@ OSDMapRef OSDService::_add_map(OSDMap *o)
 {
   epoch_t e = o->get_epoch();
 
-  if (cct->_conf->osd_map_dedup) {
-    // Dedup against an existing map at a nearby epoch
-    OSDMapRef for_dedup = map_cache.lower_bound(e);
-    if (for_dedup) {
-      OSDMap::dedup(for_dedup.get(), o);
-    }
+  // an existing map at a nearby epoch, usually e - 1
+  OSDMapRef nearby = map_cache.lower_bound(e);
+  if (nearby && cct->_conf->osd_map_dedup) {
+    OSDMap::dedup(nearby.get(), o);
   }
   bool existed;
   OSDMapRef l = map_cache.add(e, o, &existed);
   if (existed) {
     delete o;
+  } else if (nearby && nearby->get_epoch() < e && logger) {
+    logger->set(l_osd_map_shared_bytes,
+		OSDMap::get_shared_bytes(nearby.get(), l.get()));
   }
+
+  OSDMapRef &slot = recent_maps[e % RECENT_MAPS];
+  OSDMapRef cur = std::atomic_load(&slot);
+  if (!cur || cur->get_epoch() < e)
+    std::atomic_store(&slot, l);
   return l;
 }
 
 OSDMapRef OSDService::try_get_map(epoch_t epoch)
 {
+  OSDMapRef recent = std::atomic_load(&recent_maps[epoch % RECENT_MAPS]);
+  if (recent && recent->get_epoch() == epoch) {
+    dout(30) << "get_map " << epoch << " -recent" << dendl;
+    return recent;
+  }
+
   Mutex::Locker l(map_cache_lock);
   OSDMapRef retval = map_cache.lookup(epoch);
   if (retval) {
@@ -1789,6 +1838,36 @@ bool OSD::asok_command(string command, cmdmap_t& cmdmap, string format,
     }
 
     f->close_section(); //watches
+  } else if (command == "dump_pg_log_mem") {
+    uint64_t total_entries = 0, total_entry_bytes = 0, total_index_bytes = 0;
+    f->open_object_section("pg_log_mem");
+    f->open_array_section("pgs");
+    {
+      Mutex::Locker l(osd_lock);
+      RWLock::RLocker l2(pg_map_lock);
+      for (ceph::unordered_map<spg_t,PG*>::iterator it = pg_map.begin();
+          it != pg_map.end();
+          ++it) {
+        PG *pg = it->second;
+        uint64_t entry_bytes, index_bytes;
+        pg->lock();
+        const PGLog::IndexedLog &log = pg->pg_log.get_log();
+        log.get_mem_usage(&entry_bytes, &index_bytes);
+        f->open_object_section("pg");
+        f->dump_stream("pgid") << pg->info.pgid;
+        log.dump_mem(f, entry_bytes, index_bytes);
+        f->close_section();
+        total_entries += log.log.size();
+        pg->unlock();
+        total_entry_bytes += entry_bytes;
+        total_index_bytes += index_bytes;
+      }
+    }
+    f->close_section();
+    f->dump_unsigned("total_entries", total_entries);
+    f->dump_unsigned("total_entry_bytes", total_entry_bytes);
+    f->dump_unsigned("total_index_bytes", total_index_bytes);
+    f->close_section();
   } else if (command == "dump_reservations") {
     f->open_object_section("reservations");
     f->open_object_section("local_reservations");
@@ -2173,6 +2252,11 @@ void OSD::final_init()
 				     "show clients which have active watches,"
 				     " and on which objects");
   assert(r == 0);
+  r = admin_socket->register_command("dump_pg_log_mem", "dump_pg_log_mem",
+				     asok_hook,
+				     "show the approximate memory used by"
+				     " each pg's log");
+  assert(r == 0);
   r = admin_socket->register_command("dump_reservations", "dump_reservations",
 				     asok_hook,
 				     "show recovery reservations");
@@ -2375,6 +2459,7 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_map, "map_messages", "OSD map messages");           // osdmap messages
   osd_plb.add_u64_counter(l_osd_mape, "map_message_epochs", "OSD map epochs");         // osdmap epochs
   osd_plb.add_u64_counter(l_osd_mape_dup, "map_message_epoch_dups", "OSD map duplicates"); // dup osdmap epochs
+  osd_plb.add_u64(l_osd_map_shared_bytes, "map_shared_bytes", "OSD map bytes shared with the previous epoch"); // memory saved by the newest epoch
   osd_plb.add_u64_counter(l_osd_waiting_for_map, "messages_delayed_for_map", "Operations waiting for OSD map"); // dup osdmap epochs
 
   osd_plb.add_u64(l_osd_stat_bytes, "stat_bytes", "OSD size");
@@ -2509,6 +2594,7 @@ int OSD::shutdown()
   cct->get_admin_socket()->unregister_command("dump_op_pq_state");
   cct->get_admin_socket()->unregister_command("dump_blacklist");
   cct->get_admin_socket()->unregister_command("dump_watchers");
+  cct->get_admin_socket()->unregister_command("dump_pg_log_mem");
   cct->get_admin_socket()->unregister_command("dump_reservations");
   cct->get_admin_socket()->unregister_command("get_latest_osdmap");
   cct->get_admin_socket()->unregister_command("set_heap_property");
@@ -6504,11 +6590,12 @@ void OSD::handle_osd_map(MOSDMap *m)
       t.write(coll_t::meta(), oid, 0, bl.length(), bl);
       pin_map_inc_bl(e, bl);
 
+      // build on the previous map, sharing whatever the incremental
+      // leaves unchanged instead of decoding a full copy of it
       OSDMap *o = new OSDMap;
       if (e > 1) {
-	bufferlist obl;
-	get_map_bl(e - 1, obl);
-	o->decode(obl);
+	OSDMapRef prev = get_map(e - 1);
+	o->shallow_copy_from(*prev);
       }
 
       OSDMap::Incremental inc;
@@ -7375,6 +7462,9 @@ struct C_OpenPGs : public Context {
     for (auto p : pgs) {
       p->ch = store->open_collection(p->coll);
       assert(p->ch);
+      p->lock();
+      p->update_store_with_options();
+      p->unlock();
     }
   }
 };
@@ -8497,6 +8587,51 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb )
   (item.first)->unlock();
 }
 
+OSD::ShardedOpWQ::mclock_client_t OSD::ShardedOpWQ::mclock_classify(
+  const entity_inst_t &owner, const pair<PGRef, PGQueueable> &item)
+{
+  PGQueueable::op_type_t type = item.second.get_op_type();
+  if (type == PGQueueable::client_op || type == PGQueueable::osd_subop)
+    return mclock_client_t(type, owner);
+  return mclock_client_t(type, entity_inst_t());
+}
+
+OSD::ShardedOpWQ::mClockOpQueue::ClientInfo
+OSD::ShardedOpWQ::mclock_client_info(
+  CephContext *cct, const mclock_client_t &client)
+{
+  const md_config_t *conf = cct->_conf;
+  switch (client.first) {
+  case PGQueueable::client_op:
+    return mClockOpQueue::ClientInfo(
+      conf->osd_op_queue_mclock_client_op_res,
+      conf->osd_op_queue_mclock_client_op_wgt,
+      conf->osd_op_queue_mclock_client_op_lim);
+  case PGQueueable::osd_subop:
+    return mClockOpQueue::ClientInfo(
+      conf->osd_op_queue_mclock_osd_subop_res,
+      conf->osd_op_queue_mclock_osd_subop_wgt,
+      conf->osd_op_queue_mclock_osd_subop_lim);
+  case PGQueueable::bg_snaptrim:
+    return mClockOpQueue::ClientInfo(
+      conf->osd_op_queue_mclock_snap_res,
+      conf->osd_op_queue_mclock_snap_wgt,
+      conf->osd_op_queue_mclock_snap_lim);
+  case PGQueueable::bg_recovery:
+    return mClockOpQueue::ClientInfo(
+      conf->osd_op_queue_mclock_recov_res,
+      conf->osd_op_queue_mclock_recov_wgt,
+      conf->osd_op_queue_mclock_recov_lim);
+  case PGQueueable::bg_scrub:
+    return mClockOpQueue::ClientInfo(
+      conf->osd_op_queue_mclock_scrub_res,
+      conf->osd_op_queue_mclock_scrub_wgt,
+      conf->osd_op_queue_mclock_scrub_lim);
+  }
+  assert(0 == "unknown op type");
+  return mClockOpQueue::ClientInfo();
+}
+
 void OSD::ShardedOpWQ::_enqueue(pair<PGRef, PGQueueable> item) {
 
   uint32_t shard_index = (((item.first)->get_pgid().ps())% shard_list.size());
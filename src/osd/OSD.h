@@ -54,6 +54,7 @@ using namespace std;
 #include "common/sharedptr_registry.hpp"
 #include "common/WeightedPriorityQueue.h"
 #include "common/PrioritizedQueue.h"
+#include "common/mClockPriorityQueue.h"
 #include "common/OpQueue.h"
 #include "messages/MOSDOp.h"
 #include "include/Spinlock.h"
@@ -126,6 +127,7 @@ enum {
   l_osd_map,
   l_osd_mape,
   l_osd_mape_dup,
+  l_osd_map_shared_bytes,
 
   l_osd_waiting_for_map,
 
@@ -365,7 +367,20 @@ class PGQueueable {
     void operator()(PGSnapTrim &op);
     void operator()(PGScrub &op);
   };
+  struct OpTypeVis : public boost::static_visitor<int> {
+    int operator()(const OpRequestRef &op) const;
+    int operator()(const PGSnapTrim &op) const;
+    int operator()(const PGScrub &op) const;
+  };
 public:
+  /// scheduling class, used by the mclock op queue
+  enum op_type_t {
+    client_op,
+    osd_subop,
+    bg_snaptrim,
+    bg_recovery,
+    bg_scrub
+  };
   // cppcheck-suppress noExplicitConstructor
   PGQueueable(OpRequestRef op)
     : qvariant(op), cost(op->get_req()->get_cost()),
@@ -395,7 +410,11 @@ public:
   int get_cost() const { return cost; }
   utime_t get_start_time() const { return start_time; }
   entity_inst_t get_owner() const { return owner; }
+  op_type_t get_op_type() const {
+    return static_cast<op_type_t>(boost::apply_visitor(OpTypeVis(), qvariant));
+  }
 };
+ostream& operator<<(ostream& out, PGQueueable::op_type_t t);
 
 class OSDService {
 public:
@@ -855,6 +874,16 @@ public:
   SimpleLRU<epoch_t, bufferlist> map_bl_cache;
   SimpleLRU<epoch_t, bufferlist> map_bl_inc_cache;
 
+  /**
+   * The most recently added maps, in slot epoch % RECENT_MAPS.  Slots
+   * are published with std::atomic_store under map_cache_lock and read
+   * with std::atomic_load without it, so try_get_map() for a recent
+   * epoch, which is nearly every lookup, takes neither map_cache_lock
+   * nor the SharedLRU's lock.
+   */
+  static const unsigned RECENT_MAPS = 32;
+  OSDMapRef recent_maps[RECENT_MAPS];
+
   OSDMapRef try_get_map(epoch_t e);
   OSDMapRef get_map(epoch_t e) {
     OSDMapRef ret(try_get_map(e));
@@ -1614,13 +1643,23 @@ private:
   // -- op queue --
   enum io_queue {
     prioritized,
-    weightedpriority};
+    weightedpriority,
+    mclock};
   const io_queue op_queue;
   const unsigned int op_prio_cutoff;
 
   friend class PGQueueable;
   class ShardedOpWQ: public ShardedThreadPool::ShardedWQ < pair <PGRef, PGQueueable> > {
 
+    /// mclock clients: client ops and sub ops by source, the rest by type
+    typedef pair<PGQueueable::op_type_t, entity_inst_t> mclock_client_t;
+    typedef mClockQueue< pair<PGRef, PGQueueable>, entity_inst_t,
+			 mclock_client_t> mClockOpQueue;
+    static mclock_client_t mclock_classify(
+      const entity_inst_t &owner, const pair<PGRef, PGQueueable> &item);
+    static mClockOpQueue::ClientInfo mclock_client_info(
+      CephContext *cct, const mclock_client_t &client);
+
     struct ShardData {
       Mutex sdata_lock;
       Cond sdata_cond;
@@ -1643,6 +1682,12 @@ private:
 		<PrioritizedQueue< pair<PGRef, PGQueueable>, entity_inst_t>>(
 		  new PrioritizedQueue< pair<PGRef, PGQueueable>, entity_inst_t>(
 		    max_tok_per_prio, min_cost));
+	    } else if (opqueue == mclock) {
+	      pqueue = std::unique_ptr<mClockOpQueue>(
+		new mClockOpQueue(
+		  std::bind(&ShardedOpWQ::mclock_client_info, cct,
+			    std::placeholders::_1),
+		  &ShardedOpWQ::mclock_classify));
 	    }
 	  }
     };
@@ -2324,6 +2369,8 @@ protected:
       return (rand() % 2 < 1) ? prioritized : weightedpriority;
     } else if (cct->_conf->osd_op_queue == "wpq") {
       return weightedpriority;
+    } else if (cct->_conf->osd_op_queue == "mclock") {
+      return mclock;
     } else {
       return prioritized;
     }
@@ -923,6 +923,9 @@ void OSDMap::set_max_osd(int m)
   }
   osd_info.resize(m);
   osd_xinfo.resize(m);
+  _cow_osd_addrs();
+  _cow_osd_uuid();
+  _cow_primary_affinity();
   osd_addrs->client_addr.resize(m);
   osd_addrs->cluster_addr.resize(m);
   osd_addrs->hb_back_addr.resize(m);
@@ -1123,61 +1126,139 @@ void OSDMap::dedup(const OSDMap *o, OSDMap *n)
   int diff = 0;
 
   // do addrs match?
-  if (o->max_osd != n->max_osd)
-    diff++;
-  for (int i = 0; i < o->max_osd && i < n->max_osd; i++) {
-    if ( n->osd_addrs->client_addr[i] &&  o->osd_addrs->client_addr[i] &&
-	*n->osd_addrs->client_addr[i] == *o->osd_addrs->client_addr[i])
-      n->osd_addrs->client_addr[i] = o->osd_addrs->client_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->cluster_addr[i] &&  o->osd_addrs->cluster_addr[i] &&
-	*n->osd_addrs->cluster_addr[i] == *o->osd_addrs->cluster_addr[i])
-      n->osd_addrs->cluster_addr[i] = o->osd_addrs->cluster_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->hb_back_addr[i] &&  o->osd_addrs->hb_back_addr[i] &&
-	*n->osd_addrs->hb_back_addr[i] == *o->osd_addrs->hb_back_addr[i])
-      n->osd_addrs->hb_back_addr[i] = o->osd_addrs->hb_back_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->hb_front_addr[i] &&  o->osd_addrs->hb_front_addr[i] &&
-	*n->osd_addrs->hb_front_addr[i] == *o->osd_addrs->hb_front_addr[i])
-      n->osd_addrs->hb_front_addr[i] = o->osd_addrs->hb_front_addr[i];
-    else
+  if (o->osd_addrs != n->osd_addrs) {
+    n->_cow_osd_addrs();
+    if (o->max_osd != n->max_osd)
       diff++;
-  }
-  if (diff == 0) {
-    // zoinks, no differences at all!
-    n->osd_addrs = o->osd_addrs;
+    for (int i = 0; i < o->max_osd && i < n->max_osd; i++) {
+      if ( n->osd_addrs->client_addr[i] &&  o->osd_addrs->client_addr[i] &&
+	  *n->osd_addrs->client_addr[i] == *o->osd_addrs->client_addr[i])
+	n->osd_addrs->client_addr[i] = o->osd_addrs->client_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->cluster_addr[i] &&  o->osd_addrs->cluster_addr[i] &&
+	  *n->osd_addrs->cluster_addr[i] == *o->osd_addrs->cluster_addr[i])
+	n->osd_addrs->cluster_addr[i] = o->osd_addrs->cluster_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->hb_back_addr[i] &&  o->osd_addrs->hb_back_addr[i] &&
+	  *n->osd_addrs->hb_back_addr[i] == *o->osd_addrs->hb_back_addr[i])
+	n->osd_addrs->hb_back_addr[i] = o->osd_addrs->hb_back_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->hb_front_addr[i] &&  o->osd_addrs->hb_front_addr[i] &&
+	  *n->osd_addrs->hb_front_addr[i] == *o->osd_addrs->hb_front_addr[i])
+	n->osd_addrs->hb_front_addr[i] = o->osd_addrs->hb_front_addr[i];
+      else
+	diff++;
+    }
+    if (diff == 0) {
+      // zoinks, no differences at all!
+      n->osd_addrs = o->osd_addrs;
+    }
   }
 
   // does crush match?
-  bufferlist oc, nc;
-  ::encode(*o->crush, oc);
-  ::encode(*n->crush, nc);
-  if (oc.contents_equal(nc)) {
-    n->crush = o->crush;
+  if (o->crush != n->crush) {
+    bufferlist oc, nc;
+    ::encode(*o->crush, oc);
+    ::encode(*n->crush, nc);
+    if (oc.contents_equal(nc)) {
+      n->crush = o->crush;
+    }
   }
 
   // does pg_temp match?
-  if (o->pg_temp->size() == n->pg_temp->size()) {
+  if (o->pg_temp != n->pg_temp &&
+      o->pg_temp->size() == n->pg_temp->size()) {
     if (*o->pg_temp == *n->pg_temp)
       n->pg_temp = o->pg_temp;
   }
 
   // does primary_temp match?
-  if (o->primary_temp->size() == n->primary_temp->size()) {
+  if (o->primary_temp != n->primary_temp &&
+      o->primary_temp->size() == n->primary_temp->size()) {
     if (*o->primary_temp == *n->primary_temp)
       n->primary_temp = o->primary_temp;
   }
 
   // do uuids match?
-  if (o->osd_uuid->size() == n->osd_uuid->size() &&
+  if (o->osd_uuid != n->osd_uuid &&
+      o->osd_uuid->size() == n->osd_uuid->size() &&
       *o->osd_uuid == *n->osd_uuid)
     n->osd_uuid = o->osd_uuid;
 }
 
+// rough per-node overhead of a std::map, on top of the value
+static const uint64_t MAP_NODE_OVERHEAD = 32;
+
+static uint64_t estimate_crush_bytes(const CrushWrapper& c)
+{
+  uint64_t bytes = sizeof(c);
+  for (int b = 0; b < c.get_max_buckets(); ++b) {
+    int id = -1 - b;
+    if (c.bucket_exists(id))
+      bytes += sizeof(crush_bucket) +
+	c.get_bucket_size(id) * (sizeof(__s32) + sizeof(__u32));
+  }
+  for (int r = 0; r < c.get_max_rules(); ++r) {
+    if (c.rule_exists(r))
+      bytes += sizeof(crush_rule) + c.get_rule_len(r) * sizeof(crush_rule_step);
+  }
+  const map<int32_t,string> *names[] = {
+    &c.type_map, &c.name_map, &c.rule_name_map
+  };
+  for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    for (map<int32_t,string>::const_iterator p = names[i]->begin();
+	 p != names[i]->end();
+	 ++p)
+      bytes += MAP_NODE_OVERHEAD + sizeof(*p) + p->second.size();
+  }
+  return bytes;
+}
+
+uint64_t OSDMap::get_shared_bytes(const OSDMap *o, const OSDMap *n)
+{
+  uint64_t bytes = 0;
+
+  if (o->osd_addrs == n->osd_addrs)
+    bytes += sizeof(addrs_s) +
+      4 * n->max_osd * sizeof(ceph::shared_ptr<entity_addr_t>);
+  const vector<ceph::shared_ptr<entity_addr_t> > *oa[] = {
+    &o->osd_addrs->client_addr, &o->osd_addrs->cluster_addr,
+    &o->osd_addrs->hb_back_addr, &o->osd_addrs->hb_front_addr
+  };
+  const vector<ceph::shared_ptr<entity_addr_t> > *na[] = {
+    &n->osd_addrs->client_addr, &n->osd_addrs->cluster_addr,
+    &n->osd_addrs->hb_back_addr, &n->osd_addrs->hb_front_addr
+  };
+  for (unsigned v = 0; v < 4; ++v) {
+    for (unsigned i = 0; i < oa[v]->size() && i < na[v]->size(); ++i) {
+      if ((*na[v])[i] && (*na[v])[i] == (*oa[v])[i])
+	bytes += sizeof(entity_addr_t);
+    }
+  }
+
+  if (o->pg_temp == n->pg_temp) {
+    for (map<pg_t,vector<int32_t> >::const_iterator p = n->pg_temp->begin();
+	 p != n->pg_temp->end();
+	 ++p)
+      bytes += MAP_NODE_OVERHEAD + sizeof(*p) +
+	p->second.size() * sizeof(int32_t);
+  }
+  if (o->primary_temp == n->primary_temp)
+    bytes += n->primary_temp->size() *
+      (MAP_NODE_OVERHEAD + sizeof(pair<const pg_t,int32_t>));
+  if (n->osd_primary_affinity &&
+      o->osd_primary_affinity == n->osd_primary_affinity)
+    bytes += n->osd_primary_affinity->size() * sizeof(__u32);
+  if (o->osd_uuid == n->osd_uuid)
+    bytes += n->osd_uuid->size() * sizeof(uuid_d);
+  if (o->crush == n->crush)
+    bytes += estimate_crush_bytes(*n->crush);
+  return bytes;
+}
+
 void OSDMap::remove_redundant_temporaries(CephContext *cct, const OSDMap& osdmap,
 					  OSDMap::Incremental *pending_inc)
 {
@@ -1353,6 +1434,8 @@ int OSDMap::apply_incremental(const Incremental &inc)
     if ((osd_state[i->first] & CEPH_OSD_EXISTS) &&
 	(s & CEPH_OSD_EXISTS)) {
       // osd is destroyed; clear out anything interesting.
+      _cow_osd_uuid();
+      _cow_osd_addrs();
       (*osd_uuid)[i->first] = uuid_d();
       osd_info[i->first] = osd_info_t();
       osd_xinfo[i->first] = osd_xinfo_t();
@@ -1371,6 +1454,7 @@ int OSDMap::apply_incremental(const Incremental &inc)
        i != inc.new_up_client.end();
        ++i) {
     osd_state[i->first] |= CEPH_OSD_EXISTS | CEPH_OSD_UP;
+    _cow_osd_addrs();
     osd_addrs->client_addr[i->first].reset(new entity_addr_t(i->second));
     if (inc.new_hb_back_up.empty())
       osd_addrs->hb_back_addr[i->first].reset(new entity_addr_t(i->second)); //this is a backward-compatibility hack
@@ -1387,8 +1471,10 @@ int OSDMap::apply_incremental(const Incremental &inc)
   }
   for (map<int32_t,entity_addr_t>::const_iterator i = inc.new_up_cluster.begin();
        i != inc.new_up_cluster.end();
-       ++i)
+       ++i) {
+    _cow_osd_addrs();
     osd_addrs->cluster_addr[i->first].reset(new entity_addr_t(i->second));
+  }
 
   // info
   for (map<int32_t,epoch_t>::const_iterator i = inc.new_up_thru.begin();
@@ -1409,10 +1495,14 @@ int OSDMap::apply_incremental(const Incremental &inc)
     osd_xinfo[p->first] = p->second;
 
   // uuid
+  if (!inc.new_uuid.empty())
+    _cow_osd_uuid();
   for (map<int32_t,uuid_d>::const_iterator p = inc.new_uuid.begin(); p != inc.new_uuid.end(); ++p) 
     (*osd_uuid)[p->first] = p->second;
 
   // pg rebuild
+  if (!inc.new_pg_temp.empty())
+    _cow_pg_temp();
   for (map<pg_t, vector<int> >::const_iterator p = inc.new_pg_temp.begin(); p != inc.new_pg_temp.end(); ++p) {
     if (p->second.empty())
       pg_temp->erase(p->first);
@@ -1420,6 +1510,8 @@ int OSDMap::apply_incremental(const Incremental &inc)
       (*pg_temp)[p->first] = p->second;
   }
 
+  if (!inc.new_primary_temp.empty())
+    _cow_primary_temp();
   for (map<pg_t,int32_t>::const_iterator p = inc.new_primary_temp.begin();
       p != inc.new_primary_temp.end();
       ++p) {
@@ -2109,6 +2201,13 @@ void OSDMap::decode(bufferlist::iterator& bl)
   size_t tail_offset = 0;
   bufferlist crc_front, crc_tail;
 
+  // the pieces may be shared with other epochs; decode into new ones
+  osd_addrs.reset(new addrs_s);
+  pg_temp.reset(new map<pg_t,vector<int32_t> >);
+  primary_temp.reset(new map<pg_t,int32_t>);
+  osd_uuid.reset(new vector<uuid_d>);
+  crush.reset(new CrushWrapper);
+
   DECODE_START_LEGACY_COMPAT_LEN(8, 7, 7, bl); // wrapper
   if (struct_v < 7) {
     int struct_v_size = sizeof(struct_v);
@@ -255,6 +255,32 @@ private:
 
   void _calc_up_osd_features();
 
+  /**
+   * The ref-counted pieces below may be shared with other epochs
+   * (see shallow_copy_from() and dedup()), so each is copied before
+   * it is modified in place if anyone else holds a reference to it.
+   */
+  void _cow_osd_addrs() {
+    if (osd_addrs.use_count() > 1)
+      osd_addrs.reset(new addrs_s(*osd_addrs));
+  }
+  void _cow_pg_temp() {
+    if (pg_temp.use_count() > 1)
+      pg_temp.reset(new map<pg_t,vector<int32_t> >(*pg_temp));
+  }
+  void _cow_primary_temp() {
+    if (primary_temp.use_count() > 1)
+      primary_temp.reset(new map<pg_t,int32_t>(*primary_temp));
+  }
+  void _cow_osd_uuid() {
+    if (osd_uuid.use_count() > 1)
+      osd_uuid.reset(new vector<uuid_d>(*osd_uuid));
+  }
+  void _cow_primary_affinity() {
+    if (osd_primary_affinity && osd_primary_affinity.use_count() > 1)
+      osd_primary_affinity.reset(new vector<__u32>(*osd_primary_affinity));
+  }
+
  public:
   bool have_crc() const { return crc_defined; }
   uint32_t get_crc() const { return crc; }
@@ -306,6 +332,17 @@ public:
     // allocate a new CrushWrapper, though.
   }
 
+  /**
+   * Copy o, sharing its ref-counted pieces (addrs, pg_temp,
+   * primary_temp, primary affinity, uuids and crush) rather than
+   * copying them.  Each piece is copied only when this map first
+   * modifies it, so applying an incremental to a shallow copy of the
+   * previous epoch costs memory only for what the incremental changes.
+   */
+  void shallow_copy_from(const OSDMap& o) {
+    *this = o;
+  }
+
   // map info
   const uuid_d& get_fsid() const { return fsid; }
   void set_fsid(uuid_d& f) { fsid = f; }
@@ -392,6 +429,8 @@ public:
     if (!osd_primary_affinity)
       osd_primary_affinity.reset(new vector<__u32>(max_osd,
 						   CEPH_OSD_DEFAULT_PRIMARY_AFFINITY));
+    else
+      _cow_primary_affinity();
     (*osd_primary_affinity)[o] = w;
   }
   unsigned get_primary_affinity(int o) const {
@@ -582,6 +621,10 @@ public:
   /// try to re-use/reference addrs in oldmap from newmap
   static void dedup(const OSDMap *oldmap, OSDMap *newmap);
 
+  /// approximate bytes of newmap's ref-counted pieces shared with oldmap
+  static uint64_t get_shared_bytes(const OSDMap *oldmap,
+				   const OSDMap *newmap);
+
   static void remove_redundant_temporaries(CephContext *cct, const OSDMap& osdmap,
 					   Incremental *pending_inc);
   static void remove_down_temps(CephContext *cct, const OSDMap& osdmap,
@@ -854,8 +897,8 @@ public:
   bool crush_ruleset_in_use(int ruleset) const;
 
   void clear_temp() {
-    pg_temp->clear();
-    primary_temp->clear();
+    pg_temp.reset(new map<pg_t,vector<int32_t> >);
+    primary_temp.reset(new map<pg_t,int32_t>);
   }
 
 private:
@@ -3117,6 +3117,8 @@ void PG::read_state(ObjectStore *store, bufferlist &bl)
 
   // log any weirdness
   log_weirdness();
+
+  update_store_with_options();
 }
 
 void PG::log_weirdness()
@@ -5431,8 +5433,10 @@ void PG::handle_advance_map(
     osdmap, lastmap, newup, up_primary,
     newacting, acting_primary);
   recovery_state.handle_event(evt, rctx);
-  if (pool.info.last_change == osdmap_ref->get_epoch())
+  if (pool.info.last_change == osdmap_ref->get_epoch()) {
     on_pool_change();
+    update_store_with_options();
+  }
 }
 
 void PG::handle_activate_map(RecoveryCtx *rctx)
@@ -5478,6 +5482,15 @@ void PG::handle_query_state(Formatter *f)
   recovery_state.handle_event(q, 0);
 }
 
+void PG::update_store_with_options()
+{
+  int r = osd->store->set_collection_opts(coll, pool.info.opts);
+  if (r < 0 && r != -EOPNOTSUPP) {
+    derr << __func__ << " set_collection_opts returns error: "
+	 << cpp_strerror(r) << dendl;
+  }
+}
+
 
 
 std::ostream& operator<<(std::ostream& oss,
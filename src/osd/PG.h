@@ -893,6 +893,14 @@ public:
 	old_version,
 	t);
     }
+    void rollback_extents(
+      version_t gen,
+      const vector<pair<uint64_t, uint64_t> > &extents) {
+      pg->get_pgbackend()->trim_stashed_object(
+	soid,
+	gen,
+	t);
+    }
   };
 
   struct SnapRollBacker : public ObjectModDesc::Visitor {
@@ -2299,6 +2307,9 @@ public:
   void handle_loaded(RecoveryCtx *rctx);
   void handle_query_state(Formatter *f);
 
+  /// push the pool options that the ObjectStore cares about to our collection
+  void update_store_with_options();
+
   virtual void on_removal(ObjectStore::Transaction *t) = 0;
 
 
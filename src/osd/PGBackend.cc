@@ -66,6 +66,14 @@ struct RollbackVisitor : public ObjectModDesc::Visitor {
   void update_snaps(set<snapid_t> &snaps) {
     // pass
   }
+  void rollback_extents(
+    version_t gen,
+    const vector<pair<uint64_t, uint64_t> > &extents) {
+    ObjectStore::Transaction temp;
+    pg->rollback_extents(hoid, gen, extents, &temp);
+    temp.append(t);
+    temp.swap(t);
+  }
 };
 
 void PGBackend::rollback(
@@ -229,6 +229,14 @@
 
      virtual LogClientTemp clog_error() = 0;
 
+     /**
+      * Force a new interval, for a backend that cannot complete an op
+      * it has already accepted.  on_change() then drops every in-flight
+      * op and clients resend.  The given shards are mapped out of the
+      * acting set until peering asks for the set it wants back.
+      */
+     virtual void request_repeer(const set<pg_shard_t> &bad) = 0;
+
      virtual ~Listener() {}
    };
    Listener *parent;
@@ -506,6 +514,15 @@
      uint64_t old_size,
      ObjectStore::Transaction *t);
 
+   /// Restore extents cloned aside to rollback an overwrite
+   virtual void rollback_extents(
+     const hobject_t &hoid,
+     version_t gen,
+     const vector<pair<uint64_t, uint64_t> > &extents,
+     ObjectStore::Transaction *t) {
+     assert(0 == "overwrite rollback not supported by this backend");
+   }
+
    /// Unstash object to rollback stash
    void rollback_stash(
      const hobject_t &hoid,
@@ -86,8 +86,7 @@ void PGLog::IndexedLog::split_into(
 
 void PGLog::IndexedLog::trim(
   LogEntryHandler *handler,
-  eversion_t s,
-  set<eversion_t> *trimmed)
+  eversion_t s)
 {
   if (complete_to != log.end() &&
       complete_to->version <= s) {
@@ -105,8 +104,6 @@ void PGLog::IndexedLog::trim(
     if (e.version > s)
       break;
     generic_dout(20) << "trim " << e << dendl;
-    if (trimmed)
-      trimmed->insert(e.version);
 
     unindex(e);         // remove from index,
 
@@ -124,6 +121,98 @@ void PGLog::IndexedLog::trim(
     tail = s;
 }
 
+// copy bl out of a buffer holding more than bl
+static void compact_bl(bufferlist &bl)
+{
+  if (bl.length() == 0)
+    return;
+  if (bl.buffers().size() > 1 ||
+      bl.buffers().front().raw_length() > bl.length())
+    bl.rebuild();
+}
+
+void PGLog::IndexedLog::compact(pg_log_entry_t &e)
+{
+  compact_bl(e.mod_desc.bl);
+  compact_bl(e.snaps);
+  // objects is empty unless indexed, or being indexed by index()
+  object_index_t::iterator p = objects.find(e.soid);
+  if (p != objects.end() && p->second != &e)
+    e.soid = p->second->soid;
+}
+
+// the part of a string's bytes held outside the string itself, counted
+// once however many strings share it
+static uint64_t string_heap_bytes(const string &s, set<const char*> *seen)
+{
+  if (s.capacity() < sizeof(s) || !seen->insert(s.data()).second)
+    return 0;
+  return s.capacity() + 1;
+}
+
+// the ptr nodes of bl, and the buffers behind them not counted yet
+static uint64_t bufferlist_heap_bytes(const bufferlist &bl,
+				      set<const char*> *seen)
+{
+  uint64_t bytes = 0;
+  for (std::list<bufferptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end();
+       ++p) {
+    bytes += sizeof(*p) + 2 * sizeof(void*);
+    if (seen->insert(p->raw_c_str()).second)
+      bytes += p->raw_length();
+  }
+  return bytes;
+}
+
+// rough size of a hash table node holding v, plus its bucket
+template <typename V>
+static uint64_t hash_node_bytes()
+{
+  return sizeof(V) + 3 * sizeof(void*);
+}
+
+void PGLog::IndexedLog::get_mem_usage(
+  uint64_t *entry_bytes, uint64_t *index_bytes) const
+{
+  *entry_bytes = 0;
+  set<const char*> seen;
+  for (list<pg_log_entry_t>::const_iterator p = log.begin();
+       p != log.end();
+       ++p) {
+    *entry_bytes += sizeof(*p) + 2 * sizeof(void*) +
+      string_heap_bytes(p->soid.oid.name, &seen) +
+      string_heap_bytes(p->soid.get_key(), &seen) +
+      string_heap_bytes(p->soid.nspace, &seen) +
+      bufferlist_heap_bytes(p->mod_desc.bl, &seen) +
+      bufferlist_heap_bytes(p->snaps, &seen) +
+      p->extra_reqids.capacity() * sizeof(p->extra_reqids[0]);
+  }
+  *index_bytes =
+    objects.size() * hash_node_bytes<object_index_t::value_type>() +
+    caller_ops.size() * hash_node_bytes<caller_index_t::value_type>() +
+    extra_caller_ops.size() *
+      hash_node_bytes<extra_caller_index_t::value_type>();
+}
+
+void PGLog::IndexedLog::dump_mem(Formatter *f) const
+{
+  uint64_t entry_bytes, index_bytes;
+  get_mem_usage(&entry_bytes, &index_bytes);
+  dump_mem(f, entry_bytes, index_bytes);
+}
+
+void PGLog::IndexedLog::dump_mem(Formatter *f, uint64_t entry_bytes,
+				 uint64_t index_bytes) const
+{
+  f->dump_unsigned("entries", log.size());
+  f->dump_unsigned("objects", objects.size());
+  f->dump_unsigned("caller_ops", caller_ops.size());
+  f->dump_unsigned("extra_caller_ops", extra_caller_ops.size());
+  f->dump_unsigned("entry_bytes", entry_bytes);
+  f->dump_unsigned("index_bytes", index_bytes);
+}
+
 ostream& PGLog::IndexedLog::print(ostream& out) const
 {
   out << *this << std::endl;
@@ -175,7 +264,9 @@ void PGLog::trim(
     assert(trim_to <= info.last_complete);
 
     dout(10) << "trim " << log << " to " << trim_to << dendl;
-    log.trim(handler, trim_to, &trimmed);
+    log.trim(handler, trim_to);
+    if (trim_to > trimmed_to)
+      trimmed_to = trim_to;
     info.log_tail = log.tail;
   }
 }
@@ -374,7 +465,7 @@ void PGLog::_merge_object_divergent_entries(
 	   << " last_divergent_update: " << last_divergent_update
 	   << dendl;
 
-  ceph::unordered_map<hobject_t, pg_log_entry_t*>::const_iterator objiter =
+  IndexedLog::object_index_t::const_iterator objiter =
     log.objects.find(hoid);
   if (objiter != log.objects.end() &&
       objiter->second->version >= first_divergent_update) {
@@ -753,14 +844,14 @@ void PGLog::write_log(
 	     << (dirty_divergent_priors ? "true" : "false")
 	     << ", divergent_priors: " << divergent_priors.size()
 	     << ", writeout_from: " << writeout_from
-	     << ", trimmed: " << trimmed
+	     << ", trimmed_to: " << trimmed_to
 	     << dendl;
     _write_log(
       t, km, log, coll, log_oid, divergent_priors,
       dirty_to,
       dirty_from,
       writeout_from,
-      trimmed,
+      trimmed_to,
       dirty_divergent_priors,
       !touched_log,
       require_rollback,
@@ -782,7 +873,7 @@ void PGLog::write_log(
   _write_log(
     t, km, log, coll, log_oid,
     divergent_priors, eversion_t::max(), eversion_t(), eversion_t(),
-    set<eversion_t>(),
+    eversion_t(),
     true, true, require_rollback, 0);
 }
 
@@ -795,27 +886,26 @@ void PGLog::_write_log(
   eversion_t dirty_to,
   eversion_t dirty_from,
   eversion_t writeout_from,
-  const set<eversion_t> &trimmed,
+  eversion_t trimmed_to,
   bool dirty_divergent_priors,
   bool touch_log,
   bool require_rollback,
   set<string> *log_keys_debug
   )
 {
-  set<string> to_remove;
-  for (set<eversion_t>::const_iterator i = trimmed.begin();
-       i != trimmed.end();
-       ++i) {
-    to_remove.insert(i->get_key_name());
-    if (log_keys_debug) {
-      assert(log_keys_debug->count(i->get_key_name()));
-      log_keys_debug->erase(i->get_key_name());
-    }
-  }
-
 //dout(10) << "write_log, clearing up to " << dirty_to << dendl;
   if (touch_log)
     t.touch(coll, log_oid);
+  if (trimmed_to != eversion_t()) {
+    // trimming only removes entries from the tail, so every key up to
+    // and including trimmed_to goes, and one range removal covers them
+    string end = eversion_t(trimmed_to.epoch,
+			    trimmed_to.version + 1).get_key_name();
+    t.omap_rmkeyrange(
+      coll, log_oid,
+      eversion_t().get_key_name(), end);
+    clear_up_to(log_keys_debug, end);
+  }
   if (dirty_to != eversion_t()) {
     t.omap_rmkeyrange(
       coll, log_oid,
@@ -867,9 +957,6 @@ void PGLog::_write_log(
   ::encode(log.can_rollback_to, (*km)["can_rollback_to"]);
   ::encode(log.rollback_info_trimmed_to, (*km)["rollback_info_trimmed_to"]);
   }
-
-  if (!to_remove.empty())
-    t.omap_rmkeys(coll, log_oid, to_remove);
 }
 
 void PGLog::read_log(ObjectStore *store, coll_t pg_coll,
@@ -55,14 +55,41 @@ struct PGLog {
     char buf[512];
   };
 
+  /**
+   * Key of the IndexedLog indexes.  It refers to the hobject_t or
+   * osd_reqid_t held by a log entry rather than holding a copy, so an
+   * index costs a pointer per key instead of another copy of every
+   * object name in the log.  An index key always refers to the entry
+   * the key maps to; lookups convert from a plain value.
+   */
+  template <typename T>
+  struct entry_key_t {
+    mutable const T *p;
+    entry_key_t(const T &v) : p(&v) {}
+    const T &get() const { return *p; }
+    bool operator==(const entry_key_t &o) const { return *p == *o.p; }
+    struct hash {
+      size_t operator()(const entry_key_t &k) const {
+	return std::hash<T>()(*k.p);
+      }
+    };
+  };
+
   /**
    * IndexLog - adds in-memory index of the log, by oid.
    * plus some methods to manipulate it all.
    */
   struct IndexedLog : public pg_log_t {
-    mutable ceph::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
-    mutable ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
+    typedef ceph::unordered_map<entry_key_t<hobject_t>, pg_log_entry_t*,
+				entry_key_t<hobject_t>::hash> object_index_t;
+    typedef ceph::unordered_map<entry_key_t<osd_reqid_t>, pg_log_entry_t*,
+				entry_key_t<osd_reqid_t>::hash> caller_index_t;
+    typedef ceph::unordered_multimap<entry_key_t<osd_reqid_t>, pg_log_entry_t*,
+				     entry_key_t<osd_reqid_t>::hash> extra_caller_index_t;
+
+    mutable object_index_t objects;  // ptrs into log.  be careful!
+    mutable caller_index_t caller_ops;
+    mutable extra_caller_index_t extra_caller_ops;
 
     // recovery pointers
     list<pg_log_entry_t>::iterator complete_to;  // not inclusive of referenced item
@@ -71,6 +98,17 @@ struct PGLog {
     //
   private:
     mutable __u16 indexed_data;
+
+    /// map key to e, making the key refer to e's copy of it
+    template <typename M, typename T>
+    static void index_set(M &m, const T &key, pg_log_entry_t *e) {
+      pair<typename M::iterator, bool> r =
+	m.insert(make_pair(typename M::key_type(key), e));
+      if (!r.second) {
+	r.first->first.p = &key;
+	r.first->second = e;
+      }
+    }
     /**
      * rollback_info_trimmed_to_riter points to the first log entry <=
      * rollback_info_trimmed_to
@@ -79,6 +117,18 @@ struct PGLog {
      * tail, and rbegin() works nicely for head.
      */
     list<pg_log_entry_t>::reverse_iterator rollback_info_trimmed_to_riter;
+
+    /**
+     * shrink an entry entering the log
+     *
+     * The log outlives the buffers entries are decoded from or encoded
+     * into, so mod_desc and snaps are copied out of any larger buffer
+     * they share.  The object name is interned: soid is copied from the
+     * indexed entry for the same object, so that with reference counted
+     * strings all of an object's entries share one copy of it.  Call
+     * before e is indexed.
+     */
+    void compact(pg_log_entry_t &e);
   public:
     void advance_rollback_info_trimmed_to(eversion_t to, LogEntryHandler *h);
 
@@ -153,11 +203,10 @@ struct PGLog {
       version_t *user_version) const {
       assert(replay_version);
       assert(user_version);
-      ceph::unordered_map<osd_reqid_t,pg_log_entry_t*>::const_iterator p;
       if (!(indexed_data & PGLOG_INDEXED_CALLER_OPS)) {
         index_caller_ops();
       }
-      p = caller_ops.find(r);
+      caller_index_t::const_iterator p = caller_ops.find(r);
       if (p != caller_ops.end()) {
 	*replay_version = p->second->version;
 	*user_version = p->second->user_version;
@@ -169,14 +218,14 @@ struct PGLog {
       if (!(indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS)) {
         index_extra_caller_ops();
       }
-      p = extra_caller_ops.find(r);
-      if (p != extra_caller_ops.end()) {
+      extra_caller_index_t::const_iterator q = extra_caller_ops.find(r);
+      if (q != extra_caller_ops.end()) {
 	for (vector<pair<osd_reqid_t, version_t> >::const_iterator i =
-	       p->second->extra_reqids.begin();
-	     i != p->second->extra_reqids.end();
+	       q->second->extra_reqids.begin();
+	     i != q->second->extra_reqids.end();
 	     ++i) {
 	  if (i->first == r) {
-	    *replay_version = p->second->version;
+	    *replay_version = q->second->version;
 	    *user_version = i->second;
 	    return true;
 	  }
@@ -228,19 +277,20 @@ struct PGLog {
       for (list<pg_log_entry_t>::iterator i = log.begin();
              i != log.end();
              ++i) {
-               
-        objects[i->soid] = &(*i);
+        compact(*i);
+        index_set(objects, i->soid, &(*i));
         
         if (i->reqid_is_indexed()) {
         //assert(caller_ops.count(i->reqid) == 0);  // divergent merge_log indexes new before unindexing old
-          caller_ops[i->reqid] = &(*i);
+          index_set(caller_ops, i->reqid, &(*i));
         }
         
         for (vector<pair<osd_reqid_t, version_t> >::const_iterator j =
               i->extra_reqids.begin();
               j != i->extra_reqids.end();
               ++j) {
-            extra_caller_ops.insert(make_pair(j->first, &(*i)));
+            extra_caller_ops.insert(
+	      make_pair(extra_caller_index_t::key_type(j->first), &(*i)));
         }
       }
         
@@ -254,7 +304,7 @@ struct PGLog {
       for (list<pg_log_entry_t>::const_iterator i = log.begin();
             i != log.end();
             ++i) {
-         objects[i->soid] = const_cast<pg_log_entry_t*>(&(*i));
+         index_set(objects, i->soid, const_cast<pg_log_entry_t*>(&(*i)));
        }
  
       indexed_data |= PGLOG_INDEXED_OBJECTS;
@@ -269,7 +319,7 @@ struct PGLog {
                
         if (i->reqid_is_indexed()) {
         //assert(caller_ops.count(i->reqid) == 0);  // divergent merge_log indexes new before unindexing old
-          caller_ops[i->reqid] = const_cast<pg_log_entry_t*>(&(*i));
+          index_set(caller_ops, i->reqid, const_cast<pg_log_entry_t*>(&(*i)));
         }        
       }
         
@@ -286,7 +336,9 @@ struct PGLog {
               i->extra_reqids.begin();
               j != i->extra_reqids.end();
               ++j) {
-            extra_caller_ops.insert(make_pair(j->first, const_cast<pg_log_entry_t*>(&(*i))));
+            extra_caller_ops.insert(
+	      make_pair(extra_caller_index_t::key_type(j->first),
+			const_cast<pg_log_entry_t*>(&(*i))));
         }
       }
         
@@ -295,14 +347,15 @@ struct PGLog {
 
     void index(pg_log_entry_t& e) {
       if (indexed_data & PGLOG_INDEXED_OBJECTS) {
-        if (objects.count(e.soid) == 0 || 
-            objects[e.soid]->version < e.version)
-          objects[e.soid] = &e;
+        object_index_t::iterator p = objects.find(e.soid);
+        if (p == objects.end() ||
+            p->second->version < e.version)
+          index_set(objects, e.soid, &e);
       }
       if (indexed_data & PGLOG_INDEXED_CALLER_OPS) {
         if (e.reqid_is_indexed()) {
     //assert(caller_ops.count(i->reqid) == 0);  // divergent merge_log indexes new before unindexing old
-    caller_ops[e.reqid] = &e;
+    index_set(caller_ops, e.reqid, &e);
         }
       }
       if (indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS) {
@@ -310,7 +363,8 @@ struct PGLog {
          e.extra_reqids.begin();
        j != e.extra_reqids.end();
        ++j) {
-    extra_caller_ops.insert(make_pair(j->first, &e));
+    extra_caller_ops.insert(
+      make_pair(extra_caller_index_t::key_type(j->first), &e));
         }
       }
     }
@@ -323,14 +377,16 @@ struct PGLog {
     void unindex(pg_log_entry_t& e) {
       // NOTE: this only works if we remove from the _tail_ of the log!
       if (indexed_data & PGLOG_INDEXED_OBJECTS) {
-        if (objects.count(e.soid) && objects[e.soid]->version == e.version)
-          objects.erase(e.soid);
+        object_index_t::iterator p = objects.find(e.soid);
+        if (p != objects.end() && p->second->version == e.version)
+          objects.erase(p);
       }
       if (e.reqid_is_indexed()) {
         if (indexed_data & PGLOG_INDEXED_CALLER_OPS) {
-          if (caller_ops.count(e.reqid) &&  // divergent merge_log indexes new before unindexing old
-              caller_ops[e.reqid] == &e)
-            caller_ops.erase(e.reqid);    
+          caller_index_t::iterator p = caller_ops.find(e.reqid);
+          if (p != caller_ops.end() &&  // divergent merge_log indexes new before unindexing old
+              p->second == &e)
+            caller_ops.erase(p);
         }
       }
       if (indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS) {
@@ -338,9 +394,9 @@ struct PGLog {
              e.extra_reqids.begin();
              j != e.extra_reqids.end();
              ++j) {
-          for (ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*>::iterator k =
+          for (extra_caller_index_t::iterator k =
                extra_caller_ops.find(j->first);
-               k != extra_caller_ops.end() && k->first == j->first;
+               k != extra_caller_ops.end() && k->first.get() == j->first;
                ++k) {
             if (k->second == &e) {
               extra_caller_ops.erase(k);
@@ -360,7 +416,7 @@ struct PGLog {
        * Make sure we don't keep around more than we need to in the
        * in-memory log
        */
-      log.back().mod_desc.trim_bl();
+      compact(log.back());
 
       // riter previously pointed to the previous entry
       if (rollback_info_trimmed_to_riter == log.rbegin())
@@ -370,33 +426,41 @@ struct PGLog {
       assert(head.version == 0 || e.version.version > head.version);
       head = e.version;
 
-      // to our index
+      // to our index; the keys refer to the copy in the log, not e
+      pg_log_entry_t &le = log.back();
       if (indexed_data & PGLOG_INDEXED_OBJECTS) {
-        objects[e.soid] = &(log.back());
+        index_set(objects, le.soid, &le);
       }
       if (indexed_data & PGLOG_INDEXED_CALLER_OPS) {
-        if (e.reqid_is_indexed()) {
-    caller_ops[e.reqid] = &(log.back());
+        if (le.reqid_is_indexed()) {
+    index_set(caller_ops, le.reqid, &le);
         }
       }
       
       if (indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS) {
         for (vector<pair<osd_reqid_t, version_t> >::const_iterator j =
-         e.extra_reqids.begin();
-       j != e.extra_reqids.end();
+         le.extra_reqids.begin();
+       j != le.extra_reqids.end();
        ++j) {
-    extra_caller_ops.insert(make_pair(j->first, &(log.back())));
+    extra_caller_ops.insert(
+      make_pair(extra_caller_index_t::key_type(j->first), &le));
         }
       }
     }
 
     void trim(
       LogEntryHandler *handler,
-      eversion_t s,
-      set<eversion_t> *trimmed);
+      eversion_t s);
 
     ostream& print(ostream& out) const;
 
+    /// approximate bytes used by the entries and by the indexes
+    void get_mem_usage(uint64_t *entry_bytes, uint64_t *index_bytes) const;
+    void dump_mem(Formatter *f) const;
+    /// dump_mem with entry_bytes and index_bytes from get_mem_usage
+    void dump_mem(Formatter *f, uint64_t entry_bytes,
+		  uint64_t index_bytes) const;
+
     void filter_log(spg_t pgid, const OSDMap &map, const string &hit_set_namespace);
   };
 
@@ -411,7 +475,7 @@ protected:
   eversion_t dirty_to;         ///< must clear/writeout all keys <= dirty_to
   eversion_t dirty_from;       ///< must clear/writeout all keys >= dirty_from
   eversion_t writeout_from;    ///< must writout keys >= writeout_from
-  set<eversion_t> trimmed;     ///< must clear keys in trimmed
+  eversion_t trimmed_to;       ///< must clear all keys <= trimmed_to
   CephContext *cct;
   bool pg_log_debug;
   /// Log is clean on [dirty_to, dirty_from)
@@ -424,7 +488,7 @@ protected:
       (dirty_from != eversion_t::max()) ||
       dirty_divergent_priors ||
       (writeout_from != eversion_t::max()) ||
-      !(trimmed.empty());
+      (trimmed_to != eversion_t());
   }
   void mark_dirty_to(eversion_t to) {
     if (to > dirty_to)
@@ -473,7 +537,7 @@ protected:
     dirty_from = eversion_t::max();
     dirty_divergent_priors = false;
     touched_log = true;
-    trimmed.clear();
+    trimmed_to = eversion_t();
     writeout_from = eversion_t::max();
     check();
   }
@@ -772,7 +836,7 @@ public:
     eversion_t dirty_to,
     eversion_t dirty_from,
     eversion_t writeout_from,
-    const set<eversion_t> &trimmed,
+    eversion_t trimmed_to,
     bool dirty_divergent_priors,
     bool touch_log,
     bool require_rollback,
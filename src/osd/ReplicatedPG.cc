@@ -4799,13 +4799,18 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	}
 
 	if (!obs.exists) {
-	  if (pool.info.require_rollback() && op.extent.offset) {
+	  if (pool.info.require_rollback() && op.extent.offset &&
+	      !pool.info.allows_ecoverwrites()) {
 	    result = -EOPNOTSUPP;
 	    break;
 	  }
 	  ctx->mod_desc.create();
 	} else if (op.extent.offset == oi.size) {
 	  ctx->mod_desc.append(oi.size);
+	} else if (pool.info.allows_ecoverwrites()) {
+	  // ECBackend records the overwritten extents for rollback
+	  if (op.extent.offset + op.extent.length > oi.size)
+	    ctx->mod_desc.append(oi.size);
 	} else {
 	  ctx->mod_desc.mark_unrollbackable();
 	  if (pool.info.require_rollback()) {
@@ -4847,7 +4852,13 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	result = check_offset_and_length(op.extent.offset, op.extent.length, cct->_conf->osd_max_object_size);
 	if (result < 0)
 	  break;
-	if (pool.info.require_rollback()) {
+	if (pool.info.allows_ecoverwrites()) {
+	  if (op.extent.offset == oi.size &&
+	      op.extent.offset % pool.info.get_stripe_width() == 0)
+	    t->append(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
+	  else
+	    t->write(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
+	} else if (pool.info.require_rollback()) {
 	  t->append(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
 	} else {
 	  t->write(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
@@ -4931,7 +4942,7 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 
     case CEPH_OSD_OP_ZERO:
       tracepoint(osd, do_osd_op_pre_zero, soid.oid.name.c_str(), soid.snap.val, op.extent.offset, op.extent.length);
-      if (pool.info.require_rollback()) {
+      if (pool.info.require_rollback() && !pool.info.allows_ecoverwrites()) {
 	result = -EOPNOTSUPP;
 	break;
       }
@@ -4941,8 +4952,16 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	if (result < 0)
 	  break;
 	assert(op.extent.length);
+	if (pool.info.require_rollback() && obs.exists &&
+	    op.extent.offset + op.extent.length > oi.size) {
+	  // an ec zero is an overwrite, and must not extend the object
+	  if (op.extent.offset >= oi.size)
+	    break;
+	  op.extent.length = oi.size - op.extent.offset;
+	}
 	if (obs.exists && !oi.is_whiteout()) {
-	  ctx->mod_desc.mark_unrollbackable();
+	  if (!pool.info.require_rollback())
+	    ctx->mod_desc.mark_unrollbackable();
 	  t->zero(soid, op.extent.offset, op.extent.length);
 	  interval_set<uint64_t> ch;
 	  ch.insert(op.extent.offset, op.extent.length);
@@ -9291,6 +9310,36 @@ void ReplicatedPG::failed_push(pg_shard_t from, const hobject_t &soid)
   finish_recovery_op(soid);  // close out this attempt,
 }
 
+void ReplicatedPG::request_repeer(const set<pg_shard_t> &bad)
+{
+  // a pg_temp that maps the bad shards out is enough to start a new
+  // interval; choose_acting will ask for the up set back once we peer
+  vector<int> want = acting;
+  for (set<pg_shard_t>::const_iterator p = bad.begin(); p != bad.end(); ++p) {
+    if (*p == pg_whoami)
+      continue;
+    if (pool.info.ec_pool()) {
+      if ((unsigned)p->shard < want.size())
+	want[p->shard] = CRUSH_ITEM_NONE;
+    } else {
+      want.erase(std::remove(want.begin(), want.end(), p->osd), want.end());
+    }
+  }
+  if (want == acting) {
+    // only our own shard failed; keep just ourselves
+    if (pool.info.ec_pool()) {
+      want.assign(acting.size(), CRUSH_ITEM_NONE);
+      want[pg_whoami.shard] = pg_whoami.osd;
+    } else {
+      want.assign(1, pg_whoami.osd);
+    }
+  }
+  osd->clog->warn() << info.pgid << " forcing a new interval, acting "
+		    << acting << " -> pg_temp " << want << "\n";
+  osd->queue_want_pg_temp(info.pgid.pgid, want);
+  osd->send_pg_temp();
+}
+
 void ReplicatedPG::sub_op_remove(OpRequestRef op)
 {
   MOSDSubOp *m = static_cast<MOSDSubOp*>(op->get_req());
@@ -470,6 +470,7 @@ public:
   ceph_tid_t get_tid() { return osd->get_tid(); }
 
   LogClientTemp clog_error() { return osd->clog->error(); }
+  void request_repeer(const set<pg_shard_t> &bad);
 
   /*
    * Capture all object state associated with an in-progress read or write.
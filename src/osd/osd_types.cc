@@ -947,7 +947,15 @@ static opt_mapping_t opt_mapping = boost::assign::map_list_of
            ("recovery_priority", pool_opts_t::opt_desc_t(
              pool_opts_t::RECOVERY_PRIORITY, pool_opts_t::INT))
            ("recovery_op_priority", pool_opts_t::opt_desc_t(
-             pool_opts_t::RECOVERY_OP_PRIORITY, pool_opts_t::INT));
+             pool_opts_t::RECOVERY_OP_PRIORITY, pool_opts_t::INT))
+           ("compression_mode", pool_opts_t::opt_desc_t(
+             pool_opts_t::COMPRESSION_MODE, pool_opts_t::STR))
+           ("compression_algorithm", pool_opts_t::opt_desc_t(
+             pool_opts_t::COMPRESSION_ALGORITHM, pool_opts_t::STR))
+           ("compression_required_ratio", pool_opts_t::opt_desc_t(
+             pool_opts_t::COMPRESSION_REQUIRED_RATIO, pool_opts_t::DOUBLE))
+           ("kstore_stripe_size", pool_opts_t::opt_desc_t(
+             pool_opts_t::KSTORE_STRIPE_SIZE, pool_opts_t::INT));
 
 bool pool_opts_t::is_opt_name(const std::string& name) {
     return opt_mapping.find(name) != opt_mapping.end();
@@ -3272,6 +3280,14 @@ void ObjectModDesc::visit(Visitor *visitor) const
 	visitor->update_snaps(snaps);
 	break;
       }
+      case ROLLBACK_EXTENTS: {
+	version_t gen;
+	vector<pair<uint64_t, uint64_t> > extents;
+	::decode(gen, bp);
+	::decode(extents, bp);
+	visitor->rollback_extents(gen, extents);
+	break;
+      }
       default:
 	assert(0 == "Invalid rollback code");
       }
@@ -3320,6 +3336,15 @@ struct DumpVisitor : public ObjectModDesc::Visitor {
     f->dump_stream("snaps") << snaps;
     f->close_section();
   }
+  void rollback_extents(
+    version_t gen,
+    const vector<pair<uint64_t, uint64_t> > &extents) {
+    f->open_object_section("op");
+    f->dump_string("code", "ROLLBACK_EXTENTS");
+    f->dump_unsigned("gen", gen);
+    f->dump_stream("extents") << extents;
+    f->close_section();
+  }
 };
 
 void ObjectModDesc::dump(Formatter *f) const
@@ -3348,6 +3373,10 @@ void ObjectModDesc::generate_test_instances(list<ObjectModDesc*>& o)
   o.push_back(new ObjectModDesc());
   o.back()->rmobject(1001);
   o.push_back(new ObjectModDesc());
+  o.back()->setattrs(attrs);
+  o.back()->rollback_extents(1002, vector<pair<uint64_t, uint64_t> >(
+			       1, make_pair(4096, 8192)));
+  o.push_back(new ObjectModDesc());
   o.back()->create();
   o.back()->setattrs(attrs);
   o.push_back(new ObjectModDesc());
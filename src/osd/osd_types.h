@@ -73,6 +73,9 @@
 /// base backfill priority for MBackfillReserve
 #define OSD_BACKFILL_PRIORITY_BASE 1u
 
+/// max kstore_stripe_size pool option; each stripe is one kv value
+#define KSTORE_STRIPE_SIZE_MAX (4 << 20)
+
 typedef hobject_t collection_list_handle_t;
 
 /// convert a single CPEH_OSD_FLAG_* to a string
@@ -953,7 +956,11 @@ public:
     SCRUB_MAX_INTERVAL,
     DEEP_SCRUB_INTERVAL,
     RECOVERY_PRIORITY,
-    RECOVERY_OP_PRIORITY
+    RECOVERY_OP_PRIORITY,
+    COMPRESSION_MODE,
+    COMPRESSION_ALGORITHM,
+    COMPRESSION_REQUIRED_RATIO,
+    KSTORE_STRIPE_SIZE
   };
 
   enum type_t {
@@ -1051,6 +1058,7 @@ struct pg_pool_t {
     FLAG_WRITE_FADVISE_DONTNEED = 1<<7, // write mode with LIBRADOS_OP_FLAG_FADVISE_DONTNEED
     FLAG_NOSCRUB = 1<<8, // block periodic scrub
     FLAG_NODEEP_SCRUB = 1<<9, // block periodic deep-scrub
+    FLAG_EC_OVERWRITES = 1<<10, // ec pool accepts partial overwrites
   };
 
   static const char *get_flag_name(int f) {
@@ -1065,6 +1073,7 @@ struct pg_pool_t {
     case FLAG_WRITE_FADVISE_DONTNEED: return "write_fadvise_dontneed";
     case FLAG_NOSCRUB: return "noscrub";
     case FLAG_NODEEP_SCRUB: return "nodeep-scrub";
+    case FLAG_EC_OVERWRITES: return "ec_overwrites";
     default: return "???";
     }
   }
@@ -1103,6 +1112,8 @@ struct pg_pool_t {
       return FLAG_NOSCRUB;
     if (name == "nodeep-scrub")
       return FLAG_NODEEP_SCRUB;
+    if (name == "ec_overwrites")
+      return FLAG_EC_OVERWRITES;
     return 0;
   }
 
@@ -1364,7 +1375,14 @@ public:
     return !(get_type() == TYPE_ERASURE || has_flag(FLAG_DEBUG_FAKE_EC_POOL));
   }
 
-  bool requires_aligned_append() const { return is_erasure(); }
+  /// true if partial overwrites are allowed on this ec pool
+  bool allows_ecoverwrites() const {
+    return is_erasure() && has_flag(FLAG_EC_OVERWRITES);
+  }
+
+  bool requires_aligned_append() const {
+    return is_erasure() && !has_flag(FLAG_EC_OVERWRITES);
+  }
   uint64_t required_alignment() const { return stripe_width; }
 
   bool can_shift_osds() const {
@@ -2362,6 +2380,9 @@ public:
     virtual void rmobject(version_t old_version) {}
     virtual void create() {}
     virtual void update_snaps(set<snapid_t> &old_snaps) {}
+    virtual void rollback_extents(
+      version_t gen,
+      const vector<pair<uint64_t, uint64_t> > &extents) {}
     virtual ~Visitor() {}
   };
   void visit(Visitor *visitor) const;
@@ -2371,7 +2392,8 @@ public:
     SETATTRS = 2,
     DELETE = 3,
     CREATE = 4,
-    UPDATE_SNAPS = 5
+    UPDATE_SNAPS = 5,
+    ROLLBACK_EXTENTS = 6
   };
   ObjectModDesc() : can_local_rollback(true), rollback_info_completed(false) {}
   void claim(ObjectModDesc &other) {
@@ -2447,6 +2469,21 @@ public:
     ::encode(old_snaps, bl);
     ENCODE_FINISH(bl);
   }
+  /**
+   * extents of the object, in shard space, which were cloned to the
+   * object at generation gen before being overwritten
+   */
+  void rollback_extents(
+    version_t gen,
+    const vector<pair<uint64_t, uint64_t> > &extents) {
+    if (!can_local_rollback || rollback_info_completed)
+      return;
+    ENCODE_START(1, 1, bl);
+    append_id(ROLLBACK_EXTENTS);
+    ::encode(gen, bl);
+    ::encode(extents, bl);
+    ENCODE_FINISH(bl);
+  }
 
   // cannot be rolled back
   void mark_unrollbackable() {
@@ -2456,6 +2493,10 @@ public:
   bool can_rollback() const {
     return can_local_rollback;
   }
+  /// true if further rollback info would be recorded
+  bool rollback_info_open() const {
+    return can_local_rollback && !rollback_info_completed;
+  }
   bool empty() const {
     return can_local_rollback && (bl.length() == 0);
   }
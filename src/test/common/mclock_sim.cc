@@ -0,0 +1,200 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Drive an mClockQueue with synthetic clients against a server of
+ * fixed throughput, in simulated time, and report the iops each class
+ * of clients achieved.
+ */
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common/mClockPriorityQueue.h"
+
+static void usage()
+{
+  std::cerr << "usage: ceph_test_mclock_sim [flags]\n"
+	    << "	 --capacity <iops>\n"
+	    << "	       ops per second the server completes (default 1000)\n"
+	    << "	 --duration <seconds>\n"
+	    << "	       simulated time (default 60)\n"
+	    << "	 --depth <ops>\n"
+	    << "	       ops kept queued by each backlogged client (default 8)\n"
+	    << "	 --class <name>:<res>:<wgt>:<lim>:<iops>[:<clients>]\n"
+	    << "	       add clients with the given reservation, weight and\n"
+	    << "	       limit; each offers iops ops per second, or is always\n"
+	    << "	       backlogged if iops is 0.  The default is\n"
+	    << "	         --class client:100:500:0:0:4 --class recovery:100:10:0:0\n"
+	    << "	         --class scrub:0:1:50:0 --class snaptrim:0:1:0:20\n"
+	    << std::endl;
+}
+
+struct SimClass {
+  std::string name;
+  double reservation, weight, limit;
+  double iops;
+  unsigned clients;
+};
+
+struct SimClient {
+  unsigned cls;
+  double next_arrival;
+  unsigned queued;
+  uint64_t offered;
+  uint64_t served;
+  SimClient(unsigned cls)
+    : cls(cls), next_arrival(0), queued(0), offered(0), served(0) {}
+};
+
+static bool parse_class(const std::string &s, SimClass *c)
+{
+  std::vector<std::string> f;
+  std::stringstream ss(s);
+  std::string tok;
+  while (std::getline(ss, tok, ':'))
+    f.push_back(tok);
+  if (f.size() < 5 || f.size() > 6)
+    return false;
+  c->name = f[0];
+  c->reservation = atof(f[1].c_str());
+  c->weight = atof(f[2].c_str());
+  c->limit = atof(f[3].c_str());
+  c->iops = atof(f[4].c_str());
+  c->clients = f.size() == 6 ? atoi(f[5].c_str()) : 1;
+  return c->weight > 0 && c->clients > 0;
+}
+
+int main(int argc, const char **argv)
+{
+  double capacity = 1000;
+  double duration = 60;
+  unsigned depth = 8;
+  std::vector<SimClass> classes;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    std::string val = argv[++i];
+    if (arg == "--capacity") {
+      capacity = atof(val.c_str());
+    } else if (arg == "--duration") {
+      duration = atof(val.c_str());
+    } else if (arg == "--depth") {
+      depth = atoi(val.c_str());
+    } else if (arg == "--class") {
+      SimClass c;
+      if (!parse_class(val, &c)) {
+	std::cerr << "bad class: " << val << std::endl;
+	usage();
+	return 1;
+      }
+      classes.push_back(c);
+    } else {
+      std::cerr << "can't understand argument: " << arg << std::endl;
+      usage();
+      return 1;
+    }
+  }
+  if (capacity <= 0 || duration <= 0 || depth == 0) {
+    usage();
+    return 1;
+  }
+  if (classes.empty()) {
+    const char *def[] = { "client:100:500:0:0:4", "recovery:100:10:0:0",
+			  "scrub:0:1:50:0", "snaptrim:0:1:0:20" };
+    for (unsigned i = 0; i < sizeof(def) / sizeof(def[0]); ++i) {
+      SimClass c;
+      parse_class(def[i], &c);
+      classes.push_back(c);
+    }
+  }
+
+  std::vector<SimClient> clients;
+  for (unsigned i = 0; i < classes.size(); ++i) {
+    for (unsigned j = 0; j < classes[i].clients; ++j)
+      clients.push_back(SimClient(i));
+  }
+
+  typedef mClockQueue<unsigned, unsigned> Queue;
+  double now = 0;
+  Queue q(
+    [&](const unsigned &client) {
+      const SimClass &c = classes[clients[client].cls];
+      return Queue::ClientInfo(c.reservation, c.weight, c.limit);
+    },
+    Queue::classify_by_class,
+    [&]() { return now; });
+
+  while (now < duration) {
+    double next_arrival = duration;
+    for (unsigned i = 0; i < clients.size(); ++i) {
+      SimClient &c = clients[i];
+      double iops = classes[c.cls].iops;
+      if (iops > 0) {
+	while (c.next_arrival <= now) {
+	  q.enqueue(i, 0, 0, i);
+	  ++c.queued;
+	  ++c.offered;
+	  c.next_arrival += 1.0 / iops;
+	}
+	next_arrival = std::min(next_arrival, c.next_arrival);
+      } else {
+	while (c.queued < depth) {
+	  q.enqueue(i, 0, 0, i);
+	  ++c.queued;
+	  ++c.offered;
+	}
+      }
+    }
+    if (q.empty()) {
+      now = next_arrival;
+      continue;
+    }
+    SimClient &c = clients[q.dequeue()];
+    --c.queued;
+    ++c.served;
+    now += 1.0 / capacity;
+  }
+
+  std::cout << std::fixed << std::setprecision(1)
+	    << "capacity " << capacity << " iops, " << duration
+	    << "s simulated" << std::endl;
+  std::cout << std::left << std::setw(12) << "class"
+	    << std::right << std::setw(8) << "clients"
+	    << std::setw(10) << "res" << std::setw(10) << "wgt"
+	    << std::setw(10) << "lim" << std::setw(12) << "offered"
+	    << std::setw(12) << "iops" << std::setw(14) << "iops/client"
+	    << std::endl;
+  for (unsigned i = 0; i < classes.size(); ++i) {
+    const SimClass &cls = classes[i];
+    uint64_t served = 0;
+    for (unsigned j = 0; j < clients.size(); ++j) {
+      if (clients[j].cls == i)
+	served += clients[j].served;
+    }
+    std::ostringstream offered;
+    offered << std::fixed << std::setprecision(1);
+    if (cls.iops > 0)
+      offered << cls.iops * cls.clients;
+    else
+      offered << "backlog";
+    std::cout << std::left << std::setw(12) << cls.name
+	      << std::right << std::setw(8) << cls.clients
+	      << std::setw(10) << cls.reservation
+	      << std::setw(10) << cls.weight
+	      << std::setw(10) << cls.limit
+	      << std::setw(12) << offered.str()
+	      << std::setw(12) << served / duration
+	      << std::setw(14) << served / duration / cls.clients
+	      << std::endl;
+  }
+  return 0;
+}
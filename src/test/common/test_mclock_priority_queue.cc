@@ -0,0 +1,149 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+#include "common/Formatter.h"
+#include "common/mClockPriorityQueue.h"
+
+#include <map>
+#include <list>
+#include <memory>
+
+class MClockPriorityQueueTest : public testing::Test
+{
+protected:
+  typedef unsigned Klass;
+  typedef std::pair<Klass, unsigned> Item;  // class, op id
+  typedef mClockQueue<Item, Klass> MQ;
+
+  double now;
+  std::map<Klass, MQ::ClientInfo> infos;
+
+  MClockPriorityQueueTest() : now(0) {}
+
+  std::unique_ptr<MQ> make_queue() {
+    return std::unique_ptr<MQ>(new MQ(
+      [this](const Klass &k) { return infos[k]; },
+      MQ::classify_by_class,
+      [this]() { return now; }));
+  }
+
+  // serve n ops at rate ops/s, keeping every class backlogged
+  std::map<Klass, unsigned> run(MQ &q, unsigned n, double rate) {
+    std::map<Klass, unsigned> served;
+    for (unsigned i = 0; i < n; ++i) {
+      for (std::map<Klass, MQ::ClientInfo>::iterator p = infos.begin();
+	   p != infos.end(); ++p) {
+	q.enqueue(p->first, 0, 0, Item(p->first, i));
+      }
+      Item item = q.dequeue();
+      ++served[item.first];
+      now += 1.0 / rate;
+    }
+    return served;
+  }
+};
+
+TEST_F(MClockPriorityQueueTest, Strict)
+{
+  infos[1] = MQ::ClientInfo(0, 1, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  q->enqueue(1, 0, 0, Item(1, 0));
+  q->enqueue_strict(2, 10, Item(2, 0));
+  q->enqueue_strict(2, 20, Item(2, 1));
+  q->enqueue_strict_front(2, 10, Item(2, 2));
+  ASSERT_EQ(4u, q->length());
+  ASSERT_EQ(Item(2, 1), q->dequeue());
+  ASSERT_EQ(Item(2, 2), q->dequeue());
+  ASSERT_EQ(Item(2, 0), q->dequeue());
+  ASSERT_EQ(Item(1, 0), q->dequeue());
+  ASSERT_TRUE(q->empty());
+}
+
+TEST_F(MClockPriorityQueueTest, Fifo)
+{
+  infos[1] = MQ::ClientInfo(0, 1, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  q->enqueue(1, 0, 0, Item(1, 1));
+  q->enqueue(1, 0, 0, Item(1, 2));
+  q->enqueue_front(1, 0, 0, Item(1, 0));
+  for (unsigned i = 0; i < 3; ++i) {
+    ASSERT_EQ(Item(1, i), q->dequeue());
+  }
+  ASSERT_TRUE(q->empty());
+}
+
+TEST_F(MClockPriorityQueueTest, Weight)
+{
+  infos[1] = MQ::ClientInfo(0, 1, 0);
+  infos[2] = MQ::ClientInfo(0, 3, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  std::map<Klass, unsigned> served = run(*q, 4000, 1000);
+  ASSERT_NEAR(1000u, served[1], 20);
+  ASSERT_NEAR(3000u, served[2], 20);
+}
+
+TEST_F(MClockPriorityQueueTest, Reservation)
+{
+  // 200 ops/s are reserved for class 1 despite its small weight
+  infos[1] = MQ::ClientInfo(200, 1, 0);
+  infos[2] = MQ::ClientInfo(0, 100, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  std::map<Klass, unsigned> served = run(*q, 10000, 1000);
+  ASSERT_NEAR(2000u, served[1], 40);
+  ASSERT_NEAR(8000u, served[2], 40);
+}
+
+TEST_F(MClockPriorityQueueTest, Limit)
+{
+  // class 1 would get most of the 1000 ops/s by weight
+  infos[1] = MQ::ClientInfo(0, 10, 100);
+  infos[2] = MQ::ClientInfo(0, 1, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  std::map<Klass, unsigned> served = run(*q, 10000, 1000);
+  ASSERT_NEAR(1000u, served[1], 20);
+  ASSERT_NEAR(9000u, served[2], 20);
+}
+
+TEST_F(MClockPriorityQueueTest, Remove)
+{
+  infos[1] = MQ::ClientInfo(0, 1, 0);
+  infos[2] = MQ::ClientInfo(0, 1, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  for (unsigned i = 0; i < 10; ++i) {
+    q->enqueue(1, 0, 0, Item(1, i));
+    q->enqueue(2, 0, 0, Item(2, i));
+  }
+  q->enqueue_strict(1, 10, Item(1, 10));
+
+  std::list<Item> removed;
+  q->remove_by_class(1, &removed);
+  ASSERT_EQ(11u, removed.size());
+  ASSERT_EQ(Item(1, 10), removed.front());
+  ASSERT_EQ(10u, q->length());
+
+  removed.clear();
+  q->remove_by_filter([](Item item) { return item.second % 2; }, &removed);
+  ASSERT_EQ(5u, removed.size());
+  ASSERT_EQ(Item(2, 1), removed.front());
+  for (unsigned i = 0; i < 10; i += 2) {
+    ASSERT_EQ(Item(2, i), q->dequeue());
+  }
+  ASSERT_TRUE(q->empty());
+}
+
+TEST_F(MClockPriorityQueueTest, Dump)
+{
+  infos[1] = MQ::ClientInfo(10, 1, 0);
+  std::unique_ptr<MQ> q = make_queue();
+  q->enqueue(1, 0, 0, Item(1, 0));
+  q->enqueue_strict(1, 10, Item(1, 1));
+  JSONFormatter f;
+  f.open_object_section("queue");
+  q->dump(&f);
+  f.close_section();
+  std::stringstream ss;
+  f.flush(ss);
+  ASSERT_NE(std::string::npos, ss.str().find("\"high_size\":1"));
+  ASSERT_NE(std::string::npos, ss.str().find("\"size\":1"));
+}
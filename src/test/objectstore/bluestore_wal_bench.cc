@@ -0,0 +1,301 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Random small overwrites against BlueStore, run once with every wal
+ * transaction applied on its own (bluestore_wal_max_batch = 1) and once
+ * with the given batch size, reporting iops and the number of wal write
+ * ops versus device writes actually issued for each.
+ */
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "os/ObjectStore.h"
+
+#include "global/global_init.h"
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_json.h"
+#include "common/errno.h"
+#include "common/Formatter.h"
+#include "common/perf_counters.h"
+#include "include/stringify.h"
+
+#define dout_subsys ceph_subsys_bluestore
+
+static void usage()
+{
+  derr << "usage: ceph_perf_bluestore_wal [flags]\n"
+      "	 --objects\n"
+      "	       number of objects to overwrite (default 16)\n"
+      "	 --object-size\n"
+      "	       size of each object in bytes (default 4MB)\n"
+      "	 --block-size\n"
+      "	       size of each overwrite in bytes (default 4096)\n"
+      "	 --ops\n"
+      "	       overwrites per run (default 10000)\n"
+      "	 --threads\n"
+      "	       writer threads, each with its own sequencer (default 4)\n"
+      "	 --queue-depth\n"
+      "	       in-flight transactions per thread (default 16)\n"
+      "	 --batch\n"
+      "	       bluestore_wal_max_batch for the second run (default 64)\n"
+	<< dendl;
+  generic_server_usage();
+}
+
+struct BenchConfig {
+  int objects;
+  uint64_t object_size;
+  uint64_t block_size;
+  int ops;
+  int threads;
+  int queue_depth;
+  int batch;
+  BenchConfig()
+    : objects(16), object_size(4 << 20), block_size(4096),
+      ops(10000), threads(4), queue_depth(16), batch(64) {}
+};
+
+struct Result {
+  uint64_t usec;
+  uint64_t wal_write_ops;
+  uint64_t wal_write_ios;
+  Result() : usec(0), wal_write_ops(0), wal_write_ios(0) {}
+};
+
+class C_Inflight : public Context {
+  std::mutex *mutex;
+  std::condition_variable *cond;
+  int *inflight;
+public:
+  C_Inflight(std::mutex *mutex, std::condition_variable *cond, int *inflight)
+    : mutex(mutex), cond(cond), inflight(inflight) {}
+  void finish(int r) {
+    std::lock_guard<std::mutex> lock(*mutex);
+    --*inflight;
+    cond->notify_one();
+  }
+};
+
+static void worker(ObjectStore *os, const BenchConfig &cfg, const coll_t cid,
+		   const vector<ghobject_t> &oids, int ops, unsigned seed)
+{
+  ObjectStore::Sequencer osr("walbench");
+  bufferlist data;
+  data.append(buffer::create(cfg.block_size));
+  data.zero();
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  int inflight = 0;
+  uint64_t blocks = cfg.object_size / cfg.block_size;
+
+  for (int i = 0; i < ops; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&](){ return inflight < cfg.queue_depth; });
+      ++inflight;
+    }
+    const ghobject_t &oid = oids[rand_r(&seed) % oids.size()];
+    uint64_t offset = (rand_r(&seed) % blocks) * cfg.block_size;
+    ObjectStore::Transaction t;
+    t.write(cid, oid, offset, cfg.block_size, data);
+    os->queue_transaction(&osr, std::move(t), nullptr,
+			  new C_Inflight(&mutex, &cond, &inflight));
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&](){ return inflight == 0; });
+  lock.unlock();
+  osr.flush();
+}
+
+static uint64_t get_counter(JSONObj *logger, const string &name)
+{
+  JSONObj *o = logger ? logger->find_obj(name) : nullptr;
+  if (!o)
+    return 0;
+  return strtoull(o->get_data().c_str(), NULL, 10);
+}
+
+static void read_counters(Result *result)
+{
+  JSONFormatter f;
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(&f, false,
+								"BlueStore");
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser p;
+  if (!p.parse(s.c_str(), s.length())) {
+    derr << "failed to parse perf counters" << dendl;
+    return;
+  }
+  JSONObj *logger = p.find_obj("BlueStore");
+  result->wal_write_ops = get_counter(logger, "wal_write_ops");
+  result->wal_write_ios = get_counter(logger, "wal_write_ios");
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+  return ::remove(path);
+}
+
+/// remove everything under path (without following symlinks) and
+/// recreate it empty
+static int reset_dir(const string &path)
+{
+  if (::nftw(path.c_str(), rm_entry, 16, FTW_DEPTH | FTW_PHYS) < 0 &&
+      errno != ENOENT)
+    return -errno;
+  if (::mkdir(path.c_str(), 0755) < 0)
+    return -errno;
+  return 0;
+}
+
+static int run(const BenchConfig &cfg, int batch, Result *result)
+{
+  g_conf->set_val("bluestore_wal_max_batch", stringify(batch));
+  g_conf->apply_changes(NULL);
+
+  int r = reset_dir(g_conf->osd_data);
+  if (r < 0) {
+    derr << "failed to reset data directory " << g_conf->osd_data << ": "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  std::unique_ptr<ObjectStore> os(
+    ObjectStore::create(g_ceph_context, "bluestore", g_conf->osd_data,
+			g_conf->osd_journal));
+  if (!os) {
+    derr << "bluestore is not available" << dendl;
+    return -EINVAL;
+  }
+  if (os->mkfs() < 0 || os->mount() < 0) {
+    derr << "mkfs/mount failed" << dendl;
+    return -EIO;
+  }
+
+  // create and fully write the objects, so that overwrites go via the wal
+  spg_t pg;
+  const coll_t cid(pg);
+  vector<ghobject_t> oids;
+  {
+    ObjectStore::Sequencer osr(__func__);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    os->apply_transaction(&osr, std::move(t));
+
+    bufferlist bl;
+    bl.append(buffer::create(cfg.object_size));
+    bl.zero();
+    for (int i = 0; i < cfg.objects; ++i) {
+      std::stringstream oss;
+      oss << "walbench-" << i;
+      oids.push_back(ghobject_t(pg.make_temp_object(oss.str())));
+      ObjectStore::Transaction t;
+      t.write(cid, oids.back(), 0, cfg.object_size, bl);
+      r = os->apply_transaction(&osr, std::move(t));
+      assert(r == 0);
+    }
+  }
+
+  Result start;
+  read_counters(&start);
+
+  std::vector<std::thread> workers;
+  using namespace std::chrono;
+  auto t1 = high_resolution_clock::now();
+  for (int i = 0; i < cfg.threads; ++i) {
+    workers.emplace_back(worker, os.get(), std::ref(cfg), cid, std::ref(oids),
+			 cfg.ops / cfg.threads, i + 1);
+  }
+  // each worker flushes its sequencer, which waits for the wal as well
+  for (auto &w : workers)
+    w.join();
+  auto t2 = high_resolution_clock::now();
+  result->usec = duration_cast<microseconds>(t2 - t1).count();
+
+  read_counters(result);
+  result->wal_write_ops -= start.wal_write_ops;
+  result->wal_write_ios -= start.wal_write_ios;
+
+  os->umount();
+  return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+  BenchConfig cfg;
+
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  global_init(nullptr, args, CEPH_ENTITY_TYPE_OSD, CODE_ENVIRONMENT_UTILITY, 0);
+
+  std::string val;
+  vector<const char*>::iterator i = args.begin();
+  while (i != args.end()) {
+    if (ceph_argparse_double_dash(args, i))
+      break;
+    if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)nullptr)) {
+      cfg.objects = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--object-size", (char*)nullptr)) {
+      cfg.object_size = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--block-size", (char*)nullptr)) {
+      cfg.block_size = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)nullptr)) {
+      cfg.ops = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)nullptr)) {
+      cfg.threads = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--queue-depth", (char*)nullptr)) {
+      cfg.queue_depth = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--batch", (char*)nullptr)) {
+      cfg.batch = atoi(val.c_str());
+    } else {
+      derr << "Error: can't understand argument: " << *i << "\n" << dendl;
+      usage();
+      return 1;
+    }
+  }
+  if (cfg.objects <= 0 || cfg.threads <= 0 || cfg.queue_depth <= 0 ||
+      cfg.block_size == 0 || cfg.object_size < cfg.block_size) {
+    usage();
+    return 1;
+  }
+
+  g_ceph_context->_conf->set_val(
+    "enable_experimental_unrecoverable_data_corrupting_features", "*");
+  common_init_finish(g_ceph_context);
+
+  int batches[2] = { 1, cfg.batch };
+  Result results[2];
+  for (int n = 0; n < 2; ++n) {
+    int r = run(cfg, batches[n], &results[n]);
+    if (r < 0)
+      return 1;
+  }
+
+  for (int n = 0; n < 2; ++n) {
+    const Result &res = results[n];
+    uint64_t ops = cfg.ops / cfg.threads * cfg.threads;
+    std::cout << "bluestore_wal_max_batch " << batches[n] << ": "
+	      << ops << " overwrites of " << cfg.block_size << " bytes in "
+	      << res.usec << "us, " << (ops * 1000000ull / MAX(res.usec, 1ull))
+	      << " iops; wal write ops " << res.wal_write_ops
+	      << ", device writes " << res.wal_write_ios << std::endl;
+  }
+  return 0;
+}
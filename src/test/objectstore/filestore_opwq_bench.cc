@@ -0,0 +1,316 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Small writes against FileStore spread over many sequencers (one per
+ * pg, each with its own collection), run once for every given
+ * filestore_op_threads value, reporting transactions per second and the
+ * average apply latency.  Running the same binary against a tree with
+ * and without a given OpWQ change gives before/after numbers.
+ */
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "os/ObjectStore.h"
+
+#include "global/global_init.h"
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_json.h"
+#include "common/errno.h"
+#include "common/Formatter.h"
+#include "common/perf_counters.h"
+#include "include/str_list.h"
+#include "include/stringify.h"
+
+#define dout_subsys ceph_subsys_filestore
+
+static void usage()
+{
+  derr << "usage: ceph_perf_filestore_opwq [flags]\n"
+      "	 --pgs\n"
+      "	       number of sequencers/collections (default 64)\n"
+      "	 --objects\n"
+      "	       objects per pg (default 4)\n"
+      "	 --block-size\n"
+      "	       size of each write in bytes (default 4096)\n"
+      "	 --ops\n"
+      "	       transactions per run (default 20000)\n"
+      "	 --threads\n"
+      "	       submitting threads, the pgs are split between them (default 4)\n"
+      "	 --queue-depth\n"
+      "	       in-flight transactions per submitting thread (default 32)\n"
+      "	 --op-threads\n"
+      "	       comma separated filestore_op_threads values (default 1,2,4,8)\n"
+	<< dendl;
+  generic_server_usage();
+}
+
+struct BenchConfig {
+  int pgs;
+  int objects;
+  uint64_t block_size;
+  int ops;
+  int threads;
+  int queue_depth;
+  vector<int> op_threads;
+  BenchConfig()
+    : pgs(64), objects(4), block_size(4096), ops(20000), threads(4),
+      queue_depth(32), op_threads({1, 2, 4, 8}) {}
+};
+
+struct Result {
+  uint64_t usec;
+  uint64_t applied;
+  double apply_sum;
+  Result() : usec(0), applied(0), apply_sum(0) {}
+};
+
+struct PG {
+  coll_t cid;
+  vector<ghobject_t> oids;
+  std::unique_ptr<ObjectStore::Sequencer> osr;
+};
+
+class C_Inflight : public Context {
+  std::mutex *mutex;
+  std::condition_variable *cond;
+  int *inflight;
+public:
+  C_Inflight(std::mutex *mutex, std::condition_variable *cond, int *inflight)
+    : mutex(mutex), cond(cond), inflight(inflight) {}
+  void finish(int r) {
+    std::lock_guard<std::mutex> lock(*mutex);
+    --*inflight;
+    cond->notify_one();
+  }
+};
+
+static void worker(ObjectStore *os, const BenchConfig &cfg,
+		   vector<PG> *pgs, int first, int step, int ops, unsigned seed)
+{
+  bufferlist data;
+  data.append(buffer::create(cfg.block_size));
+  data.zero();
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  int inflight = 0;
+  int mine = (pgs->size() - first + step - 1) / step;
+
+  for (int i = 0; i < ops; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&](){ return inflight < cfg.queue_depth; });
+      ++inflight;
+    }
+    PG &pg = (*pgs)[first + (i % mine) * step];
+    const ghobject_t &oid = pg.oids[rand_r(&seed) % pg.oids.size()];
+    ObjectStore::Transaction t;
+    t.write(pg.cid, oid, 0, cfg.block_size, data);
+    os->queue_transaction(pg.osr.get(), std::move(t),
+			  new C_Inflight(&mutex, &cond, &inflight));
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&](){ return inflight == 0; });
+}
+
+static void read_counters(Result *result)
+{
+  JSONFormatter f;
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(
+    &f, false, "filestore", "apply_latency");
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser p;
+  if (!p.parse(s.c_str(), s.length())) {
+    derr << "failed to parse perf counters" << dendl;
+    return;
+  }
+  JSONObj *logger = p.find_obj("filestore");
+  JSONObj *lat = logger ? logger->find_obj("apply_latency") : nullptr;
+  if (!lat)
+    return;
+  JSONObj *o = lat->find_obj("avgcount");
+  if (o)
+    result->applied = strtoull(o->get_data().c_str(), NULL, 10);
+  o = lat->find_obj("sum");
+  if (o)
+    result->apply_sum = strtod(o->get_data().c_str(), NULL);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+  return ::remove(path);
+}
+
+/// remove everything under path (without following symlinks) and
+/// recreate it empty
+static int reset_dir(const string &path)
+{
+  if (::nftw(path.c_str(), rm_entry, 16, FTW_DEPTH | FTW_PHYS) < 0 &&
+      errno != ENOENT)
+    return -errno;
+  if (::mkdir(path.c_str(), 0755) < 0)
+    return -errno;
+  return 0;
+}
+
+static int run(const BenchConfig &cfg, int op_threads, Result *result)
+{
+  // read by the FileStore constructor
+  g_conf->set_val("filestore_op_threads", stringify(op_threads));
+  g_conf->apply_changes(NULL);
+
+  int r = reset_dir(g_conf->osd_data);
+  if (r < 0) {
+    derr << "failed to reset data directory " << g_conf->osd_data << ": "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  std::unique_ptr<ObjectStore> os(
+    ObjectStore::create(g_ceph_context, "filestore", g_conf->osd_data,
+			g_conf->osd_journal));
+  if (!os) {
+    derr << "filestore is not available" << dendl;
+    return -EINVAL;
+  }
+  if (os->mkfs() < 0 || os->mount() < 0) {
+    derr << "mkfs/mount failed" << dendl;
+    return -EIO;
+  }
+
+  vector<PG> pgs(cfg.pgs);
+  {
+    ObjectStore::Sequencer osr(__func__);
+    bufferlist bl;
+    bl.append(buffer::create(cfg.block_size));
+    bl.zero();
+    for (int i = 0; i < cfg.pgs; ++i) {
+      spg_t pgid(pg_t(i, 0), shard_id_t::NO_SHARD);
+      PG &pg = pgs[i];
+      pg.cid = coll_t(pgid);
+      pg.osr.reset(new ObjectStore::Sequencer("opwqbench." + stringify(i)));
+      ObjectStore::Transaction t;
+      t.create_collection(pg.cid, 0);
+      for (int j = 0; j < cfg.objects; ++j) {
+	pg.oids.push_back(ghobject_t(pgid.make_temp_object(
+	  "opwqbench-" + stringify(j))));
+	t.write(pg.cid, pg.oids.back(), 0, cfg.block_size, bl);
+      }
+      r = os->apply_transaction(&osr, std::move(t));
+      assert(r == 0);
+    }
+  }
+
+  Result start;
+  read_counters(&start);
+
+  std::vector<std::thread> workers;
+  using namespace std::chrono;
+  auto t1 = high_resolution_clock::now();
+  for (int i = 0; i < cfg.threads; ++i) {
+    workers.emplace_back(worker, os.get(), std::ref(cfg), &pgs, i,
+			 cfg.threads, cfg.ops / cfg.threads, i + 1);
+  }
+  for (auto &w : workers)
+    w.join();
+  auto t2 = high_resolution_clock::now();
+  result->usec = duration_cast<microseconds>(t2 - t1).count();
+
+  read_counters(result);
+  result->applied -= start.applied;
+  result->apply_sum -= start.apply_sum;
+
+  for (auto &pg : pgs)
+    pg.osr->flush();
+  os->umount();
+  return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+  BenchConfig cfg;
+
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  global_init(nullptr, args, CEPH_ENTITY_TYPE_OSD, CODE_ENVIRONMENT_UTILITY, 0);
+
+  std::string val;
+  vector<const char*>::iterator i = args.begin();
+  while (i != args.end()) {
+    if (ceph_argparse_double_dash(args, i))
+      break;
+    if (ceph_argparse_witharg(args, i, &val, "--pgs", (char*)nullptr)) {
+      cfg.pgs = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)nullptr)) {
+      cfg.objects = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--block-size", (char*)nullptr)) {
+      cfg.block_size = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)nullptr)) {
+      cfg.ops = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)nullptr)) {
+      cfg.threads = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--queue-depth", (char*)nullptr)) {
+      cfg.queue_depth = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--op-threads", (char*)nullptr)) {
+      list<string> ls;
+      get_str_list(val, ",", ls);
+      cfg.op_threads.clear();
+      for (auto &s : ls)
+	cfg.op_threads.push_back(atoi(s.c_str()));
+    } else {
+      derr << "Error: can't understand argument: " << *i << "\n" << dendl;
+      usage();
+      return 1;
+    }
+  }
+  if (cfg.pgs <= 0 || cfg.objects <= 0 || cfg.threads <= 0 ||
+      cfg.threads > cfg.pgs || cfg.queue_depth <= 0 ||
+      cfg.block_size == 0 || cfg.op_threads.empty()) {
+    usage();
+    return 1;
+  }
+  for (auto n : cfg.op_threads) {
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+  }
+
+  common_init_finish(g_ceph_context);
+
+  vector<Result> results(cfg.op_threads.size());
+  for (unsigned n = 0; n < cfg.op_threads.size(); ++n) {
+    int r = run(cfg, cfg.op_threads[n], &results[n]);
+    if (r < 0)
+      return 1;
+  }
+
+  uint64_t ops = cfg.ops / cfg.threads * cfg.threads;
+  for (unsigned n = 0; n < cfg.op_threads.size(); ++n) {
+    const Result &res = results[n];
+    std::cout << "filestore_op_threads " << cfg.op_threads[n] << ": "
+	      << ops << " writes of " << cfg.block_size << " bytes over "
+	      << cfg.pgs << " pgs in " << res.usec << "us, "
+	      << (ops * 1000000ull / MAX(res.usec, 1ull)) << " tx/s; "
+	      << "avg apply latency "
+	      << (res.applied ? res.apply_sum * 1000000.0 / res.applied : 0)
+	      << "us" << std::endl;
+  }
+  return 0;
+}
@@ -19,6 +19,9 @@
 #include <sys/mount.h>
 #include "os/ObjectStore.h"
 #include "os/filestore/FileStore.h"
+#if defined(HAVE_LIBAIO)
+#include "os/bluestore/BlueStore.h"
+#endif
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
@@ -26,6 +29,8 @@
 #include "common/Cond.h"
 #include "common/errno.h"
 #include "include/stringify.h"
+#include "common/ceph_json.h"
+#include "common/perf_counters.h"
 #include <boost/scoped_ptr.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -116,6 +121,179 @@ TEST_P(StoreTest, TrivialRemount) {
   ASSERT_EQ(0, r);
 }
 
+TEST_P(StoreTest, Fsck) {
+  if (GetParam() != string("bluestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  for (int pg = 0; pg < 8; ++pg) {
+    coll_t cid(spg_t(pg_t(pg, 1), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 3);
+    for (int i = 0; i < 10; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP), "", pg, 1, ""));
+      bufferlist bl;
+      bl.append(string(4096 * (i + 1), 'a' + i));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      map<string,bufferlist> omap;
+      omap["key"] = bl;
+      t.omap_setkeys(cid, hoid, omap);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->fsck(true));
+  r = store->mount();
+  ASSERT_EQ(0, r);
+}
+
+#if defined(HAVE_LIBAIO)
+TEST_P(StoreTest, FsckErrors) {
+  if (GetParam() != string("bluestore"))
+    return;
+  BlueStore *bstore = static_cast<BlueStore*>(store.get());
+  ObjectStore::Sequencer osr("test");
+  const uint64_t len = g_conf->bluestore_min_alloc_size * 2;
+  coll_t cid;
+  vector<ghobject_t> oids;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (int i = 0; i < 4; ++i) {
+      oids.push_back(ghobject_t(hobject_t(sobject_t(
+	"Object " + stringify(i), CEPH_NOSNAP))));
+      bufferlist bl;
+      bl.append(string(len, 'a' + i));
+      t.write(cid, oids.back(), 0, bl.length(), bl);
+    }
+    ASSERT_EQ(0, store->apply_transaction(&osr, std::move(t)));
+  }
+  store->umount();
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->fsck(true));
+
+  // blocks that are neither free nor used by anything
+  ASSERT_EQ(0, store->mount());
+  bstore->inject_leaked(len);
+  store->umount();
+  ASSERT_EQ(1, store->fsck(false));
+  ASSERT_EQ(1, store->fsck(true));
+
+  // two objects using the same blocks; errors add up
+  ASSERT_EQ(0, store->mount());
+  bstore->inject_misreference(cid, oids[0], oids[1]);
+  store->umount();
+  ASSERT_EQ(2, store->fsck(false));
+  ASSERT_EQ(2, store->fsck(true));
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, FsckSharedClone) {
+  if (GetParam() != string("bluestore"))
+    return;
+  g_ceph_context->_conf->set_val("bluestore_clone_cow", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+  BlueStore *bstore = static_cast<BlueStore*>(store.get());
+  ObjectStore::Sequencer osr("test");
+  const uint64_t len = g_conf->bluestore_min_alloc_size * 4;
+  coll_t cid;
+  ghobject_t head(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t snap1(hobject_t(sobject_t("Object 1", 1)));
+  ghobject_t snap2(hobject_t(sobject_t("Object 1", 2)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    bufferlist bl;
+    bl.append(string(len, 'a'));
+    t.write(cid, head, 0, bl.length(), bl);
+    t.clone(cid, head, snap1);
+    ASSERT_EQ(0, store->apply_transaction(&osr, std::move(t)));
+  }
+  {
+    // part of head stops being shared, the rest is now shared three ways
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(g_conf->bluestore_min_alloc_size, 'b'));
+    t.write(cid, head, 0, bl.length(), bl);
+    t.clone(cid, head, snap2);
+    ASSERT_EQ(0, store->apply_transaction(&osr, std::move(t)));
+  }
+  // extents shared by the clones are counted once, not as
+  // double allocations
+  store->umount();
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->fsck(true));
+
+  // a reference count that does not match the clones sharing the
+  // extent
+  ASSERT_EQ(0, store->mount());
+  bstore->inject_shared_ref(cid, snap1);
+  store->umount();
+  ASSERT_EQ(1, store->fsck(false));
+  ASSERT_EQ(1, store->fsck(true));
+  ASSERT_EQ(0, store->mount());
+}
+#endif
+
+TEST_P(StoreTest, FsckSyncSubmitWal) {
+  if (GetParam() != string("bluestore"))
+    return;
+  // with sync submit the txcs' freelist updates reach the kv store as
+  // they are queued; the post-wal releases must not be reordered past them
+  g_ceph_context->_conf->set_val("bluestore_sync_submit_transaction", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (int i = 0; i < 8; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      bufferlist bl;
+      bl.append(string(65536, 'a' + i));
+      t.write(cid, hoid, 0, bl.length(), bl);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // small overwrites of allocated blocks go through the wal
+  for (int round = 0; round < 16; ++round) {
+    for (int i = 0; i < 8; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      ObjectStore::Transaction t;
+      bufferlist bl;
+      bl.append(string(4096, 'A' + round));
+      t.write(cid, hoid, 4096 * ((round * 3 + i) % 16), bl.length(), bl);
+      r = store->apply_transaction(&osr, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  store->umount();
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->fsck(true));
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    ObjectStore::Transaction t;
+    for (int i = 0; i < 8; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("bluestore_sync_submit_transaction", "false");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST_P(StoreTest, SimpleRemount) {
   ObjectStore::Sequencer osr("test");
   coll_t cid;
@@ -655,6 +833,86 @@ TEST_P(StoreTest, SmallSequentialUnaligned) {
   }
 }
 
+TEST_P(StoreTest, RereadAfterOverwrite) {
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t a(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    cerr << "Creating collection " << cid << std::endl;
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist bl;
+    bufferptr bp(65536);
+    memset(bp.c_str(), 1, 65536);
+    bl.append(bp);
+    ObjectStore::Transaction t;
+    t.write(cid, a, 0, 65536, bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // read repeatedly, and in pieces, so that stores with a cache hit it
+  for (int i = 0; i < 2; ++i) {
+    bufferlist bl;
+    ASSERT_EQ(65536, store->read(cid, a, 0, 65536, bl));
+    for (unsigned j=0; j<65536; ++j)
+      ASSERT_EQ(1, bl[j]);
+    bufferlist part;
+    ASSERT_EQ(4096, store->read(cid, a, 8192, 4096, part));
+    for (unsigned j=0; j<4096; ++j)
+      ASSERT_EQ(1, part[j]);
+  }
+  {
+    bufferlist bl;
+    bufferptr bp(4096);
+    memset(bp.c_str(), 2, 4096);
+    bl.append(bp);
+    ObjectStore::Transaction t;
+    t.write(cid, a, 8192, 4096, bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist bl;
+    ASSERT_EQ(65536, store->read(cid, a, 0, 65536, bl));
+    for (unsigned j=0; j<65536; ++j)
+      ASSERT_EQ(j >= 8192 && j < 12288 ? 2 : 1, bl[j]);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, a, 4096);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist bl;
+    ASSERT_EQ(4096, store->read(cid, a, 0, 65536, bl));
+    bufferlist part;
+    ASSERT_EQ(0, store->read(cid, a, 8192, 4096, part));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist bl;
+    ASSERT_EQ(-ENOENT, store->read(cid, a, 0, 4096, bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    cerr << "Cleaning" << std::endl;
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, ManyBigWrite) {
   ObjectStore::Sequencer osr("test");
   int r;
@@ -1451,6 +1709,276 @@ TEST_P(StoreTest, SimpleCloneRangeTest) {
 }
 
 
+static uint64_t get_kstore_counter(const string& name)
+{
+  JSONFormatter f;
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(
+    &f, false, "KStore", name);
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser p;
+  if (!p.parse(s.c_str(), s.length()))
+    return 0;
+  JSONObj *logger = p.find_obj("KStore");
+  JSONObj *o = logger ? logger->find_obj(name) : nullptr;
+  if (!o)
+    return 0;
+  return strtoull(o->get_data().c_str(), NULL, 10);
+}
+
+TEST_P(StoreTest, KStoreStripeTest) {
+  if (string(GetParam()) != "kstore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    pool_opts_t opts;
+    opts.set(pool_opts_t::KSTORE_STRIPE_SIZE, 3000);
+    ASSERT_EQ(-EINVAL, store->set_collection_opts(cid, opts));
+    opts.set(pool_opts_t::KSTORE_STRIPE_SIZE, 8 << 20);
+    ASSERT_EQ(-EINVAL, store->set_collection_opts(cid, opts));
+    opts.set(pool_opts_t::KSTORE_STRIPE_SIZE, -4096);
+    ASSERT_EQ(-EINVAL, store->set_collection_opts(cid, opts));
+    opts.set(pool_opts_t::KSTORE_STRIPE_SIZE, 4096);
+    ASSERT_EQ(0, store->set_collection_opts(cid, opts));
+  }
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  bufferlist expected;
+  {
+    for (unsigned i = 0; i < 3 * 4096 / 16; ++i) {
+      char buf[17];
+      snprintf(buf, sizeof(buf), "%015u\n", i);
+      expected.append(buf, 16);
+    }
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, expected.length(), expected);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // a repeated read is served from the stripe cache
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+    uint64_t hits = get_kstore_counter("stripe_cache_hit");
+    in.clear();
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+    ASSERT_LT(hits, get_kstore_counter("stripe_cache_hit"));
+  }
+  {
+    // partial stripe overwrites, one spanning a stripe boundary
+    bufferlist a, b;
+    a.append(string(100, 'a'));
+    b.append(string(300, 'b'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 10, a.length(), a);
+    t.write(cid, hoid, 4096 - 100, b.length(), b);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist exp;
+    exp.substr_of(expected, 0, 10);
+    exp.append(a);
+    bufferlist t1, t2;
+    t1.substr_of(expected, 110, 4096 - 100 - 110);
+    exp.append(t1);
+    exp.append(b);
+    t2.substr_of(expected, 4096 + 200, expected.length() - 4096 - 200);
+    exp.append(t2);
+    expected = exp;
+
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    // truncating mid-stripe and extending again reads back zeros
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 5000);
+    t.truncate(cid, hoid, expected.length());
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist exp;
+    exp.substr_of(expected, 0, 5000);
+    exp.append_zero(expected.length() - 5000);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, exp.length(), in);
+    ASSERT_EQ((int)exp.length(), r);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    // cached stripes must not outlive the object
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.touch(cid, hoid);
+    t.truncate(cid, hoid, expected.length());
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    bufferlist exp;
+    exp.append_zero(expected.length());
+    bufferlist in;
+    r = store->read(cid, hoid, 0, exp.length(), in);
+    ASSERT_EQ((int)exp.length(), r);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, CompressionTest) {
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    cerr << "Creating collection " << cid << std::endl;
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  pool_opts_t opts;
+  opts.set(pool_opts_t::COMPRESSION_MODE, string("aggressive"));
+  r = store->set_collection_opts(cid, opts);
+  if (r == -EOPNOTSUPP) {
+    cout << "SKIP: " << GetParam() << " does not support compression"
+	 << std::endl;
+  } else {
+    ASSERT_EQ(r, 0);
+  }
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  hoid.hobj.pool = -1;
+
+  // compressible, but not all the same
+  bufferlist data;
+  for (unsigned i = 0; i < 1024 * 1024 / 16; ++i) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%015u\n", i / 64);
+    data.append(buf, 16);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 1000, data.length(), data);
+    cerr << "write " << data.length() << " bytes at 1000" << std::endl;
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist expected;
+  expected.append_zero(1000);
+  expected.append(data);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    // partial overwrite of a compressed unit
+    bufferlist small;
+    small.append("overwrite");
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 300000, small.length(), small);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    bufferlist e;
+    e.substr_of(expected, 0, 300000);
+    e.append(small);
+    bufferlist rest;
+    rest.substr_of(expected, 300000 + small.length(),
+		   expected.length() - 300000 - small.length());
+    e.append(rest);
+    expected.swap(e);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    // zero part of a compressed unit
+    ObjectStore::Transaction t;
+    t.zero(cid, hoid, 500000, 1000);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    bufferlist e;
+    e.substr_of(expected, 0, 500000);
+    e.append_zero(1000);
+    bufferlist rest;
+    rest.substr_of(expected, 501000, expected.length() - 501000);
+    e.append(rest);
+    expected.swap(e);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    // write + truncate into a compressed unit in a single transaction,
+    // and clone what is left
+    ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+    hoid2.hobj.pool = -1;
+    ObjectStore::Transaction t;
+    t.write(cid, hoid2, 0, data.length(), data);
+    t.truncate(cid, hoid2, 100000);
+    t.truncate(cid, hoid, 700000);
+    t.clone(cid, hoid, hoid2);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    bufferlist e;
+    e.substr_of(expected, 0, 700000);
+    expected.swap(e);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, 1024 * 1024, in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+    in.clear();
+    r = store->read(cid, hoid2, 0, 1024 * 1024, in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+
+    ObjectStore::Transaction t2;
+    t2.remove(cid, hoid2);
+    r = store->apply_transaction(&osr, std::move(t2));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // compressed data survives a remount
+    store->umount();
+    r = store->mount();
+    ASSERT_EQ(0, r);
+    store->set_collection_opts(cid, opts);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    cerr << "Cleaning" << std::endl;
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, SimpleObjectLongnameTest) {
   ObjectStore::Sequencer osr("test");
   int r;
@@ -0,0 +1,94 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Exercise the bluestore Allocator implementations.
+ */
+
+#include "include/types.h"
+#include "os/bluestore/Allocator.h"
+#include "gtest/gtest.h"
+
+#include <memory>
+
+class AllocTest : public ::testing::TestWithParam<const char*> {
+public:
+  static const uint64_t block_size = 4096;
+  static const uint64_t dev_size = 1024 * 1024 * 1024;  // 1gb
+  std::unique_ptr<Allocator> alloc;
+
+  virtual void SetUp() {
+    alloc.reset(Allocator::create(GetParam(), dev_size, block_size));
+    ASSERT_TRUE(alloc);
+  }
+  virtual void TearDown() {
+    alloc->shutdown();
+  }
+};
+
+TEST_P(AllocTest, AllocRelease)
+{
+  alloc->init_add_free(0, dev_size);
+  alloc->init_rm_free(0, 1024 * 1024);
+  ASSERT_EQ(dev_size - 1024 * 1024, alloc->get_free());
+
+  ASSERT_EQ(0, alloc->reserve(65536));
+  uint64_t offset;
+  uint32_t length;
+  ASSERT_EQ(0, alloc->allocate(65536, 65536, 0, &offset, &length));
+  ASSERT_EQ(65536u, length);
+  ASSERT_EQ(0u, offset % 65536);
+  ASSERT_GE(offset, 1024u * 1024u);
+  ASSERT_EQ(dev_size - 1024 * 1024 - 65536, alloc->get_free());
+
+  // released space is not reusable until the commit completes
+  alloc->release(offset, length);
+  ASSERT_EQ(dev_size - 1024 * 1024 - 65536, alloc->get_free());
+  alloc->commit_start();
+  alloc->commit_finish();
+  ASSERT_EQ(dev_size - 1024 * 1024, alloc->get_free());
+
+  ASSERT_EQ(-ENOSPC, alloc->reserve(dev_size));
+}
+
+TEST_P(AllocTest, Fragmented)
+{
+  // free every other 64k chunk of the first 64mb
+  for (uint64_t off = 0; off < 64 * 1024 * 1024; off += 131072)
+    alloc->init_add_free(off, 65536);
+  ASSERT_EQ(32u * 1024 * 1024, alloc->get_free());
+
+  // a large request comes back in alloc_unit pieces
+  ASSERT_EQ(0, alloc->reserve(1024 * 1024));
+  uint64_t left = 1024 * 1024;
+  while (left) {
+    uint64_t offset;
+    uint32_t length;
+    ASSERT_EQ(0, alloc->allocate(left, 65536, 0, &offset, &length));
+    ASSERT_EQ(65536u, length);
+    ASSERT_EQ(0u, offset % 131072);
+    left -= length;
+  }
+  ASSERT_EQ(31u * 1024 * 1024, alloc->get_free());
+}
+
+TEST_P(AllocTest, Exhaust)
+{
+  alloc->init_add_free(0, 16 * 1024 * 1024);
+  ASSERT_EQ(0, alloc->reserve(16 * 1024 * 1024));
+  uint64_t total = 0;
+  while (total < 16 * 1024 * 1024) {
+    uint64_t offset;
+    uint32_t length;
+    ASSERT_EQ(0, alloc->allocate(4096, 4096, 0, &offset, &length));
+    ASSERT_EQ(4096u, length);
+    ASSERT_LT(offset, 16u * 1024 * 1024);
+    total += length;
+  }
+  ASSERT_EQ(0u, alloc->get_free());
+  ASSERT_EQ(-ENOSPC, alloc->reserve(4096));
+}
+
+INSTANTIATE_TEST_CASE_P(
+  Allocator,
+  AllocTest,
+  ::testing::Values("stupid", "bitmap"));
@@ -7,6 +7,8 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <atomic>
+#include <thread>
 #include "global/global_init.h"
 #include "common/ceph_argparse.h"
 #include "include/stringify.h"
@@ -131,6 +133,150 @@ TEST(BlueFS, small_appends) {
   rm_temp_bdev(fn);
 }
 
+TEST(BlueFS, wal_preextend) {
+  uint64_t size = 1048476 * 128;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val("bluefs_preextend_wal_size", "4194304");
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(0, fn));
+  fs.add_block_extent(0, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+  string data;
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "000001.log", &h, false));
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(4194304u, fsize);
+    for (unsigned i = 0; i < 100; ++i) {
+      bufferlist bl;
+      bl.append("fddjdjdjdjdjdjdjdjdjdjjddjoo");
+      data.append(bl.c_str(), bl.length());
+      h->append(bl);
+      fs.fsync(h);
+    }
+    fs.close_writer(h);
+    ASSERT_EQ(0, fs.stat("dir", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(4194304u, fsize);
+  }
+  {
+    // compact the log on every metadata sync, and keep syncing while new
+    // wal files are zeroed: each must end up linked exactly once
+    g_ceph_context->_conf->set_val("bluefs_log_compact_min_size", "0");
+    g_ceph_context->_conf->set_val("bluefs_log_compact_min_ratio", "0");
+    std::atomic<bool> stop(false);
+    std::thread syncer([&fs, &stop]() {
+      unsigned n = 0;
+      while (!stop) {
+	// dirty the log so sync_metadata has something to commit
+	BlueFS::FileWriter *h;
+	ASSERT_EQ(0, fs.open_for_write("dir", "sync." + stringify(n++ % 4),
+				       &h, false));
+	fs.close_writer(h);
+	fs.sync_metadata();
+      }
+    });
+    for (unsigned i = 0; i < 8; ++i) {
+      BlueFS::FileWriter *h;
+      ASSERT_EQ(0, fs.open_for_write("dir", stringify(i + 10) + ".log", &h,
+				     false));
+      fs.close_writer(h);
+    }
+    stop = true;
+    syncer.join();
+    fs.sync_metadata();
+    g_ceph_context->_conf->set_val("bluefs_log_compact_min_size", "16777216");
+    g_ceph_context->_conf->set_val("bluefs_log_compact_min_ratio", "5");
+  }
+  fs.umount();
+  ASSERT_EQ(0, fs.mount());
+  for (unsigned i = 0; i < 8; ++i) {
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", stringify(i + 10) + ".log", &fsize, &mtime));
+    ASSERT_EQ(4194304u, fsize);
+  }
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "000001.log", &h));
+    bufferlist bl;
+    BlueFS::FileReaderBuffer buf(4096);
+    ASSERT_EQ((int)data.length() + 10,
+	      fs.read(h, &buf, 0, data.length() + 10, &bl, NULL));
+    ASSERT_EQ(0, memcmp(bl.c_str(), data.c_str(), data.length()));
+    ASSERT_EQ(string(10, 0), string(bl.c_str() + data.length(), 10));
+    delete h;
+  }
+  fs.umount();
+  g_ceph_context->_conf->set_val("bluefs_preextend_wal_size", "67108864");
+  rm_temp_bdev(fn);
+}
+
+TEST(BlueFS, wal_preextend_concurrent_fsync) {
+  uint64_t size = 1048476 * 128;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val("bluefs_preextend_wal_size", "4194304");
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(0, fn));
+  fs.add_block_extent(0, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+  // wal files are zeroed without the bluefs lock held; writers to other
+  // files keep going meanwhile
+  std::thread opener([&fs]() {
+    for (unsigned i = 0; i < 8; ++i) {
+      char name[32];
+      snprintf(name, sizeof(name), "%06u.log", i + 10);
+      BlueFS::FileWriter *h;
+      ASSERT_EQ(0, fs.open_for_write("dir", name, &h, false));
+      fs.close_writer(h);
+    }
+  });
+  string data;
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "other", &h, false));
+    for (unsigned i = 0; i < 200; ++i) {
+      bufferlist bl;
+      bl.append("fddjdjdjdjdjdjdjdjdjdjjddjoo");
+      data.append(bl.c_str(), bl.length());
+      h->append(bl);
+      fs.fsync(h);
+    }
+    fs.close_writer(h);
+  }
+  opener.join();
+  for (unsigned i = 0; i < 8; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "%06u.log", i + 10);
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", name, &fsize, &mtime));
+    ASSERT_EQ(4194304u, fsize);
+  }
+  fs.umount();
+  ASSERT_EQ(0, fs.mount());
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "other", &h));
+    bufferlist bl;
+    BlueFS::FileReaderBuffer buf(4096);
+    ASSERT_EQ((int)data.length(),
+	      fs.read(h, &buf, 0, data.length(), &bl, NULL));
+    ASSERT_EQ(0, memcmp(bl.c_str(), data.c_str(), data.length()));
+    delete h;
+  }
+  fs.umount();
+  g_ceph_context->_conf->set_val("bluefs_preextend_wal_size", "67108864");
+  rm_temp_bdev(fn);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -155,3 +155,116 @@ TEST(bluestore_extent_ref_map_t, contains)
   ASSERT_FALSE(m.contains(40, 3000));
   ASSERT_FALSE(m.contains(4000, 30));
 }
+
+TEST(bluestore_extent_t, csum)
+{
+  bluestore_extent_t e(0, 16384);
+  e.init_csum(bluestore_extent_t::CSUM_CRC32C, 12);
+  ASSERT_EQ(4u, e.csum_data.size());
+  ASSERT_EQ(4096u, e.get_csum_chunk_size());
+
+  bufferlist bl;
+  bl.append(string(8192, 'a'));
+  e.calc_csum(4096, bl);
+  ASSERT_EQ(0u, e.csum_data[0]);
+  ASSERT_NE(0u, e.csum_data[1]);
+  ASSERT_NE(0u, e.csum_data[2]);
+  ASSERT_EQ(0u, e.csum_data[3]);
+
+  uint64_t bad = 0;
+  ASSERT_EQ(0, e.verify_csum(4096, bl, &bad));
+  bufferlist corrupt;
+  corrupt.append(string(4096, 'a'));
+  corrupt.append(string(4095, 'a'));
+  corrupt.append("b");
+  ASSERT_EQ(-EIO, e.verify_csum(4096, corrupt, &bad));
+  ASSERT_EQ(8192u, bad);
+
+  // unknown chunks are not verified
+  bufferlist whole;
+  whole.append(string(4096, 'x'));
+  whole.append(bl);
+  whole.append(string(4096, 'y'));
+  ASSERT_EQ(0, e.verify_csum(0, whole, &bad));
+
+  // a partial overwrite forgets the chunks it touches
+  bufferlist small;
+  small.append("foo");
+  e.calc_csum(8192 + 10, small);
+  ASSERT_NE(0u, e.csum_data[1]);
+  ASSERT_EQ(0u, e.csum_data[2]);
+
+  e.calc_csum_zero(12288, 4096);
+  bufferlist zeros;
+  zeros.append_zero(4096);
+  ASSERT_EQ(0, e.verify_csum(12288, zeros, &bad));
+  ASSERT_EQ(-EIO, e.verify_csum(12288, whole, &bad));
+}
+
+TEST(bluestore_extent_t, csum_split)
+{
+  bluestore_extent_t e(0, 16384);
+  e.init_csum(bluestore_extent_t::CSUM_CRC32C, 12);
+  for (unsigned i = 0; i < 4; ++i)
+    e.csum_data[i] = i + 1;
+  bluestore_extent_t r(8192, 8192);
+  e.split_csum(8192, &r);
+  ASSERT_TRUE(r.has_csum());
+  ASSERT_EQ(2u, r.csum_data.size());
+  ASSERT_EQ(3u, r.csum_data[0]);
+  ASSERT_EQ(4u, r.csum_data[1]);
+  e.length = 8192;
+  ASSERT_EQ(2u, e.get_csum_count());
+
+  bluestore_extent_t u(1000, 1000);
+  e.split_csum(1000, &u);
+  ASSERT_FALSE(u.has_csum());
+}
+
+TEST(bluestore_onode_t, csum_encode)
+{
+  bluestore_onode_t o;
+  o.block_map[0] = bluestore_extent_t(65536, 16384);
+  o.block_map[0].init_csum(bluestore_extent_t::CSUM_CRC32C, 12);
+  o.block_map[0].csum_data[2] = 77;
+  o.block_map[16384] = bluestore_extent_t(131072, 4096);
+  bufferlist bl;
+  ::encode(o, bl);
+  bluestore_onode_t d;
+  bufferlist::iterator p = bl.begin();
+  ::decode(d, p);
+  ASSERT_EQ(2u, d.block_map.size());
+  ASSERT_TRUE(d.block_map[0].has_csum());
+  ASSERT_EQ(4u, d.block_map[0].csum_data.size());
+  ASSERT_EQ(77u, d.block_map[0].csum_data[2]);
+  ASSERT_FALSE(d.block_map[16384].has_csum());
+}
+
+TEST(bluestore_onode_t, compressed_encode)
+{
+  bluestore_onode_t o;
+  o.block_map[0] = bluestore_extent_t(
+    65536, 65536, bluestore_extent_t::FLAG_COMPRESSED);
+  o.block_map[0].comp_alg = bluestore_extent_t::COMP_ALG_ZLIB;
+  o.block_map[0].comp_length = 5000;
+  o.block_map[0].disk_length = 8192;
+  o.block_map[0].init_csum(bluestore_extent_t::CSUM_CRC32C, 12);
+  o.block_map[65536] = bluestore_extent_t(262144, 65536);
+  ASSERT_EQ(65536u + 8192u, o.block_map[0].end());
+  ASSERT_EQ(2u, o.block_map[0].csum_data.size());
+  bufferlist bl;
+  ::encode(o, bl);
+  bluestore_onode_t d;
+  bufferlist::iterator p = bl.begin();
+  ::decode(d, p);
+  ASSERT_EQ(2u, d.block_map.size());
+  ASSERT_TRUE(d.block_map[0].has_flag(bluestore_extent_t::FLAG_COMPRESSED));
+  ASSERT_EQ(bluestore_extent_t::COMP_ALG_ZLIB, d.block_map[0].comp_alg);
+  ASSERT_EQ(65536u, d.block_map[0].length);
+  ASSERT_EQ(5000u, d.block_map[0].comp_length);
+  ASSERT_EQ(8192u, d.block_map[0].get_disk_length());
+  ASSERT_EQ(2u, d.block_map[0].csum_data.size());
+  ASSERT_FALSE(d.block_map[65536].has_flag(
+		 bluestore_extent_t::FLAG_COMPRESSED));
+  ASSERT_EQ(65536u, d.block_map[65536].get_disk_length());
+}
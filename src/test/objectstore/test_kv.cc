@@ -17,6 +17,7 @@
 #include <iostream>
 #include <time.h>
 #include <sys/mount.h>
+#include <thread>
 #include "kv/KeyValueDB.h"
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
@@ -113,6 +114,270 @@ TEST_P(KVTest, PutReopen) {
   fini();
 }
 
+struct AppendMOP : public KeyValueDB::MergeOperator {
+  void merge_nonexistent(
+    const char *rdata, size_t rlen, std::string *new_value) {
+    *new_value = "?" + std::string(rdata, rlen);
+  }
+  void merge(
+    const char *ldata, size_t llen,
+    const char *rdata, size_t rlen,
+    std::string *new_value) {
+    *new_value = std::string(ldata, llen) + std::string(rdata, rlen);
+  }
+  string name() const {
+    return "Append";
+  }
+};
+
+TEST_P(KVTest, Merge) {
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  int r = db->set_merge_operator("A", p);
+  if (r < 0)
+    return; // No merge operators for this database type
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1, v2, v3;
+    v1.append(string("1"));
+    v2.append(string("2"));
+    v3.append(string("3"));
+    t->set("P", "K1", v1);
+    t->set("A", "A1", v2);
+    t->rmkey("A", "A2");
+    t->merge("A", "A2", v3);
+    db->submit_transaction_sync(t);
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1;
+    v1.append(string("1"));
+    t->merge("A", "A2", v1);
+    t->merge("A", "A1", v1);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A1", &v));
+    ASSERT_EQ("21", string(v.c_str(), v.length()));
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A2", &v));
+    ASSERT_EQ("?31", string(v.c_str(), v.length()));
+  }
+  fini();
+}
+
+TEST_P(KVTest, MultiGet) {
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 10; i += 2) {
+      bufferlist v;
+      v.append("value" + stringify(i));
+      t->set("prefix", "key" + stringify(i), v);
+    }
+    bufferlist v;
+    v.append("other");
+    t->set("other", "key1", v);
+    db->submit_transaction_sync(t);
+  }
+  {
+    vector<string> keys;
+    for (int i = 0; i < 10; ++i)
+      keys.push_back("key" + stringify(i));
+    map<string,bufferlist> out;
+    ASSERT_EQ(0, db->multi_get("prefix", keys, &out));
+    ASSERT_EQ(5u, out.size());
+    for (int i = 0; i < 10; ++i) {
+      auto p = out.find("key" + stringify(i));
+      if (i % 2) {
+	ASSERT_TRUE(p == out.end());
+      } else {
+	ASSERT_TRUE(p != out.end());
+	ASSERT_EQ("value" + stringify(i),
+		  string(p->second.c_str(), p->second.length()));
+      }
+    }
+  }
+  fini();
+}
+
+TEST_P(KVTest, MergeRmkeysByPrefix) {
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  int r = db->set_merge_operator("A", p);
+  if (r < 0)
+    return; // No merge operators for this database type
+  ASSERT_EQ(0, db->create_and_open(cout));
+  bufferlist v1, v2;
+  v1.append(string("1"));
+  v2.append(string("2"));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->merge("A", "A1", v1);
+    t->merge("A", "A1", v2);
+    t->merge("A", "A2", v1);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A1", &v));
+    ASSERT_EQ("?12", string(v.c_str(), v.length()));
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("A");
+    t->merge("A", "A2", v2);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(-ENOENT, db->get("A", "A1", &v));
+    ASSERT_EQ(0, db->get("A", "A2", &v));
+    ASSERT_EQ("?2", string(v.c_str(), v.length()));
+  }
+  fini();
+}
+
+TEST_P(KVTest, MergeConcurrentSet) {
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  int r = db->set_merge_operator("A", p);
+  if (r < 0)
+    return; // No merge operators for this database type
+  ASSERT_EQ(0, db->create_and_open(cout));
+  const int n = 1000;
+  // a set racing with merges must never be lost, so the value always
+  // starts with the last one set
+  std::thread merger([&] {
+      bufferlist v;
+      v.append("m");
+      for (int i = 0; i < n; ++i) {
+	KeyValueDB::Transaction t = db->get_transaction();
+	t->merge("A", "K", v);
+	db->submit_transaction(t);
+      }
+    });
+  for (int i = 0; i < n; ++i) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v;
+    v.append("s" + stringify(i) + ":");
+    t->set("A", "K", v);
+    db->submit_transaction(t);
+  }
+  merger.join();
+  bufferlist v;
+  ASSERT_EQ(0, db->get("A", "K", &v));
+  string last = "s" + stringify(n - 1) + ":";
+  ASSERT_EQ(last, string(v.c_str(), v.length()).substr(0, last.size()));
+  fini();
+}
+
+TEST_P(KVTest, ColumnFamilies) {
+  // start from an empty db so the column families get created
+  fini();
+  ASSERT_EQ(0, ::system("rm -rf kv_test_cf_dir"));
+  db.reset(KeyValueDB::create(g_ceph_context, string(GetParam()),
+			      string("kv_test_cf_dir")));
+  int r = db->set_column_family("B", "bloom_bits=10,write_buffer_size=1048576");
+  if (r < 0)
+    return; // No column families for this database type
+  ASSERT_EQ(0, db->set_column_family("D", ""));
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  ASSERT_EQ(0, db->set_merge_operator("D", p));
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    const char *prefixes[] = { "A", "B", "C", "D" };
+    for (auto prefix : prefixes) {
+      for (int i = 0; i < 3; ++i) {
+	bufferlist v;
+	v.append(string(prefix) + stringify(i));
+	t->set(prefix, "k" + stringify(i), v);
+      }
+    }
+    bufferlist v;
+    v.append("x");
+    t->merge("D", "k1", v);
+    t->rmkey("B", "k1");
+    db->submit_transaction_sync(t);
+  }
+  {
+    // the whole keyspace, in order, in both directions
+    string expected = "A0 A1 A2 B0 B2 C0 C1 C2 D0 D1x D2 ";
+    string out;
+    KeyValueDB::WholeSpaceIterator it = db->get_iterator();
+    for (it->seek_to_first(); it->valid(); it->next()) {
+      bufferlist v = it->value();
+      out += string(v.c_str(), v.length()) + " ";
+    }
+    ASSERT_EQ(expected, out);
+    out.clear();
+    for (it->seek_to_last(); it->valid(); it->prev()) {
+      bufferlist v = it->value();
+      out = string(v.c_str(), v.length()) + " " + out;
+    }
+    ASSERT_EQ(expected, out);
+
+    // turn around at a column family boundary
+    it->lower_bound("C", "k0");
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ(make_pair(string("C"), string("k0")), it->raw_key());
+    it->prev();
+    ASSERT_EQ(make_pair(string("B"), string("k2")), it->raw_key());
+    it->next();
+    ASSERT_EQ(make_pair(string("C"), string("k0")), it->raw_key());
+    it->seek_to_last("B");
+    ASSERT_EQ(make_pair(string("B"), string("k2")), it->raw_key());
+  }
+  {
+    KeyValueDB::Iterator it = db->get_iterator("B");
+    it->seek_to_first();
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ("k0", it->key());
+    it->next();
+    ASSERT_EQ("k2", it->key());
+    it->next();
+    ASSERT_FALSE(it->valid());
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("D", "k1", &v));
+    ASSERT_EQ("D1x", string(v.c_str(), v.length()));
+    v.clear();
+    ASSERT_EQ(-ENOENT, db->get("B", "k1", &v));
+    vector<string> keys = { "k0", "k1", "k2" };
+    map<string,bufferlist> out;
+    ASSERT_EQ(0, db->multi_get("B", keys, &out));
+    ASSERT_EQ(2u, out.size());
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("B");
+    db->submit_transaction_sync(t);
+    KeyValueDB::Iterator it = db->get_iterator("B");
+    it->seek_to_first();
+    ASSERT_FALSE(it->valid());
+  }
+  db->compact();
+  fini();
+
+  // column families on disk are found without being configured
+  db.reset(KeyValueDB::create(g_ceph_context, string(GetParam()),
+			      string("kv_test_cf_dir")));
+  ASSERT_EQ(0, db->set_merge_operator("D", p));
+  ASSERT_EQ(0, db->open(cout));
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("D", "k1", &v));
+    ASSERT_EQ("D1x", string(v.c_str(), v.length()));
+    v.clear();
+    ASSERT_EQ(0, db->get("C", "k2", &v));
+    ASSERT_EQ("C2", string(v.c_str(), v.length()));
+  }
+  fini();
+}
+
 TEST_P(KVTest, BenchCommit) {
   int n = 1024;
   ASSERT_EQ(0, db->create_and_open(cout));
@@ -0,0 +1,142 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "os/ObjectReadahead.h"
+#include "global/global_context.h"
+#include "include/rados.h"
+#include "include/stringify.h"
+#include "common/config.h"
+#include <thread>
+#include <gtest/gtest.h>
+
+static ghobject_t make_oid(const string &name)
+{
+  return ghobject_t(hobject_t(sobject_t(name, CEPH_NOSNAP)));
+}
+
+TEST(ObjectReadahead, Sequential)
+{
+  g_conf->set_val("osd_objectstore_readahead_trigger_requests", "2");
+  g_conf->set_val("osd_objectstore_readahead_min_bytes", "0");
+  g_conf->set_val("osd_objectstore_readahead_max_bytes", "1048576");
+  g_conf->apply_changes(NULL);
+  ObjectReadahead ra(g_ceph_context);
+  ghobject_t oid = make_oid("seq");
+  const uint64_t size = 4 << 20;
+
+  // the first reads only establish the pattern
+  ASSERT_EQ(0u, ra.update(oid, 65536, 65536, size, 0).second);
+  ASSERT_EQ(0u, ra.update(oid, 131072, 65536, size, 0).second);
+  Readahead::extent_t e = ra.update(oid, 196608, 65536, size, 0);
+  ASSERT_EQ(262144u, e.first);
+  ASSERT_EQ(131072u, e.second);
+
+  // never past the end of the object
+  uint64_t off = 262144;
+  while (off < size) {
+    e = ra.update(oid, off, 65536, size, 0);
+    ASSERT_LE(e.first + e.second, size);
+    off += 65536;
+  }
+}
+
+TEST(ObjectReadahead, Hints)
+{
+  g_conf->set_val("osd_objectstore_readahead_trigger_requests", "10");
+  g_conf->set_val("osd_objectstore_readahead_min_bytes", "131072");
+  g_conf->apply_changes(NULL);
+  ObjectReadahead ra(g_ceph_context);
+  const uint64_t size = 4 << 20;
+
+  // declared sequential: prefetch right away
+  ghobject_t seq = make_oid("seq");
+  Readahead::extent_t e = ra.update(seq, 8192, 4096, size,
+				    CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL);
+  ASSERT_EQ(12288u, e.first);
+  ASSERT_EQ(131072u, e.second);
+
+  // declared random: never
+  ghobject_t rnd = make_oid("rnd");
+  for (uint64_t off = 0; off < size; off += 65536) {
+    ASSERT_EQ(0u, ra.update(rnd, off, 65536, size,
+			    CEPH_OSD_OP_FLAG_FADVISE_RANDOM).second);
+  }
+}
+
+TEST(ObjectReadahead, Bounded)
+{
+  // a single shard has a single LRU over every stream
+  g_conf->set_val("osd_objectstore_readahead_shards", "1");
+  g_conf->set_val("osd_objectstore_readahead_streams", "4");
+  g_conf->set_val("osd_objectstore_readahead_trigger_requests", "1");
+  g_conf->apply_changes(NULL);
+  ObjectReadahead ra(g_ceph_context);
+  const uint64_t size = 4 << 20;
+
+  ghobject_t first = make_oid("first");
+  ra.update(first, 0, 4096, size, 0);
+  for (int i = 0; i < 4; ++i)
+    ra.update(make_oid(stringify(i)), 0, 4096, size, 0);
+  // first was evicted, so this looks like a new stream's first read
+  ASSERT_EQ(0u, ra.update(first, 4096, 4096, size, 0).second);
+
+  g_conf->set_val("osd_objectstore_readahead_streams", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0u, ra.update(first, 8192, 4096, size, 0).second);
+}
+
+TEST(ObjectReadahead, Sharded)
+{
+  const unsigned num_shards = 4;
+  g_conf->set_val("osd_objectstore_readahead_shards", stringify(num_shards));
+  g_conf->set_val("osd_objectstore_readahead_streams", stringify(num_shards));
+  g_conf->set_val("osd_objectstore_readahead_trigger_requests", "1");
+  g_conf->set_val("osd_objectstore_readahead_min_bytes", "0");
+  g_conf->apply_changes(NULL);
+  ObjectReadahead ra(g_ceph_context);
+  const uint64_t size = 4 << 20;
+
+  // each shard only evicts its own streams
+  ghobject_t first = make_oid("first");
+  size_t first_shard = std::hash<ghobject_t>()(first) % num_shards;
+  ghobject_t same, other;
+  for (int i = 0; same == ghobject_t() || other == ghobject_t(); ++i) {
+    ghobject_t oid = make_oid(stringify(i));
+    if (std::hash<ghobject_t>()(oid) % num_shards == first_shard)
+      same = oid;
+    else
+      other = oid;
+  }
+  ra.update(first, 0, 4096, size, 0);
+  ra.update(other, 0, 4096, size, 0);
+  ASSERT_NE(0u, ra.update(first, 4096, 4096, size, 0).second);
+  ra.update(same, 0, 4096, size, 0);
+  ASSERT_EQ(0u, ra.update(first, 8192, 4096, size, 0).second);
+
+  // concurrent sequential readers each see their own pattern
+  g_conf->set_val("osd_objectstore_readahead_streams", "256");
+  g_conf->set_val("osd_objectstore_readahead_trigger_requests", "2");
+  g_conf->apply_changes(NULL);
+  std::vector<std::thread> readers;
+  std::vector<int> failed(16, 0);
+  for (unsigned t = 0; t < failed.size(); ++t) {
+    readers.emplace_back([&, t]() {
+      ghobject_t oid = make_oid("reader" + stringify(t));
+      if (ra.update(oid, 65536, 65536, size, 0).second ||
+	  ra.update(oid, 131072, 65536, size, 0).second)
+	++failed[t];
+      Readahead::extent_t e = ra.update(oid, 196608, 65536, size, 0);
+      if (e.first != 262144 || e.second != 131072)
+	++failed[t];
+      for (uint64_t off = 262144; off < size; off += 65536) {
+	e = ra.update(oid, off, 65536, size, 0);
+	if (e.second && (e.first < off + 65536 || e.first + e.second > size))
+	  ++failed[t];
+      }
+    });
+  }
+  for (auto &r : readers)
+    r.join();
+  for (unsigned t = 0; t < failed.size(); ++t)
+    ASSERT_EQ(0, failed[t]) << "reader " << t;
+}
@@ -13,6 +13,7 @@
  */
 
 #include "os/ObjectStore.h"
+#include "common/Clock.h"
 #include <gtest/gtest.h>
 
 TEST(Transaction, MoveConstruct)
@@ -73,3 +74,133 @@ TEST(Transaction, Swap)
   ASSERT_TRUE(a.empty());
   ASSERT_FALSE(b.empty());
 }
+
+TEST(Transaction, IndexReuse)
+{
+  coll_t c1(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD));
+  coll_t c2(spg_t(pg_t(2, 1), shard_id_t::NO_SHARD));
+  ghobject_t o1(hobject_t(sobject_t("one", CEPH_NOSNAP)));
+  ghobject_t o2(hobject_t(sobject_t("two", CEPH_NOSNAP)));
+
+  auto t = ObjectStore::Transaction{};
+  t.touch(c1, o1);
+  t.touch(c1, o1);
+  t.touch(c2, o2);
+  t.touch(c1, o2);
+  t.touch(c2, o1);
+
+  const coll_t cids[] = { c1, c1, c2, c1, c2 };
+  const ghobject_t oids[] = { o1, o1, o2, o2, o1 };
+  auto i = t.begin();
+  ASSERT_EQ(2u, i.colls.size());
+  ASSERT_EQ(2u, i.objects.size());
+  for (int n = 0; n < 5; ++n) {
+    ASSERT_TRUE(i.have_op());
+    auto op = i.decode_op();
+    ASSERT_EQ(cids[n], i.get_cid(op->cid));
+    ASSERT_EQ(oids[n], i.get_oid(op->oid));
+  }
+  ASSERT_FALSE(i.have_op());
+}
+
+TEST(Transaction, CopyThenAppend)
+{
+  coll_t c(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD));
+  ghobject_t o1(hobject_t(sobject_t("one", CEPH_NOSNAP)));
+  ghobject_t o2(hobject_t(sobject_t("two", CEPH_NOSNAP)));
+
+  auto a = ObjectStore::Transaction{};
+  a.reserve(8);
+  a.touch(c, o1);
+  auto b = a;
+  // both go on adding ops; neither may scribble on the other's
+  a.truncate(c, o1, 1);
+  b.remove(c, o2);
+
+  auto i = a.begin();
+  ASSERT_EQ((int)ObjectStore::Transaction::OP_TOUCH, (int)i.decode_op()->op);
+  auto op = i.decode_op();
+  ASSERT_EQ((int)ObjectStore::Transaction::OP_TRUNCATE, (int)op->op);
+  ASSERT_EQ(o1, i.get_oid(op->oid));
+
+  auto j = b.begin();
+  ASSERT_EQ((int)ObjectStore::Transaction::OP_TOUCH, (int)j.decode_op()->op);
+  op = j.decode_op();
+  ASSERT_EQ((int)ObjectStore::Transaction::OP_REMOVE, (int)op->op);
+  ASSERT_EQ(o2, j.get_oid(op->oid));
+}
+
+TEST(Transaction, EncodeDecode)
+{
+  coll_t c(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD));
+  ghobject_t o(hobject_t(sobject_t("obj", CEPH_NOSNAP)));
+  bufferlist data;
+  data.append(string(4096, 'x'));
+
+  auto t = ObjectStore::Transaction{};
+  t.reserve(40, 512);
+  for (int n = 0; n < 40; ++n)
+    t.write(c, o, n * 4096, 4096, data);
+
+  bufferlist bl;
+  ::encode(t, bl);
+  auto d = ObjectStore::Transaction{};
+  bufferlist::iterator p = bl.begin();
+  ::decode(d, p);
+  ASSERT_EQ(40, d.get_num_ops());
+  auto i = d.begin();
+  for (int n = 0; n < 40; ++n) {
+    auto op = i.decode_op();
+    ASSERT_EQ((int)ObjectStore::Transaction::OP_WRITE, (int)op->op);
+    ASSERT_EQ(n * 4096u, (uint64_t)op->off);
+    bufferlist got;
+    i.decode_bl(got);
+    ASSERT_TRUE(got.contents_equal(data));
+  }
+}
+
+// Build and encode the transaction a replicated 4k write produces: the
+// data write, object info and snapset attrs, and a pg log entry.
+static void build_4k_write(ObjectStore::Transaction &t, const coll_t &c,
+			   const ghobject_t &o, const ghobject_t &pgmeta,
+			   bufferlist &data, map<string,bufferlist> &attrs,
+			   map<string,bufferlist> &log)
+{
+  t.write(c, o, 0, data.length(), data);
+  t.setattrs(c, o, attrs);
+  t.omap_setkeys(c, pgmeta, log);
+}
+
+TEST(Transaction, BuildEncodeBench)
+{
+  coll_t c(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD));
+  ghobject_t o(hobject_t(sobject_t("rbd_data.1234.0000000000000001",
+				   CEPH_NOSNAP)));
+  ghobject_t pgmeta(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD).make_pgmeta_oid());
+  bufferlist data;
+  data.append(string(4096, 'x'));
+  map<string,bufferlist> attrs, log;
+  attrs["_"].append(string(250, 'o'));
+  attrs["snapset"].append(string(30, 's'));
+  log["0000000010.00000000000000012345"].append(string(180, 'l'));
+
+  const int count = 20000;
+  for (int reserve = 0; reserve < 2; ++reserve) {
+    utime_t start = ceph_clock_now(NULL);
+    uint64_t bytes = 0;
+    for (int n = 0; n < count; ++n) {
+      auto t = ObjectStore::Transaction{};
+      if (reserve)
+	t.reserve(3, 1024);
+      build_4k_write(t, c, o, pgmeta, data, attrs, log);
+      bufferlist bl;
+      ::encode(t, bl);
+      bytes += bl.length();
+    }
+    utime_t elapsed = ceph_clock_now(NULL) - start;
+    std::cout << (reserve ? "reserved" : "default ") << ": " << count
+	      << " transactions, " << bytes / count << " bytes each, "
+	      << (elapsed.to_nsec() / count) << " ns per build+encode"
+	      << std::endl;
+  }
+}
@@ -17,6 +17,11 @@
 #include <errno.h>
 #include <signal.h>
 #include "osd/ECBackend.h"
+#include "osd/OpRequest.h"
+#include "messages/MOSDECSubOpRead.h"
+#include "messages/MOSDECSubOpReadReply.h"
+#include "global/global_context.h"
+#include "test/erasure-code/ErasureCodeExample.h"
 #include "gtest/gtest.h"
 
 TEST(ECUtil, stripe_info_t)
@@ -58,3 +63,799 @@ TEST(ECUtil, stripe_info_t)
             make_pair((uint64_t)0, 2*swidth));
 }
 
+TEST(ECUtil, offset_len_to_chunk_shard)
+{
+  const uint64_t swidth = 4096;
+  ECUtil::stripe_info_t s(4, swidth);
+  const uint64_t csize = s.get_chunk_size();
+
+  // inside chunk 1 of the first stripe
+  ASSERT_EQ(s.offset_len_to_chunk_shard(make_pair(csize + 10, (uint64_t)20), 1),
+	    make_pair((uint64_t)10, (uint64_t)20));
+  ASSERT_EQ(s.offset_len_to_chunk_shard(make_pair(csize + 10, (uint64_t)20), 0),
+	    make_pair(csize, (uint64_t)0));
+  ASSERT_EQ(s.offset_len_to_chunk_shard(make_pair(csize + 10, (uint64_t)20), 2),
+	    make_pair((uint64_t)0, (uint64_t)0));
+
+  // from the end of chunk 3 of stripe 0 to the start of chunk 1 of stripe 2
+  pair<uint64_t, uint64_t> in(swidth - 10, swidth + csize + 30);
+  ASSERT_EQ(s.offset_len_to_chunk_shard(in, 3),
+	    make_pair(csize - 10, csize + 10));
+  ASSERT_EQ(s.offset_len_to_chunk_shard(in, 0),
+	    make_pair(csize, csize + csize));
+  ASSERT_EQ(s.offset_len_to_chunk_shard(in, 1),
+	    make_pair(csize, csize + 20));
+  ASSERT_EQ(s.offset_len_to_chunk_shard(in, 2),
+	    make_pair(csize, csize));
+}
+
+// logical contents of an object, i.e. byte i is i % 251
+static bufferlist make_logical(uint64_t len)
+{
+  bufferlist bl;
+  for (uint64_t i = 0; i < len; ++i)
+    bl.append((char)(i % 251));
+  return bl;
+}
+
+// the shard of data chunk chunk holding logical
+static bufferlist make_shard(
+  const ECUtil::stripe_info_t &sinfo,
+  const bufferlist &logical,
+  unsigned chunk)
+{
+  const uint64_t csize = sinfo.get_chunk_size();
+  bufferlist shard;
+  for (uint64_t off = 0; off < logical.length();
+       off += sinfo.get_stripe_width()) {
+    bufferlist bl;
+    bl.substr_of(logical, off + chunk * csize, csize);
+    shard.claim_append(bl);
+  }
+  return shard;
+}
+
+// what reading logical extent [off, off + len) from each data chunk
+// shard returns
+static map<int, bufferlist> read_subchunks(
+  const ECUtil::stripe_info_t &sinfo,
+  const bufferlist &logical,
+  uint64_t off,
+  uint64_t len)
+{
+  map<int, bufferlist> chunks;
+  const unsigned k = sinfo.get_stripe_width() / sinfo.get_chunk_size();
+  for (unsigned chunk = 0; chunk < k; ++chunk) {
+    pair<uint64_t, uint64_t> extent =
+      sinfo.offset_len_to_chunk_shard(make_pair(off, len), chunk);
+    bufferlist shard = make_shard(sinfo, logical, chunk);
+    if (extent.first >= shard.length())
+      continue;
+    chunks[chunk].substr_of(
+      shard, extent.first,
+      MIN(extent.second, shard.length() - extent.first));
+  }
+  return chunks;
+}
+
+TEST(ECUtil, assemble_subchunks)
+{
+  ECUtil::stripe_info_t s(4, 4096);
+  const uint64_t csize = s.get_chunk_size();
+  bufferlist logical = make_logical(3 * 4096);
+
+  // within a chunk, across chunks, across stripes and both
+  const uint64_t offs[] = { 0, 1, csize - 1, csize, 4095, 4096 + 100 };
+  const uint64_t lens[] = { 1, 10, csize, csize + 1, 4096, 4096 + csize + 100 };
+  for (auto off : offs) {
+    for (auto len : lens) {
+      map<int, bufferlist> chunks = read_subchunks(s, logical, off, len);
+      bufferlist bl;
+      ECUtil::assemble_subchunks(s, off, len, chunks, &bl);
+      bufferlist expected;
+      expected.substr_of(logical, off, len);
+      ASSERT_TRUE(bl.contents_equal(expected)) << off << "~" << len;
+    }
+  }
+}
+
+TEST(ECUtil, assemble_subchunks_short)
+{
+  ECUtil::stripe_info_t s(4, 4096);
+  const uint64_t csize = s.get_chunk_size();
+  bufferlist logical = make_logical(2 * 4096);
+
+  // past the end of the object every shard comes up short
+  {
+    map<int, bufferlist> chunks = read_subchunks(s, logical, 1000, 8000);
+    bufferlist bl;
+    ECUtil::assemble_subchunks(s, 1000, 8000, chunks, &bl);
+    bufferlist expected;
+    expected.substr_of(logical, 1000, logical.length() - 1000);
+    ASSERT_TRUE(bl.contents_equal(expected));
+  }
+
+  // a shard short in the middle of a piece stops assembly there,
+  // nothing from a later chunk is spliced in after the gap
+  {
+    map<int, bufferlist> chunks = read_subchunks(s, logical, 1000, 7000);
+    bufferlist truncated;
+    truncated.substr_of(chunks[2], 0, chunks[2].length() - 100);
+    chunks[2].swap(truncated);
+    bufferlist bl;
+    ECUtil::assemble_subchunks(s, 1000, 7000, chunks, &bl);
+    bufferlist expected;
+    expected.substr_of(logical, 1000, 4096 + 3 * csize - 100 - 1000);
+    ASSERT_TRUE(bl.contents_equal(expected));
+  }
+
+  // a shard returning nothing at all
+  {
+    map<int, bufferlist> chunks = read_subchunks(s, logical, 100, 3000);
+    chunks[1].clear();
+    bufferlist bl;
+    ECUtil::assemble_subchunks(s, 100, 3000, chunks, &bl);
+    bufferlist expected;
+    expected.substr_of(logical, 100, csize - 100);
+    ASSERT_TRUE(bl.contents_equal(expected));
+  }
+}
+
+TEST(ECUtil, HashInfo_clear_hash)
+{
+  ECUtil::HashInfo hinfo(3);
+  ASSERT_TRUE(hinfo.has_chunk_hash());
+
+  map<int, bufferlist> to_append;
+  for (int i = 0; i < 3; ++i)
+    to_append[i].append_zero(1024);
+  hinfo.append(0, to_append);
+  ASSERT_EQ(hinfo.get_total_chunk_size(), 1024u);
+
+  // after an overwrite only the size is tracked
+  hinfo.set_total_chunk_size_clear_hash(2048);
+  ASSERT_FALSE(hinfo.has_chunk_hash());
+  hinfo.append(2048, to_append);
+  ASSERT_EQ(hinfo.get_total_chunk_size(), 3072u);
+}
+
+TEST(ECTransaction, get_partial_stripes)
+{
+  const uint64_t swidth = 4096;
+  ECUtil::stripe_info_t sinfo(4, swidth);
+  hobject_t oid(sobject_t("foo", CEPH_NOSNAP));
+
+  // two full stripes on disk
+  map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> hash_infos;
+  hash_infos[oid] = ECUtil::HashInfoRef(new ECUtil::HashInfo(4));
+  hash_infos[oid]->set_total_chunk_size_clear_hash(2 * sinfo.get_chunk_size());
+
+  ECTransaction t;
+  bufferlist bl;
+  bl.append_zero(100);
+  t.write(oid, 100, bl.length(), bl, 0);        // stripe 0, both ends partial
+  t.write(oid, 50, bl.length(), bl, 0);         // stripe 0 already rewritten
+  t.write(oid, swidth + 10, bl.length(), bl, 0); // stripe 1
+  t.write(oid, 2 * swidth, bl.length(), bl, 0);  // past the end on disk
+
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> partial;
+  t.get_partial_stripes(hash_infos, sinfo, &partial);
+  ASSERT_EQ(partial.size(), 1u);
+  set<uint64_t> expected;
+  expected.insert(0);
+  expected.insert(swidth);
+  ASSERT_EQ(partial[oid], expected);
+}
+
+// ErasureCodeExample, with chunks that exactly fill a stripe
+class ErasureCodeStripe : public ErasureCodeExample {
+public:
+  virtual unsigned int get_chunk_size(unsigned int object_size) const {
+    return object_size / DATA_CHUNKS;
+  }
+};
+
+// apply the data ops of a shard transaction to in-memory objects
+static void apply_shard_transaction(
+  ObjectStore::Transaction &t,
+  map<ghobject_t, bufferlist, ghobject_t::BitwiseComparator> *objects)
+{
+  ObjectStore::Transaction::iterator i = t.begin();
+  while (i.have_op()) {
+    ObjectStore::Transaction::Op *op = i.decode_op();
+    switch (op->op) {
+    case ObjectStore::Transaction::OP_WRITE: {
+      bufferlist bl;
+      i.decode_bl(bl);
+      bufferlist &obj = (*objects)[i.get_oid(op->oid)];
+      bufferlist out;
+      if (op->off > obj.length())
+	obj.append_zero(op->off - obj.length());
+      out.substr_of(obj, 0, op->off);
+      out.append(bl);
+      if (op->off + op->len < obj.length()) {
+	bufferlist tail;
+	tail.substr_of(obj, op->off + op->len,
+		       obj.length() - op->off - op->len);
+	out.append(tail);
+      }
+      obj.swap(out);
+      break;
+    }
+    case ObjectStore::Transaction::OP_CLONERANGE2: {
+      bufferlist &from = (*objects)[i.get_oid(op->oid)];
+      bufferlist &to = (*objects)[i.get_oid(op->dest_oid)];
+      ASSERT_LE(op->off + op->len, from.length());
+      if (op->dest_off > to.length())
+	to.append_zero(op->dest_off - to.length());
+      bufferlist out, mid;
+      out.substr_of(to, 0, op->dest_off);
+      mid.substr_of(from, op->off, op->len);
+      out.append(mid);
+      if (op->dest_off + op->len < to.length()) {
+	bufferlist tail;
+	tail.substr_of(to, op->dest_off + op->len,
+		       to.length() - op->dest_off - op->len);
+	out.append(tail);
+      }
+      to.swap(out);
+      break;
+    }
+    case ObjectStore::Transaction::OP_REMOVE:
+      objects->erase(i.get_oid(op->oid));
+      break;
+    case ObjectStore::Transaction::OP_SETATTR: {
+      i.decode_string();
+      bufferlist bl;
+      i.decode_bl(bl);
+      break;
+    }
+    default:
+      FAIL() << "unexpected op " << op->op;
+    }
+  }
+}
+
+// logical contents of oid, decoded without data shard 1
+static bufferlist read_shards(
+  const ECUtil::stripe_info_t &sinfo,
+  ErasureCodeInterfaceRef &ec_impl,
+  const hobject_t &oid,
+  map<ghobject_t, bufferlist, ghobject_t::BitwiseComparator> &objects)
+{
+  map<int, bufferlist> to_decode;
+  to_decode[0] = objects[ghobject_t(oid, ghobject_t::NO_GEN, shard_id_t(0))];
+  to_decode[2] = objects[ghobject_t(oid, ghobject_t::NO_GEN, shard_id_t(2))];
+  to_decode[0].rebuild();
+  to_decode[2].rebuild();
+  bufferlist bl;
+  ECUtil::decode(sinfo, ec_impl, to_decode, &bl);
+  return bl;
+}
+
+struct RollbackExtentsVisitor : public ObjectModDesc::Visitor {
+  version_t gen;
+  vector<pair<uint64_t, uint64_t> > extents;
+  RollbackExtentsVisitor() : gen(0) {}
+  void rollback_extents(
+    version_t _gen,
+    const vector<pair<uint64_t, uint64_t> > &_extents) {
+    gen = _gen;
+    extents = _extents;
+  }
+};
+
+TEST(ECTransaction, overwrite_rollback)
+{
+  const uint64_t swidth = 4096;
+  ErasureCodeInterfaceRef ec_impl(new ErasureCodeStripe);
+  ECUtil::stripe_info_t sinfo(ec_impl->get_data_chunk_count(), swidth);
+  const uint64_t csize = sinfo.get_chunk_size();
+  pg_t pgid(0, 1);
+  hobject_t oid(sobject_t("foo", CEPH_NOSNAP));
+
+  // two stripes on disk
+  bufferlist old;
+  old.append(string(swidth, 'a'));
+  old.append(string(swidth, 'b'));
+  map<ghobject_t, bufferlist, ghobject_t::BitwiseComparator> objects;
+  {
+    set<int> want;
+    for (unsigned i = 0; i < ec_impl->get_chunk_count(); ++i)
+      want.insert(i);
+    map<int, bufferlist> encoded;
+    ASSERT_EQ(0, ECUtil::encode(sinfo, ec_impl, old, want, &encoded));
+    for (map<int, bufferlist>::iterator i = encoded.begin();
+	 i != encoded.end();
+	 ++i)
+      objects[ghobject_t(oid, ghobject_t::NO_GEN, shard_id_t(i->first))] =
+	i->second;
+  }
+  map<hobject_t, ECUtil::HashInfoRef, hobject_t::BitwiseComparator> hash_infos;
+  hash_infos[oid] = ECUtil::HashInfoRef(new ECUtil::HashInfo(3));
+  hash_infos[oid]->set_total_chunk_size_clear_hash(2 * csize);
+
+  // unaligned, across the stripe boundary
+  ECTransaction t;
+  bufferlist bl;
+  bl.append(string(200, 'x'));
+  t.write(oid, swidth - 100, bl.length(), bl, 0);
+
+  map<hobject_t, set<uint64_t>, hobject_t::BitwiseComparator> partial;
+  t.get_partial_stripes(hash_infos, sinfo, &partial);
+  ECTransaction::stripe_map_t partial_stripes;
+  for (set<uint64_t>::iterator i = partial[oid].begin();
+       i != partial[oid].end();
+       ++i)
+    partial_stripes[oid][*i].substr_of(old, *i, swidth);
+  ASSERT_EQ(2u, partial_stripes[oid].size());
+
+  vector<pg_log_entry_t> entries(1);
+  entries[0].soid = oid;
+  entries[0].version = eversion_t(1, 5);
+  map<shard_id_t, ObjectStore::Transaction> trans;
+  for (unsigned i = 0; i < ec_impl->get_chunk_count(); ++i)
+    trans[shard_id_t(i)];
+  set<hobject_t, hobject_t::BitwiseComparator> temp_added, temp_removed;
+  ECTransaction::stripe_map_t written;
+  set<hobject_t, hobject_t::BitwiseComparator> invalidated;
+  t.generate_transactions(
+    hash_infos, ec_impl, pgid, sinfo, partial_stripes, &entries, &trans,
+    &temp_added, &temp_removed, &written, &invalidated);
+
+  bufferlist expected;
+  expected.append(string(swidth - 100, 'a'));
+  expected.append(string(200, 'x'));
+  expected.append(string(swidth - 100, 'b'));
+
+  // the merged stripes go to the extent cache
+  ASSERT_TRUE(invalidated.empty());
+  ASSERT_EQ(2u, written[oid].size());
+  bufferlist w;
+  w.append(written[oid][0]);
+  w.append(written[oid][swidth]);
+  ASSERT_TRUE(w.contents_equal(expected));
+  ASSERT_FALSE(hash_infos[oid]->has_chunk_hash());
+  ASSERT_EQ(2 * csize, hash_infos[oid]->get_total_chunk_size());
+
+  // the overwritten chunks are cloned aside first
+  RollbackExtentsVisitor vis;
+  entries[0].mod_desc.visit(&vis);
+  ASSERT_EQ(5u, vis.gen);
+  ASSERT_EQ(1u, vis.extents.size());
+  ASSERT_EQ(make_pair((uint64_t)0, 2 * csize), vis.extents[0]);
+
+  for (map<shard_id_t, ObjectStore::Transaction>::iterator i = trans.begin();
+       i != trans.end();
+       ++i)
+    apply_shard_transaction(i->second, &objects);
+  ASSERT_TRUE(read_shards(sinfo, ec_impl, oid, objects).contents_equal(
+		expected));
+
+  // roll back as ECBackend::rollback_extents does
+  for (unsigned s = 0; s < ec_impl->get_chunk_count(); ++s) {
+    ghobject_t goid(oid, ghobject_t::NO_GEN, shard_id_t(s));
+    ghobject_t stash(oid, vis.gen, shard_id_t(s));
+    coll_t cid(spg_t(pgid, shard_id_t(s)));
+    ObjectStore::Transaction rt;
+    for (vector<pair<uint64_t, uint64_t> >::iterator i = vis.extents.begin();
+	 i != vis.extents.end();
+	 ++i)
+      rt.clone_range(cid, stash, goid, i->first, i->second, i->first);
+    rt.remove(cid, stash);
+    apply_shard_transaction(rt, &objects);
+  }
+  ASSERT_EQ(3u, objects.size());
+  ASSERT_TRUE(read_shards(sinfo, ec_impl, oid, objects).contents_equal(old));
+}
+
+TEST(ECBackend, ExtentCache)
+{
+  ECBackend::ExtentCache cache;
+  hobject_t a(sobject_t("a", CEPH_NOSNAP));
+  hobject_t b(sobject_t("b", CEPH_NOSNAP));
+  bufferlist one, two, bl;
+  one.append(string(4096, '1'));
+  two.append(string(4096, '2'));
+
+  ASSERT_FALSE(cache.lookup(a, 0, &bl));
+  cache.set(a, 0, one, 1);
+  cache.set(a, 4096, one, 1);
+  cache.set(b, 0, one, 1);
+  ASSERT_EQ(3 * 4096u, cache.get_bytes());
+
+  // a later op pins the stripe with its own contents
+  cache.set(a, 0, two, 2);
+  ASSERT_EQ(3 * 4096u, cache.get_bytes());
+  ASSERT_TRUE(cache.lookup(a, 0, &bl));
+  ASSERT_TRUE(bl.contents_equal(two));
+
+  // held until every op writing it has released it
+  cache.release(a, 0, 1);
+  ASSERT_TRUE(cache.lookup(a, 0, &bl));
+  cache.release(a, 4096, 1);
+  ASSERT_FALSE(cache.lookup(a, 4096, &bl));
+  ASSERT_EQ(2 * 4096u, cache.get_bytes());
+  cache.release(a, 0, 2);
+  ASSERT_FALSE(cache.lookup(a, 0, &bl));
+  ASSERT_EQ(4096u, cache.get_bytes());
+
+  // releasing a stripe which is not cached is harmless
+  cache.release(a, 0, 2);
+
+  // invalidate drops every stripe of the object, whatever its pins
+  cache.set(a, 0, one, 3);
+  cache.set(a, 8192, one, 4);
+  cache.invalidate(a);
+  ASSERT_FALSE(cache.lookup(a, 0, &bl));
+  ASSERT_FALSE(cache.lookup(a, 8192, &bl));
+  ASSERT_TRUE(cache.lookup(b, 0, &bl));
+  ASSERT_EQ(4096u, cache.get_bytes());
+  cache.release(a, 0, 3);
+  ASSERT_EQ(4096u, cache.get_bytes());
+
+  cache.clear();
+  ASSERT_FALSE(cache.lookup(b, 0, &bl));
+  ASSERT_EQ(0u, cache.get_bytes());
+}
+
+// primary of a pg whose shard i lives on osd i, keeping the reads
+// ECBackend sends instead of sending them
+class ReadListener : public PGBackend::Listener {
+  pg_shard_t whoami;
+  set<pg_shard_t> acting;
+  set<pg_shard_t> backfill;
+  map<hobject_t, set<pg_shard_t>, hobject_t::BitwiseComparator> missing_loc;
+  pg_missing_t missing;
+  map<pg_shard_t, pg_missing_t> shard_missing;
+  map<pg_shard_t, pg_info_t> shard_info;
+  pg_info_t info;
+  pg_pool_t pool;
+  PGLog log;
+  LogChannel clog;
+  ceph_tid_t last_tid;
+public:
+  vector<MOSDECSubOpRead*> reads;
+
+  explicit ReadListener(unsigned shards)
+    : whoami(0, shard_id_t(0)),
+      log(g_ceph_context),
+      clog(g_ceph_context, NULL, "cluster"),
+      last_tid(0) {
+    info.pgid = spg_t(pg_t(0, 1), shard_id_t(0));
+    for (unsigned i = 0; i < shards; ++i) {
+      pg_shard_t shard(i, shard_id_t(i));
+      acting.insert(shard);
+      if (shard != whoami) {
+	shard_missing[shard];
+	shard_info[shard] = info;
+      }
+    }
+  }
+  ~ReadListener() {
+    for (auto m : reads)
+      m->put();
+  }
+  const spg_t &get_pgid() const {
+    return info.pgid;
+  }
+
+  void on_local_recover(
+    const hobject_t &oid,
+    const ObjectRecoveryInfo &recovery_info,
+    ObjectContextRef obc,
+    ObjectStore::Transaction *t) {}
+  void on_global_recover(
+    const hobject_t &oid,
+    const object_stat_sum_t &stat_diff) {}
+  void on_peer_recover(
+    pg_shard_t peer,
+    const hobject_t &oid,
+    const ObjectRecoveryInfo &recovery_info,
+    const object_stat_sum_t &stat) {}
+  void begin_peer_recover(
+    pg_shard_t peer,
+    const hobject_t oid) {}
+  void failed_push(pg_shard_t from, const hobject_t &soid) {}
+  void cancel_pull(const hobject_t &soid) {}
+  Context *bless_context(Context *c) {
+    return c;
+  }
+  GenContext<ThreadPool::TPHandle&> *bless_gencontext(
+    GenContext<ThreadPool::TPHandle&> *c) {
+    return c;
+  }
+  void send_message(int to_osd, Message *m) {
+    ADD_FAILURE() << "unexpected " << m->get_type_name();
+    m->put();
+  }
+  void queue_transaction(
+    ObjectStore::Transaction&& t,
+    OpRequestRef op) {}
+  void queue_transactions(
+    vector<ObjectStore::Transaction>& tls,
+    OpRequestRef op) {}
+  epoch_t get_epoch() const {
+    return 1;
+  }
+  const set<pg_shard_t> &get_actingbackfill_shards() const {
+    return acting;
+  }
+  const set<pg_shard_t> &get_acting_shards() const {
+    return acting;
+  }
+  const set<pg_shard_t> &get_backfill_shards() const {
+    return backfill;
+  }
+  std::string gen_dbg_prefix() const {
+    return "ReadListener ";
+  }
+  const map<hobject_t, set<pg_shard_t>, hobject_t::BitwiseComparator>
+  &get_missing_loc_shards() const {
+    return missing_loc;
+  }
+  const pg_missing_t &get_local_missing() const {
+    return missing;
+  }
+  const map<pg_shard_t, pg_missing_t> &get_shard_missing() const {
+    return shard_missing;
+  }
+  const map<pg_shard_t, pg_info_t> &get_shard_info() const {
+    return shard_info;
+  }
+  const PGLog &get_log() const {
+    return log;
+  }
+  bool pgb_is_primary() const {
+    return true;
+  }
+  OSDMapRef pgb_get_osdmap() const {
+    return OSDMapRef();
+  }
+  const pg_info_t &get_info() const {
+    return info;
+  }
+  const pg_pool_t &get_pool() const {
+    return pool;
+  }
+  ObjectContextRef get_obc(
+    const hobject_t &hoid,
+    map<string, bufferlist> &attrs) {
+    return ObjectContextRef();
+  }
+  void op_applied(
+    const eversion_t &applied_version) {}
+  bool should_send_op(
+    pg_shard_t peer,
+    const hobject_t &hoid) {
+    return true;
+  }
+  void log_operation(
+    const vector<pg_log_entry_t> &logv,
+    boost::optional<pg_hit_set_history_t> &hset_history,
+    const eversion_t &trim_to,
+    const eversion_t &trim_rollback_to,
+    bool transaction_applied,
+    ObjectStore::Transaction *t) {}
+  void update_peer_last_complete_ondisk(
+    pg_shard_t fromosd,
+    eversion_t lcod) {}
+  void update_last_complete_ondisk(
+    eversion_t lcod) {}
+  void update_stats(
+    const pg_stat_t &stat) {}
+  void schedule_recovery_work(
+    GenContext<ThreadPool::TPHandle&> *c) {
+    delete c;
+  }
+  pg_shard_t whoami_shard() const {
+    return whoami;
+  }
+  spg_t primary_spg_t() const {
+    return info.pgid;
+  }
+  pg_shard_t primary_shard() const {
+    return whoami;
+  }
+  uint64_t min_peer_features() const {
+    return CEPH_FEATURES_SUPPORTED_DEFAULT;
+  }
+  bool sort_bitwise() const {
+    return true;
+  }
+  bool transaction_use_tbl() {
+    return false;
+  }
+  hobject_t get_temp_recovery_object(eversion_t version,
+				     snapid_t snap) {
+    return hobject_t();
+  }
+  void send_message_osd_cluster(
+    int peer, Message *m, epoch_t from_epoch) {
+    if (m->get_type() != MSG_OSD_EC_READ) {
+      ADD_FAILURE() << "unexpected " << m->get_type_name();
+      m->put();
+      return;
+    }
+    EXPECT_EQ(peer, static_cast<MOSDECSubOpRead*>(m)->pgid.shard);
+    reads.push_back(static_cast<MOSDECSubOpRead*>(m));
+  }
+  void send_message_osd_cluster(
+    Message *m, Connection *con) {
+    ADD_FAILURE() << "unexpected " << m->get_type_name();
+    m->put();
+  }
+  void send_message_osd_cluster(
+    Message *m, const ConnectionRef& con) {
+    ADD_FAILURE() << "unexpected " << m->get_type_name();
+    m->put();
+  }
+  ConnectionRef get_con_osd_cluster(int peer, epoch_t from_epoch) {
+    return ConnectionRef();
+  }
+  entity_name_t get_cluster_msgr_name() {
+    return entity_name_t::OSD(whoami.osd);
+  }
+  PerfCounters *get_logger() {
+    return NULL;
+  }
+  ceph_tid_t get_tid() {
+    return ++last_tid;
+  }
+  LogClientTemp clog_error() {
+    return clog.error();
+  }
+  void request_repeer(const set<pg_shard_t> &bad) {
+    ADD_FAILURE() << "unexpected repeer of " << bad;
+  }
+};
+
+struct C_ReadDone : public Context {
+  int *r;
+  explicit C_ReadDone(int *r) : r(r) {}
+  void finish(int _r) {
+    *r = _r;
+  }
+};
+
+// answer read with the extents it asked for out of shard, or with
+// -EIO if shard is NULL
+static void reply_read(
+  ECBackend &ec,
+  OpTracker &tracker,
+  const hobject_t &hoid,
+  MOSDECSubOpRead *read,
+  const bufferlist *shard)
+{
+  MOSDECSubOpReadReply *m = new MOSDECSubOpReadReply;
+  m->pgid = read->pgid;
+  m->map_epoch = read->map_epoch;
+  m->op.from = pg_shard_t(read->pgid.shard, read->pgid.shard);
+  m->op.tid = read->op.tid;
+  if (shard) {
+    list<pair<uint64_t, bufferlist> > &buffers = m->op.buffers_read[hoid];
+    for (auto &e : read->op.to_read[hoid]) {
+      bufferlist bl;
+      if (e.get<0>() < shard->length())
+	bl.substr_of(*shard, e.get<0>(),
+		     MIN(e.get<1>(), shard->length() - e.get<0>()));
+      buffers.push_back(make_pair(e.get<0>(), bl));
+    }
+  } else {
+    m->op.errors[hoid] = -EIO;
+  }
+  OpRequestRef op = tracker.create_request<OpRequest, Message*>(m);
+  ASSERT_TRUE(ec.handle_message(op));
+}
+
+class ECBackendSubchunks : public ::testing::Test {
+public:
+  ErasureCodeInterfaceRef ec_impl;
+  ECUtil::stripe_info_t sinfo;
+  ReadListener listener;
+  ObjectStore::CollectionHandle ch;
+  ECBackend ec;
+  OpTracker tracker;
+  hobject_t hoid;
+  bufferlist logical;
+
+  ECBackendSubchunks()
+    : ec_impl(new ErasureCodeStripe),
+      sinfo(ec_impl->get_data_chunk_count(), 4096),
+      listener(ec_impl->get_chunk_count()),
+      ec(&listener, coll_t(listener.get_pgid()), ch, NULL, g_ceph_context,
+	 ec_impl, sinfo.get_stripe_width()),
+      tracker(g_ceph_context, false, 1),
+      hoid(sobject_t("foo", CEPH_NOSNAP)),
+      logical(make_logical(2 * sinfo.get_stripe_width())) {}
+
+  void SetUp() {
+    g_ceph_context->_conf->set_val("osd_ec_subchunk_reads", "true");
+    g_ceph_context->_conf->apply_changes(NULL);
+  }
+
+  bufferlist shard(shard_id_t s) {
+    return make_shard(sinfo, logical, s);
+  }
+  void read(uint64_t off, uint64_t len, bufferlist *out,
+	    int *extent_r, int *r) {
+    list<pair<boost::tuple<uint64_t, uint64_t, uint32_t>,
+	      pair<bufferlist*, Context*> > > to_read;
+    to_read.push_back(
+      make_pair(boost::make_tuple(off, len, 0),
+		make_pair(out, (Context*)new C_ReadDone(extent_r))));
+    ec.objects_read_async(hoid, to_read, new C_ReadDone(r));
+  }
+};
+
+TEST_F(ECBackendSubchunks, read)
+{
+  const uint64_t csize = sinfo.get_chunk_size();
+  // from inside chunk 0 of stripe 0 to well past the end of the
+  // object, so both shards come up short
+  const uint64_t off = 1000, len = 12000;
+  bufferlist out;
+  int extent_r = 1, r = 1;
+  read(off, len, &out, &extent_r, &r);
+
+  // only the shard extents holding the range are read
+  ASSERT_EQ(2u, listener.reads.size());
+  for (auto m : listener.reads) {
+    pair<uint64_t, uint64_t> extent = sinfo.offset_len_to_chunk_shard(
+      make_pair(off, len), m->pgid.shard);
+    ASSERT_EQ(1u, m->op.to_read[hoid].size());
+    ASSERT_EQ(extent.first, m->op.to_read[hoid].front().get<0>());
+    ASSERT_EQ(extent.second, m->op.to_read[hoid].front().get<1>());
+    ASSERT_GT(extent.first + extent.second, 2 * csize);
+  }
+
+  for (auto m : listener.reads) {
+    ASSERT_EQ(1, r);
+    bufferlist bl = shard(m->pgid.shard);
+    reply_read(ec, tracker, hoid, m, &bl);
+  }
+  ASSERT_EQ(0, r);
+  bufferlist expected;
+  expected.substr_of(logical, off, logical.length() - off);
+  ASSERT_EQ((int)expected.length(), extent_r);
+  ASSERT_TRUE(out.contents_equal(expected));
+  ASSERT_EQ(2u, listener.reads.size());
+}
+
+TEST_F(ECBackendSubchunks, fallback_on_error)
+{
+  // crosses from chunk 0 into chunk 1
+  const uint64_t off = 1000, len = 2000;
+  bufferlist out;
+  int extent_r = 1, r = 1;
+  read(off, len, &out, &extent_r, &r);
+  ASSERT_EQ(2u, listener.reads.size());
+
+  // one good shard and one failed one
+  bufferlist bl = shard(listener.reads[0]->pgid.shard);
+  reply_read(ec, tracker, hoid, listener.reads[0], &bl);
+  reply_read(ec, tracker, hoid, listener.reads[1], NULL);
+  ASSERT_EQ(1, r);
+
+  // the whole stripe is read again to be decoded
+  ASSERT_EQ(4u, listener.reads.size());
+  pair<uint64_t, uint64_t> stripe = sinfo.aligned_offset_len_to_chunk(
+    sinfo.offset_len_to_stripe_bounds(make_pair(off, len)));
+  for (unsigned i = 2; i < listener.reads.size(); ++i) {
+    MOSDECSubOpRead *m = listener.reads[i];
+    ASSERT_NE(listener.reads[0]->op.tid, m->op.tid);
+    ASSERT_EQ(1u, m->op.to_read[hoid].size());
+    ASSERT_EQ(stripe.first, m->op.to_read[hoid].front().get<0>());
+    ASSERT_EQ(stripe.second, m->op.to_read[hoid].front().get<1>());
+  }
+
+  for (unsigned i = 2; i < listener.reads.size(); ++i) {
+    bufferlist bl = shard(listener.reads[i]->pgid.shard);
+    reply_read(ec, tracker, hoid, listener.reads[i], &bl);
+  }
+  ASSERT_EQ(0, r);
+  bufferlist expected;
+  expected.substr_of(logical, off, len);
+  ASSERT_EQ((int)len, extent_r);
+  ASSERT_TRUE(out.contents_equal(expected));
+}
@@ -400,3 +400,47 @@ TEST_F(OSDMapTest, PrimaryAffinity) {
     osdmap.set_primary_affinity(1, 0x10000);
   }
 }
+
+TEST_F(OSDMapTest, ShallowCopySharesUnchanged) {
+  set_up_map();
+
+  pg_t rawpg(0, 0, -1);
+  pg_t pgid = osdmap.raw_pg_to_pg(rawpg);
+  vector<int> up_osds, acting_osds;
+  int up_primary, acting_primary;
+  osdmap.pg_to_up_acting_osds(pgid, &up_osds, &up_primary,
+                              &acting_osds, &acting_primary);
+  vector<int> new_acting_osds(acting_osds.rbegin(), acting_osds.rend());
+  bufferlist before;
+  osdmap.encode(before);
+
+  OSDMap next;
+  next.shallow_copy_from(osdmap);
+  uint64_t all_shared = OSDMap::get_shared_bytes(&osdmap, &next);
+  ASSERT_LT(0u, all_shared);
+
+  OSDMap::Incremental inc(next.get_epoch() + 1);
+  inc.new_pg_temp[pgid] = new_acting_osds;
+  uuid_d new_uuid;
+  new_uuid.generate_random();
+  inc.new_uuid[0] = new_uuid;
+  next.apply_incremental(inc);
+
+  // the uuids were copied, crush and the addrs are still shared
+  uint64_t shared = OSDMap::get_shared_bytes(&osdmap, &next);
+  ASSERT_LT(0u, shared);
+  ASSERT_GT(all_shared, shared);
+
+  // and the old map did not change
+  bufferlist after;
+  osdmap.encode(after);
+  ASSERT_TRUE(before.contents_equal(after));
+  ASSERT_NE(new_uuid, osdmap.get_uuid(0));
+  ASSERT_EQ(new_uuid, next.get_uuid(0));
+  next.pg_to_up_acting_osds(pgid, &up_osds, &up_primary,
+                            &acting_osds, &acting_primary);
+  ASSERT_EQ(new_acting_osds, acting_osds);
+  osdmap.pg_to_up_acting_osds(pgid, &up_osds, &up_primary,
+                              &acting_osds, &acting_primary);
+  ASSERT_NE(new_acting_osds, acting_osds);
+}
@@ -2040,6 +2040,139 @@ TEST_F(PGLogTest, filter_log_1) {
   }
 }
 
+TEST_F(PGLogTest, trim_index_and_write) {
+  clear();
+
+  hobject_t a = mk_obj(1), b = mk_obj(2);
+  pg_log_entry_t e1 = mk_ple_mod(a, mk_evt(10, 100), mk_evt(8, 80));
+  e1.reqid = osd_reqid_t(entity_name_t::CLIENT(1), 0, 1);
+  pg_log_entry_t e2 = mk_ple_mod(a, mk_evt(10, 101), mk_evt(10, 100));
+  e2.reqid = osd_reqid_t(entity_name_t::CLIENT(1), 0, 2);
+  pg_log_entry_t e3 = mk_ple_mod(b, mk_evt(11, 102), mk_evt(8, 80));
+  e3.reqid = osd_reqid_t(entity_name_t::CLIENT(1), 0, 3);
+  log.tail = mk_evt(8, 80);
+  log.index();
+  add(e1);
+  add(e2);
+  add(e3);
+
+  // the index keys refer to the entries in the log
+  PGLog::IndexedLog::object_index_t::const_iterator p = log.objects.find(a);
+  ASSERT_TRUE(p != log.objects.end());
+  EXPECT_EQ(&p->second->soid, &p->first.get());
+  EXPECT_EQ(mk_evt(10, 101), p->second->version);
+
+  ObjectStore::Transaction t;
+  map<string,bufferlist> km;
+  coll_t coll;
+  ghobject_t log_oid(mk_obj(3));
+  write_log(t, &km, coll, log_oid, false);
+  EXPECT_EQ(3u, km.size());
+
+  // trim the first two entries; a stays indexed until its last one goes
+  pg_info_t info;
+  info.last_complete = mk_evt(11, 102);
+  list<hobject_t> removed;
+  TestHandler h(removed);
+  trim(&h, mk_evt(10, 100), info);
+  EXPECT_TRUE(log.logged_object(a));
+  EXPECT_FALSE(log.logged_req(e1.reqid));
+  trim(&h, mk_evt(10, 101), info);
+  EXPECT_FALSE(log.logged_object(a));
+  EXPECT_TRUE(log.logged_object(b));
+  EXPECT_FALSE(log.logged_req(e2.reqid));
+  EXPECT_TRUE(log.logged_req(e3.reqid));
+  p = log.objects.find(b);
+  ASSERT_TRUE(p != log.objects.end());
+  EXPECT_EQ(&log.log.front().soid, &p->first.get());
+
+  // both trims are removed with one key range
+  ObjectStore::Transaction t2;
+  km.clear();
+  write_log(t2, &km, coll, log_oid, false);
+  EXPECT_FALSE(is_dirty());
+  EXPECT_TRUE(km.empty());
+  unsigned rmkeyrange = 0;
+  for (ObjectStore::Transaction::iterator i = t2.begin(); i.have_op(); ) {
+    ObjectStore::Transaction::Op *op = i.decode_op();
+    EXPECT_NE((__u32)ObjectStore::Transaction::OP_OMAP_RMKEYS, op->op);
+    if (op->op == ObjectStore::Transaction::OP_OMAP_RMKEYRANGE) {
+      ++rmkeyrange;
+      string first = i.decode_string();
+      string last = i.decode_string();
+      EXPECT_EQ(eversion_t().get_key_name(), first);
+      EXPECT_LT(mk_evt(10, 101).get_key_name(), last);
+      EXPECT_GT(mk_evt(11, 102).get_key_name(), last);
+    }
+  }
+  EXPECT_EQ(1u, rmkeyrange);
+
+  JSONFormatter f;
+  f.open_object_section("log");
+  log.dump_mem(&f);
+  f.close_section();
+  stringstream ss;
+  f.flush(ss);
+  EXPECT_NE(string::npos, ss.str().find("\"entries\":1"));
+}
+
+TEST_F(PGLogTest, compact_entries) {
+  clear();
+
+  // 3000 entries over 1000 objects, as a peer would send them
+  pg_log_t sent;
+  sent.tail = mk_evt(9, 0);
+  for (unsigned i = 0; i < 3000; ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "rbd_data.10086b8b4567.%016x", i % 1000);
+    hobject_t hoid(object_t(name), "", CEPH_NOSNAP, i % 1000, 1, "");
+    pg_log_entry_t e;
+    e.op = pg_log_entry_t::MODIFY;
+    e.soid = hoid;
+    e.version = mk_evt(10, i + 1);
+    e.prior_version = i < 1000 ? eversion_t() : mk_evt(10, i - 999);
+    e.reqid = osd_reqid_t(entity_name_t::CLIENT(1), 0, i + 1);
+    e.mod_desc.append(4096 * i);
+    sent.log.push_back(e);
+    sent.head = e.version;
+  }
+  bufferlist bl;
+  ::encode(sent, bl);
+  pg_log_t received;
+  bufferlist::iterator p = bl.begin();
+  ::decode(received, p);
+
+  // as decoded, every mod_desc shares the buffer of the whole log
+  PGLog::IndexedLog decoded;
+  decoded.log = received.log;
+  uint64_t before_entry, before_index;
+  decoded.get_mem_usage(&before_entry, &before_index);
+
+  log.claim_log_and_clear_rollback_info(received);
+  uint64_t after_entry, after_index;
+  log.get_mem_usage(&after_entry, &after_index);
+  EXPECT_LT(after_entry, before_entry);
+
+  for (list<pg_log_entry_t>::const_iterator i = log.log.begin();
+       i != log.log.end();
+       ++i) {
+    ASSERT_EQ(1u, i->mod_desc.bl.buffers().size());
+    ASSERT_EQ(i->mod_desc.bl.length(),
+	      i->mod_desc.bl.buffers().front().raw_length());
+  }
+
+  // an object's entries all take soid from its first one, which shares
+  // its storage where strings are reference counted
+  const pg_log_entry_t &first = log.log.front();
+  list<pg_log_entry_t>::const_iterator third = log.log.begin();
+  std::advance(third, 2000);
+  EXPECT_EQ(first.soid, third->soid);
+  PGLog::IndexedLog::object_index_t::const_iterator o =
+    log.objects.find(first.soid);
+  ASSERT_TRUE(o != log.objects.end());
+  EXPECT_EQ(&*third, o->second);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
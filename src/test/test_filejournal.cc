@@ -66,6 +66,12 @@ unsigned size_mb = 200;
 //Gtest argument prefix
 const char GTEST_PRFIX[] = "--gtest_";
 
+// --bench [--bench-ops N] [--bench-size BYTES] [--bench-inflight N]
+bool bench = false;
+int bench_ops = 20000;
+int bench_size = 4096;
+int bench_inflight = 64;
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -80,6 +86,21 @@ int main(int argc, char **argv) {
 
   finisher = new Finisher(g_ceph_context);
   
+  std::string val;
+  for (vector<const char*>::iterator i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_flag(args, i, "--bench", (char*)NULL)) {
+      bench = true;
+    } else if (ceph_argparse_witharg(args, i, &val, "--bench-ops", (char*)NULL)) {
+      bench_ops = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--bench-size", (char*)NULL)) {
+      bench_size = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--bench-inflight", (char*)NULL)) {
+      bench_inflight = atoi(val.c_str());
+    } else {
+      ++i;
+    }
+  }
+
   path[0] = '\0';
   if (!args.empty()) {
     for ( unsigned int i = 0; i < args.size(); ++i) {
@@ -665,3 +686,97 @@ TEST(TestFileJournal, ReplayDetectCorruptHeader) {
     ::close(fd);
   }
 }
+
+class C_BenchWrite : public Context {
+  utime_t start;
+  vector<uint64_t> *lat_us;
+  Mutex *lock;
+  Cond *cond;
+  int *inflight;
+public:
+  C_BenchWrite(vector<uint64_t> *l, Mutex *lk, Cond *c, int *in)
+    : start(ceph_clock_now(g_ceph_context)),
+      lat_us(l), lock(lk), cond(c), inflight(in) {}
+  void finish(int r) {
+    utime_t lat = ceph_clock_now(g_ceph_context) - start;
+    Mutex::Locker l(*lock);
+    lat_us->push_back(lat.to_nsec() / 1000);
+    --*inflight;
+    cond->Signal();
+  }
+};
+
+TEST(TestFileJournal, Bench) {
+  if (!bench) {
+    cout << "SKIP: run with --bench to measure journal write latency"
+	 << std::endl;
+    return;
+  }
+  g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  for (unsigned i = 0 ; i < 3; ++i) {
+    SCOPED_TRACE(subtests[i].description);
+    fsid.generate_random();
+    FileJournal j(fsid, finisher, &sync_cond, path, subtests[i].directio,
+		  subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(0, j.create());
+    j.make_writeable();
+
+    Mutex lock("Bench::lock");
+    Cond cond;
+    int inflight = 0;
+    vector<uint64_t> lat_us;
+    lat_us.reserve(bench_ops);
+    uint64_t committed = 0;
+
+    bufferptr data = buffer::create_page_aligned(bench_size);
+    memset(data.c_str(), 1, bench_size);
+    vector<ObjectStore::Transaction> tls;
+    utime_t start = ceph_clock_now(g_ceph_context);
+    for (int seq = 1; seq <= bench_ops; ++seq) {
+      uint64_t done;
+      {
+	Mutex::Locker l(lock);
+	while (inflight >= bench_inflight)
+	  cond.Wait(lock);
+	++inflight;
+	done = lat_us.size();
+      }
+      // entries complete in seq order; trim what is done so the journal
+      // never fills up
+      if (done > committed) {
+	committed = done;
+	j.committed_thru(committed);
+      }
+      bufferlist bl;
+      bl.append(data);
+      int orig_len = j.prepare_entry(tls, &bl);
+      j.submit_entry(seq, bl, orig_len,
+		     new C_BenchWrite(&lat_us, &lock, &cond, &inflight));
+    }
+    {
+      Mutex::Locker l(lock);
+      while (inflight > 0)
+	cond.Wait(lock);
+    }
+    utime_t elapsed = ceph_clock_now(g_ceph_context) - start;
+    j.committed_thru(bench_ops);
+    j.close();
+
+    ASSERT_EQ((size_t)bench_ops, lat_us.size());
+    std::sort(lat_us.begin(), lat_us.end());
+    cout << subtests[i].description << ": " << bench_ops << " writes of "
+	 << bench_size << " bytes, " << bench_inflight << " in flight, aio depth "
+	 << g_conf->journal_aio_queue_depth << ": "
+	 << (int)(bench_ops / (double)elapsed) << " iops" << std::endl;
+    double pcts[] = { 50, 90, 99, 99.9 };
+    for (double pct : pcts) {
+      cout << "  p" << pct << " "
+	   << lat_us[MIN((size_t)(lat_us.size() * pct / 100), lat_us.size() - 1)]
+	   << "us";
+    }
+    cout << "  max " << lat_us.back() << "us" << std::endl;
+  }
+}
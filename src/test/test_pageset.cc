@@ -1,5 +1,6 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "os/memstore/PageSet.h"
@@ -269,3 +270,91 @@ TEST(PageSet, FreeHoles)
   pages.get_range(0, 8, range);
   ASSERT_EQ(0u, range.size());
 }
+
+TEST(PageSet, CopyOnWrite)
+{
+  PageSet pages(2);
+  PageSet::page_vector range;
+  pages.alloc_range(0, 2, range);
+  range[0]->data[0] = 'a';
+  range.clear();
+
+  // hold a reference to the page, as a zero-copy read would
+  PageSet::page_vector reader;
+  pages.get_range(0, 2, reader);
+  ASSERT_EQ(1u, reader.size());
+
+  // writing gets a copy of the page, the reader's page is unchanged
+  pages.alloc_range(1, 1, range);
+  ASSERT_EQ(1u, range.size());
+  ASSERT_NE(reader[0].get(), range[0].get());
+  ASSERT_EQ('a', range[0]->data[0]);
+  range[0]->data[0] = 'b';
+  ASSERT_EQ('a', reader[0]->data[0]);
+  range.clear();
+  reader.clear();
+
+  // without outside references the page is written in place
+  pages.get_range(0, 2, reader);
+  Page *page = reader[0].get();
+  ASSERT_EQ('b', page->data[0]);
+  reader.clear();
+  pages.alloc_range(0, 2, range);
+  ASSERT_EQ(page, range[0].get());
+  ASSERT_EQ(1u, pages.size());
+}
+
+TEST(PageSet, SparseOffsets)
+{
+  PageSet pages(1);
+  PageSet::page_vector range;
+  for (uint64_t i : {0ull, 1ull << 20, 1ull << 40, ~0ull - 1})
+    pages.alloc_range(i, 1, range);
+  range.clear();
+
+  pages.get_range(0, ~0ull, range);
+  ASSERT_EQ(4u, range.size());
+  ASSERT_EQ(0u, range[0]->offset);
+  ASSERT_EQ(1ull << 20, range[1]->offset);
+  ASSERT_EQ(1ull << 40, range[2]->offset);
+  ASSERT_EQ(~0ull - 1, range[3]->offset);
+  range.clear();
+
+  pages.free_pages_after(1);
+  pages.get_range(0, ~0ull, range);
+  ASSERT_EQ(1u, range.size());
+  ASSERT_EQ(1u, pages.size());
+}
+
+TEST(PageSet, ConcurrentReads)
+{
+  // readers walk the set while a writer frees and reallocates pages
+  const uint64_t page_size = 4096, npages = 64;
+  PageSet pages(page_size);
+  PageSet::page_vector range;
+  pages.alloc_range(0, page_size * npages, range);
+  range.clear();
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&]() {
+	PageSet::page_vector r;
+	while (!done) {
+	  pages.get_range(0, page_size * npages, r);
+	  for (auto &page : r)
+	    ASSERT_EQ(0u, page->offset % page_size);
+	  r.clear();
+	}
+      });
+  }
+  for (int i = 0; i < 2000; i++) {
+    pages.free_pages_after((i % npages) * page_size);
+    pages.alloc_range(0, page_size * npages, range);
+    range.clear();
+  }
+  done = true;
+  for (auto &t : readers)
+    t.join();
+  ASSERT_EQ(npages, pages.size());
+}
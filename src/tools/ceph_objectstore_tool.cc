@@ -2454,7 +2454,7 @@ int main(int argc, char **argv)
   }
 
   if (op == "fsck") {
-    int r = fs->fsck();
+    int r = fs->fsck(true);
     if (r < 0) {
       cerr << "fsck failed: " << cpp_strerror(r) << std::endl;
       myexit(1);